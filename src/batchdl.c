@@ -0,0 +1,449 @@
+
+// batchdl.c
+
+#include "config.h"
+#include "mt_log.h"
+#include "public.h"
+#include "pathops.h"
+#include "md5ops.h"
+#include "events_poll.h"
+#include "conn_mgmt.h"
+#include "tunables.h"
+#include "fdcache.h"
+#include "batchdl.h"
+
+extern char *default_md5sum_filename;
+extern const char *backend_key(const char *path, int *index);
+extern int open_seq_file(const char *key, struct backend_file *f, uint32_t *mask);
+extern int send_file_blob(int sd, struct backend_file *f, int index);
+
+#define BATCH_HEAD_MAX    (2 + DIRWALK_PATH_MAX + 8 + MD5_LEN)
+#define BATCH_TAIL_LEN    6   // 文件名长度 0 和文件个数
+
+struct batch_download {
+    struct dirwalk *w;    // 正在遍历的目录
+    int curr;             // 下一个要遍历的目录
+    int nr_dir;
+    char **dirs;
+    int next_file;        // 下一个要下载的列表中的文件
+    int nr_files;
+    char **files;
+    int head;             // 正在发送的文件在 ready 中的下标
+    int nr_ready;         // 已经打开的文件个数，包括正在发送的
+    int sending;          // 正在发送的文件的文件头已经写入发送缓冲区
+    int finished;         // 结束记录已经写入发送缓冲区
+    uint32_t nr_sent;     // 发送了内容的文件个数
+    int backends[BATCH_PREFETCH_MAX];   // 文件所在的后端，打不开时为 -1
+    struct backend_file ready[BATCH_PREFETCH_MAX];
+};
+
+static void free_batch(struct batch_download *s)
+{
+    if (s->w) {
+        dirwalk_close(s->w);
+    }
+    int i;
+    for (i = 0; i < s->nr_dir; i++) {
+        free(s->dirs[i]);
+    }
+    for (i = 0; i < s->nr_files; i++) {
+        free(s->files[i]);
+    }
+    for (i = 0; i < s->nr_ready; i++) {
+        int k = (s->head + i) % BATCH_PREFETCH_MAX;
+        if (s->backends[k] >= 0) {
+            fdcache_close(&s->ready[k]);
+        }
+    }
+    free(s->dirs);
+    free(s->files);
+    free(s);
+}
+
+static char **copy_strings(const char *strs[], int nr, int *copied)
+{
+    char **out = calloc(nr > 0 ? nr : 1, sizeof(char *));
+    if (!out) {
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < nr; i++) {
+        out[i] = strdup(strs[i]);
+        if (!out[i]) {
+            break;
+        }
+        *copied = i + 1;
+    }
+    return out;
+}
+
+int open_batch_download(conn_info_t *c, const char *dirs[], int nr_dir,
+                        const char *files[], int nr_files)
+{
+    if (c->batch != NULL) {
+        log_error("sock_fd:%d is already in a batch download", c->sock_fd);
+        return -1;
+    }
+
+    struct batch_download *s = calloc(1, sizeof(struct batch_download));
+    if (!s) {
+        log_error("malloc batch download failed");
+        return -1;
+    }
+    s->dirs = copy_strings(dirs, nr_dir, &s->nr_dir);
+    s->files = copy_strings(files, nr_files, &s->nr_files);
+    if (!s->dirs || !s->files || s->nr_dir != nr_dir || s->nr_files != nr_files) {
+        log_error("malloc batch download failed");
+        free_batch(s);
+        return -1;
+    }
+
+    c->batch = s;
+    return 0;
+}
+
+void close_batch_download(conn_info_t *c)
+{
+    if (c->batch != NULL) {
+        free_batch(c->batch);
+        c->batch = NULL;
+    } else {
+        // 没有正在进行的批量下载
+    }
+}
+
+/*
+ * 取得下一个要下载的文件的绝对路径，没有文件了返回 0
+ */
+static int next_path(struct batch_download *s, char *path, int len)
+{
+    if (s->next_file < s->nr_files) {
+        snprintf(path, len, "%s", s->files[s->next_file]);
+        s->next_file = s->next_file + 1;
+        return 1;
+    }
+
+    while (s->w != NULL || s->curr < s->nr_dir) {
+        if (s->w == NULL) {
+            const char *dirpath = s->dirs[s->curr];
+            s->curr = s->curr + 1;
+            s->w = dirwalk_open(dirpath);
+            if (s->w == NULL) {
+                log_error("skip %s: open directory failed", dirpath);
+                continue;
+            }
+        } else {
+            // 继续遍历当前目录
+        }
+
+        struct dirwalk_entry e;
+        int rc = dirwalk_next(s->w, &e);
+        if (rc > 0) {
+            if (!strcmp(e.name, default_md5sum_filename)) {
+                /* 不下载生成的，用来记录 md5 校验和的文件 */
+                continue;
+            }
+            snprintf(path, len, "%s", e.path);
+            return 1;
+        } else {
+            if (rc < 0) {
+                // 已经发送的文件无法收回，跳过目录中剩下的文件
+                log_error("skip rest of %s: read directory failed",
+                          s->dirs[s->curr - 1]);
+            } else {
+                // 当前目录遍历完毕
+            }
+            dirwalk_close(s->w);
+            s->w = NULL;
+        }
+    }
+    return 0;
+}
+
+// 索引中没有 md5 时从 md5sum.txt 中查找，找不到时发送全 0
+static void find_md5(struct backend_file *f)
+{
+#if HAVE_SAVE_MD5
+    if (f->md5[0] == '\0') {
+        char md5_path[2048];
+        char md5[MD5_LEN];
+        if (md5path(f->abs_file_name, md5_path) == 0 &&
+            look_for_md5(md5_path, f->abs_file_name, md5) == 0) {
+            memcpy(f->md5, md5, MD5_LEN);
+            f->md5[MD5_LEN] = '\0';
+        } else {
+            log_warning("%s: look_for_md5 failed", f->abs_file_name);
+        }
+    }
+#else
+    // 没有保存 md5 时只有索引中有
+    (void) f;
+#endif
+}
+
+/*
+ * 打开后面的文件，让内核提前读入文件的开头，当前文件发送完时下一个文件通常已
+ * 经在页缓存中
+ */
+static void prefetch(struct batch_download *s)
+{
+    char path[DIRWALK_PATH_MAX];
+    while (s->nr_ready < batch_prefetch + 1 && next_path(s, path, sizeof(path))) {
+        int k = (s->head + s->nr_ready) % BATCH_PREFETCH_MAX;
+        struct backend_file *f = &s->ready[k];
+        const char *key = backend_key(path, NULL);
+        uint32_t mask;
+        int b = key != NULL ? open_seq_file(key, f, &mask) : -1;
+        if (b >= 0) {
+            find_md5(f);
+            int64_t len = f->filesize < BATCH_WILLNEED_BYTES ?
+                f->filesize : BATCH_WILLNEED_BYTES;
+            (void) posix_fadvise(f->fd, f->base, len, POSIX_FADV_WILLNEED);
+        } else {
+            log_warning("batch download of %s failed: %s", path, strerror(errno));
+            memset(f, 0, sizeof(struct backend_file));
+            f->fd = -1;
+            f->filesize = -1;
+            snprintf(f->abs_file_name, sizeof(f->abs_file_name), "%s", path);
+        }
+        s->backends[k] = b;
+        s->nr_ready = s->nr_ready + 1;
+    }
+}
+
+/*
+ * 预读时取得的大小可能已经过时，发送文件头前重新检查。等待发送期间被截断或者
+ * 正在重新上传的文件按现在的大小发送，md5 不再可信，发送全 0。打包存放的文件
+ * 在段文件中不会改变
+ */
+static void recheck_size(struct batch_download *s, int k)
+{
+    struct backend_file *f = &s->ready[k];
+    if (s->backends[k] < 0 || f->packed) {
+        return;
+    }
+    struct stat st;
+    if (fstat(f->fd, &st) != 0) {
+        log_warning("batch download of %s failed: %s", f->abs_file_name,
+                    strerror(errno));
+        fdcache_close(f);
+        f->filesize = -1;
+        s->backends[k] = -1;
+    } else if (st.st_size < f->filesize) {
+        log_warning("%s shrank from %lld to %lld before batch download",
+                    f->abs_file_name, (long long int)f->filesize,
+                    (long long int)st.st_size);
+        f->filesize = st.st_size;
+        f->fileleft = st.st_size;
+        f->md5[0] = '\0';
+    } else {
+        // 大小没有变小，按打开时的大小发送
+    }
+}
+
+static int write_head(conn_info_t *c, struct backend_file *f)
+{
+    char head[BATCH_HEAD_MAX];
+    const char *name = backend_key(f->abs_file_name, NULL);
+    if (name == NULL) {
+        name = f->abs_file_name;
+    }
+    int n = fill_file_list(head, head + sizeof(head) - MD5_LEN,
+                           name, strlen(name), f->filesize);
+    if (n < 0) {
+        return -1;
+    }
+    memset(head + n, 0, MD5_LEN);
+    memcpy(head + n, f->md5, strlen(f->md5));
+    write_ring(c->send, (uint8_t *)head, n + MD5_LEN);
+    return 0;
+}
+
+int pump_batch_download(events_poll_t *e, conn_info_t *c)
+{
+    struct batch_download *s = c->batch;
+    if (s == NULL) {
+        return 0;
+    }
+
+    int n = 0;
+    while (1) {
+        // 文件头和结束记录先从发送缓冲区发送出去，再发送文件内容
+        if (get_ring_data_size(c->send) > 0) {
+            if (send_message_internal(e, c) < 0) {
+                return -1;
+            }
+            if (get_ring_data_size(c->send) > 0) {
+                return 1;
+            }
+        }
+        if (s->finished) {
+            log_info("sock_fd:%d batch downloaded %u files", c->sock_fd, s->nr_sent);
+            return 0;
+        }
+        if (n >= BATCH_PUMP_FILES) {
+            // 等待下次可写事件再继续
+            return 1;
+        }
+
+        prefetch(s);
+        if (s->nr_ready == 0) {
+            char tail[BATCH_TAIL_LEN];
+            *((uint16_t *)&tail[0]) = 0;
+            *((uint32_t *)&tail[2]) = htobe32(s->nr_sent);
+            write_ring(c->send, (uint8_t *)tail, BATCH_TAIL_LEN);
+            s->finished = 1;
+            continue;
+        }
+
+        struct backend_file *f = &s->ready[s->head];
+        if (!s->sending) {
+            recheck_size(s, s->head);
+            if (write_head(c, f) != 0) {
+                return -1;
+            }
+            s->sending = 1;
+            continue;
+        }
+
+        if (s->backends[s->head] >= 0) {
+            int rc = send_file_blob(c->sock_fd, f, s->backends[s->head]);
+            if (rc == 0) {
+                // 连接暂时不可写，等待下次继续发送
+                return 1;
+            } else if (rc < 0) {
+                // 包括文件头发送以后文件被截断，文件头中的大小已经无法收回
+                return -1;
+            }
+            log_debug("%s successfully downloaded (%lld bytes)",
+                      f->abs_file_name, (long long int)f->filedone);
+            s->nr_sent = s->nr_sent + 1;
+            fdcache_close(f);
+        } else {
+            // 打不开的文件只有文件头
+        }
+        s->head = (s->head + 1) % BATCH_PREFETCH_MAX;
+        s->nr_ready = s->nr_ready - 1;
+        s->sending = 0;
+        n = n + 1;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// 测试用例
+////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_UNITTEST
+
+#include <assert.h>
+#include <sys/socket.h>
+
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+static void test_batch_file(const char *path, int size)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    char buf[4096];
+    memset(buf, path[strlen(path) - 1], sizeof(buf));
+    int done = 0;
+    while (done < size) {
+        int n = size - done < (int)sizeof(buf) ? size - done : (int)sizeof(buf);
+        assert(write(fd, buf, n) == n);
+        done = done + n;
+    }
+    close(fd);
+}
+
+// 读出连接上已经发送的数据，追加到 buf 中
+static int drain(int sd, uint8_t *buf, int len, int used)
+{
+    while (used < len) {
+        ssize_t n = recv(sd, buf + used, len - used, MSG_DONTWAIT);
+        if (n <= 0) {
+            break;
+        }
+        used = used + n;
+    }
+    return used;
+}
+
+// 解码一个文件头，返回文件大小，内容留在 *p 处
+static int64_t decode_head(uint8_t **p, const char *name, char *md5)
+{
+    uint16_t namelen = be16toh(*(uint16_t *)*p);
+    assert(namelen == strlen(name) && !memcmp(*p + 2, name, namelen));
+    *p = *p + 2 + namelen;
+    int64_t size = be64toh(*(int64_t *)*p);
+    memcpy(md5, *p + 8, MD5_LEN);
+    *p = *p + 8 + MD5_LEN;
+    return size;
+}
+
+void test_batchdl(void)
+{
+    printf("test_batchdl: ");
+
+    backend_cnt = 1;
+    snprintf(backend_dirs[0], sizeof(backend_dirs[0]), "/tmp/test_batchdl");
+    assert(mkdir(backend_dirs[0], 0755) == 0 || errno == EEXIST);
+    test_batch_file("/tmp/test_batchdl/a", 4 * 1024 * 1024);
+    test_batch_file("/tmp/test_batchdl/b", 1000);
+    unlink("/tmp/test_batchdl/c");
+    fdcache_size = 0;
+    batch_prefetch = 2;
+
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    assert(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+    conn_info_t c;
+    memset(&c, 0, sizeof(c));
+    c.sock_fd = sv[0];
+    c.send = create_ring(MAX_RING_DATA_LEN);
+    assert(c.send != NULL);
+
+    const char *files[] = {"/tmp/test_batchdl/a", "/tmp/test_batchdl/c",
+                           "/tmp/test_batchdl/b"};
+    assert(open_batch_download(&c, NULL, 0, files, 3) == 0);
+
+    /* 发送 a 的内容时连接不可写，b 已经预读，等待期间被截断 */
+    int len = 8 * 1024 * 1024;
+    uint8_t *buf = malloc(len);
+    assert(buf != NULL);
+    assert(pump_batch_download(NULL, &c) == 1);
+    assert(truncate("/tmp/test_batchdl/b", 10) == 0);
+    int used = 0;
+    int rc;
+    do {
+        used = drain(sv[1], buf, len, used);
+        rc = pump_batch_download(NULL, &c);
+    } while (rc == 1);
+    assert(rc == 0);
+    used = drain(sv[1], buf, len, used);
+    close_batch_download(&c);
+
+    /* 解码：a 的内容，打不开的 c，按截断后大小发送的 b，结束记录 */
+    char md5[MD5_LEN];
+    uint8_t *p = buf;
+    assert(decode_head(&p, "/a", md5) == 4 * 1024 * 1024);
+    assert(p[0] == 'a' && p[4 * 1024 * 1024 - 1] == 'a');
+    p = p + 4 * 1024 * 1024;
+    assert(decode_head(&p, "/c", md5) == -1);
+    assert(decode_head(&p, "/b", md5) == 10);
+    assert(md5[0] == '\0' && p[0] == 'b' && p[9] == 'b');
+    p = p + 10;
+    assert(*(uint16_t *)p == 0 && be32toh(*(uint32_t *)(p + 2)) == 2);
+    assert(p + BATCH_TAIL_LEN == buf + used);
+
+    free(buf);
+    destroy_ring(c.send);
+    close(sv[0]);
+    close(sv[1]);
+    unlink("/tmp/test_batchdl/a");
+    unlink("/tmp/test_batchdl/b");
+    rmdir("/tmp/test_batchdl");
+    printf("success\n");
+}
+
+#endif
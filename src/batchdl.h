@@ -0,0 +1,57 @@
+#ifndef BATCHDL_H
+#define BATCHDL_H
+
+#include "conn_mgmt.h"
+
+/*
+ * 批量顺序下载（CMD_BATCH_DOWNLOAD_REQ）
+ *
+ * 客户端原来先取文件列表，再为每个文件发一个 CMD_SEQ_DOWNLOAD_REQ，每个文件都
+ * 要一次往返、一次打开文件和查找 md5，还要切换接收和发送事件。批量下载请求的
+ * file_name 和 CMD_GET_FILE_LIST_REQ 一样是 studyid 或者 studyid/serial，下载
+ * 目录下的所有文件；task_info 之后还可以带一个文件列表，每个文件名以 '\0' 结
+ * 束，格式和 CMD_SEQ_DOWNLOAD_REQ 的 file_name 一样，这时只下载列表中的文件。
+ *
+ * 所有文件在连接上一个接一个发送，都是网络字节序：
+ *
+ * (2 字节文件名长度) (文件名) (8 字节文件大小) (32 字节 md5) (文件内容) ...
+ *
+ * 文件名是相对于后端目录的路径，和文件列表中的一样。打不开的文件大小是 -1，
+ * 后面没有内容。最后是文件名长度为 0 的结束记录，后面是 4 字节的发送了内容的
+ * 文件个数。和 CMD_SEQ_DOWNLOAD_REQ 一样，响应是没有消息头的数据流，
+ * CMD_BATCH_DOWNLOAD_RSP 只是和请求配对的命令号，不出现在连接上。
+ *
+ * 文件大小是发送文件头时的大小：预读以后被截断的文件按截断后的大小发送，md5
+ * 为全 0；发送内容期间被截断时已经无法更正文件头，关闭连接。
+ *
+ * 文件内容用 sendfile() 发送，文件头和结束记录经过发送缓冲区。发送当前文件时，
+ * 后面 batch_prefetch 个文件已经打开、取得了大小和 md5，并用 POSIX_FADV_WILLNEED
+ * 让内核提前读入文件开头的 BATCH_WILLNEED_BYTES 字节。发送期间暂停接收客户端的
+ * 请求。
+ */
+
+#define BATCH_PREFETCH_MAX      8
+#define BATCH_WILLNEED_BYTES    (16 * 1024 * 1024)
+#define BATCH_PUMP_FILES        16  // 每次最多发送的文件个数，避免长时间占用工作线程
+
+struct batch_download;
+
+/*
+ * 开始批量下载。先下载 files 中的文件，再下载 dirs 中的目录下的所有文件，都是
+ * 后端目录中的绝对路径，会被复制。成功返回 0，失败返回 -1
+ */
+extern int open_batch_download(conn_info_t *c, const char *dirs[], int nr_dir,
+                               const char *files[], int nr_files);
+
+/*
+ * 连接可写时继续发送。返回 1 表示还没有结束，返回 0 表示所有数据都已经发送，
+ * 返回 -1 表示出错
+ */
+extern int pump_batch_download(events_poll_t *e, conn_info_t *c);
+
+/*
+ * 结束批量下载，关闭打开的文件，连接关闭时也会调用
+ */
+extern void close_batch_download(conn_info_t *c);
+
+#endif  /* BATCHDL_H */
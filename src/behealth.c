@@ -0,0 +1,379 @@
+
+// behealth.c
+
+#include <fcntl.h>
+
+#include "mt_log.h"
+#include "public.h"
+#include "tunables.h"
+#include "jobq.h"
+#include "dio.h"
+#include "metaidx.h"
+#include "behealth.h"
+
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+#define BEHEALTH_PROBE_FILE  "probe"        // 探测时读取的文件，在 METAIDX_DIR 中
+#define BEHEALTH_PROBE_SIZE  DIO_ALIGN
+
+struct be_health {
+    pthread_mutex_t lock;
+    int state;
+    int consecutive;        // 连续出错的次数
+    int backoff;            // 下次隔离时间是 backend_quarantine_ms 的几倍
+    uint64_t until;         // 隔离结束的时间（毫秒）
+    uint64_t ewma8;         // 平均耗时（微秒）的 8 倍，保留小数部分
+    uint64_t samples;       // 计入平均耗时的读取次数，恢复健康时清零
+    uint64_t reads;
+    uint64_t errors;
+    uint64_t quarantines;
+};
+
+static struct be_health healths[MAX_BACK_END];
+static uint64_t explore_count = 0;
+
+static const char *state_string(int state)
+{
+    switch (state) {
+    case BEHEALTH_HEALTHY:     return "healthy";
+    case BEHEALTH_QUARANTINED: return "quarantined";
+    case BEHEALTH_PROBING:     return "probing";
+    default:                   return "unknown";
+    }
+}
+
+uint64_t behealth_now_usecs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+void init_behealth(void)
+{
+    int i;
+    for (i = 0; i < MAX_BACK_END; i++) {
+        struct be_health *h = &healths[i];
+        memset(h, 0, sizeof(struct be_health));
+        pthread_mutex_init(&h->lock, NULL);
+        h->state = BEHEALTH_HEALTHY;
+        h->backoff = 1;
+    }
+}
+
+// 调用者持有 h->lock
+static void quarantine(struct be_health *h, int index, uint64_t now_ms)
+{
+    h->state = BEHEALTH_QUARANTINED;
+    h->until = now_ms + (uint64_t)backend_quarantine_ms * h->backoff;
+    h->quarantines = h->quarantines + 1;
+    log_warning("quarantine backend %s for %lld ms: %d consecutive errors",
+                backend_dirs[index],
+                (long long int)backend_quarantine_ms * h->backoff,
+                h->consecutive);
+}
+
+void behealth_record(int index, uint64_t usecs, int ok)
+{
+    if (index < 0 || index >= backend_cnt) {
+        return;
+    }
+
+    struct be_health *h = &healths[index];
+    pthread_mutex_lock(&h->lock);
+    h->reads = h->reads + 1;
+    if (ok) {
+        if (h->samples == 0) {
+            h->ewma8 = usecs * 8;
+        } else {
+            h->ewma8 = h->ewma8 - h->ewma8 / 8 + usecs;
+        }
+        h->samples = h->samples + 1;
+        h->consecutive = 0;
+    } else {
+        h->errors = h->errors + 1;
+        h->consecutive = h->consecutive + 1;
+        if (h->state == BEHEALTH_HEALTHY && backend_quarantine_errors > 0 &&
+            h->consecutive >= backend_quarantine_errors) {
+            quarantine(h, index, behealth_now_usecs() / 1000);
+        } else {
+            // 还没有达到隔离的条件，或者已经隔离了
+        }
+    }
+    pthread_mutex_unlock(&h->lock);
+}
+
+int behealth_is_fault(int err)
+{
+    switch (err) {
+    case EIO:
+    case ESTALE:
+    case ENXIO:
+    case ENODEV:
+    case ETIMEDOUT:
+    case EHOSTDOWN:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+int behealth_is_healthy(int index)
+{
+    struct be_health *h = &healths[index];
+    pthread_mutex_lock(&h->lock);
+    int ok = h->state == BEHEALTH_HEALTHY;
+    pthread_mutex_unlock(&h->lock);
+    return ok;
+}
+
+int behealth_order(int *order, uint32_t mask)
+{
+    int healthy[MAX_BACK_END];
+    uint64_t latency[MAX_BACK_END];
+    int n = 0;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        if (!(mask & (1U << i))) {
+            continue;
+        }
+        struct be_health *h = &healths[i];
+        pthread_mutex_lock(&h->lock);
+        int ok = h->state == BEHEALTH_HEALTHY;
+        // 还没有样本的后端平均耗时为 0，先读一次得到样本
+        uint64_t usecs = h->samples > 0 ? h->ewma8 / 8 : 0;
+        pthread_mutex_unlock(&h->lock);
+
+        // 插入排序，健康的在前，同样健康的平均耗时小的在前
+        int j = n;
+        while (j > 0 && (healthy[j - 1] < ok ||
+                         (healthy[j - 1] == ok && latency[j - 1] > usecs))) {
+            order[j] = order[j - 1];
+            healthy[j] = healthy[j - 1];
+            latency[j] = latency[j - 1];
+            j = j - 1;
+        }
+        order[j] = i;
+        healthy[j] = ok;
+        latency[j] = usecs;
+        n = n + 1;
+    }
+
+    if (n >= 2 && healthy[1] &&
+        __sync_add_and_fetch(&explore_count, 1) % BEHEALTH_EXPLORE == 0) {
+        // 偶尔先读第二快的后端，更新它的平均耗时
+        int t = order[0];
+        order[0] = order[1];
+        order[1] = t;
+    } else {
+        // 最快的后端在最前面
+    }
+    return n;
+}
+
+/*
+ * 绕过页缓存读取后端目录中的探测文件，打开目录只会用到目录项缓存，挂死的存储
+ * 也能成功。探测文件第一次使用时创建。成功返回 0，失败返回 -1，*what 是出错的
+ * 操作
+ */
+static int probe_backend(int index, const char **what)
+{
+    char path[MAX_NAME_LEN + 64];
+    snprintf(path, sizeof(path), "%s/%s", backend_dirs[index], METAIDX_DIR);
+    // 只创建 METAIDX_DIR，后端目录不见了（例如没有挂载）时探测失败
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        *what = "mkdir";
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%s/%s", backend_dirs[index], METAIDX_DIR,
+             BEHEALTH_PROBE_FILE);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        *what = "open";
+        return -1;
+    }
+
+    uint8_t data[BEHEALTH_PROBE_SIZE];
+    struct stat st;
+    int rc = -1;
+    if (fstat(fd, &st) != 0) {
+        *what = "fstat";
+    } else if (st.st_size < BEHEALTH_PROBE_SIZE &&
+               (memset(data, 0x5a, sizeof(data)) == NULL ||
+                pwrite(fd, data, sizeof(data), 0) != (ssize_t)sizeof(data) ||
+                fdatasync(fd) != 0)) {
+        *what = "write";
+    } else {
+        int direct = set_direct_io(fd, 1) == 0;
+        if (!direct) {
+            // 文件系统不支持 O_DIRECT，先丢弃缓存的页
+            (void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        int n = direct ? dio_pread(fd, data, sizeof(data), 0) :
+            pread(fd, data, sizeof(data), 0);
+        if (n == (int)sizeof(data)) {
+            rc = 0;
+        } else {
+            *what = "read";
+            if (n >= 0) {
+                errno = EIO;
+            }
+        }
+    }
+    int err = errno;
+    close(fd);
+    errno = err;
+    return rc;
+}
+
+// 在任务执行线程中探测后端，挂死的后端只阻塞这个线程
+static int run_probe_job(struct job *j)
+{
+    int index = *(int *)j->data;
+    struct be_health *h = &healths[index];
+
+    const char *what = NULL;
+    int ok = probe_backend(index, &what) == 0;
+    if (!ok) {
+        log_error("probe backend %s failed: %s: %s",
+                  backend_dirs[index], what, strerror(errno));
+    }
+
+    pthread_mutex_lock(&h->lock);
+    if (ok) {
+        // 恢复后重新统计平均耗时，不再使用出问题之前的样本
+        h->state = BEHEALTH_HEALTHY;
+        h->consecutive = 0;
+        h->backoff = 1;
+        h->samples = 0;
+        log_info("backend %s is healthy again", backend_dirs[index]);
+    } else {
+        if (h->backoff < BEHEALTH_BACKOFF_MAX) {
+            h->backoff = h->backoff * 2;
+        } else {
+            // 隔离时间不再加倍
+        }
+        quarantine(h, index, behealth_now_usecs() / 1000);
+    }
+    pthread_mutex_unlock(&h->lock);
+    return ok ? 0 : -1;
+}
+
+void behealth_probe(void)
+{
+    uint64_t now_ms = behealth_now_usecs() / 1000;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct be_health *h = &healths[i];
+        pthread_mutex_lock(&h->lock);
+        int due = h->state == BEHEALTH_QUARANTINED && now_ms >= h->until;
+        if (due) {
+            h->state = BEHEALTH_PROBING;
+        }
+        pthread_mutex_unlock(&h->lock);
+        if (!due) {
+            continue;
+        }
+
+        struct job *j = alloc_job();
+        if (j == NULL) {
+            // 任务队列已满，下一秒再探测
+            pthread_mutex_lock(&h->lock);
+            h->state = BEHEALTH_QUARANTINED;
+            pthread_mutex_unlock(&h->lock);
+            continue;
+        }
+        *(int *)j->data = i;
+        j->run = run_probe_job;
+        j->done = NULL;
+        submit_job(j);
+    }
+}
+
+int behealth_json(char *buf, int len)
+{
+    // 放不下的后端不写出，总是留出 ']' 和 '\0' 的位置，输出总是完整的 JSON
+    if (len < 3) {
+        return 0;
+    }
+    int n = snprintf(buf, len, "[");
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct be_health *h = &healths[i];
+        char one[MAX_NAME_LEN + 256];
+        pthread_mutex_lock(&h->lock);
+        int m = snprintf(one, sizeof(one),
+                         "%s{\"dir\": \"%s\", \"state\": \"%s\", "
+                         "\"latency_us\": %lu, \"reads\": %lu, \"errors\": %lu, "
+                         "\"quarantines\": %lu}",
+                         n > 1 ? ", " : "", backend_dirs[i], state_string(h->state),
+                         h->samples > 0 ? h->ewma8 / 8 : 0UL,
+                         h->reads, h->errors, h->quarantines);
+        pthread_mutex_unlock(&h->lock);
+        if (m >= (int)sizeof(one) || n + m + 2 > len) {
+            log_warning("backend health of %s does not fit in %d bytes",
+                        backend_dirs[i], len);
+            break;
+        }
+        memcpy(buf + n, one, m);
+        n = n + m;
+    }
+    buf[n] = ']';
+    buf[n + 1] = '\0';
+    return n + 1;
+}
+
+#ifdef CONFIG_UNITTEST
+
+#include <assert.h>
+
+void test_behealth(void)
+{
+    printf("test_behealth: ");
+
+    backend_cnt = 3;
+    snprintf(backend_dirs[0], sizeof(backend_dirs[0]), "/tmp/test_behealth0");
+    snprintf(backend_dirs[1], sizeof(backend_dirs[1]), "/tmp/test_behealth1");
+    snprintf(backend_dirs[2], sizeof(backend_dirs[2]), "/tmp/test_behealth2");
+    backend_quarantine_errors = 2;
+    init_behealth();
+
+    /* 没有样本时按下标排列，之后按平均耗时排列 */
+    int order[MAX_BACK_END];
+    assert(behealth_order(order, 0x7) == 3);
+    assert(order[0] == 0 && order[1] == 1 && order[2] == 2);
+    behealth_record(0, 900, 1);
+    behealth_record(1, 100, 1);
+    behealth_record(2, 500, 1);
+    assert(behealth_order(order, 0x7) == 3);
+    assert(order[0] == 1 && order[1] == 2 && order[2] == 0);
+    assert(behealth_order(order, 0x5) == 2);
+    assert(order[0] == 2 && order[1] == 0);
+
+    /* 连续出错的后端被隔离，排在最后 */
+    behealth_record(1, 0, 0);
+    behealth_record(1, 100, 1);
+    behealth_record(1, 0, 0);
+    assert(healths[1].state == BEHEALTH_HEALTHY);
+    behealth_record(1, 0, 0);
+    assert(healths[1].state == BEHEALTH_QUARANTINED);
+    assert(behealth_order(order, 0x7) == 3);
+    assert(order[0] == 2 && order[1] == 0 && order[2] == 1);
+
+    /* 放不下的后端不写出，JSON 仍然完整 */
+    char json[512];
+    int n = behealth_json(json, sizeof(json));
+    assert(n == (int)strlen(json) && json[0] == '[' && json[n - 1] == ']');
+    assert(strstr(json, "\"quarantined\"") != NULL);
+    /* 只放得下第一个后端（'[' 第一个后端 ']' '\0'） */
+    int first = strchr(json, '}') - json;
+    n = behealth_json(json, first + 3);
+    assert(n == first + 2 && json[n - 1] == ']' && json[first] == '}');
+    assert(strstr(json, "test_behealth0") != NULL && strstr(json, "quarantined") == NULL);
+    assert(behealth_json(json, 3) == 2 && !strcmp(json, "[]"));
+
+    printf("success\n");
+}
+
+#endif
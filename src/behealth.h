@@ -0,0 +1,73 @@
+#ifndef BEHEALTH_H
+#define BEHEALTH_H
+
+#include <stdint.h>
+
+/*
+ * 后端目录的健康状况
+ *
+ * 每个后端目录都是完整的镜像，下载时可以从任何一个后端读取。以前总是先读第一
+ * 个后端，它变慢或者出错时所有的下载都受影响。现在每次读取都记录耗时和结果，
+ * sendfile() 的耗时主要取决于连接，只记录出错：
+ *
+ * - 耗时用指数加权移动平均（EWMA，新样本的权重是 1/8）统计，下载时按平均耗时
+ *   从快到慢依次尝试健康的后端。每 BEHEALTH_EXPLORE 次读取把第二快的后端排在
+ *   最前面，让其他后端的平均耗时也能及时更新；
+ * - 连续出错 backend_quarantine_errors 次的后端被隔离，只有健康的后端都读不到
+ *   文件时才使用。隔离 backend_quarantine_ms 后，在任务队列（jobq.h）中绕过
+ *   页缓存读一次后端 METAIDX_DIR 中的探测文件，成功就恢复，失败就再隔离，每次
+ *   隔离的时间加倍，最多 BEHEALTH_BACKOFF_MAX 倍。
+ *
+ * 文件不存在（ENOENT）不算后端出错，镜像之间本来就可能不一致。每个后端的状态
+ * 和统计随心跳消息发送给 asm。
+ */
+
+#define BEHEALTH_EXPLORE      64
+#define BEHEALTH_BACKOFF_MAX  64
+
+#define BEHEALTH_HEALTHY      0
+#define BEHEALTH_QUARANTINED  1
+#define BEHEALTH_PROBING      2
+
+/*
+ * 初始化所有后端的状态
+ */
+extern void init_behealth(void);
+
+/*
+ * 记录后端 index 的一次读取，usecs 是耗时（微秒），ok 为 0 表示读取出错
+ */
+extern void behealth_record(int index, uint64_t usecs, int ok);
+
+/*
+ * errno 是否表示后端目录本身出了问题（EIO、ESTALE 等），而不是文件不存在或者
+ * 进程的资源不够
+ */
+extern int behealth_is_fault(int err);
+
+/*
+ * 后端 index 没有被隔离时返回 1
+ */
+extern int behealth_is_healthy(int index);
+
+/*
+ * 按读取的优先顺序把后端的下标写入 order，只包括 mask 中的后端（第 i 位对应
+ * backend_dirs[i]）。健康的后端按平均耗时排在前面，隔离的后端排在最后。返回
+ * 写入的个数
+ */
+extern int behealth_order(int *order, uint32_t mask);
+
+/*
+ * 隔离时间已到的后端提交探测任务，由主线程的定时器每秒调用一次
+ */
+extern void behealth_probe(void);
+
+/*
+ * 把所有后端的状态和统计写成 JSON 数组，返回写入的长度。len 放不下时省略后面
+ * 的后端，输出仍然是完整的 JSON
+ */
+extern int behealth_json(char *buf, int len);
+
+extern uint64_t behealth_now_usecs(void);
+
+#endif  /* BEHEALTH_H */
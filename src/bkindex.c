@@ -0,0 +1,533 @@
+
+// bkindex.c
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mt_log.h"
+#include "scandir.h"
+#include "bkindex.h"
+
+#define BKINDEX_COMPACT 1024    /* 删除记录超过这个数量，并且多于新增记录的一半时压缩 */
+#define BKINDEX_SUFFIXES 5      /* 备份文件名时间后缀的字段数：年.月.日.时分秒.微秒 */
+
+int backup_origname_len(const char *bakname)
+{
+    int len = strlen(bakname);
+    int fields = 0;
+    int digits = 0;
+    int i;
+    for (i = len - 1; i >= 0; i--) {
+        if (bakname[i] == '.') {
+            if (digits == 0) {
+                return -1;
+            }
+            fields = fields + 1;
+            digits = 0;
+            if (fields == BKINDEX_SUFFIXES) {
+                return i > 0 ? i : -1;
+            }
+        } else if (isdigit((unsigned char)bakname[i])) {
+            digits = digits + 1;
+        } else {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+static int is_backup_of(const char *bakname, const char *origname)
+{
+    int len = backup_origname_len(bakname);
+    return len > 0 && (int)strlen(origname) == len &&
+        strncmp(bakname, origname, len) == 0;
+}
+
+/* 打开备份目录并加锁，备份目录不存在时返回 -1，errno 为 ENOENT */
+static int lock_backup_dir(const char *dirpath, int how)
+{
+    char bkdir[MAX_PATH_LEN];
+    snprintf(bkdir, sizeof(bkdir), "%s/%s", dirpath, BKDIRNAME);
+    int dfd = open(bkdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        return -1;
+    }
+    while (flock(dfd, how) != 0) {
+        if (errno != EINTR) {
+            int ec = errno;
+            log_error("flock failed: %s, %s", bkdir, strerror(ec));
+            close(dfd);
+            errno = ec;
+            return -1;
+        }
+    }
+    return dfd;
+}
+
+/*
+ * 追加记录失败，索引缺少了记录，删除索引，下次查找时重建。调用者持有 dfd 的
+ * 共享锁，删除前换成排他锁，不会删除别人刚重建的索引
+ */
+static void drop_index(int dfd, const char *dirpath)
+{
+    while (flock(dfd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            log_error("flock failed: %s/%s, %s", dirpath, BKDIRNAME, strerror(errno));
+            return;
+        }
+    }
+    if (unlinkat(dfd, BKINDEX_NAME, 0) == 0) {
+        log_warning("drop backup index: %s", dirpath);
+    } else if (errno != ENOENT) {
+        log_error("unlink index failed: %s, %s", dirpath, strerror(errno));
+    } else {
+        /* 索引已经被删除 */
+    }
+}
+
+static int append_records(const char *dirpath, char op,
+                          const char **names, int nr)
+{
+    if (nr <= 0) {
+        return 0;
+    }
+
+    int dfd = lock_backup_dir(dirpath, LOCK_SH);
+    if (dfd < 0) {
+        if (errno == ENOENT) {
+            return 0; /* 没有备份目录，也就没有索引 */
+        } else {
+            return -1;
+        }
+    }
+
+    int fd = openat(dfd, BKINDEX_NAME, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            close(dfd);
+            return 0; /* 还没有索引，查找时会重建 */
+        } else {
+            log_error("open index failed: %s, %s", dirpath, strerror(errno));
+            drop_index(dfd, dirpath);
+            close(dfd);
+            return -1;
+        }
+    }
+
+    /* 所有记录一次写入，避免和其他线程的记录交错 */
+    size_t size = 0;
+    int i;
+    for (i = 0; i < nr; i++) {
+        size = size + strlen(names[i]) + 2;
+    }
+    char *buffer = malloc(size + 1);
+    int retcode = -1;
+    if (buffer) {
+        char *p = buffer;
+        for (i = 0; i < nr; i++) {
+            p += sprintf(p, "%c%s\n", op, names[i]);
+        }
+        ssize_t n = write(fd, buffer, p - buffer);
+        if (n == p - buffer) {
+            retcode = 0;
+        } else {
+            log_error("append index failed: %s, %s", dirpath, strerror(errno));
+        }
+        free(buffer);
+    } else {
+        log_error("malloc %d bytes failed", (int)size);
+    }
+    close(fd);
+    if (retcode != 0) {
+        drop_index(dfd, dirpath);
+    }
+    close(dfd);
+    return retcode;
+}
+
+int bkindex_add(const char *dirpath, const char **names, int nr)
+{
+    return append_records(dirpath, '+', names, nr);
+}
+
+int bkindex_remove(const char *dirpath, const char **names, int nr)
+{
+    return append_records(dirpath, '-', names, nr);
+}
+
+int bkindex_rebuild(const char *dirpath)
+{
+    int dfd = lock_backup_dir(dirpath, LOCK_EX);
+    if (dfd < 0) {
+        if (errno == ENOENT) {
+            return 0; /* 没有备份目录，不需要索引 */
+        } else {
+            log_error("lock backup dir failed: %s", dirpath);
+            return -1;
+        }
+    }
+
+    int retcode = -1;
+    FILE *out = NULL;
+    int fd = openat(dfd, BKINDEX_TMPNAME,
+                    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0 && (out = fdopen(fd, "w")) != NULL) {
+        int dfd2 = dup(dfd);
+        DIR *dirp = dfd2 >= 0 ? fdopendir(dfd2) : NULL;
+        if (dirp) {
+            int nr = 0;
+            struct dirent *e;
+            while ((e = readdir(dirp)) != NULL) {
+                if (backup_origname_len(e->d_name) <= 0) {
+                    /* 不是备份文件 */
+                    continue;
+                }
+                int isreg = e->d_type == DT_REG;
+                if (e->d_type == DT_UNKNOWN) {
+                    struct stat s;
+                    isreg = fstatat(dfd, e->d_name, &s, AT_SYMLINK_NOFOLLOW) == 0
+                        && S_ISREG(s.st_mode);
+                }
+                if (isreg) {
+                    fprintf(out, "+%s\n", e->d_name);
+                    nr = nr + 1;
+                } else {
+                    /* 被删除的目录也放在备份目录中，不记录 */
+                }
+            }
+            closedir(dirp);
+            if (fclose(out) == 0) {
+                if (renameat(dfd, BKINDEX_TMPNAME, dfd, BKINDEX_NAME) == 0) {
+                    log_info("rebuild backup index: %s, %d backups",
+                             dirpath, nr);
+                    retcode = 0;
+                } else {
+                    log_error("rename index failed: %s, %s",
+                              dirpath, strerror(errno));
+                }
+            } else {
+                log_error("write index failed: %s, %s", dirpath, strerror(errno));
+            }
+            out = NULL;
+        } else {
+            log_error("opendir failed: %s/%s, %s",
+                      dirpath, BKDIRNAME, strerror(errno));
+            if (dfd2 >= 0) {
+                close(dfd2);
+            }
+        }
+    } else {
+        log_error("create index failed: %s, %s", dirpath, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (out) {
+        fclose(out);
+    }
+    close(dfd);
+    return retcode;
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec ||
+        (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * 读入整个索引文件，索引不存在时返回 NULL，errno 为 ENOENT。
+ *
+ * 备份目录中增删文件都会更新目录的 mtime，随后追加记录或者重命名索引会更新
+ * 索引的 ctime。索引的 ctime 早于目录的 mtime 时，有备份在追加记录前中断（崩
+ * 溃，或者追加失败后没能删除索引），或者正在进行，索引不可信，*stale 为 1
+ */
+static char *read_index(const char *dirpath, size_t *size, int *stale)
+{
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/%s", dirpath, BKDIRNAME);
+    struct stat d;
+    if (stat(path, &d) != 0) {
+        return NULL;
+    }
+    snprintf(path, sizeof(path), "%s/%s/%s", dirpath, BKDIRNAME, BKINDEX_NAME);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat s;
+    char *buffer = NULL;
+    if (fstat(fd, &s) == 0 && (buffer = malloc(s.st_size + 1)) != NULL) {
+        *stale = timespec_before(&s.st_ctim, &d.st_mtim);
+        size_t done = 0;
+        while (done < (size_t)s.st_size) {
+            ssize_t n = read(fd, buffer + done, s.st_size - done);
+            if (n > 0) {
+                done = done + n;
+            } else if (n < 0 && errno == EINTR) {
+                /* 系统调用被中断，继续读取 */
+            } else {
+                break;
+            }
+        }
+        buffer[done] = '\0';
+        *size = done;
+    } else {
+        log_error("read index failed: %s, %s", path, strerror(errno));
+        errno = EIO;
+    }
+    close(fd);
+    return buffer;
+}
+
+static int list_add(struct bkindex_list *l, const char *name, int len)
+{
+    int i;
+    for (i = 0; i < l->nr; i++) {
+        if ((int)strlen(l->names[i]) == len && !strncmp(l->names[i], name, len)) {
+            return 0; /* 已经记录过 */
+        }
+    }
+    if (l->nr == 0 || (l->nr >= 4 && (l->nr & (l->nr - 1)) == 0)) {
+        /* 数组满了，容量是 4 以上的 2 的幂 */
+        char **names = realloc(l->names, (l->nr ? l->nr * 2 : 4) * sizeof(char *));
+        if (!names) {
+            return -1;
+        }
+        l->names = names;
+    }
+    l->names[l->nr] = strndup(name, len);
+    if (!l->names[l->nr]) {
+        return -1;
+    }
+    l->nr = l->nr + 1;
+    return 0;
+}
+
+static void list_remove(struct bkindex_list *l, const char *name, int len)
+{
+    int i;
+    for (i = 0; i < l->nr; i++) {
+        if ((int)strlen(l->names[i]) == len && !strncmp(l->names[i], name, len)) {
+            free(l->names[i]);
+            l->names[i] = l->names[l->nr - 1];
+            l->nr = l->nr - 1;
+            return;
+        }
+    }
+}
+
+void bkindex_free(struct bkindex_list *l)
+{
+    int i;
+    for (i = 0; i < l->nr; i++) {
+        free(l->names[i]);
+    }
+    free(l->names);
+    l->names = NULL;
+    l->nr = 0;
+}
+
+int bkindex_lookup(const char *dirpath, const char *origname,
+                   struct bkindex_list *l)
+{
+    memset(l, 0, sizeof(struct bkindex_list));
+
+    size_t size = 0;
+    int stale = 0;
+    char *buffer = read_index(dirpath, &size, &stale);
+    if (buffer != NULL && stale) {
+        /* 重新扫描一次备份目录，不相信索引 */
+        log_warning("backup index older than %s/%s", dirpath, BKDIRNAME);
+        free(buffer);
+        buffer = NULL;
+        errno = ENOENT;
+    }
+    if (buffer == NULL && errno == ENOENT) {
+        if (bkindex_rebuild(dirpath) != 0) {
+            return -1;
+        }
+        buffer = read_index(dirpath, &size, &stale);
+        if (buffer == NULL && errno == ENOENT) {
+            return 0; /* 没有备份目录 */
+        }
+    }
+    if (buffer == NULL) {
+        return -1;
+    }
+
+    int added = 0, removed = 0;
+    char *line = buffer;
+    while (line < buffer + size) {
+        char *end = strchr(line, '\n');
+        if (end == NULL) {
+            break; /* 不完整的最后一行 */
+        }
+        *end = '\0';
+        const char *name = line + 1;
+        if (line[0] == '+') {
+            added = added + 1;
+            if (is_backup_of(name, origname) && list_add(l, name, end - name) != 0) {
+                log_error("malloc backup list failed");
+                free(buffer);
+                bkindex_free(l);
+                return -1;
+            }
+        } else if (line[0] == '-') {
+            removed = removed + 1;
+            if (is_backup_of(name, origname)) {
+                list_remove(l, name, end - name);
+            }
+        } else {
+            /* 不认识的记录，跳过 */
+        }
+        line = end + 1;
+    }
+    free(buffer);
+
+    if (removed > BKINDEX_COMPACT && removed > added / 2) {
+        /* 压缩失败不影响查找结果 */
+        bkindex_rebuild(dirpath);
+    }
+    return 0;
+}
+
+int bkindex_rebuild_tree(const char *rootpath)
+{
+    DIR *dirp = opendir(rootpath);
+    if (dirp == NULL) {
+        log_error("opendir failed: %s, %s", rootpath, strerror(errno));
+        return -1;
+    }
+
+    int count = 0;
+    struct dirent *e;
+    while ((e = readdir(dirp)) != NULL) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+            continue;
+        }
+        int isdir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN) {
+            struct stat s;
+            isdir = fstatat(dirfd(dirp), e->d_name, &s, AT_SYMLINK_NOFOLLOW) == 0
+                && S_ISDIR(s.st_mode);
+        }
+        if (!isdir) {
+            continue;
+        }
+
+        if (!strcmp(e->d_name, BKDIRNAME)) {
+            if (bkindex_rebuild(rootpath) == 0) {
+                count = count + 1;
+            } else {
+                log_error("rebuild backup index failed: %s", rootpath);
+            }
+        } else {
+            char path[MAX_PATH_LEN];
+            snprintf(path, sizeof(path), "%s/%s", rootpath, e->d_name);
+            int n = bkindex_rebuild_tree(path);
+            if (n > 0) {
+                count = count + n;
+            }
+        }
+    }
+    closedir(dirp);
+    return count;
+}
+
+////////////////////////////////////////////////////////////////////////
+// 测试用例
+////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_UNITTEST
+
+extern int mkdirs(const char *dirpath);
+extern int write_zero_file(const char *filepath, off_t filesize);
+
+void test_bkindex(void)
+{
+    printf("test_bkindex: ");
+
+    assert(backup_origname_len("a.txt.2020.03.20.164815.876") == 5);
+    assert(backup_origname_len("a.txt") == -1);
+    assert(backup_origname_len("a.2020.03.20.1648x5.876") == -1);
+
+    const char *dirpath = "/tmp/test_bkindex";
+    const char *bkdir = "/tmp/test_bkindex/" BKDIRNAME;
+    int rc = mkdirs(bkdir); assert(rc == 0);
+    const char *files[] = {
+        "a.2020.03.20.164815.1", "a.2020.03.20.164815.2",
+        "ab.2020.03.20.164815.3", "b.2020.03.20.164815.4",
+    };
+    int i;
+    char path[MAX_PATH_LEN];
+    for (i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/%s", bkdir, files[i]);
+        rc = write_zero_file(path, 1); assert(rc == 0);
+    }
+    snprintf(path, sizeof(path), "%s/%s", bkdir, BKINDEX_NAME);
+    unlink(path);
+
+    /* 没有索引时重建 */
+    struct bkindex_list l;
+    rc = bkindex_lookup(dirpath, "a", &l); assert(rc == 0 && l.nr == 2);
+    bkindex_free(&l);
+
+    const char *added[] = {"a.2020.03.20.164815.5"};
+    rc = bkindex_add(dirpath, added, 1); assert(rc == 0);
+    const char *removed[] = {"a.2020.03.20.164815.1", "b.2020.03.20.164815.4"};
+    rc = bkindex_remove(dirpath, removed, 2); assert(rc == 0);
+    rc = bkindex_lookup(dirpath, "a", &l); assert(rc == 0 && l.nr == 2);
+    for (i = 0; i < l.nr; i++) {
+        assert(strcmp(l.names[i], "a.2020.03.20.164815.1") != 0);
+    }
+    bkindex_free(&l);
+    rc = bkindex_lookup(dirpath, "b", &l); assert(rc == 0 && l.nr == 0);
+    bkindex_free(&l);
+
+    rc = bkindex_rebuild_tree("/tmp/test_bkindex"); assert(rc == 1);
+    rc = bkindex_lookup(dirpath, "ab", &l); assert(rc == 0 && l.nr == 1);
+    bkindex_free(&l);
+
+    /* 备份放入备份目录后没有记录（崩溃），索引比目录旧，重新扫描 */
+    usleep(20000);
+    snprintf(path, sizeof(path), "%s/%s", bkdir, "a.2020.03.20.164815.6");
+    rc = write_zero_file(path, 1); assert(rc == 0);
+    rc = bkindex_lookup(dirpath, "a", &l); assert(rc == 0 && l.nr == 3);
+    int found = 0;
+    for (i = 0; i < l.nr; i++) {
+        found = found || !strcmp(l.names[i], "a.2020.03.20.164815.6");
+    }
+    assert(found);
+    bkindex_free(&l);
+    unlink(path);
+
+    for (i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/%s", bkdir, files[i]);
+        unlink(path);
+    }
+    snprintf(path, sizeof(path), "%s/%s", bkdir, BKINDEX_NAME);
+    unlink(path);
+    rmdir(bkdir);
+    rmdir(dirpath);
+
+    printf("success\n");
+}
+
+#endif
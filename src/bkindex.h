@@ -0,0 +1,66 @@
+#ifndef BKINDEX_H
+#define BKINDEX_H
+
+/*
+ * 备份索引
+ *
+ * 一个目录中所有文件的备份都在这个目录的备份目录（BKDIRNAME）中，备份文件名
+ * 是原文件名加上时间后缀，见 make_backup_name()。备份目录中的索引文件记录了
+ * 所有备份文件名，查找一个文件的备份只需要读一次索引，不用遍历目录树。
+ *
+ * 索引文件只追加，每行一条记录：
+ *
+ * +<备份文件名>    新增备份
+ * -<备份文件名>    备份被粉碎或者重命名
+ *
+ * 索引不存在时（旧的目录，或者第一次备份），查找时扫描一次备份目录重建索引。
+ * 重建索引时对备份目录加排他锁，追加记录时加共享锁，保证重建期间新增的备份
+ * 不会丢失。删除的记录太多时，也通过重建来压缩索引。
+ *
+ * 追加记录失败时删除索引。备份目录的 mtime 晚于索引的 ctime 时（备份放入了
+ * 备份目录，还没有记录就崩溃了），查找时也不使用索引，重新扫描备份目录，粉碎
+ * 和重命名不会漏掉备份。
+ */
+
+#define BKINDEX_NAME ".index"
+#define BKINDEX_TMPNAME ".index.tmp"
+
+struct bkindex_list {
+    int nr;
+    char **names;           /* 备份文件名，不包括目录 */
+};
+
+/*
+ * 从备份文件名中得到原文件名的长度，不是备份文件名时返回 -1
+ */
+extern int backup_origname_len(const char *bakname);
+
+/*
+ * 在 dirpath 的备份索引中记录新增的备份，names 是备份目录中的文件名
+ */
+extern int bkindex_add(const char *dirpath, const char **names, int nr);
+
+/*
+ * 在 dirpath 的备份索引中记录删除的备份
+ */
+extern int bkindex_remove(const char *dirpath, const char **names, int nr);
+
+/*
+ * 查找 dirpath 中文件 origname 的所有备份，结果用 bkindex_free() 释放
+ */
+extern int bkindex_lookup(const char *dirpath, const char *origname,
+                          struct bkindex_list *list);
+
+extern void bkindex_free(struct bkindex_list *list);
+
+/*
+ * 扫描 dirpath 的备份目录，重建索引
+ */
+extern int bkindex_rebuild(const char *dirpath);
+
+/*
+ * 重建 rootpath 下所有目录的备份索引，返回重建的索引个数，出错返回 -1
+ */
+extern int bkindex_rebuild_tree(const char *rootpath);
+
+#endif  /* BKINDEX_H */
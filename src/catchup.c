@@ -0,0 +1,836 @@
+
+// catchup.c
+
+#include "mt_log.h"
+#include "public.h"
+#include "conn_mgmt.h"
+#include "tunables.h"
+#include "scandir.h"
+#include "gcommit.h"
+#include "metaidx.h"
+#include "behealth.h"
+#include "catchup.h"
+
+extern void init_mt_cntt(int thread_id);
+extern int mkdirs(const char *dirpath);
+extern const char *backend_key(const char *path, int *index);
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+#define CATCHUP_RETRY_MS  1000  // 一轮没有任何进展时等待的时间
+
+// 等待补齐的文件
+struct pending {
+    uint64_t seq;           // 最近一条 L 记录的序号
+    uint32_t mask;          // 落后的镜像
+    int64_t size;
+    uint64_t since;         // 开始落后的时间（毫秒）
+    struct pending *next;
+    char key[0];            // 相对于后端目录的路径，以 '/' 开头
+};
+
+// 补齐日志中的一条记录
+struct record {
+    char op;
+    uint64_t seq;
+    uint32_t mask;
+    int64_t size;
+    char *key;
+};
+
+static pthread_mutex_t catchup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t catchup_cond = PTHREAD_COND_INITIALIZER;
+static struct pending *pending_head = NULL;
+static struct pending *pending_tail = NULL;
+static volatile int nr_pending = 0;
+static uint64_t last_seq = 0;
+static uint64_t nr_repaired = 0;    // 补齐的镜像文件个数
+static uint64_t nr_dropped = 0;     // 源文件已经删除，放弃补齐的文件个数
+
+static int log_fd = -1;             // 正在追加的日志
+static int log_backend = -1;        // 日志所在的后端
+static int64_t log_size = 0;
+
+static uint64_t now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+// 调用者持有 catchup_lock
+static uint64_t next_seq(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t seq = tv.tv_sec * 1000000UL + tv.tv_usec;
+    last_seq = seq > last_seq ? seq : last_seq + 1;
+    return last_seq;
+}
+
+static void backend_path(char *buf, size_t len, int b, const char *key)
+{
+    int n = strlen(backend_dirs[b]);
+    while (n > 1 && backend_dirs[b][n - 1] == '/') {
+        n = n - 1;
+    }
+    snprintf(buf, len, "%.*s%s", n, backend_dirs[b], key);
+}
+
+static void log_path(char *buf, size_t len, int b)
+{
+    snprintf(buf, len, "%s/%s/%s", backend_dirs[b], METAIDX_DIR, CATCHUP_LOG_NAME);
+}
+
+static struct pending *find_pending(const char *key, struct pending **prev)
+{
+    struct pending *p = NULL;
+    struct pending *e = pending_head;
+    while (e != NULL && strcmp(e->key, key) != 0) {
+        p = e;
+        e = e->next;
+    }
+    if (prev != NULL) {
+        *prev = p;
+    }
+    return e;
+}
+
+static void unlink_pending(struct pending *e, struct pending *prev)
+{
+    if (prev != NULL) {
+        prev->next = e->next;
+    } else {
+        pending_head = e->next;
+    }
+    if (pending_tail == e) {
+        pending_tail = prev;
+    }
+    nr_pending = nr_pending - 1;
+}
+
+static void append_pending(struct pending *e)
+{
+    e->next = NULL;
+    if (pending_tail != NULL) {
+        pending_tail->next = e;
+    } else {
+        pending_head = e;
+    }
+    pending_tail = e;
+    nr_pending = nr_pending + 1;
+}
+
+static struct pending *new_pending(const char *key, uint64_t seq,
+                                   uint32_t mask, int64_t size)
+{
+    struct pending *e = malloc(sizeof(struct pending) + strlen(key) + 1);
+    if (e == NULL) {
+        log_error("malloc catchup entry failed");
+        return NULL;
+    }
+    e->seq = seq;
+    e->mask = mask;
+    e->size = size;
+    e->since = now_ms();
+    strcpy(e->key, key);
+    return e;
+}
+
+// 调用者持有 catchup_lock。打开第一个可以写入的健康后端中的日志
+static int open_log(uint32_t skip)
+{
+    int order[MAX_BACK_END];
+    int n = behealth_order(order, ((1U << backend_cnt) - 1) & ~skip);
+    int k;
+    for (k = 0; k < n; k++) {
+        int b = order[k];
+        char path[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+        snprintf(path, sizeof(path), "%s/%s", backend_dirs[b], METAIDX_DIR);
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+            log_error("mkdir %s failed: %s", path, strerror(errno));
+            continue;
+        }
+        log_path(path, sizeof(path), b);
+        int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            log_fd = fd;
+            log_backend = b;
+            log_size = lseek(fd, 0, SEEK_END);
+            return 0;
+        } else {
+            log_error("open %s failed: %s", path, strerror(errno));
+        }
+    }
+    return -1;
+}
+
+// 调用者持有 catchup_lock。日志写不进任何后端时只保留在内存中
+static void append_log(const char *rec, int len)
+{
+    uint32_t skip = 0;
+    while (1) {
+        if (log_fd < 0 && open_log(skip) != 0) {
+            log_error("no backend for catchup log, keep in memory: %.*s",
+                      len - 1, rec);
+            return;
+        }
+        if (write(log_fd, rec, len) == len &&
+            (upload_durability != DURABILITY_FSYNC || fdatasync(log_fd) == 0)) {
+            log_size = log_size + len;
+            return;
+        }
+        log_error("write catchup log in %s failed: %s",
+                  backend_dirs[log_backend], strerror(errno));
+        skip |= 1U << log_backend;
+        close(log_fd);
+        log_fd = -1;
+    }
+}
+
+// 调用者持有 catchup_lock
+static void log_record(char op, uint64_t seq, uint32_t mask, int64_t size,
+                       const char *key)
+{
+    char rec[MAX_PATH_LEN + MAX_NAME_LEN + 128];
+    int len;
+    if (op == 'L') {
+        len = snprintf(rec, sizeof(rec), "L %lu %x %lld %s\n",
+                       seq, mask, (long long int)size, key);
+    } else {
+        len = snprintf(rec, sizeof(rec), "R %lu %x %s\n", seq, mask, key);
+    }
+    if (len < (int)sizeof(rec)) {
+        append_log(rec, len);
+    } else {
+        log_error("catchup record too long: %s", key);
+    }
+}
+
+// 调用者持有 catchup_lock。所有的文件都补齐后清空日志，日志太大时只保留没有
+// 补齐的文件
+static void compact_log(void)
+{
+    if (nr_pending > 0 && log_size <= CATCHUP_LOG_MAX) {
+        return;
+    }
+
+    char path[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    if (nr_pending > 0 && log_fd >= 0) {
+        char tmp[MAX_PATH_LEN + MAX_NAME_LEN + 16];
+        log_path(path, sizeof(path), log_backend);
+        snprintf(tmp, sizeof(tmp), "%s.new", path);
+        FILE *fp = fopen(tmp, "w");
+        if (fp == NULL) {
+            log_error("open %s failed: %s", tmp, strerror(errno));
+            return;
+        }
+        struct pending *e;
+        for (e = pending_head; e != NULL; e = e->next) {
+            fprintf(fp, "L %lu %x %lld %s\n", e->seq, e->mask,
+                    (long long int)e->size, e->key);
+        }
+        int rc = fflush(fp) == 0 && fdatasync(fileno(fp)) == 0 ? 0 : -1;
+        fclose(fp);
+        if (rc != 0 || rename(tmp, path) != 0) {
+            log_error("rewrite %s failed: %s", path, strerror(errno));
+            unlink(tmp);
+            return;
+        }
+        close(log_fd);
+        log_fd = -1;
+        if (open_log(~(1U << log_backend)) != 0) {
+            return;
+        }
+    }
+
+    // 其他后端中的日志已经没有用了
+    int b;
+    for (b = 0; b < backend_cnt; b++) {
+        if (nr_pending > 0 && b == log_backend) {
+            continue;
+        }
+        log_path(path, sizeof(path), b);
+        if (truncate(path, 0) != 0 && errno != ENOENT) {
+            log_warning("truncate %s failed: %s", path, strerror(errno));
+        }
+    }
+    if (nr_pending == 0) {
+        log_size = 0;
+    }
+}
+
+// 调用者持有 catchup_lock
+static void apply_record(const struct record *r)
+{
+    struct pending *prev;
+    struct pending *e = find_pending(r->key, &prev);
+    if (r->op == 'L' && r->mask != 0) {
+        if (e != NULL) {
+            // 文件重新上传，以最近一次上传落后的镜像为准
+            e->seq = r->seq;
+            e->mask = r->mask;
+            e->size = r->size;
+        } else if ((e = new_pending(r->key, r->seq, r->mask, r->size)) != NULL) {
+            append_pending(e);
+        }
+    } else if (e != NULL) {
+        e->mask = r->op == 'L' ? 0 : e->mask & ~r->mask;
+        if (e->mask == 0) {
+            unlink_pending(e, prev);
+            free(e);
+        }
+    } else {
+        // 文件已经补齐
+    }
+    if (r->seq > last_seq) {
+        last_seq = r->seq;
+    }
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const struct record *x = a;
+    const struct record *y = b;
+    return x->seq < y->seq ? -1 : (x->seq > y->seq ? 1 : 0);
+}
+
+// 读取一个后端中的日志，记录追加到 *recs 中
+static int load_log(int b, struct record **recs, int *nr, int *cap)
+{
+    char path[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    log_path(path, sizeof(path), b);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    char line[MAX_PATH_LEN + MAX_NAME_LEN + 128];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        struct record r;
+        unsigned long seq;
+        unsigned int mask;
+        long long int size = 0;
+        int pos = 0;
+        int len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') {
+            // 崩溃时没有写完整的记录
+            break;
+        }
+        line[len - 1] = '\0';
+        if (sscanf(line, "L %lu %x %lld %n", &seq, &mask, &size, &pos) == 3 && pos > 0) {
+            r.op = 'L';
+        } else if (sscanf(line, "R %lu %x %n", &seq, &mask, &pos) == 2 && pos > 0) {
+            r.op = 'R';
+        } else {
+            log_warning("skip bad catchup record in %s: %s", path, line);
+            continue;
+        }
+        if (*nr == *cap) {
+            int ncap = *cap > 0 ? *cap * 2 : 256;
+            struct record *n = realloc(*recs, ncap * sizeof(struct record));
+            if (n == NULL) {
+                fclose(fp);
+                return -1;
+            }
+            *recs = n;
+            *cap = ncap;
+        }
+        r.seq = seq;
+        r.mask = mask;
+        r.size = size;
+        r.key = strdup(line + pos);
+        if (r.key == NULL) {
+            fclose(fp);
+            return -1;
+        }
+        (*recs)[*nr] = r;
+        *nr = *nr + 1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void fsync_dir(const char *path)
+{
+    char dirpath[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    snprintf(dirpath, sizeof(dirpath), "%s", path);
+    int fd = open(dirname(dirpath), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        (void) fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * 从一个完整的镜像复制文件到后端 dst，seq 是开始复制时等待补齐的记录的序号。
+ * 成功返回 0，源文件已经不存在返回 1，其他错误返回 -1，稍后重试
+ */
+static int repair_file(const char *key, int dst, uint32_t mask, int64_t size,
+                       uint64_t seq)
+{
+    int order[MAX_BACK_END];
+    int n = behealth_order(order, ((1U << backend_cnt) - 1) & ~mask);
+    if (n == 0) {
+        return -1;
+    }
+    int src = order[0];
+
+    char srcpath[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    char dstpath[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    char tmppath[MAX_PATH_LEN + MAX_NAME_LEN + 16];
+    backend_path(srcpath, sizeof(srcpath), src, key);
+    backend_path(dstpath, sizeof(dstpath), dst, key);
+    snprintf(tmppath, sizeof(tmppath), "%s%s", dstpath, CATCHUP_TMP_SUFFIX);
+
+    int sfd = open(srcpath, O_RDONLY | O_CLOEXEC);
+    if (sfd < 0) {
+        if (errno == ENOENT) {
+            return 1;
+        }
+        log_error("open %s failed: %s", srcpath, strerror(errno));
+        return -1;
+    }
+    struct stat s1;
+    if (fstat(sfd, &s1) != 0 || s1.st_size != size) {
+        // 文件正在重新上传
+        close(sfd);
+        return -1;
+    }
+
+    char dirpath[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    snprintf(dirpath, sizeof(dirpath), "%s", dstpath);
+    (void) mkdirs(dirname(dirpath));
+    int dfd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (dfd < 0) {
+        log_error("open %s failed: %s", tmppath, strerror(errno));
+        if (behealth_is_fault(errno)) {
+            behealth_record(dst, 0, 0);
+        }
+        close(sfd);
+        return -1;
+    }
+
+    uint64_t start = behealth_now_usecs();
+    int method = copy_fd(sfd, dfd, size, COPY_METHOD_RANGE);
+    int rc = method >= 0 ? 0 : -1;
+    if (rc == 0 && upload_durability != DURABILITY_NONE && fdatasync(dfd) != 0) {
+        log_error("fdatasync %s failed: %s", tmppath, strerror(errno));
+        rc = -1;
+    }
+    struct stat s2;
+    if (rc == 0 && (fstat(sfd, &s2) != 0 || s2.st_size != s1.st_size ||
+                    s2.st_mtim.tv_sec != s1.st_mtim.tv_sec ||
+                    s2.st_mtim.tv_nsec != s1.st_mtim.tv_nsec)) {
+        // 复制期间源文件被修改了
+        rc = -1;
+    }
+    close(sfd);
+    close(dfd);
+
+    /*
+     * 持有锁检查记录的序号再重命名：上传开始时 catchup_begin() 修改了序号，这
+     * 之后重命名会替换上传正在写入的文件
+     */
+    pthread_mutex_lock(&catchup_lock);
+    struct pending *e = find_pending(key, NULL);
+    if (rc == 0 && (e == NULL || e->seq != seq)) {
+        log_info("catch up %s on %s: file is being uploaded again", key,
+                 backend_dirs[dst]);
+        rc = -1;
+    }
+    if (rc == 0 && rename(tmppath, dstpath) != 0) {
+        rc = -1;
+    }
+    pthread_mutex_unlock(&catchup_lock);
+    if (rc != 0) {
+        log_error("catch up %s on %s failed", key, backend_dirs[dst]);
+        unlink(tmppath);
+        return -1;
+    }
+    if (upload_durability != DURABILITY_NONE) {
+        fsync_dir(dstpath);
+    }
+    if (access(srcpath, F_OK) != 0 && errno == ENOENT) {
+        // 复制期间文件被删除了
+        unlink(dstpath);
+        return 1;
+    }
+    log_info("catch up %s on %s: %lld bytes by %s in %.3f ms", key,
+             backend_dirs[dst], (long long int)size, copy_method_string(method),
+             (behealth_now_usecs() - start) / 1000.0);
+    return 0;
+}
+
+static void *catchup_thread(void *arg)
+{
+    int thread_id = (int)(intptr_t)arg;
+    init_mt_cntt(thread_id);
+    log_info("catchup thread:%d start", thread_id);
+
+    char key[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    int idle = 0;   // 连续没有进展的文件个数
+    while (1) {
+        pthread_mutex_lock(&catchup_lock);
+        while (pending_head == NULL) {
+            pthread_cond_wait(&catchup_cond, &catchup_lock);
+        }
+        struct pending *e = pending_head;
+        snprintf(key, sizeof(key), "%s", e->key);
+        uint64_t seq = e->seq;
+        uint32_t mask = e->mask;
+        int64_t size = e->size;
+        pthread_mutex_unlock(&catchup_lock);
+
+        // 复制的时候不持有锁，上传完成可以继续记录
+        uint32_t done = 0;
+        int gone = 0;
+        int b;
+        for (b = 0; b < backend_cnt && !gone; b++) {
+            if (!(mask & (1U << b)) || !behealth_is_healthy(b)) {
+                continue;
+            }
+            int rc = repair_file(key, b, mask, size, seq);
+            if (rc == 0) {
+                done |= 1U << b;
+            } else if (rc == 1) {
+                gone = 1;
+            } else {
+                // 稍后重试
+            }
+        }
+
+        pthread_mutex_lock(&catchup_lock);
+        struct pending *prev;
+        e = find_pending(key, &prev);
+        if (e == NULL || e->seq != seq) {
+            // 复制期间文件重新上传或者已经补齐，以新的记录为准
+        } else if (gone) {
+            log_info("drop catchup of %s: file was removed", key);
+            log_record('R', next_seq(), e->mask, 0, key);
+            unlink_pending(e, prev);
+            free(e);
+            nr_dropped = nr_dropped + 1;
+        } else {
+            e->mask = e->mask & ~done;
+            if (done != 0) {
+                log_record('R', next_seq(), done, 0, key);
+            }
+            unlink_pending(e, prev);
+            if (e->mask == 0) {
+                free(e);
+                nr_repaired = nr_repaired + 1;
+            } else {
+                // 还有镜像没有补齐，排到队尾
+                append_pending(e);
+            }
+        }
+        compact_log();
+        idle = done == 0 && !gone ? idle + 1 : 0;
+        if (idle >= nr_pending) {
+            // 一轮都没有进展，等待后端恢复或者文件上传完成
+            idle = 0;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec = ts.tv_sec + CATCHUP_RETRY_MS / 1000;
+            pthread_cond_timedwait(&catchup_cond, &catchup_lock, &ts);
+        }
+        pthread_mutex_unlock(&catchup_lock);
+    }
+    return NULL;
+}
+
+// 按序号重放所有后端中的日志，重写日志只保留没有补齐的文件
+static void replay_logs(void)
+{
+    struct record *recs = NULL;
+    int nr = 0;
+    int cap = 0;
+    int b;
+    for (b = 0; b < backend_cnt; b++) {
+        if (load_log(b, &recs, &nr, &cap) != 0) {
+            log_error("load catchup log in %s failed", backend_dirs[b]);
+        }
+    }
+
+    qsort(recs, nr, sizeof(struct record), compare_records);
+    pthread_mutex_lock(&catchup_lock);
+    int i;
+    for (i = 0; i < nr; i++) {
+        apply_record(&recs[i]);
+        free(recs[i].key);
+    }
+    free(recs);
+    if (nr > 0) {
+        // 重写日志，只保留没有补齐的文件
+        if (open_log(0) == 0) {
+            // open_log() 读取了日志的大小，之后才能强制重写
+            log_size = CATCHUP_LOG_MAX + 1;
+            compact_log();
+        }
+    }
+    log_info("catchup: %d records, %d files to catch up", nr, nr_pending);
+    pthread_mutex_unlock(&catchup_lock);
+}
+
+int init_catchup(int thread_id)
+{
+    replay_logs();
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, catchup_thread, (void *)(intptr_t)thread_id) != 0) {
+        log_crit("create catchup thread:%d failed", thread_id);
+        return -1;
+    } else {
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+int catchup_quorum(void)
+{
+    if (write_quorum == 0 || write_quorum >= backend_cnt) {
+        return backend_cnt;
+    } else if (nr_pending >= catchup_max_pending) {
+        // 补齐的延迟太大，暂时要求所有镜像
+        return backend_cnt;
+    } else {
+        return write_quorum;
+    }
+}
+
+void catchup_begin(const char *path)
+{
+    if (nr_pending == 0) {
+        // 没有等待补齐的文件
+        return;
+    }
+    const char *key = backend_key(path, NULL);
+    if (key == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&catchup_lock);
+    struct pending *e = find_pending(key, NULL);
+    if (e != NULL) {
+        // 只修改内存中的序号，正在复制的补齐不再重命名
+        e->seq = next_seq();
+    }
+    pthread_mutex_unlock(&catchup_lock);
+}
+
+void catchup_add(const char *path, uint32_t mask, int64_t size)
+{
+    const char *key = backend_key(path, NULL);
+    if (key == NULL || strchr(key, '\n') != NULL) {
+        log_error("can't catch up %s", path);
+        return;
+    }
+
+    pthread_mutex_lock(&catchup_lock);
+    struct pending *prev;
+    struct pending *e = find_pending(key, &prev);
+    if (mask == 0) {
+        if (e != NULL) {
+            // 新上传的文件在所有镜像中都是完整的
+            log_record('L', next_seq(), 0, size, key);
+            unlink_pending(e, prev);
+            free(e);
+            compact_log();
+        } else {
+            // 没有等待补齐
+        }
+        pthread_mutex_unlock(&catchup_lock);
+        return;
+    }
+
+    uint64_t seq = next_seq();
+    if (e != NULL) {
+        e->seq = seq;
+        e->mask = mask;
+        e->size = size;
+    } else if ((e = new_pending(key, seq, mask, size)) != NULL) {
+        append_pending(e);
+    }
+    log_record('L', seq, mask, size, key);
+    pthread_cond_signal(&catchup_cond);
+    pthread_mutex_unlock(&catchup_lock);
+}
+
+int catchup_drop_mirror(conn_info_t *c, int index)
+{
+    struct backend_file *f = &c->befiles[index];
+    if (f->lagging) {
+        return 0;
+    }
+    int quorum = c->write_quorum > 0 ? c->write_quorum : backend_cnt;
+    int synced = 0;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        if (!c->befiles[i].lagging) {
+            synced = synced + 1;
+        }
+    }
+    if (synced - 1 < quorum) {
+        return -1;
+    }
+
+    if (f->fd >= 0) {
+        close(f->fd);
+        f->fd = -1;
+    }
+    if (unlink(f->abs_file_name) != 0 && errno != ENOENT) {
+        log_warning("unlink %s failed: %s", f->abs_file_name, strerror(errno));
+    }
+    f->lagging = 1;
+    f->direct = 0;
+    log_warning("%s dropped from upload, catch up later", f->abs_file_name);
+    return 0;
+}
+
+uint32_t catchup_lagging_mask(conn_info_t *c)
+{
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        if (c->befiles[i].lagging) {
+            mask |= 1U << i;
+        }
+    }
+    return mask;
+}
+
+int catchup_json(char *buf, int len)
+{
+    pthread_mutex_lock(&catchup_lock);
+    uint64_t now = now_ms();
+    uint64_t lag = 0;
+    struct pending *e;
+    for (e = pending_head; e != NULL; e = e->next) {
+        if (now > e->since && now - e->since > lag) {
+            lag = now - e->since;
+        }
+    }
+    int n = snprintf(buf, len, "{\"pending\": %d, \"repaired\": %lu, "
+                     "\"dropped\": %lu, \"lag_ms\": %lu}",
+                     nr_pending, nr_repaired, nr_dropped, lag);
+    pthread_mutex_unlock(&catchup_lock);
+    return n < len ? n : len - 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// 测试用例
+////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_UNITTEST
+
+#include <assert.h>
+
+static void test_write_file(const char *path, const char *data)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(write(fd, data, strlen(data)) == (ssize_t)strlen(data));
+    close(fd);
+}
+
+static int64_t test_file_size(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+void test_catchup(void)
+{
+    printf("test_catchup: ");
+
+    assert(system("rm -rf /tmp/test_catchup") == 0);
+    backend_cnt = 3;
+    char path[MAX_PATH_LEN + MAX_NAME_LEN + 16];
+    int b;
+    for (b = 0; b < backend_cnt; b++) {
+        snprintf(backend_dirs[b], sizeof(backend_dirs[b]), "/tmp/test_catchup/%d", b);
+        snprintf(path, sizeof(path), "%s/%s", backend_dirs[b], METAIDX_DIR);
+        assert(mkdirs(path) == 0);
+    }
+    init_behealth();
+
+    /*
+     * 两个后端中的日志按序号交错：/a 重新上传后落后的镜像是 1、2，镜像 1 已经
+     * 补齐；/c 已经补齐；最后一条记录没有写完整
+     */
+    log_path(path, sizeof(path), 0);
+    test_write_file(path, "L 100 2 5 /a\nL 300 4 5 /b\nR 400 2 /a\n");
+    log_path(path, sizeof(path), 1);
+    test_write_file(path, "L 200 6 5 /a\nL 250 1 5 /c\nbad\n"
+                          "R 500 1 /c\nL 600 2 5 /d");
+    replay_logs();
+    assert(nr_pending == 2);
+    struct pending *a = find_pending("/a", NULL);
+    struct pending *p = find_pending("/b", NULL);
+    assert(a != NULL && a->seq == 200 && a->mask == 4 && a->size == 5);
+    assert(p != NULL && p->seq == 300 && p->mask == 4);
+    assert(find_pending("/c", NULL) == NULL && find_pending("/d", NULL) == NULL);
+    assert(last_seq == 500);
+
+    // 重写后只有一个后端中有日志，再次重放的结果相同
+    struct record *recs = NULL;
+    int nr = 0;
+    int cap = 0;
+    for (b = 0; b < backend_cnt; b++) {
+        assert(load_log(b, &recs, &nr, &cap) == 0);
+    }
+    assert(nr == 2);
+    for (b = 0; b < nr; b++) {
+        assert(recs[b].op == 'L' && recs[b].mask == 4);
+        free(recs[b].key);
+    }
+    free(recs);
+    log_path(path, sizeof(path), log_backend == 0 ? 1 : 0);
+    assert(test_file_size(path) == 0);
+
+    // 从镜像 0、1 补齐 /a 到镜像 2
+    for (b = 0; b < 2; b++) {
+        backend_path(path, sizeof(path), b, "/a");
+        test_write_file(path, "aaaaa");
+        backend_path(path, sizeof(path), b, "/b");
+        test_write_file(path, "bbbbb");
+    }
+    assert(repair_file("/a", 2, 4, 5, a->seq) == 0);
+    backend_path(path, sizeof(path), 2, "/a");
+    assert(test_file_size(path) == 5);
+
+    // 复制期间 /b 开始重新上传，补齐不能替换上传正在写入的文件
+    uint64_t seq = p->seq;
+    backend_path(path, sizeof(path), 0, "/b");
+    catchup_begin(path);
+    assert(p->seq != seq);
+    assert(repair_file("/b", 2, 4, 5, seq) == -1);
+    backend_path(path, sizeof(path), 2, "/b");
+    assert(test_file_size(path) == -1);
+    strcat(path, CATCHUP_TMP_SUFFIX);
+    assert(test_file_size(path) == -1);
+
+    // 源文件已经删除
+    for (b = 0; b < 2; b++) {
+        backend_path(path, sizeof(path), b, "/b");
+        assert(unlink(path) == 0);
+    }
+    assert(repair_file("/b", 2, 4, 5, p->seq) == 1);
+
+    pthread_mutex_lock(&catchup_lock);
+    while (pending_head != NULL) {
+        struct pending *e = pending_head;
+        unlink_pending(e, NULL);
+        free(e);
+    }
+    if (log_fd >= 0) {
+        close(log_fd);
+        log_fd = -1;
+    }
+    pthread_mutex_unlock(&catchup_lock);
+    assert(system("rm -rf /tmp/test_catchup") == 0);
+    printf("success\n");
+}
+
+#endif
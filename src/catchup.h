@@ -0,0 +1,82 @@
+#ifndef CATCHUP_H
+#define CATCHUP_H
+
+#include <stdint.h>
+
+#include "conn_mgmt.h"
+
+/*
+ * 镜像补齐
+ *
+ * tunable write_quorum 为 W（0 表示全部）时，上传只要求 W 个镜像写入成功：
+ *
+ * - 被隔离的后端（见 behealth.h）不参与上传；
+ * - 写入失败的镜像，或者一次写入超过 write_lag_ms 而其他镜像已经够 W 个时，
+ *   这个镜像退出这次上传，已经写入的部分文件被删除，下载时不会读到不完整的
+ *   文件；
+ * - 剩下的镜像不够 W 个时上传失败，和以前一样。
+ *
+ * 上传完成时，没有跟上的镜像记录到补齐日志中，补齐线程从一个完整的镜像用
+ * copy_fd()（优先 copy_file_range()）复制文件：先写入同一目录中的临时文件，
+ * 复制前后源文件的大小和修改时间都没有变化、复制期间这个文件也没有开始重新上
+ * 传才重命名为正式的文件名，源文件已经不存在时（被删除了）放弃这一条。目标后
+ * 端被隔离时等它恢复后再复制。
+ *
+ * 补齐日志是后端目录的 METAIDX_DIR/catchup.log 中的文本记录，写在第一个可以
+ * 写入的健康后端中：
+ *
+ *   L <序号> <落后的镜像> <文件大小> <路径>   镜像没有跟上
+ *   R <序号> <补齐的镜像> <路径>             镜像已经补齐
+ *
+ * 路径相对于后端目录，序号是记录时的时间（微秒）。启动时读取所有后端的日志，
+ * 按序号重放，没有补齐的文件继续补齐。所有的文件都补齐后清空日志。日志的持久
+ * 化跟随 upload_durability。
+ *
+ * 等待补齐的文件达到 catchup_max_pending 个时，上传重新要求所有镜像写入成功，
+ * 补齐的延迟因此是有界的。镜像补齐之前，文件列表（只遍历第一个存在的后端目
+ * 录）可能暂时看不到落后镜像上的文件。
+ */
+
+#define CATCHUP_LOG_NAME  "catchup.log"
+#define CATCHUP_TMP_SUFFIX ".catchup" // 复制中的临时文件名是正式文件名加上这个后缀
+#define CATCHUP_LOG_MAX   (1024 * 1024)    // 日志超过这个大小时重写
+
+/*
+ * 读取补齐日志，启动补齐线程。成功返回 0，失败返回 -1
+ */
+extern int init_catchup(int thread_id);
+
+/*
+ * 上传需要写入成功的镜像个数
+ */
+extern int catchup_quorum(void);
+
+/*
+ * 上传开始，path 是文件在任意一个后端中的绝对路径。正在复制这个文件的补齐不再
+ * 替换后端中的文件，否则会覆盖这次上传写入的内容
+ */
+extern void catchup_begin(const char *path);
+
+/*
+ * 上传完成，path 是文件在任意一个后端中的绝对路径，mask 是没有跟上的镜像（第
+ * i 位对应 backend_dirs[i]），为 0 时取消这个文件以前没有完成的补齐
+ */
+extern void catchup_add(const char *path, uint32_t mask, int64_t size);
+
+/*
+ * 上传中的镜像 index 退出这次上传：关闭并删除已经写入的部分文件。剩下的镜像不
+ * 够 c->write_quorum 个时不退出，返回 -1，否则返回 0
+ */
+extern int catchup_drop_mirror(conn_info_t *c, int index);
+
+/*
+ * 退出了这次上传的镜像
+ */
+extern uint32_t catchup_lagging_mask(conn_info_t *c);
+
+/*
+ * 补齐的统计写成 JSON，返回写入的长度
+ */
+extern int catchup_json(char *buf, int len);
+
+#endif  /* CATCHUP_H */
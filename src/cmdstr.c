@@ -68,6 +68,18 @@ const char * command_string(uint32_t c)
         return "CMD_BK_DIR_RENAME_REQ";
     case CMD_BK_DIR_RENAME_RSP:
         return "CMD_BK_DIR_RENAME_RSP";
+    case CMD_GET_FILE_LIST_STREAM_REQ:
+        return "CMD_GET_FILE_LIST_STREAM_REQ";
+    case CMD_GET_FILE_LIST_STREAM_RSP:
+        return "CMD_GET_FILE_LIST_STREAM_RSP";
+    case CMD_BK_JOB_STATUS_REQ:
+        return "CMD_BK_JOB_STATUS_REQ";
+    case CMD_BK_JOB_STATUS_RSP:
+        return "CMD_BK_JOB_STATUS_RSP";
+    case CMD_BATCH_DOWNLOAD_REQ:
+        return "CMD_BATCH_DOWNLOAD_REQ";
+    case CMD_BATCH_DOWNLOAD_RSP:
+        return "CMD_BATCH_DOWNLOAD_RSP";
     case CMD_MIGRATION_START_REQ:
         return "CMD_MIGRATION_START_REQ";
     case CMD_MIGRATION_START_RSP:
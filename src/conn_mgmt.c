@@ -1,12 +1,183 @@
 
 // conn_mgmt.c
 
+#include "config.h"
 #include "mt_log.h"
 #include "public.h"
 #include "conn_mgmt.h"
+#include "tunables.h"
+#include "liststream.h"
+#include "wbuf.h"
+#include "stripe.h"
+#include "hotcache.h"
+#include "fdcache.h"
+#include "batchdl.h"
+#include "pack.h"
 
 
 extern int backend_cnt;
+extern int get_thread_id(void);
+extern timer_set_t * timer_sets[MAX_WORKERS+1];
+extern events_poll_t events_polls[MAX_WORKERS+1];
+
+uint64_t conn_timeouts[CONN_TIMEOUT_MAX] = {0UL};
+
+static const char *conn_timeout_string(int reason)
+{
+    switch (reason) {
+    case CONN_TIMEOUT_IDLE:     return "idle";
+    case CONN_TIMEOUT_STALL:    return "stall";
+    case CONN_TIMEOUT_DEADLINE: return "deadline";
+    default:                    return "unknown";
+    }
+}
+
+void count_conn_timeout(conn_info_t * conn_info, int reason)
+{
+    if (0 <= reason && reason < CONN_TIMEOUT_MAX) {
+        uint64_t n = __sync_add_and_fetch(&conn_timeouts[reason], 1);
+        log_warning("sock_fd:%d peer %s:%u %s timeout, %lu %s timeouts so far",
+                    conn_info->sock_fd, conn_info->peer_ip, conn_info->peer_port,
+                    conn_timeout_string(reason), n, conn_timeout_string(reason));
+    } else {
+        log_error("invalid timeout reason %d", reason);
+    }
+}
+
+int conn_timeouts_json(char *buf, int len)
+{
+    int n = snprintf(buf, len, "{\"%s\": %lu, \"%s\": %lu, \"%s\": %lu}",
+                     conn_timeout_string(CONN_TIMEOUT_IDLE),
+                     conn_timeouts[CONN_TIMEOUT_IDLE],
+                     conn_timeout_string(CONN_TIMEOUT_STALL),
+                     conn_timeouts[CONN_TIMEOUT_STALL],
+                     conn_timeout_string(CONN_TIMEOUT_DEADLINE),
+                     conn_timeouts[CONN_TIMEOUT_DEADLINE]);
+    return n < len ? n : len - 1;
+}
+
+// 定时器到期时检查连接是否真的超时。空闲和停顿定时器周期性检查最近一次收发
+// 数据的时间，收发数据时只需要更新时间，不用重置定时器
+static int on_conn_timer(void * pv_user_timer)
+{
+    user_timer_t * t = (user_timer_t *)pv_user_timer;
+    int sock_fd = (int)(intptr_t)t->pv_param1;
+    uint32_t generation = (uint32_t)(uintptr_t)t->pv_param2;
+    int reason = (int)(intptr_t)t->pv_param3;
+    int tid = get_thread_id();
+
+    conn_info_t * c = &conns_info[sock_fd];
+    if (c->sock_fd != sock_fd || c->generation != generation || c->thread_id != tid) {
+        // 连接已经关闭或者被复用，定时器不应该还在，销毁自己
+        log_warning("stale %s timer %d for sock_fd:%d",
+                    conn_timeout_string(reason), t->timer_id, sock_fd);
+        destroy_one_timer(timer_sets[tid], t->timer_id);
+        return 0;
+    }
+
+    uint64_t now = get_curr_time();
+    uint64_t idle = (now > c->last_active) ? now - c->last_active : 0;
+    if (reason == CONN_TIMEOUT_IDLE) {
+        if (c->pending_jobs > 0) {
+            // 客户端在等待后台任务完成，不算空闲
+            touch_conn(c);
+            return 0;
+        } else if (idle < (uint64_t)conn_idle_timeout * 1000) {
+            return 0;
+        } else {
+            // 空闲超时，关闭连接
+        }
+    } else if (reason == CONN_TIMEOUT_STALL) {
+        if (idle < (uint64_t)conn_stall_timeout * 1000) {
+            return 0;
+        } else {
+            // 传输停顿超时，关闭连接
+        }
+    } else {
+        // 截止定时器只触发一次，触发就是超时
+    }
+
+    count_conn_timeout(c, reason);
+    close_tcp_conn(&events_polls[tid], sock_fd);
+    return 0;
+}
+
+// 超时时间的 1/4 检查一次，连接在超时后的 1/4 超时时间内被关闭
+static int create_conn_timer(conn_info_t * c, int reason,
+                             int64_t timeout, int periodic)
+{
+    user_timer_t t;
+    memset(&t, 0, sizeof(user_timer_t));
+    if (periodic) {
+        t.loop_cnt = 0xFFFFFFFF;
+        t.hold_time = timeout * 1000 / 4;
+        if (t.hold_time < MS_PER_TICK) {
+            t.hold_time = MS_PER_TICK;
+        }
+    } else {
+        t.loop_cnt = 1;
+        t.hold_time = timeout * 1000;
+    }
+    t.call_back = on_conn_timer;
+    t.pv_param1 = (void *)(intptr_t)c->sock_fd;
+    t.pv_param2 = (void *)(uintptr_t)c->generation;
+    t.pv_param3 = (void *)(intptr_t)reason;
+    int timer_id = create_one_timer(timer_sets[c->thread_id], &t);
+    if (timer_id > 0) {
+        return timer_id;
+    } else {
+        log_error("create %s timer for sock_fd:%d failed",
+                  conn_timeout_string(reason), c->sock_fd);
+        return 0;
+    }
+}
+
+static void destroy_conn_timer(conn_info_t * c, int * timer_id)
+{
+    if (*timer_id > 0) {
+        destroy_one_timer(timer_sets[c->thread_id], *timer_id);
+        *timer_id = 0;
+    } else {
+        // 没有创建定时器
+    }
+}
+
+int start_conn_timers(conn_info_t * conn_info)
+{
+    touch_conn(conn_info);
+    if (conn_idle_timeout > 0) {
+        conn_info->idle_timer = create_conn_timer(
+            conn_info, CONN_TIMEOUT_IDLE, conn_idle_timeout, 1);
+        return conn_info->idle_timer > 0 ? 0 : -1;
+    } else {
+        return 0;
+    }
+}
+
+// 开始一次传输，传输期间检查停顿和截止时间
+int begin_conn_transfer(conn_info_t * conn_info)
+{
+    int ret = 0;
+    touch_conn(conn_info);
+    end_conn_transfer(conn_info);
+    if (conn_stall_timeout > 0) {
+        conn_info->stall_timer = create_conn_timer(
+            conn_info, CONN_TIMEOUT_STALL, conn_stall_timeout, 1);
+        ret |= conn_info->stall_timer > 0 ? 0 : -1;
+    }
+    if (conn_deadline > 0) {
+        conn_info->deadline_timer = create_conn_timer(
+            conn_info, CONN_TIMEOUT_DEADLINE, conn_deadline, 0);
+        ret |= conn_info->deadline_timer > 0 ? 0 : -1;
+    }
+    return ret;
+}
+
+void end_conn_transfer(conn_info_t * conn_info)
+{
+    destroy_conn_timer(conn_info, &conn_info->stall_timer);
+    destroy_conn_timer(conn_info, &conn_info->deadline_timer);
+}
 
 static int setrcvbuf(int s, int v)
 {
@@ -244,6 +415,19 @@ void close_tcp_conn(events_poll_t * events_poll, int sock_fd)
         delete_from_events_poll(events_poll, sock_fd);
     }
 
+    destroy_conn_timer(conn_info, &conn_info->idle_timer);
+    end_conn_transfer(conn_info);
+    close_file_list_stream(conn_info);
+    close_batch_download(conn_info);
+    close_write_buffer(conn_info);
+    abort_pack_upload(conn_info);
+    close_striped_read(conn_info);
+    if (conn_info->hot != NULL)
+    {
+        hotcache_release(conn_info->hot);
+        conn_info->hot = NULL;
+    }
+
     if (conn_info->recv != NULL)
     {
         destroy_ring(conn_info->recv);
@@ -279,7 +463,7 @@ void close_tcp_conn(events_poll_t * events_poll, int sock_fd)
         {
             if (conn_info->befiles[i].fd >= 3)
             {
-                close(conn_info->befiles[i].fd);
+                fdcache_close(&conn_info->befiles[i]);
                 // log_info("> close backend_fd %d in connection %d", conn_info->befiles [i].fd, conn_info->sock_fd);
             }
         }
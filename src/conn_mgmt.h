@@ -6,6 +6,7 @@
 
 #include "ring.h"
 #include "events_poll.h"
+#include "timer_set.h"
 
 #ifndef MAX_TCP_BUF
 #define MAX_TCP_BUF (8192)
@@ -19,15 +20,30 @@
 #define MAX_SO_RCVBUF (128*1024) // 128KB
 #endif
 
+// 顺序下载请求中最多的区间个数，见 handle_seq_download_request()
+#define SEQ_RANGES_MAX  16
+
 #define CONN_STATUS_IDLE		0
 #define CONN_STATUS_CONNECTING	1
 #define CONN_STATUS_CONNECTED  	2
 #define CONN_STATUS_CLOSING  	3
 
+struct file_list_stream;
+struct pack_upload;
+struct stripe;
+struct hot_file;
+struct fd_handle;
+struct batch_download;
+
 struct backend_file
 {
     int fd; // 文件描述符
     int sndstate; // 发送状态
+    int direct; // fd 打开了 O_DIRECT，见 dio.h
+    int packed; // 文件打包存放，fd 是段文件，见 pack.h
+    int64_t base; // 打包存放的文件在段文件中的偏移
+    int lagging; // 镜像退出了这次上传，上传完成后补齐，见 catchup.h
+    struct fd_handle *cached; // fd 属于描述符缓存，见 fdcache.h
     // filesize, fileleft, filedone 主要用于 sendfile() 的文件顺序下载
     int64_t filesize; // 文件大小
     int64_t fileleft; // 文件需要传输的大小
@@ -36,6 +52,16 @@ struct backend_file
     char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
 };
 
+// 上传完成的文件的统计，用区段个数查看预分配对碎片的影响
+struct upload_stat
+{
+    uint64_t files; // 上传完成的文件个数
+    uint64_t bytes; // 上传完成的字节数
+    uint64_t extents; // 这些文件占用的区段个数
+};
+
+extern struct upload_stat upload_stats;
+
 typedef struct conn_info_
 {
     uint32_t flags;
@@ -64,6 +90,26 @@ typedef struct conn_info_
     int debug_fd;
     int close_thread_id;
     int is_sequence; // 是否使用文件的顺序传输
+
+    uint32_t generation; // 每次清空连接信息都加一，定时器据此判断连接是否已被复用
+    int idle_timer;      // 空闲超时定时器，0 表示没有
+    int stall_timer;     // 传输停顿超时定时器，0 表示没有
+    int deadline_timer;  // 传输截止定时器，0 表示没有
+    uint64_t last_active; // 最近一次收发数据的时间，单位是毫秒
+
+    struct file_list_stream *list_stream; // 正在分段发送的文件列表
+    int pending_jobs;    // 等待完成后才响应的后台任务个数
+    struct write_buffer *wbuf; // 上传数据的写缓冲，见 wbuf.h
+    struct pack_upload *pack; // 打包上传的数据，见 pack.h
+    struct stripe *stripe; // 大文件下载的条带读取，见 stripe.h
+    int write_quorum;    // 这次上传需要写入成功的镜像个数，0 表示全部
+    struct hot_file *hot; // 从热点文件缓存下载的文件，见 hotcache.h
+    int64_t ra_next;     // 分块下载期望的下一个请求的位置，见 stripe.h 的预读
+    int ra_seq;          // 连续的顺序请求个数
+    struct batch_download *batch; // 正在进行的批量下载，见 batchdl.h
+    int nr_ranges;       // 顺序下载请求的区间个数，0 表示整个文件
+    int cur_range;       // 正在发送的区间
+    int64_t ranges[SEQ_RANGES_MAX][2]; // 每个区间的偏移和长度，已经截到文件末尾
     
 } conn_info_t;
 
@@ -71,10 +117,13 @@ static inline void clear_conn_info(conn_info_t * conn_info)
 {
     int i = 0;
     int close_thread_id;
+    uint32_t generation;
 
     close_thread_id = conn_info->close_thread_id;
+    generation = conn_info->generation;
     memset(conn_info, 0, sizeof(conn_info_t));
     conn_info->close_thread_id = close_thread_id;
+    conn_info->generation = generation + 1;
     conn_info->is_sequence = 0;
     
     conn_info->next_sock_fd = -1;
@@ -91,6 +140,33 @@ static inline void clear_conn_info(conn_info_t * conn_info)
 
 extern conn_info_t conns_info[MAX_CONNS_CNT];
 
+// 连接超时的原因
+enum conn_timeout_reason {
+    CONN_TIMEOUT_IDLE = 0, // 长时间没有收发数据
+    CONN_TIMEOUT_STALL,    // 传输过程中长时间没有进展
+    CONN_TIMEOUT_DEADLINE, // 传输超过了截止时间
+    CONN_TIMEOUT_MAX
+};
+
+extern uint64_t conn_timeouts[CONN_TIMEOUT_MAX];
+
+// 有数据收发时调用，超时定时器到期时根据这个时间判断是否真正超时
+static inline void touch_conn(conn_info_t * conn_info)
+{
+    conn_info->last_active = get_curr_time();
+}
+
+void count_conn_timeout(conn_info_t * conn_info, int reason);
+
+// 各种原因超时的连接个数写成 JSON，返回写入的长度，放在心跳消息中
+int conn_timeouts_json(char *buf, int len);
+
+int start_conn_timers(conn_info_t * conn_info);
+
+int begin_conn_transfer(conn_info_t * conn_info);
+
+void end_conn_transfer(conn_info_t * conn_info);
+
 extern void tcp_setblocking(int fd);
 extern void tcp_setnonblock(int fd);
 
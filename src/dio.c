@@ -0,0 +1,244 @@
+
+// dio.c
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mt_log.h"
+#include "public.h"
+#include "tunables.h"
+#include "dio.h"
+
+#define DIO_POOL_MAX  64    // 缓冲池中最多保留的空闲缓冲区个数
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *pool_head = NULL;  // 空闲缓冲区的链表，链表指针放在缓冲区开头
+static int pool_free = 0;
+static int pool_size = 0;       // 第一次使用时确定，之后不再变化
+
+int dio_buffer_size(void)
+{
+    pthread_mutex_lock(&pool_lock);
+    if (pool_size == 0) {
+        int64_t size = MAX_MSG_DATA_LEN + 2 * DIO_ALIGN;
+        if (upload_wbuf_size > size) {
+            size = upload_wbuf_size;
+        }
+        pool_size = (size + DIO_ALIGN - 1) / DIO_ALIGN * DIO_ALIGN;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return pool_size;
+}
+
+void *get_dio_buffer(void)
+{
+    int size = dio_buffer_size();
+    pthread_mutex_lock(&pool_lock);
+    void *buf = pool_head;
+    if (buf != NULL) {
+        pool_head = *(void **)buf;
+        pool_free = pool_free - 1;
+    } else {
+        // 没有空闲的缓冲区，分配一个新的
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (buf == NULL && posix_memalign(&buf, DIO_ALIGN, size) != 0) {
+        log_error("malloc %d bytes aligned buffer failed", size);
+        return NULL;
+    }
+    return buf;
+}
+
+void put_dio_buffer(void *buf)
+{
+    if (buf == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool_lock);
+    if (pool_free < DIO_POOL_MAX) {
+        *(void **)buf = pool_head;
+        pool_head = buf;
+        pool_free = pool_free + 1;
+        buf = NULL;
+    } else {
+        // 空闲的缓冲区太多，直接释放
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(buf);
+}
+
+int backend_direct_io(int index)
+{
+    return (direct_io_backends >> index) & 1;
+}
+
+int set_direct_io(int fd, int on)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
+        log_error("fcntl(%d, F_GETFL) failed: %s", fd, strerror(errno));
+        return -1;
+    }
+    flags = on ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+    if (fcntl(fd, F_SETFL, flags) == 0) {
+        return 0;
+    } else if (errno == EINVAL) {
+        return 1;
+    } else {
+        log_error("fcntl(%d, F_SETFL, O_DIRECT) failed: %s", fd, strerror(errno));
+        return -1;
+    }
+}
+
+static int pwrite_full(int fd, const uint8_t *buf, int len, uint64_t offset)
+{
+    int done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, buf + done, len - done, offset + done);
+        if (n > 0) {
+            done = done + n;
+        } else if (n < 0 && errno == EINTR) {
+            // 系统调用被中断，继续写入
+        } else {
+            log_error("pwrite %d bytes to fd %d at %llu failed: %s",
+                      len - done, fd, (unsigned long long)(offset + done),
+                      n < 0 ? strerror(errno) : "no space written");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 临时关闭 O_DIRECT，通过页缓存写入
+static int buffered_pwrite(int fd, const uint8_t *buf, int len, uint64_t offset)
+{
+    if (set_direct_io(fd, 0) != 0) {
+        return -1;
+    }
+    int rc = pwrite_full(fd, buf, len, offset);
+    if (set_direct_io(fd, 1) < 0) {
+        return -1;
+    }
+    return rc;
+}
+
+int dio_pwrite(int fd, const uint8_t *buf, int len, uint64_t offset)
+{
+    if ((uintptr_t)buf % DIO_ALIGN != 0 || offset % DIO_ALIGN != 0) {
+        return buffered_pwrite(fd, buf, len, offset);
+    }
+
+    int aligned = len / DIO_ALIGN * DIO_ALIGN;
+    if (aligned > 0 && pwrite_full(fd, buf, aligned, offset) != 0) {
+        return -1;
+    }
+    if (aligned < len) {
+        return buffered_pwrite(fd, buf + aligned, len - aligned, offset + aligned);
+    } else {
+        return 0;
+    }
+}
+
+int dio_pread(int fd, uint8_t *data, int len, uint64_t offset)
+{
+    uint64_t start = offset / DIO_ALIGN * DIO_ALIGN;
+    int head = offset - start;
+    int want = (head + len + DIO_ALIGN - 1) / DIO_ALIGN * DIO_ALIGN;
+    if (want > dio_buffer_size()) {
+        log_error("direct read of %d bytes is too large", len);
+        return -1;
+    }
+
+    uint8_t *buf = get_dio_buffer();
+    if (buf == NULL) {
+        return -1;
+    }
+    int done = 0;
+    while (done < want) {
+        ssize_t n = pread(fd, buf + done, want - done, start + done);
+        if (n > 0) {
+            done = done + n;
+            if (done % DIO_ALIGN != 0) {
+                break; // 读到了文件末尾
+            }
+        } else if (n == 0) {
+            break;
+        } else if (errno == EINTR) {
+            // 系统调用被中断，继续读取
+        } else {
+            log_error("pread %d bytes from fd %d at %llu failed: %s",
+                      want - done, fd, (unsigned long long)(start + done),
+                      strerror(errno));
+            put_dio_buffer(buf);
+            return -1;
+        }
+    }
+
+    int nread = done > head ? done - head : 0;
+    if (nread > len) {
+        nread = len;
+    }
+    memcpy(data, buf + head, nread);
+    put_dio_buffer(buf);
+    return nread;
+}
+
+////////////////////////////////////////////////////////////////////////
+// 测试用例
+////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_UNITTEST
+
+#include <assert.h>
+
+void test_dio(void)
+{
+    printf("test_dio: ");
+
+    /* 文件系统不支持 O_DIRECT 时（例如 tmpfs）按页缓存的方式检查同样的读写 */
+    const char *path = "/tmp/test_dio";
+    int fd = open(path, O_CREAT|O_RDWR|O_TRUNC, 0600); assert(fd >= 0);
+    int direct = set_direct_io(fd, 1) == 0;
+
+    /* 对齐的部分和尾部，以及不对齐的写入 */
+    uint8_t *buf = get_dio_buffer(); assert(buf);
+    int size = 3 * DIO_ALIGN + 100;
+    int i;
+    for (i = 0; i < size; i++) {
+        buf[i] = (uint8_t)(i * 7);
+    }
+    int rc = direct ? dio_pwrite(fd, buf, size, 0) : pwrite_full(fd, buf, size, 0);
+    assert(rc == 0);
+    rc = direct ? dio_pwrite(fd, buf + 1, 10, size) : pwrite_full(fd, buf + 1, 10, size);
+    assert(rc == 0);
+
+    /* 不对齐的读取，读到文件末尾 */
+    uint8_t data[4 * DIO_ALIGN];
+    int n = dio_pread(fd, data, sizeof(data), 50);
+    assert(n == size + 10 - 50);
+    assert(memcmp(data, buf + 50, size - 50) == 0);
+    assert(memcmp(data + size - 50, buf + 1, 10) == 0);
+    assert(dio_pread(fd, data, sizeof(data), size + 10) == 0);
+
+    /* 超过缓冲区大小的读取 */
+    assert(dio_pread(fd, data, dio_buffer_size() + 1, 0) == -1);
+
+    close(fd);
+    unlink(path);
+    put_dio_buffer(buf);
+
+    printf("success\n");
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef DIO_H
+#define DIO_H
+
+#include <stdint.h>
+
+/*
+ * 直接 I/O（O_DIRECT）
+ *
+ * 大量上传的数据经过页缓存时，会把下载正在使用的热数据挤出去。tunable
+ * direct_io 是后端目录的位图（按 -b 参数中的顺序，第一个后端是 1），被选中的
+ * 后端在上传和分块下载时绕过页缓存：
+ *
+ * 1. 上传数据经过写缓冲（wbuf.h）合并，对齐的部分直接写入，不足一个对齐单位的
+ *    尾部仍然通过页缓存写入，上传完成后丢弃尾部的缓存页；
+ * 2. 分块下载时读取覆盖请求范围的对齐区间，再复制到消息中。
+ *
+ * 对齐的缓冲区从一个共享的缓冲池中分配，用完后放回，不用每次都分配。文件系统
+ * 不支持 O_DIRECT 时（例如 tmpfs）自动使用页缓存。
+ */
+
+#define DIO_ALIGN  4096     // 直接 I/O 的偏移、长度和缓冲区地址的对齐单位
+
+/*
+ * 缓冲池中每个缓冲区的大小，不小于写缓冲的大小，也能放下一个对齐后的下载数据
+ * 块
+ */
+extern int dio_buffer_size(void);
+
+/*
+ * 从缓冲池中取一个按 DIO_ALIGN 对齐的缓冲区，失败返回 NULL
+ */
+extern void *get_dio_buffer(void);
+
+/*
+ * 把缓冲区放回缓冲池
+ */
+extern void put_dio_buffer(void *buf);
+
+/*
+ * 第 index 个后端是否使用直接 I/O
+ */
+extern int backend_direct_io(int index);
+
+/*
+ * 打开或者关闭文件描述符上的 O_DIRECT。成功返回 0，文件系统不支持返回 1，出
+ * 错返回 -1
+ */
+extern int set_direct_io(int fd, int on);
+
+/*
+ * 写入已经打开 O_DIRECT 的文件。buf 和 offset 对齐时，对齐的部分直接写入，尾
+ * 部临时关闭 O_DIRECT 写入；不对齐时全部通过页缓存写入。成功返回 0，失败返回
+ * -1
+ */
+extern int dio_pwrite(int fd, const uint8_t *buf, int len, uint64_t offset);
+
+/*
+ * 从已经打开 O_DIRECT 的文件读取最多 len 字节，len 不能超过 MAX_MSG_DATA_LEN。
+ * 返回读取的字节数，出错返回 -1
+ */
+extern int dio_pread(int fd, uint8_t *data, int len, uint64_t offset);
+
+#endif  /* DIO_H */
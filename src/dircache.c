@@ -0,0 +1,383 @@
+
+// dircache.c
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mt_log.h"
+#include "public.h"
+#include "events_poll.h"
+#include "tunables.h"
+#include "dircache.h"
+
+extern int get_thread_id(void);
+
+#define DIRCACHE_NIL (-1)
+
+struct dir_slot {
+    char *path;
+    int len;
+    uint32_t hash;
+    int fd;
+    int hnext;              // 哈希链表的下一个
+    int prev;               // LRU 链表，表头是最近使用的
+    int next;
+};
+
+struct dircache {
+    int cap;
+    int nr;
+    int head;
+    int tail;
+    int free;               // 空闲的槽位，通过 hnext 链接
+    uint32_t generation;    // 缓存建立时的全局 generation
+    int nbuckets;
+    int *buckets;
+    struct dir_slot *slots;
+};
+
+static struct dircache *dircaches[MAX_WORKERS+1] = {NULL};
+static uint32_t dircache_generation = 0;
+
+void dircache_invalidate(void)
+{
+    __sync_add_and_fetch(&dircache_generation, 1);
+}
+
+static uint32_t hash_path(const char *path, int len)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261U;
+    int i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)path[i]) * 16777619U;
+    }
+    return h;
+}
+
+static struct dircache *create_dircache(int cap)
+{
+    struct dircache *c = calloc(1, sizeof(struct dircache));
+    if (!c) {
+        return NULL;
+    }
+    c->nbuckets = 1;
+    while (c->nbuckets < cap * 2) {
+        c->nbuckets = c->nbuckets * 2;
+    }
+    c->buckets = malloc(c->nbuckets * sizeof(int));
+    c->slots = calloc(cap, sizeof(struct dir_slot));
+    if (!c->buckets || !c->slots) {
+        free(c->buckets);
+        free(c->slots);
+        free(c);
+        return NULL;
+    }
+    c->cap = cap;
+    int i;
+    for (i = 0; i < c->nbuckets; i++) {
+        c->buckets[i] = DIRCACHE_NIL;
+    }
+    for (i = 0; i < cap; i++) {
+        c->slots[i].hnext = i + 1 < cap ? i + 1 : DIRCACHE_NIL;
+    }
+    c->free = 0;
+    c->head = c->tail = DIRCACHE_NIL;
+    c->generation = dircache_generation;
+    return c;
+}
+
+static void lru_unlink(struct dircache *c, int i)
+{
+    struct dir_slot *s = &c->slots[i];
+    if (s->prev != DIRCACHE_NIL) {
+        c->slots[s->prev].next = s->next;
+    } else {
+        c->head = s->next;
+    }
+    if (s->next != DIRCACHE_NIL) {
+        c->slots[s->next].prev = s->prev;
+    } else {
+        c->tail = s->prev;
+    }
+}
+
+static void lru_push(struct dircache *c, int i)
+{
+    struct dir_slot *s = &c->slots[i];
+    s->prev = DIRCACHE_NIL;
+    s->next = c->head;
+    if (c->head != DIRCACHE_NIL) {
+        c->slots[c->head].prev = i;
+    } else {
+        c->tail = i;
+    }
+    c->head = i;
+}
+
+static void remove_slot(struct dircache *c, int i)
+{
+    struct dir_slot *s = &c->slots[i];
+    int *p = &c->buckets[s->hash & (c->nbuckets - 1)];
+    while (*p != i) {
+        p = &c->slots[*p].hnext;
+    }
+    *p = s->hnext;
+    lru_unlink(c, i);
+    close(s->fd);
+    free(s->path);
+    s->path = NULL;
+    s->hnext = c->free;
+    c->free = i;
+    c->nr = c->nr - 1;
+}
+
+static void flush_dircache(struct dircache *c)
+{
+    while (c->head != DIRCACHE_NIL) {
+        remove_slot(c, c->head);
+    }
+}
+
+static int lookup_slot(struct dircache *c, const char *path, int len,
+                       uint32_t hash)
+{
+    int i = c->buckets[hash & (c->nbuckets - 1)];
+    while (i != DIRCACHE_NIL) {
+        struct dir_slot *s = &c->slots[i];
+        if (s->hash == hash && s->len == len && !memcmp(s->path, path, len)) {
+            return i;
+        }
+        i = s->hnext;
+    }
+    return DIRCACHE_NIL;
+}
+
+/*
+ * 缓存目录描述符 fd。成功时 fd 被移到 MAX_CONNS_CNT 以上，由缓存持有，*tmp 为
+ * 0；无法缓存时返回原来的 fd，*tmp 为 1，由调用者关闭
+ */
+static int insert_slot(struct dircache *c, const char *path, int len,
+                       uint32_t hash, int fd, int *tmp)
+{
+    int hfd = fcntl(fd, F_DUPFD_CLOEXEC, MAX_CONNS_CNT);
+    char *p = hfd >= 0 ? strndup(path, len) : NULL;
+    if (p == NULL) {
+        if (hfd >= 0) {
+            close(hfd);
+        }
+        *tmp = 1;
+        return fd;
+    }
+    close(fd);
+
+    if (c->free == DIRCACHE_NIL) {
+        /* 淘汰最久没有使用的目录 */
+        remove_slot(c, c->tail);
+    }
+    int i = c->free;
+    struct dir_slot *s = &c->slots[i];
+    c->free = s->hnext;
+    s->path = p;
+    s->len = len;
+    s->hash = hash;
+    s->fd = hfd;
+    s->hnext = c->buckets[hash & (c->nbuckets - 1)];
+    c->buckets[hash & (c->nbuckets - 1)] = i;
+    lru_push(c, i);
+    c->nr = c->nr + 1;
+    *tmp = 0;
+    return hfd;
+}
+
+/*
+ * 得到目录 path[0, len) 的描述符，create 为真时创建不存在的目录。*tmp 为 1 时
+ * 描述符没有被缓存，由调用者关闭
+ */
+static int get_dir(struct dircache *c, const char *path, int len,
+                   int create, int *tmp)
+{
+    uint32_t hash = hash_path(path, len);
+    int i = lookup_slot(c, path, len, hash);
+    if (i != DIRCACHE_NIL) {
+        lru_unlink(c, i);
+        lru_push(c, i);
+        *tmp = 0;
+        return c->slots[i].fd;
+    }
+
+    char dirpath[MAX_PATH_LEN];
+    snprintf(dirpath, sizeof(dirpath), "%.*s", len, path);
+    int fd = open(dirpath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT && create) {
+        /* 在父目录中创建目录，父目录也被缓存 */
+        int plen = len;
+        while (plen > 0 && path[plen - 1] != '/') {
+            plen = plen - 1;
+        }
+        if (plen <= 1) {
+            /* 根目录下的目录 */
+            plen = plen == 1 ? 1 : 0;
+        } else {
+            plen = plen - 1;
+        }
+        if (plen == 0) {
+            return -1;
+        }
+        const char *name = dirpath + (path[plen] == '/' ? plen + 1 : plen);
+        int ptmp;
+        int pfd = get_dir(c, path, plen, create, &ptmp);
+        if (pfd < 0) {
+            return -1;
+        }
+        if (mkdirat(pfd, name, 0755) != 0 && errno != EEXIST) {
+            log_error("create directory %s failed: %s", dirpath, strerror(errno));
+        } else {
+            fd = openat(pfd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        }
+        if (ptmp) {
+            close(pfd);
+        }
+    }
+    if (fd < 0) {
+        return -1;
+    }
+    return insert_slot(c, path, len, hash, fd, tmp);
+}
+
+static void forget_dir(struct dircache *c, const char *path, int len)
+{
+    int i = lookup_slot(c, path, len, hash_path(path, len));
+    if (i != DIRCACHE_NIL) {
+        remove_slot(c, i);
+    } else {
+        /* 目录没有被缓存 */
+    }
+}
+
+static struct dircache *get_dircache(void)
+{
+    if (dircache_size <= 0) {
+        return NULL;
+    }
+    int tid = get_thread_id();
+    struct dircache *c = dircaches[tid];
+    if (c == NULL) {
+        c = create_dircache(dircache_size);
+        dircaches[tid] = c;
+    } else if (c->generation != dircache_generation) {
+        /* 有目录被删除或者重命名了，缓存的描述符可能指向错误的目录 */
+        flush_dircache(c);
+        c->generation = dircache_generation;
+    } else {
+        // 缓存仍然有效
+    }
+    return c;
+}
+
+int dircache_open_file(const char *path, int flags, mode_t mode)
+{
+    if (path[0] != '/') {
+        return -2;
+    }
+    struct dircache *c = get_dircache();
+    if (c == NULL) {
+        return -2;
+    }
+
+    /* 合并连续的目录分隔符，作为缓存的键 */
+    char buf[MAX_PATH_LEN];
+    int len = 0;
+    const char *p;
+    for (p = path; *p != '\0' && len < MAX_PATH_LEN - 1; p++) {
+        if (*p != '/' || len == 0 || buf[len - 1] != '/') {
+            buf[len++] = *p;
+        }
+    }
+    buf[len] = '\0';
+    char *slash = strrchr(buf, '/');
+    const char *name = slash + 1;
+    int dlen = slash == buf ? 1 : slash - buf;
+    if (*name == '\0') {
+        errno = EISDIR;
+        return -1;
+    }
+
+    int attempt;
+    for (attempt = 0; attempt < 2; attempt++) {
+        int tmp;
+        int dfd = get_dir(c, buf, dlen, (flags & O_CREAT) != 0, &tmp);
+        if (dfd < 0) {
+            return -1;
+        }
+        int fd = openat(dfd, name, flags | O_CLOEXEC, mode);
+        int ec = errno;
+        if (tmp) {
+            close(dfd);
+        }
+        if (fd >= 0 || ec != ENOENT || tmp) {
+            errno = ec;
+            return fd;
+        }
+        /* 缓存的目录可能已经被删除，重新打开一次 */
+        forget_dir(c, buf, dlen);
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// 测试用例
+////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_UNITTEST
+
+#include <assert.h>
+
+void test_dircache(void)
+{
+    printf("test_dircache: ");
+
+    int fd = dircache_open_file("/tmp//test_dircache/a/b/f1",
+                                O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0 && fd < MAX_CONNS_CNT);
+    close(fd);
+
+    /* 目录不能作为文件打开 */
+    fd = dircache_open_file("/tmp/test_dircache/a", O_RDWR | O_CREAT, 0644);
+    assert(fd == -1);
+
+    /* 缓存的目录被删除后重新创建 */
+    assert(rmdir("/tmp/test_dircache/a/b") == -1);
+    assert(unlink("/tmp/test_dircache/a/b/f1") == 0);
+    assert(rmdir("/tmp/test_dircache/a/b") == 0);
+    fd = dircache_open_file("/tmp/test_dircache/a/b/f2",
+                            O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    close(fd);
+
+    /* 缓存的目录被重命名后不再使用 */
+    assert(rename("/tmp/test_dircache/a", "/tmp/test_dircache/c") == 0);
+    dircache_invalidate();
+    fd = dircache_open_file("/tmp/test_dircache/a/b/f3",
+                            O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    close(fd);
+    struct stat st;
+    assert(stat("/tmp/test_dircache/a/b/f3", &st) == 0);
+    assert(stat("/tmp/test_dircache/c/b/f3", &st) == -1);
+
+    printf("success\n");
+}
+
+#endif
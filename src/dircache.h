@@ -0,0 +1,30 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <sys/types.h>
+
+/*
+ * 目录描述符缓存
+ *
+ * 每个线程缓存最近使用的目录的描述符（LRU），键是规范化后的目录绝对路径，也
+ * 就是（后端目录，客户端 ID，子目录）。在缓存的目录中用 openat()/mkdirat()
+ * 打开和创建文件，同一个目录中的连续上传只需要一次 openat()，不再逐级 stat()
+ * 和 mkdir()。
+ *
+ * 缓存的描述符移到 MAX_CONNS_CNT 以上，不占用连接表使用的描述符。目录被删除
+ * 或者重命名时调用 dircache_invalidate()，所有线程在下次使用前清空缓存。
+ */
+
+/*
+ * 打开绝对路径 path 的文件，flags 和 mode 同 open()。flags 包含 O_CREAT 时，
+ * 同时创建不存在的目录。缓存被禁用或者 path 不是绝对路径时返回 -2，其他错误
+ * 返回 -1
+ */
+extern int dircache_open_file(const char *path, int flags, mode_t mode);
+
+/*
+ * 目录结构发生了变化，所有线程的缓存都失效
+ */
+extern void dircache_invalidate(void);
+
+#endif  /* DIRCACHE_H */
@@ -9,6 +9,12 @@
 #include "conn_mgmt.h"
 #include "events_poll.h"
 #include "md5ops.h"
+#include "liststream.h"
+#include "jobq.h"
+#include "behealth.h"
+#include "stripe.h"
+#include "fdcache.h"
+#include "batchdl.h"
 
 #ifndef EPOLLRDHUP
 #define EPOLLRDHUP 0x2000
@@ -341,7 +347,11 @@ static void on_data_socket_error(
     }
 }
 
-static int send_file_blob(int sd, struct backend_file *f)
+/*
+ * index 是文件所在的后端，只记录出错。sendfile() 的耗时主要是等待连接可写，和
+ * 后端的快慢无关，不计入平均耗时
+ */
+int send_file_blob(int sd, struct backend_file *f, int index)
 {
     off_t offset;
     while (f->fileleft > 0) {
@@ -351,11 +361,17 @@ static int send_file_blob(int sd, struct backend_file *f)
         } else {
             blocksize = MAX_TCP_BUF;
         }
-        offset = f->filedone;
+        offset = f->base + f->filedone;
         ssize_t sendlen = sendfile(sd, f->fd, &offset, blocksize);
-        if (sendlen >= 0) {
+        if (sendlen > 0) {
             f->fileleft = f->fileleft - sendlen;
             f->filedone = f->filedone + sendlen;
+        } else if (sendlen == 0) {
+            // 文件比要发送的短，被截断了或者正在重新上传
+            log_error("sendfile: %s ends at %lld, %lld bytes missing",
+                      f->abs_file_name, (long long int)offset,
+                      (long long int)f->fileleft);
+            return -1;
         } else {
             int ec = errno;
             if (ec == EAGAIN) {
@@ -363,6 +379,10 @@ static int send_file_blob(int sd, struct backend_file *f)
             } else {
                 log_error("sendfile failed: %s: out(%d) <- in(%d)",
                           strerror(ec), sd, f->fd);
+                if (ec == EIO) {
+                    // 其他错误可能来自连接，不算后端出错
+                    behealth_record(index, 0, 0);
+                }
                 return -1;
             }
         }
@@ -370,6 +390,69 @@ static int send_file_blob(int sd, struct backend_file *f)
     return 1;
 }
 
+// 从条带读取的重排缓冲发送，需要的区段还没有读完时等待
+static int send_striped_blob(int sd, conn_info_t *c, struct backend_file *f)
+{
+    while (f->fileleft > 0) {
+        const uint8_t *data;
+        int n = striped_peek(c, f->filedone, &data);
+        if (n <= 0) {
+            log_error("striped read of %s at %lld failed",
+                      f->abs_file_name, (long long int)f->filedone);
+            return -1;
+        }
+        if (n > f->fileleft) {
+            n = f->fileleft;
+        }
+        ssize_t sendlen = send(sd, data, n, MSG_DONTWAIT);
+        if (sendlen >= 0) {
+            f->fileleft = f->fileleft - sendlen;
+            f->filedone = f->filedone + sendlen;
+        } else if (errno == EAGAIN) {
+            return 0;
+        } else {
+            log_error("send failed: %s: out(%d)", strerror(errno), sd);
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * 顺序下载的响应前缀：消息长度和 md5，请求了区间时还有文件大小和每个区间实际
+ * 发送的偏移和长度，格式见 handle_seq_download_request()。返回前缀的长度
+ */
+static int fill_seq_prefix(conn_info_t *c, struct backend_file *f,
+                           const char *md5, char *buffer)
+{
+    int64_t msglen = 40 + f->filesize;
+    int len = 40;
+    if (c->nr_ranges > 0) {
+        int64_t v = htobe64(f->filesize);
+        memmove(buffer + len, &v, 8);
+        uint32_t n = htobe32(c->nr_ranges);
+        memmove(buffer + len + 8, &n, 4);
+        len = len + 12;
+        msglen = 0;
+        int i;
+        for (i = 0; i < c->nr_ranges; i++) {
+            v = htobe64(c->ranges[i][0]);
+            memmove(buffer + len, &v, 8);
+            v = htobe64(c->ranges[i][1]);
+            memmove(buffer + len + 8, &v, 8);
+            len = len + 16;
+            msglen = msglen + c->ranges[i][1];
+        }
+        msglen = msglen + len;
+    } else {
+        // 整个文件
+    }
+    msglen = htobe64(msglen);
+    memmove(buffer, &msglen, 8);
+    memmove(buffer + 8, md5, 32);
+    return len;
+}
+
 extern int get_thread_id(void);
 
 static int deal_data_socket_epollout(
@@ -395,6 +478,40 @@ static int deal_data_socket_epollout(
         else
         {
             if (c->is_sequence == 0) {
+                if (c->batch != NULL) {
+                    // 继续发送批量下载的文件，发送缓冲区在其中发送
+                    int rc = pump_batch_download(e, c);
+                    if (rc == 0) {
+                        // 所有文件都已经发送，恢复接收请求
+                        close_batch_download(c);
+                        end_conn_transfer(c);
+                        start_monitoring_recv(e, sock_fd);
+                        stop_monitoring_send(e, sock_fd);
+                        return 0;
+                    } else if (rc < 0) {
+                        log_error("pump_batch_download failed: sock_fd:%d", sock_fd);
+                        close_tcp_conn(e, sock_fd);
+                        return -1;
+                    } else {
+                        // 等待下次可写
+                        return 0;
+                    }
+                }
+                if (c->list_stream != NULL) {
+                    // 发送缓冲区有空间了，继续填充文件列表
+                    int rc = pump_file_list_stream(e, c);
+                    if (rc == 0) {
+                        // 文件列表已经全部写入发送缓冲区，恢复接收请求
+                        close_file_list_stream(c);
+                        start_monitoring_recv(e, sock_fd);
+                    } else if (rc < 0) {
+                        log_error("pump_file_list_stream failed");
+                        close_tcp_conn(e, sock_fd);
+                        return -1;
+                    } else {
+                        // 还没有遍历完，等待下次可写
+                    }
+                }
                 int write_len = send_message_internal(e, c);
                 if (write_len >= 0) {
                     return write_len;
@@ -419,24 +536,29 @@ static int deal_data_socket_epollout(
                 if (f && f->fd >= 0) {
                     if (f->sndstate == 0) {
                         char md5_path[2048];
-                        int rc1 = md5path(f->abs_file_name, md5_path);
+                        int rc1 = f->md5[0] != '\0' ? 0 : md5path(f->abs_file_name, md5_path);
                         if (rc1 == 0) {
                             // 获取文件上传时的 md5
                             char md5[32];
 #if HAVE_SAVE_MD5
-                            int rc2 = look_for_md5(
-                                md5_path, f->abs_file_name, md5);
+                            int rc2 = 0;
+                            if (f->md5[0] != '\0') {
+                                // md5 记录在包的索引或者元数据索引中
+                                memcpy(md5, f->md5, 32);
+                            } else {
+                                rc2 = look_for_md5(md5_path, f->abs_file_name, md5);
+                            }
 #else
                             int rc2 = 0;
+                            // 没有保存 md5 时只有索引中有
+                            memcpy(md5, f->md5, 32);
 #endif
                             if (rc2 == 0) {
-                                // 8字节的消息长度，32字节的md5长度
-                                int64_t msglen = htobe64(40 + f->filesize);
-                                char buffer[40];
-                                memmove(buffer, &msglen, 8);
-                                memmove(buffer+8, md5, 32);
-                                int sendlen = send(sock_fd, buffer, 40, MSG_MORE);
-                                if (sendlen == 40) {
+                                // 8字节的消息长度，32字节的md5长度，还有请求的区间
+                                char buffer[40 + 12 + 16 * SEQ_RANGES_MAX];
+                                int prefixlen = fill_seq_prefix(c, f, md5, buffer);
+                                int sendlen = send(sock_fd, buffer, prefixlen, MSG_MORE);
+                                if (sendlen == prefixlen) {
                                     // 发送消息前缀和md5校验和成功，继续发送文件内容
                                     f->sndstate = 1;
                                     goto send_blob;
@@ -458,19 +580,27 @@ static int deal_data_socket_epollout(
                         int rc3;
                     send_blob:
                         // 可以发送文件内容
-                        rc3 = send_file_blob(sock_fd, f);
+                        rc3 = c->stripe != NULL ? send_striped_blob(sock_fd, c, f) :
+                            send_file_blob(sock_fd, f, i);
                         if (rc3 == 0) {
                             // 连接暂时不可写，等待下次继续发送
                             return 0;
+                        } else if (rc3 == 1 && c->cur_range + 1 < c->nr_ranges) {
+                            // 继续发送下一个区间
+                            c->cur_range = c->cur_range + 1;
+                            f->filedone = c->ranges[c->cur_range][0];
+                            f->fileleft = c->ranges[c->cur_range][1];
+                            goto send_blob;
                         } else if (rc3 == 1) {
                             // 文件内容已经发送完毕，可以关闭文件，开
                             // 启监听客户端的可读事件
                             log_debug("%s successfully downloaded (%lld bytes)",
                                       f->abs_file_name,
                                       (long long int)f->filedone);
-                            close(f->fd);
-                            f->fd = -1;
+                            fdcache_close(f);
                             f->sndstate = 2;
+                            close_striped_read(c);
+                            end_conn_transfer(c);
                             start_monitoring_recv(e, sock_fd);
                              stop_monitoring_send(e, sock_fd);
                             return 0;
@@ -529,6 +659,11 @@ static int receive_client_fd(
         if (ret == 1)
         {
             // log_info("add client_fd:%d to EPOLLIN events poll success", client_fd);
+            if (start_conn_timers(c) < 0)
+            {
+                // 没有超时保护也能继续服务，只记录日志
+                log_warning("start timers for client_fd:%d failed", client_fd);
+            }
             return 0;
         }
         else
@@ -586,6 +721,11 @@ static int deal_data_socket_epollin(
                 return 0;
             }
         }
+        else if (c->peer_type == NODE_TYPE_JOBQ)
+        {
+            // 后台任务执行完毕，在本线程中发送响应
+            return on_jobq_events(e, sock_fd);
+        }
         else
         {
             // 工作者线程从客户端接收数据，然后进行处理
@@ -641,6 +781,13 @@ static void deal_data_socket_events(
                     log_error("deal_data_socket_epollin failed on sock_fd:%d", sock_fd);
                 }
             }
+            if (sock_fd == conn_info->sock_fd &&
+                current_thread_id == conn_info->thread_id) {
+                // 连接还在，有数据收发，推迟超时
+                touch_conn(conn_info);
+            } else {
+                // 处理过程中连接已经关闭
+            }
         } else {
             log_warning("unhandle events %s occurs", get_events_string(events));
             // 保守处理，关闭连接
@@ -692,7 +839,7 @@ static void handle_one_event(events_poll_t * events_poll, uint32_t id)
     }
 }
 
-int run_events_poll(events_poll_t * events_poll, uint32_t wait_time) // wait_time 的单位是毫秒
+int run_events_poll(events_poll_t * events_poll, int wait_time) // wait_time 的单位是毫秒，-1 表示一直等待
 {
     // 当前状态下只可能有 EINTR 的错误
     int events_cnt = epoll_wait(events_poll->epoll_fd,
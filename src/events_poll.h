@@ -47,7 +47,7 @@ int stop_monitoring_recv(events_poll_t * events_poll, int sock_fd);
 
 int stop_monitoring_send(events_poll_t * events_poll, int sock_fd);
 
-int run_events_poll(events_poll_t * events_poll, uint32_t wait_time);
+int run_events_poll(events_poll_t * events_poll, int wait_time);
 
 
 
@@ -0,0 +1,351 @@
+
+// fdcache.c
+
+#include "mt_log.h"
+#include "public.h"
+#include "events_poll.h"
+#include "conn_mgmt.h"
+#include "tunables.h"
+#include "fdcache.h"
+
+extern int get_thread_id(void);
+extern const char *backend_key(const char *path, int *index);
+
+#define FDCACHE_INVALS  1024    // 保留的失效记录个数，落后更多时清空整个缓存
+
+struct fd_handle {
+    char *path;
+    uint32_t hash;          // 绝对路径的散列
+    uint32_t keyhash;       // 相对于后端目录的路径的散列，失效时使用
+    int fd;
+    int refs;               // 引用这个描述符的连接个数
+    int dead;               // 已经不在缓存中，最后一个引用释放时关闭
+    struct fd_handle *hnext;
+    struct fd_handle *prev; // LRU 链表，表头是最近使用的
+    struct fd_handle *next;
+};
+
+struct fdcache {
+    int nr;
+    uint32_t generation;    // 缓存建立或者清空时的全局 generation
+    uint64_t seen;          // 已经处理过的失效记录
+    int nbuckets;
+    struct fd_handle **buckets;
+    struct fd_handle *head;
+    struct fd_handle *tail;
+};
+
+static struct fdcache *fdcaches[MAX_WORKERS+1] = {NULL};
+static uint32_t fdcache_generation = 0;
+
+// 最近失效的文件，按顺序记录相对路径的散列
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t invals[FDCACHE_INVALS];
+static volatile uint64_t inval_seq = 0;
+
+static uint32_t hash_path(const char *path)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261U;
+    const char *p;
+    for (p = path; *p != '\0'; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619U;
+    }
+    return h;
+}
+
+static void lru_unlink(struct fdcache *c, struct fd_handle *e)
+{
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        c->head = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        c->tail = e->prev;
+    }
+}
+
+static void lru_push(struct fdcache *c, struct fd_handle *e)
+{
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head != NULL) {
+        c->head->prev = e;
+    } else {
+        c->tail = e;
+    }
+    c->head = e;
+}
+
+static void free_handle(struct fd_handle *e)
+{
+    close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+// 从缓存中移走，还有连接引用时等最后一个引用释放再关闭
+static void remove_handle(struct fdcache *c, struct fd_handle *e)
+{
+    struct fd_handle **p = &c->buckets[e->hash & (c->nbuckets - 1)];
+    while (*p != e) {
+        p = &(*p)->hnext;
+    }
+    *p = e->hnext;
+    lru_unlink(c, e);
+    c->nr = c->nr - 1;
+    if (e->refs == 0) {
+        free_handle(e);
+    } else {
+        e->dead = 1;
+    }
+}
+
+static void flush_fdcache(struct fdcache *c)
+{
+    while (c->head != NULL) {
+        remove_handle(c, c->head);
+    }
+}
+
+static struct fdcache *create_fdcache(int cap)
+{
+    struct fdcache *c = calloc(1, sizeof(struct fdcache));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->nbuckets = 1;
+    while (c->nbuckets < cap * 2) {
+        c->nbuckets = c->nbuckets * 2;
+    }
+    c->buckets = calloc(c->nbuckets, sizeof(struct fd_handle *));
+    if (c->buckets == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->generation = fdcache_generation;
+    c->seen = inval_seq;
+    return c;
+}
+
+// 丢弃其他线程记录的失效文件的描述符
+static void apply_invalidations(struct fdcache *c)
+{
+    pthread_mutex_lock(&inval_lock);
+    uint64_t seq = inval_seq;
+    if (seq - c->seen > FDCACHE_INVALS) {
+        flush_fdcache(c);
+    } else {
+        while (c->seen < seq) {
+            uint32_t keyhash = invals[c->seen % FDCACHE_INVALS];
+            struct fd_handle *e = c->head;
+            while (e != NULL) {
+                struct fd_handle *next = e->next;
+                if (e->keyhash == keyhash) {
+                    remove_handle(c, e);
+                }
+                e = next;
+            }
+            c->seen = c->seen + 1;
+        }
+    }
+    c->seen = seq;
+    pthread_mutex_unlock(&inval_lock);
+}
+
+static struct fdcache *get_fdcache(void)
+{
+    if (fdcache_size <= 0) {
+        return NULL;
+    }
+    int tid = get_thread_id();
+    if (tid <= 0 || tid > MAX_WORKERS) {
+        return NULL;
+    }
+    struct fdcache *c = fdcaches[tid];
+    if (c == NULL) {
+        c = create_fdcache(fdcache_size);
+        fdcaches[tid] = c;
+    } else if (c->generation != fdcache_generation) {
+        /* 有目录被删除或者重命名了 */
+        flush_fdcache(c);
+        c->generation = fdcache_generation;
+        c->seen = inval_seq;
+    } else if (c->seen != inval_seq) {
+        apply_invalidations(c);
+    } else {
+        // 缓存仍然有效
+    }
+    return c;
+}
+
+static struct fd_handle *lookup(struct fdcache *c, const char *path, uint32_t hash)
+{
+    struct fd_handle *e = c->buckets[hash & (c->nbuckets - 1)];
+    while (e != NULL && (e->hash != hash || strcmp(e->path, path) != 0)) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+// 腾出一个位置，没有可以淘汰的描述符时返回 -1
+static int make_room(struct fdcache *c)
+{
+    struct fd_handle *e = c->tail;
+    while (c->nr >= fdcache_size && e != NULL) {
+        struct fd_handle *prev = e->prev;
+        if (e->refs == 0) {
+            remove_handle(c, e);
+        }
+        e = prev;
+    }
+    return c->nr < fdcache_size ? 0 : -1;
+}
+
+int fdcache_open(const char *path, struct fd_handle **h)
+{
+    *h = NULL;
+    struct fdcache *c = get_fdcache();
+    if (c == NULL) {
+        return open(path, O_RDONLY | O_CLOEXEC);
+    }
+
+    uint32_t hash = hash_path(path);
+    struct fd_handle *e = lookup(c, path, hash);
+    if (e != NULL) {
+        struct stat st;
+        if (fstat(e->fd, &st) == 0 && st.st_nlink > 0) {
+            lru_unlink(c, e);
+            lru_push(c, e);
+            e->refs = e->refs + 1;
+            *h = e;
+            return e->fd;
+        } else {
+            // 文件已经被删除或者被替换
+            remove_handle(c, e);
+        }
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    if (make_room(c) != 0 || (e = calloc(1, sizeof(struct fd_handle))) == NULL) {
+        // 缓存的描述符都在使用，不缓存
+        return fd;
+    }
+    int hfd = fcntl(fd, F_DUPFD_CLOEXEC, MAX_CONNS_CNT);
+    e->path = strdup(path);
+    if (hfd < 0 || e->path == NULL) {
+        // 高位描述符用完了，不缓存
+        if (hfd >= 0) {
+            close(hfd);
+        }
+        free(e->path);
+        free(e);
+        return fd;
+    }
+    close(fd);
+    const char *key = backend_key(path, NULL);
+    e->hash = hash;
+    e->keyhash = hash_path(key != NULL ? key : path);
+    e->fd = hfd;
+    e->refs = 1;
+    e->hnext = c->buckets[hash & (c->nbuckets - 1)];
+    c->buckets[hash & (c->nbuckets - 1)] = e;
+    lru_push(c, e);
+    c->nr = c->nr + 1;
+    *h = e;
+    return hfd;
+}
+
+void fdcache_close(struct backend_file *f)
+{
+    struct fd_handle *e = f->cached;
+    if (e != NULL) {
+        e->refs = e->refs - 1;
+        if (e->dead && e->refs == 0) {
+            free_handle(e);
+        } else {
+            // 留在缓存中给下一个连接使用
+        }
+        f->cached = NULL;
+    } else if (f->fd >= 0) {
+        close(f->fd);
+    }
+    f->fd = -1;
+}
+
+void fdcache_invalidate(const char *path)
+{
+    const char *key = backend_key(path, NULL);
+    if (fdcache_size <= 0 || key == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&inval_lock);
+    invals[inval_seq % FDCACHE_INVALS] = hash_path(key);
+    inval_seq = inval_seq + 1;
+    pthread_mutex_unlock(&inval_lock);
+}
+
+void fdcache_invalidate_all(void)
+{
+    __sync_add_and_fetch(&fdcache_generation, 1);
+}
+
+////////////////////////////////////////////////////////////////////////
+// 测试用例
+////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_UNITTEST
+
+#include <assert.h>
+
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+void test_fdcache(void)
+{
+    printf("test_fdcache: ");
+
+    /* 只有后端目录中的文件才能失效，用临时目录作为后端 */
+    backend_cnt = 1;
+    snprintf(backend_dirs[0], sizeof(backend_dirs[0]), "/tmp/test_fdcache");
+    assert(mkdir(backend_dirs[0], 0755) == 0 || errno == EEXIST);
+    fdcache_size = 2;
+    int fd = open("/tmp/test_fdcache/a", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    close(fd);
+
+    /* 同一个线程中打开同一个文件共享描述符 */
+    struct backend_file f1, f2, f3;
+    memset(&f1, 0, sizeof(f1));
+    memset(&f2, 0, sizeof(f2));
+    memset(&f3, 0, sizeof(f3));
+    f1.fd = fdcache_open("/tmp/test_fdcache/a", &f1.cached);
+    f2.fd = fdcache_open("/tmp/test_fdcache/a", &f2.cached);
+    assert(f1.fd >= MAX_CONNS_CNT && f1.fd == f2.fd && f1.cached == f2.cached);
+    assert(f1.cached->refs == 2);
+
+    /* 失效的描述符在最后一个引用释放时关闭 */
+    fdcache_invalidate("/tmp/test_fdcache/a");
+    f3.fd = fdcache_open("/tmp/test_fdcache/a", &f3.cached);
+    assert(f3.cached != f1.cached && f1.cached->dead);
+    fdcache_close(&f1);
+    fdcache_close(&f2);
+    assert(f1.fd == -1 && f2.fd == -1);
+
+    /* 被删除的文件重新打开 */
+    fdcache_close(&f3);
+    assert(unlink("/tmp/test_fdcache/a") == 0);
+    f3.fd = fdcache_open("/tmp/test_fdcache/a", &f3.cached);
+    assert(f3.fd == -1 && errno == ENOENT);
+    assert(rmdir("/tmp/test_fdcache") == 0);
+
+    printf("success\n");
+}
+
+#endif
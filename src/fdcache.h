@@ -0,0 +1,51 @@
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include "conn_mgmt.h"
+
+/*
+ * 后端文件描述符缓存
+ *
+ * 每次下载都为每个后端打开一次文件，下载完成或者连接关闭时关闭，十个客户端同
+ * 时拉取同一个序列时同一个文件被打开十次。现在每个工作者线程缓存最近下载的文
+ * 件的只读描述符（LRU，最多 fdcache_size 个），键是文件的绝对路径：
+ *
+ * - 同一个线程中下载同一个文件的连接共享一个描述符，struct backend_file 引用
+ *   缓存的句柄，关闭时只减少引用计数，没有连接使用的描述符留在缓存中；
+ * - 缓存满了时淘汰最久没有使用的、没有连接引用的描述符，都在使用时不缓存新打
+ *   开的描述符；
+ * - 缓存的描述符移到 MAX_CONNS_CNT 以上，不占用连接表使用的描述符，移不上去时
+ *   也不缓存；
+ * - 上传、删除时调用 fdcache_invalidate()，目录被删除或者重命名时调用
+ *   fdcache_invalidate_all()，每个线程在下次使用缓存前丢弃失效的描述符。命中
+ *   时还检查文件是否已经被删除（st_nlink 为 0），被替换的文件重新打开。
+ *
+ * 缓存的描述符在同一个线程的连接之间共享文件偏移，读取时用 pread()、sendfile()
+ * 这样指定偏移的调用，或者在同一次处理中 lseek() 后立刻读取。打包存放的文件
+ * 不经过这个缓存。
+ */
+
+/*
+ * 以只读方式打开绝对路径 path 的文件。成功返回描述符，*h 是缓存的句柄，需要保存
+ * 到 struct backend_file 的 cached 中，没有缓存时为 NULL；失败返回 -1，errno 同
+ * open()
+ */
+extern int fdcache_open(const char *path, struct fd_handle **h);
+
+/*
+ * 关闭 f 的描述符，缓存的描述符只释放引用
+ */
+extern void fdcache_close(struct backend_file *f);
+
+/*
+ * 绝对路径 path 的文件被修改、删除或者替换了，所有后端中对应的描述符都失效。
+ * 失效按相对于后端目录的路径记录，不在任何后端目录下的 path 被忽略
+ */
+extern void fdcache_invalidate(const char *path);
+
+/*
+ * 目录结构发生了变化，所有线程的缓存都失效
+ */
+extern void fdcache_invalidate_all(void);
+
+#endif  /* FDCACHE_H */
@@ -0,0 +1,189 @@
+
+// gcommit.c
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <sys/time.h>
+
+#include "mt_log.h"
+#include "public.h"
+#include "tunables.h"
+#include "jobq.h"
+#include "gcommit.h"
+
+extern void init_mt_cntt(int thread_id);
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+struct commit_wait;
+
+struct commit_link {
+    struct commit_wait *w;
+    struct commit_link *next;
+};
+
+// 一个上传完成请求，在每个后端的同步队列中各有一个链接
+struct commit_wait {
+    struct job *j;
+    int pending;            // 还没有同步完成的后端个数
+    int failed;             // 有后端同步失败
+    struct commit_link links[MAX_BACK_END];
+};
+
+struct sync_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct commit_link *head;
+    struct commit_link *tail;
+    int index;              // 后端的下标
+    int fd;                 // 后端目录，用来 syncfs()
+    int thread_id;
+    uint64_t batches;       // 执行 syncfs() 的次数
+    uint64_t commits;       // 完成的上传完成请求个数
+};
+
+static struct sync_queue queues[MAX_BACK_END];
+
+static void release_commit(struct commit_wait *w, int rc)
+{
+    if (rc != 0) {
+        w->failed = 1;
+    } else {
+        // 这个后端同步成功
+    }
+    if (__sync_sub_and_fetch(&w->pending, 1) == 0) {
+        struct job *j = w->j;
+        j->result = w->failed ? -1 : 0;
+        free(w);
+        finish_job(j, j->result);
+    } else {
+        // 等待其他后端同步完成
+    }
+}
+
+static uint64_t now_usecs(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+static void *sync_thread(void *arg)
+{
+    struct sync_queue *q = (struct sync_queue *)arg;
+    init_mt_cntt(q->thread_id);
+    log_info("sync thread:%d for %s start", q->thread_id, backend_dirs[q->index]);
+
+    while (1) {
+        pthread_mutex_lock(&q->lock);
+        while (q->head == NULL) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        // 等待一个窗口，收集同一批的请求
+        if (group_commit_ms > 0) {
+            usleep(group_commit_ms * 1000);
+        }
+
+        pthread_mutex_lock(&q->lock);
+        struct commit_link *batch = q->head;
+        q->head = NULL;
+        q->tail = NULL;
+        pthread_mutex_unlock(&q->lock);
+
+        uint64_t start = now_usecs();
+        int rc = syncfs(q->fd);
+        if (rc != 0) {
+            log_error("syncfs %s failed: %s", backend_dirs[q->index], strerror(errno));
+        } else {
+            // 同步成功
+        }
+        uint64_t usecs = now_usecs() - start;
+
+        int n = 0;
+        while (batch != NULL) {
+            struct commit_link *next = batch->next;
+            release_commit(batch->w, rc);
+            batch = next;
+            n = n + 1;
+        }
+        q->batches = q->batches + 1;
+        q->commits = q->commits + n;
+        log_debug("syncfs %s: %d uploads in %.3f ms, %lu uploads in %lu batches",
+                  backend_dirs[q->index], n, usecs / 1000.0, q->commits, q->batches);
+    }
+    return NULL;
+}
+
+int init_group_commit(int first_thread_id)
+{
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct sync_queue *q = &queues[i];
+        pthread_mutex_init(&q->lock, NULL);
+        pthread_cond_init(&q->cond, NULL);
+        q->index = i;
+        q->thread_id = first_thread_id + i;
+        q->fd = open(backend_dirs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (q->fd < 0) {
+            log_crit("open %s failed: %s", backend_dirs[i], strerror(errno));
+            return -1;
+        }
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, sync_thread, q) != 0) {
+            log_crit("create sync thread:%d failed", q->thread_id);
+            return -1;
+        } else {
+            pthread_detach(tid);
+        }
+    }
+    return 0;
+}
+
+int group_commit(struct job *j, uint32_t mask)
+{
+    struct commit_wait *w = calloc(1, sizeof(struct commit_wait));
+    if (w == NULL) {
+        log_error("malloc commit failed");
+        return -1;
+    }
+    w->j = j;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        if (mask & (1U << i)) {
+            w->pending = w->pending + 1;
+        }
+    }
+    if (w->pending == 0) {
+        free(w);
+        return -1;
+    }
+
+    // 最后一个链接加入队列后 w 可能已经被释放，先记下要加入的后端
+    int pending = w->pending;
+    for (i = 0; i < backend_cnt && pending > 0; i++) {
+        if (!(mask & (1U << i))) {
+            continue;
+        }
+        pending = pending - 1;
+        struct sync_queue *q = &queues[i];
+        struct commit_link *l = &w->links[i];
+        l->w = w;
+        l->next = NULL;
+        pthread_mutex_lock(&q->lock);
+        if (q->tail != NULL) {
+            q->tail->next = l;
+        } else {
+            q->head = l;
+        }
+        q->tail = l;
+        pthread_cond_signal(&q->cond);
+        pthread_mutex_unlock(&q->lock);
+    }
+    return 0;
+}
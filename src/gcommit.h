@@ -0,0 +1,42 @@
+#ifndef GCOMMIT_H
+#define GCOMMIT_H
+
+#include <stdint.h>
+
+#include "jobq.h"
+
+/*
+ * 上传完成的持久化
+ *
+ * tunable upload_durability 选择上传完成响应之前怎样持久化：
+ *
+ * none  - 不持久化，数据在页缓存中就回复上传完成响应（原来的行为）；
+ * fsync - 每个文件 fdatasync()，再 fsync() 所在的目录；
+ * group - 组提交：上传完成请求排队到每个后端的同步线程，同步线程等待
+ *         group_commit_ms 收集同一批请求，对后端所在的文件系统执行一次
+ *         syncfs()，然后同时发送这一批所有的上传完成响应。同步期间到达的请求
+ *         进入下一批。
+ *
+ * 组提交中等待的请求用任务（jobq.h）表示，不经过任务执行线程，所有后端都同步
+ * 完成后，任务交还给提交它的工作者线程发送响应。任务已经达到 jobq_depth 个时
+ * 上传完成响应为 503，工作者线程不自己同步。
+ */
+
+#define DURABILITY_NONE   0
+#define DURABILITY_FSYNC  1
+#define DURABILITY_GROUP  2
+
+/*
+ * 为每个后端目录启动一个同步线程，线程号从 first_thread_id 开始。成功返回 0，
+ * 失败返回 -1
+ */
+extern int init_group_commit(int first_thread_id);
+
+/*
+ * 把任务加入 mask 中的后端（第 i 位对应 backend_dirs[i]）的同步队列。这些后端
+ * 都同步完成后，任务在提交它的工作者线程中完成，j->result 为 0 表示同步成功，
+ * -1 表示失败。成功返回 0，失败返回 -1，此时任务仍然属于调用者
+ */
+extern int group_commit(struct job *j, uint32_t mask);
+
+#endif  /* GCOMMIT_H */
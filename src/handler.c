@@ -4,8 +4,10 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <limits.h>
 
 #include <unistd.h>
+#include <sys/resource.h>
 
 #include "config.h"
 #include "mt_log.h"
@@ -17,6 +19,23 @@
 #include "version.h"
 #include "scandir.h"
 #include "md5.h"
+#include "tunables.h"
+#include "liststream.h"
+#include "jobq.h"
+#include "bkindex.h"
+#include "dircache.h"
+#include "wbuf.h"
+#include "dio.h"
+#include "gcommit.h"
+#include "pack.h"
+#include "metaidx.h"
+#include "behealth.h"
+#include "stripe.h"
+#include "catchup.h"
+#include "hotcache.h"
+#include "fdcache.h"
+#include "batchdl.h"
+#include "resume.h"
 
 uint32_t region_id = 0;
 uint32_t system_id = 0;
@@ -36,6 +55,7 @@ char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1] = {{0}};
 char *default_md5sum_filename = "md5sum.txt";
 
 conn_info_t conns_info[MAX_CONNS_CNT] = {{0}};
+struct upload_stat upload_stats = {0UL, 0UL, 0UL};
 
 static int close_and_check_md5(conn_info_t * c);
 
@@ -549,6 +569,17 @@ int open_path(char *path)
     int fd;
     char *fullpath;
 
+    /* 绝对路径在缓存的目录中打开，不存在的文件和目录同时创建 */
+    fd = dircache_open_file(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        return fd;
+    } else if (fd == -1) {
+        log_error("open %s failed: %s", path, strerror(errno));
+        return -1;
+    } else {
+        /* 目录缓存被禁用，或者是相对路径 */
+    }
+
     /* 0. 首先尝试打开文件，如果存在则直接返回 */
     fd = open(path, O_RDWR | O_TRUNC);
     if (fd >= 0) {
@@ -696,20 +727,51 @@ int open_path(char *path)
     }
 }
 
-static void get_filepath(char *filepath, size_t maxlen,
-                         msg_t *m, task_info_t *t,
-                         const char *prefix)
+static void get_named_filepath(char *filepath, size_t maxlen,
+                               msg_t *m, const char *name,
+                               const char *prefix)
 {
-    if (t->file_name[0] == '/') {
-        char *p = t->file_name;
+    if (name[0] == '/') {
+        const char *p = name;
         while (*p == '/') {
             /* 找到第一个不是路径分隔符的起始路径名 */
             p = p + 1;
         }
         snprintf(filepath, maxlen, "%s/%d/%s", prefix, m->src_id, p);
     } else {
-        snprintf(filepath, maxlen, "%s/%d/%s", prefix, m->src_id, t->file_name);
+        snprintf(filepath, maxlen, "%s/%d/%s", prefix, m->src_id, name);
+    }
+}
+
+static void get_filepath(char *filepath, size_t maxlen,
+                         msg_t *m, task_info_t *t,
+                         const char *prefix)
+{
+    get_named_filepath(filepath, maxlen, m, t->file_name, prefix);
+}
+
+/*
+ * 绝对路径 path 相对于所在后端目录的部分，以 '/' 开头，*index 是后端的下标。
+ * 不在任何后端目录下时返回 NULL
+ */
+const char *backend_key(const char *path, int *index)
+{
+    int b;
+    for (b = 0; b < backend_cnt; b++) {
+        int n = strlen(backend_dirs[b]);
+        while (n > 1 && backend_dirs[b][n - 1] == '/') {
+            n = n - 1;
+        }
+        if (n > 0 && !strncmp(path, backend_dirs[b], n) && path[n] == '/') {
+            if (index != NULL) {
+                *index = b;
+            }
+            return path + n;
+        } else {
+            // 不在这个后端目录下
+        }
     }
+    return NULL;
 }
 
 static void get_client_root(char *clipath, const char *mountpath, int id)
@@ -786,6 +848,11 @@ void save_backend_file_struct(
     snprintf(f->md5, sizeof(f->md5), "%s", ti->file_md5);
     snprintf(f->abs_file_name, sizeof(f->abs_file_name), "%s", abs_file_name);
     f->fd = fd;
+    f->direct = 0;
+    f->packed = 0;
+    f->base = 0;
+    f->lagging = 0;
+    f->cached = NULL;
     f->filesize = m->total;
     f->fileleft = m->total;
     f->filedone = 0;
@@ -801,57 +868,346 @@ static void print_hex(const char *mem, int len)
     // log_info("buffer: %s", buffer);
 }
 
-static int create_one_backend_fd(conn_info_t * conn_info, msg_t * msg, int index)
+/* 被选中的后端绕过页缓存读写，文件系统不支持时仍然使用页缓存 */
+static void enable_direct_io(struct backend_file *f, int index)
+{
+    if (backend_direct_io(index)) {
+        f->direct = set_direct_io(f->fd, 1) == 0;
+        if (!f->direct) {
+            log_debug("%s: O_DIRECT not supported", f->abs_file_name);
+        }
+    } else {
+        // 这个后端使用页缓存
+    }
+}
+
+/* 上传开始时按最终大小预分配空间，空间不足时上传失败 */
+static int preallocate_backend_file(struct backend_file *f)
+{
+    int rc = preallocate_fd(f->fd, f->filesize, upload_prealloc);
+    if (rc == 0) {
+        return 0;
+    } else if (rc == 1) {
+        log_debug("%s: fallocate not supported", f->abs_file_name);
+        return 0;
+    } else {
+        log_error("preallocate %s %lld bytes failed", f->abs_file_name,
+                  (long long int)f->filesize);
+        return -1;
+    }
+}
+
+/* 把文件的数据和所在目录中的文件名写入磁盘 */
+static int sync_backend_file(struct backend_file *f)
+{
+    if (fdatasync(f->fd) != 0) {
+        log_error("fdatasync %s failed: %s", f->abs_file_name, strerror(errno));
+        return -1;
+    }
+
+    char dirpath[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    snprintf(dirpath, sizeof(dirpath), "%s", f->abs_file_name);
+    char *slash = strrchr(dirpath, '/');
+    if (slash == NULL) {
+        return 0;
+    } else if (slash == dirpath) {
+        slash[1] = '\0';
+    } else {
+        slash[0] = '\0';
+    }
+    int dfd = open(dirpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0 || fsync(dfd) != 0) {
+        log_error("fsync %s failed: %s", dirpath, strerror(errno));
+        if (dfd >= 0) {
+            close(dfd);
+        }
+        return -1;
+    }
+    close(dfd);
+    return 0;
+}
+
+/* 上传结束时把文件截断为实际大小，统计文件的区段个数 */
+static int finish_backend_file(struct backend_file *f)
+{
+    if (upload_prealloc != PREALLOC_OFF && ftruncate(f->fd, f->filesize) != 0) {
+        log_error("ftruncate %s to %lld bytes failed: %s", f->abs_file_name,
+                  (long long int)f->filesize, strerror(errno));
+        return -1;
+    } else {
+        // 没有预分配，文件大小就是写入的大小
+    }
+
+    if (upload_durability == DURABILITY_FSYNC && sync_backend_file(f) != 0) {
+        return -1;
+    }
+
+    int extents = count_extents(f->fd);
+    if (extents >= 0) {
+        __sync_add_and_fetch(&upload_stats.files, 1);
+        __sync_add_and_fetch(&upload_stats.bytes, (uint64_t)f->filesize);
+        __sync_add_and_fetch(&upload_stats.extents, (uint64_t)extents);
+    } else {
+        // 文件系统不支持 FIEMAP
+    }
+    log_debug("%s: %lld bytes in %d extents", f->abs_file_name,
+              (long long int)f->filesize, extents);
+    return 0;
+}
+
+/* 组提交完成，在提交上传完成请求的工作者线程中发送上传完成响应 */
+static void finish_upload_commit(events_poll_t *e, struct job *j)
+{
+    conn_info_t *c = &conns_info[j->sock_fd];
+    if (c->sock_fd != j->sock_fd || c->generation != j->generation ||
+        c->thread_id != get_thread_id()) {
+        log_warning("drop upload finish response: sock_fd:%d already closed",
+                    j->sock_fd);
+        return;
+    }
+
+    c->pending_jobs = c->pending_jobs - 1;
+    touch_conn(c);
+    msg_t *m = (msg_t *)j->data;
+    if (j->result != 0) {
+        log_error("group commit for sock_fd:%d failed", c->sock_fd);
+        m->ack_code = 404;
+    } else {
+        // 数据已经写入磁盘
+    }
+    if (send_response_message(e, c, m, sizeof(msg_t)) < 0) {
+        close_tcp_conn(e, c->sock_fd);
+    } else {
+        // 响应已经放入发送缓冲区
+    }
+}
+
+/*
+ * 组提交模式下，成功的上传完成请求等待同一批的同步完成后再回复。已经交给组提
+ * 交返回 1，需要立即回复返回 0。等待的请求太多时回复 503，不在工作者线程中同
+ * 步整个文件系统，文件已经写完，只是还没有保证落盘，客户端稍后重新上传
+ */
+static int defer_upload_finish(conn_info_t *c, msg_t *m)
+{
+    if (upload_durability != DURABILITY_GROUP || m->ack_code != 200) {
+        return 0;
+    }
+
+    // 退出了这次上传的镜像不需要同步
+    uint32_t mask = ((1U << backend_cnt) - 1) & ~catchup_lagging_mask(c);
+    struct job *j = alloc_job();
+    if (j == NULL) {
+        // 等待的请求太多，让客户端稍后重试
+        log_warning("sock_fd:%d upload finish not committed: job queue is full",
+                    c->sock_fd);
+        m->ack_code = 503;
+        return 0;
+    }
+    memcpy(j->data, m, sizeof(msg_t));
+    j->sock_fd = c->sock_fd;
+    j->generation = c->generation;
+    j->done = finish_upload_commit;
+    if (group_commit(j, mask) != 0) {
+        finish_job(j, -1);
+    }
+    c->pending_jobs = c->pending_jobs + 1;
+    return 1;
+}
+
+/* 第一个没有退出这次上传的镜像 */
+static struct backend_file *first_synced_file(conn_info_t *c)
+{
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        if (!c->befiles[i].lagging) {
+            return &c->befiles[i];
+        }
+    }
+    return &c->befiles[0];
+}
+
+/* 上传完成的文件记录到元数据索引，没有跟上的镜像交给补齐线程 */
+static void index_uploaded_file(conn_info_t *c)
+{
+    struct backend_file *f = first_synced_file(c);
+    metaidx_put(f->abs_file_name, f->filesize, f->md5, f->packed);
+    hotcache_invalidate(f->abs_file_name);
+    fdcache_invalidate(f->abs_file_name);
+    if (write_quorum > 0) {
+        // 所有镜像都跟上时取消这个文件以前没有完成的补齐
+        catchup_add(f->abs_file_name, catchup_lagging_mask(c), f->filesize);
+    } else {
+        // 上传总是要求所有镜像
+    }
+}
+
+static int check_file_md5_field(task_info_t *t)
+{
+    int md5len = 0;
+    char *p = t->file_md5;
+    while (p < t->file_md5 + 32) {
+        if (*p == '\0') {
+            break;
+        } else {
+            md5len = md5len + 1;
+        }
+        p = p + 1;
+    }
+    if (md5len == 32 && t->file_md5[32] == '\0') {
+        return 0;
+    } else {
+        log_error("invalid filemd5 length %d", md5len);
+        print_hex(t->file_md5, 33);
+        return -1;
+    }
+}
+
+/* resume 不为 0 时续传，打开已经存在的文件，不截断 */
+static int create_one_backend_fd(conn_info_t * conn_info, msg_t * msg, int index,
+                                 int resume)
 {
     char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
     get_filepath(abs_file_name, sizeof(abs_file_name),
                  msg, (task_info_t *)msg->data,
                  backend_dirs[index]);
     int errno_cached;
-    int fd = open_path(abs_file_name);
+    int fd = resume ? open(abs_file_name, O_RDWR | O_CLOEXEC) : open_path(abs_file_name);
     errno_cached = errno;
     int ret = handle_fd_error(abs_file_name, fd, errno_cached);
     if (ret == 0) {
         save_backend_file_struct(&conn_info->befiles[index],
                                  msg, fd, abs_file_name);
-        task_info_t *t = (task_info_t *)msg->data;
-        int md5len = 0;
-        char *p = t->file_md5;
-        while (p < t->file_md5 + 32) {
-            if (*p == '\0') {
-                break;
-            } else {
-                md5len = md5len + 1;
-            }
-            p = p + 1;
-        }
-        if (md5len == 32 && t->file_md5[32] == '\0') {
-            return 0;
-        } else {
-            log_error("invalid filemd5 length %d", md5len);
-            print_hex(t->file_md5, 33);
+        if (preallocate_backend_file(&conn_info->befiles[index]) != 0) {
             return -1;
         }
+        if (upload_wbuf_size > 0) {
+            // 只有经过写缓冲合并的数据才是对齐的
+            enable_direct_io(&conn_info->befiles[index], index);
+        }
+        if (pack_threshold > 0) {
+            // 新的普通文件取代包中的同名文件
+            (void) pack_remove(abs_file_name);
+        }
+        return check_file_md5_field((task_info_t *)msg->data);
     } else {
         log_error("create %s failed", abs_file_name);
         return -1;
     }
 }
 
-static int create_backend_fds(conn_info_t * conn_info, msg_t * msg)
+/* 小文件不创建后端文件，上传完成时追加到每个后端目录的包中 */
+static int create_packed_files(conn_info_t * conn_info, msg_t * msg)
 {
     int i;
     for (i = 0; i < backend_cnt; i++) {
-        int ret = create_one_backend_fd(conn_info, msg, i);
-        if (ret == -1) {
+        struct backend_file *f = &conn_info->befiles[i];
+        char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+        get_filepath(abs_file_name, sizeof(abs_file_name),
+                     msg, (task_info_t *)msg->data,
+                     backend_dirs[i]);
+        save_backend_file_struct(f, msg, -1, abs_file_name);
+        f->packed = 1;
+    }
+    if (check_file_md5_field((task_info_t *)msg->data) != 0) {
+        return -1;
+    }
+    return begin_pack_upload(conn_info, msg->total);
+}
+
+/* 镜像不参与这次上传，删除原来的文件，上传完成后补齐 */
+static void skip_backend_file(conn_info_t * conn_info, msg_t * msg, int index)
+{
+    struct backend_file *f = &conn_info->befiles[index];
+    if (f->fd >= 0) {
+        // 创建成功后预分配失败
+        close(f->fd);
+    }
+    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    get_filepath(abs_file_name, sizeof(abs_file_name),
+                 msg, (task_info_t *)msg->data,
+                 backend_dirs[index]);
+    save_backend_file_struct(f, msg, -1, abs_file_name);
+    f->lagging = 1;
+    if (unlink(abs_file_name) != 0 && errno != ENOENT) {
+        log_warning("unlink %s failed: %s", abs_file_name, strerror(errno));
+    }
+    log_warning("%s skipped in upload, catch up later", abs_file_name);
+}
+
+/*
+ * 参与上传的后端都有续传记录时，*resume 是续传的位置，否则为 0，删除以前的续
+ * 传记录
+ */
+static int create_backend_fds(conn_info_t * conn_info, msg_t * msg, int64_t *resume)
+{
+    // 上一次没有完成的上传在缓冲中的数据写入原来的文件
+    close_write_buffer(conn_info);
+    abort_pack_upload(conn_info);
+
+    task_info_t *t = (task_info_t *)msg->data;
+    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    get_filepath(abs_file_name, sizeof(abs_file_name), msg, t, backend_dirs[0]);
+    const char *key = backend_key(abs_file_name, NULL);
+    *resume = 0;
+    if (key == NULL) {
+        log_error("%s is not in a backend directory", abs_file_name);
+        return -1;
+    }
+    // 正在补齐的旧文件不能再替换这次上传的文件
+    catchup_begin(abs_file_name);
+
+    if (pack_upload_wanted(msg->total)) {
+        // 打包上传在完成时一次写入所有镜像
+        resume_clear(key);
+        conn_info->write_quorum = 0;
+        return create_packed_files(conn_info, msg);
+    }
+
+    int quorum = catchup_quorum();
+    conn_info->write_quorum = quorum;
+    if (quorum < backend_cnt && check_file_md5_field(t) != 0) {
+        return -1;
+    }
+
+    // 隔离的后端不参与上传，不要求它们有续传记录
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        if (quorum == backend_cnt || behealth_is_healthy(i)) {
+            mask |= 1U << i;
+        }
+    }
+    *resume = resume_offset(msg->src_id, key, t->file_md5, msg->total, mask);
+    if (*resume == 0) {
+        resume_clear(key);
+    }
+
+    int synced = 0;
+    for (i = 0; i < backend_cnt; i++) {
+        conn_info->befiles[i].fd = -1;
+        if (quorum < backend_cnt && !behealth_is_healthy(i)) {
+            // 隔离的后端不参与上传
+            skip_backend_file(conn_info, msg, i);
+            continue;
+        }
+        int ret = create_one_backend_fd(conn_info, msg, i, *resume > 0);
+        if (ret == 0) {
+            synced = synced + 1;
+        } else if (quorum < backend_cnt) {
+            skip_backend_file(conn_info, msg, i);
+        } else {
             return -1;
         }
     }
 
+    if (synced < quorum) {
+        log_error("only %d mirrors for upload, %d wanted", synced, quorum);
+        return -1;
+    }
     return 0;
 }
 
-/* 成功接收到一个完整的包返回 0，没有接收到完整的包返回 -1 */
+/* 成功接收到一个完整的包返回 0，接收超时返回 -2，其他错误返回 -1 */
 static ssize_t recv_packet(int sd, char *buf, ssize_t buflen)
 {
     ssize_t recvsize;
@@ -859,6 +1215,9 @@ static ssize_t recv_packet(int sd, char *buf, ssize_t buflen)
     recvsize = recv(sd, buf, 4, MSG_WAITALL);
     if (recvsize == 4) {
         // log_debug("recv msglen from sock_fd:%d finished ...", sd);
+    } else if (recvsize < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        log_error("recv msglen from sock_fd:%d timeout", sd);
+        return -2;
     } else {
         log_error("recv msglen from sock_fd:%d failed: %d recv, %d expect",
                   sd, (int)recvsize, 4);
@@ -897,7 +1256,7 @@ static ssize_t recv_packet(int sd, char *buf, ssize_t buflen)
             } else {
                 log_error("%d want, %d recv, %d left: %s",
                         (int)msglen, (int)donesize, (int)leftsize, strerror(ec));
-                return -1;
+                return (ec == EAGAIN || ec == EWOULDBLOCK) ? -2 : -1;
             }
         }
     }
@@ -935,9 +1294,40 @@ struct upctx {
     conn_info_t *ci;
     msg_t *msg;
     uint64_t filesize;
+    uint64_t deadline; // 上传的截止时间，单位是毫秒，0 表示不限制
+    int64_t committed; // 这个偏移之前的数据都已经连续收到
+    int resumable;     // 这时中断可以续传
     char buffer[MAX_MESSAGE_LEN];
 };
 
+/*
+ * 上传过程中工作线程阻塞在套接字上，定时器得不到运行，所以用套接字的收发超时
+ * 检查传输停顿，每接收一个数据包检查一次截止时间。timeout 为 0 时取消超时。
+ */
+static void set_upload_timeout(int sd, int64_t timeout)
+{
+    struct timeval tv;
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+    if (setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) != 0 ||
+        setsockopt(sd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) != 0) {
+        log_warning("set sock_fd:%d timeout %lld failed: %s",
+                    sd, (long long int)timeout, strerror(errno));
+    } else {
+        // 设置成功
+    }
+}
+
+static int upload_expired(struct upctx *ctx)
+{
+    if (ctx->deadline > 0 && get_curr_time() >= ctx->deadline) {
+        count_conn_timeout(ctx->ci, CONN_TIMEOUT_DEADLINE);
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
 /* 处理上传开始请求（CMD_START_UPLOAD_REQ） */
 static int workrq0(struct upctx *ctx)
 {
@@ -947,9 +1337,13 @@ static int workrq0(struct upctx *ctx)
 
     conn_info_t *c = ctx->ci;
     msg_t *m = ctx->msg;
-    int rc = create_backend_fds(c, m);
+    int64_t resume = 0;
+    int rc = create_backend_fds(c, m, &resume);
     if (rc == 0) {
-        ctx->filesize = m->total;
+        // 续传时客户端从响应的 offset 继续发送
+        ctx->filesize = m->total - resume;
+        ctx->committed = resume;
+        m->offset = resume;
         m->ack_code = 200;
         return 0;
     } else {
@@ -1002,7 +1396,7 @@ static int __recvrq(struct upctx *ctx)
         return 0;
     } else {
         log_error("recv packet from sock_fd:%d failed!", sd);
-        return -1;
+        return rc;
     }
 }
 
@@ -1047,23 +1441,15 @@ static int workrq1(struct upctx *ctx)
 
     conn_info_t *c = ctx->ci;
     msg_t *m = ctx->msg;
-    int i;
-    for (i = 0; i < backend_cnt; i++) {
-        int n = write_data(
-            c->befiles[i].fd, m->offset, m->data, m->count);
-        if (n == (int)m->count) {
-            // 写入文件成功，继续写入下一个后端文件
-        } else {
-            // 写入文件失败，立刻返回，不再写入其他的后端文件
-            log_error("write %s:%lld failed: %d want, %d write",
-                      c->befiles[i].abs_file_name,
-                      (long long int)m->offset,
-                      (int)m->count, n);
-            return -1;
-        }
+    if (buffer_upload_data(c, m->offset, m->data, m->count) == 0) {
+        m->ack_code = 200;
+        return 0;
+    } else {
+        log_error("write %s:%lld failed: %d bytes",
+                  c->befiles[0].abs_file_name,
+                  (long long int)m->offset, (int)m->count);
+        return -1;
     }
-    m->ack_code = 200;
-    return 0;
 }
 
 // 响应消息只有消息头部
@@ -1133,13 +1519,15 @@ static int workrq2(struct upctx *ctx)
     msg_t *m = ctx->msg;
     int rc = close_and_check_md5(c);
     if (rc == 0) {
-        struct backend_file *f = &c->befiles[0];
+        struct backend_file *f = first_synced_file(c);
 #if HAVE_SAVE_MD5
-        rc = savemd5(f->abs_file_name, f->md5);
+        // 打包存放的文件的 md5 记录在包的索引中
+        rc = f->packed ? 0 : savemd5(f->abs_file_name, f->md5);
 #else
         rc = 0;
 #endif
         if (rc == 0) {
+            index_uploaded_file(c);
             m->ack_code = 200;
             return 0;
         } else {
@@ -1168,6 +1556,12 @@ static int handle_start_upload_request(
     struct upctx ctx;
     ctx.ep = events_poll;
     ctx.ci = conn_info;
+    ctx.deadline = 0;
+    ctx.committed = 0;
+    ctx.resumable = 0;
+    if (conn_deadline > 0) {
+        ctx.deadline = get_curr_time() + (uint64_t)conn_deadline * 1000;
+    }
 
     // 上传开始请求。这个消息已经接收完成，并且完成了消息检查
     ctx.msg = msg;
@@ -1189,7 +1583,9 @@ static int handle_start_upload_request(
     }
 
     // 上传数据请求
+    ctx.resumable = 1;
     tcp_setblocking(conn_info->sock_fd);
+    set_upload_timeout(conn_info->sock_fd, conn_stall_timeout);
     int64_t leftsize = ctx.filesize;
     // log_debug("filesize: %lld", (long long int)leftsize);
     while (leftsize > 0) {
@@ -1200,6 +1596,13 @@ static int handle_start_upload_request(
             // log_debug("recvrq1 finished ...");
         } else {
             log_error("recvrq1 failed: return code %d", rc1);
+            if (rc1 == -2) {
+                count_conn_timeout(conn_info, CONN_TIMEOUT_STALL);
+            }
+            goto failed;
+        }
+        if (upload_expired(&ctx)) {
+            log_error("upload on sock_fd:%d exceeds deadline", conn_info->sock_fd);
             goto failed;
         }
 
@@ -1210,6 +1613,11 @@ static int handle_start_upload_request(
             // 接收到的消息是正常的，继续处理
             // log_debug("chkmsg1 finished ...");
             leftsize = leftsize - m->count;
+            if ((int64_t)m->offset == ctx.committed) {
+                ctx.committed = ctx.committed + m->count;
+            } else {
+                // 乱序的数据不计入续传的位置
+            }
             // log_debug("sock_fd:%d: %d recv, %lld left", ctx.ci->sock_fd, (int)m->count, (long long int)leftsize);
         } else {
             log_error("bad message on CMD_UPLOAD_DATA_REQ!");
@@ -1242,6 +1650,9 @@ static int handle_start_upload_request(
         // log_debug("recvrq2 finished ...");
     } else {
         log_error("recvrq2 failed!");
+        if (rc2 == -2) {
+            count_conn_timeout(conn_info, CONN_TIMEOUT_STALL);
+        }
         goto failed;
     }
     msg_t *m = ctx.msg;
@@ -1255,6 +1666,7 @@ static int handle_start_upload_request(
                   conn_info->sock_fd);
         goto failed;
     }
+    ctx.resumable = 0;
     rc2 = workrq2(&ctx);
     if (rc2 == 0) {
         // 处理上传结束请求成功
@@ -1263,6 +1675,12 @@ static int handle_start_upload_request(
         log_error("workrq2 failed!");
         goto failed;
     }
+    if (defer_upload_finish(conn_info, ctx.msg)) {
+        // 同步完成后在事件循环中回复上传结束响应
+        set_upload_timeout(conn_info->sock_fd, 0);
+        tcp_setnonblock(conn_info->sock_fd);
+        return 0;
+    }
     rc2 = sendrs2(&ctx);
     if (rc2 == 0) {
         // 发送上传结束响应成功
@@ -1273,10 +1691,15 @@ static int handle_start_upload_request(
     }
 
     // 处理成功，连接保留不关闭，以便可以继续使用同一个连接传输
+    set_upload_timeout(conn_info->sock_fd, 0);
     tcp_setnonblock(conn_info->sock_fd);
     return 0;
 
 failed:
+    if (ctx.resumable) {
+        // 记录已经收到的数据，客户端重新开始上传时续传
+        resume_save(conn_info, ctx.committed);
+    }
     close_tcp_conn(events_poll, conn_info->sock_fd);
     return -1;
 }
@@ -1289,9 +1712,15 @@ static int check_one_backend_file(msg_t * msg, char *basedir_name)
                  basedir_name);
 
     struct stat path_stat;
+    struct pack_extent x;
     int ret = stat(abs_file_name, &path_stat);
     int errno_cached = errno;
-    if (ret == -1)
+    if (ret == -1 && errno_cached == ENOENT && pack_lookup(abs_file_name, &x) == 0)
+    {
+        // 文件打包存放
+        return 0;
+    }
+    else if (ret == -1)
     {
         log_error("> check file %s failed: %s",
                   abs_file_name, strerror(errno_cached));
@@ -1326,15 +1755,38 @@ static int open_one_backend_fd(conn_info_t * conn_info, msg_t * msg, int index)
                  msg, (task_info_t *)msg->data,
                  backend_dirs[index]);
 
+    // O_DIRECT 是打开的文件的状态，绕过页缓存的后端不共享描述符
+    struct fd_handle *h = NULL;
     int errno_cached;
-    int fd = open(abs_file_name, O_RDONLY);
+    int fd = backend_direct_io(index) ? open(abs_file_name, O_RDONLY) :
+             fdcache_open(abs_file_name, &h);
     errno_cached = errno;
+    if (fd < 0 && behealth_is_fault(errno_cached)) {
+        behealth_record(index, 0, 0);
+    }
 
-    int ret = handle_fd_error(abs_file_name, fd, errno_cached);
+    struct pack_extent x;
+    if (fd < 0 && errno_cached == ENOENT &&
+        (fd = pack_open(abs_file_name, &x)) >= 0)
+    {
+        // 打包存放的文件从段文件中的偏移开始读取
+        struct backend_file *f = &conn_info->befiles[index];
+        save_backend_file_struct(f, msg, fd, abs_file_name);
+        snprintf(f->md5, sizeof(f->md5), "%s", x.md5);
+        f->packed = 1;
+        f->base = x.offset;
+        f->filesize = x.len;
+        return 0;
+    }
+
+    // 缓存的描述符在 MAX_CONNS_CNT 以上
+    int ret = h != NULL ? 0 : handle_fd_error(abs_file_name, fd, errno_cached);
     if (ret == 0)
     {
         save_backend_file_struct(&conn_info->befiles[index],
                                  msg, fd, abs_file_name);
+        conn_info->befiles[index].cached = h;
+        enable_direct_io(&conn_info->befiles[index], index);
         // log_info("> open backend_fd %d(%s) in connection %d", fd, abs_file_name, conn_info->sock_fd);
         return 0;
     }
@@ -1346,10 +1798,18 @@ static int open_one_backend_fd(conn_info_t * conn_info, msg_t * msg, int index)
 
 static int open_backend_fds(conn_info_t * conn_info, msg_t * msg)
 {
+    // 隔离的后端排在最后，健康的后端都打不开文件时才使用
+    int order[MAX_BACK_END];
+    int n = behealth_order(order, (1U << backend_cnt) - 1);
     int nr_opens = 0;
-    int i;
-    for (i = 0; i < backend_cnt; i++)
+    int k;
+    for (k = 0; k < n; k++)
     {
+        int i = order[k];
+        if (nr_opens > 0 && !behealth_is_healthy(i))
+        {
+            continue;
+        }
         int ret = open_one_backend_fd(conn_info, msg, i);
         if (ret == 0)
         {
@@ -1359,13 +1819,50 @@ static int open_backend_fds(conn_info_t * conn_info, msg_t * msg)
     return nr_opens;
 }
 
+/* 在元数据索引中查找请求的文件，找到返回 0 */
+static int lookup_indexed_file(msg_t * msg, struct metaidx_entry *x)
+{
+    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    get_filepath(abs_file_name, sizeof(abs_file_name),
+                 msg, (task_info_t *)msg->data,
+                 backend_dirs[0]);
+    return metaidx_get(abs_file_name, x);
+}
+
 static int setup_start_download_reponse_message(
-    conn_info_t * conn_info, msg_t * msg)
+    conn_info_t * conn_info, msg_t * msg, const struct metaidx_entry *x)
 {
-    (void) conn_info;
     char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
     struct stat file_stat;
     int i;
+    if (x != NULL)
+    {
+        // 文件大小记录在元数据索引中，正在重新上传的文件可能比记录的短
+        int64_t size = x->size;
+        for (i = 0; i < backend_cnt; i++)
+        {
+            struct backend_file *f = &conn_info->befiles[i];
+            if (f->fd >= 0 && !f->packed)
+            {
+                if (fstat(f->fd, &file_stat) == 0 && file_stat.st_size < size)
+                {
+                    log_warning("%s is shorter than indexed, %lld < %lld",
+                                f->abs_file_name, (long long int)file_stat.st_size,
+                                (long long int)size);
+                    size = file_stat.st_size;
+                }
+                break;
+            }
+        }
+        task_info_t * task_info = (task_info_t *)(msg->data);
+        task_info->file_len = size;
+        encode_task_info(task_info);
+        msg->total = size;
+        msg->offset = 0UL;
+        msg->count = 0UL;
+        msg->ack_code = 200;
+        return 0;
+    }
     for (i = 0; i < backend_cnt; i++)
     {
         get_filepath(abs_file_name, sizeof(abs_file_name),
@@ -1373,6 +1870,12 @@ static int setup_start_download_reponse_message(
                      backend_dirs[i]);
         memset(&file_stat, 0, sizeof(file_stat));
         int ret = stat(abs_file_name, &file_stat);
+        struct pack_extent x;
+        if (ret != 0 && pack_lookup(abs_file_name, &x) == 0)
+        {
+            file_stat.st_size = x.len;
+            ret = 0;
+        }
         if (ret == 0)
         {
             task_info_t * task_info = (task_info_t *)(msg->data);
@@ -1388,29 +1891,128 @@ static int setup_start_download_reponse_message(
     return -1;
 }
 
-static int handle_start_download_request(
-    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+// 大文件从打开的所有镜像条带读取，打包存放的文件不使用
+static void start_striped_download(conn_info_t * conn_info, int64_t size)
 {
-    int nr_files = check_backend_files(msg);
-    if (nr_files > 0)
+    const char *paths[MAX_BACK_END];
+    int i;
+    for (i = 0; i < backend_cnt; i++)
     {
-        int nr_opens = open_backend_fds(conn_info, msg);
-        if (nr_opens > 0)
+        struct backend_file *f = &conn_info->befiles[i];
+        if (f->fd >= 0 && f->packed)
         {
-            int ret = setup_start_download_reponse_message(conn_info, msg);
-            if (ret == 0)
-            {
-                return send_response_message(events_poll, conn_info,
-                                             msg, msg->length);
-            }
-            else
-            {
-                log_error("setup response message failed");
-                return -1;
-            }
+            return;
         }
-        else
-        {
+        paths[i] = f->fd >= 0 ? f->abs_file_name : NULL;
+    }
+    (void) open_striped_read(conn_info, paths, size, 0);
+}
+
+// 结束从热点文件缓存的下载
+static void end_cached_download(conn_info_t * conn_info)
+{
+    if (conn_info->hot != NULL)
+    {
+        hotcache_release(conn_info->hot);
+        conn_info->hot = NULL;
+    }
+}
+
+// 缓存中的热点文件不需要访问后端，命中返回 0
+static int start_cached_download(conn_info_t * conn_info, msg_t * msg)
+{
+    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    get_filepath(abs_file_name, sizeof(abs_file_name),
+                 msg, (task_info_t *)msg->data,
+                 backend_dirs[0]);
+    end_cached_download(conn_info);
+    struct hot_file *h = hotcache_get(abs_file_name);
+    if (h == NULL)
+    {
+        return -1;
+    }
+
+    struct metaidx_entry x;
+    memset(&x, 0, sizeof(x));
+    x.size = hot_file_size(h);
+    int i;
+    for (i = 0; i < backend_cnt; i++)
+    {
+        conn_info->befiles[i].fd = -1;
+    }
+    save_backend_file_struct(&conn_info->befiles[0], msg, -1, abs_file_name);
+    conn_info->hot = h;
+    return setup_start_download_reponse_message(conn_info, msg, &x);
+}
+
+// 打开的小文件交给热点文件缓存，由准入策略决定是否缓存
+static void admit_hot_file(conn_info_t * conn_info, int64_t size)
+{
+    if (hotcache_bytes == 0 || size > hotcache_file_max)
+    {
+        return;
+    }
+    int i;
+    for (i = 0; i < backend_cnt; i++)
+    {
+        struct backend_file *f = &conn_info->befiles[i];
+        if (f->fd >= 0)
+        {
+            hotcache_admit(f->abs_file_name, i, f->fd, f->base, size, f->packed);
+            return;
+        }
+    }
+}
+
+static int handle_start_download_request(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    if (start_cached_download(conn_info, msg) == 0)
+    {
+        (void) begin_conn_transfer(conn_info);
+        return send_response_message(events_poll, conn_info,
+                                     msg, msg->length);
+    }
+
+    // 在元数据索引中的文件不需要检查每个后端
+    struct metaidx_entry x;
+    int indexed = lookup_indexed_file(msg, &x) == 0;
+    int nr_files = indexed ? 1 : check_backend_files(msg);
+    if (nr_files > 0)
+    {
+        int nr_opens = open_backend_fds(conn_info, msg);
+        if (nr_opens == 0 && indexed)
+        {
+            // 后端的文件已经不在了，删除过时的记录
+            char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+            get_filepath(abs_file_name, sizeof(abs_file_name),
+                         msg, (task_info_t *)msg->data,
+                         backend_dirs[0]);
+            log_warning("drop stale metaidx entry %s", abs_file_name);
+            metaidx_remove(abs_file_name);
+        }
+        if (nr_opens > 0)
+        {
+            int ret = setup_start_download_reponse_message(
+                conn_info, msg, indexed ? &x : NULL);
+            if (ret == 0)
+            {
+                admit_hot_file(conn_info, msg->total);
+                start_striped_download(conn_info, msg->total);
+                conn_info->ra_next = 0;
+                conn_info->ra_seq = 0;
+                (void) begin_conn_transfer(conn_info);
+                return send_response_message(events_poll, conn_info,
+                                             msg, msg->length);
+            }
+            else
+            {
+                log_error("setup response message failed");
+                return -1;
+            }
+        }
+        else
+        {
             log_error("open backend files failed");
             return -1;
         }
@@ -1436,7 +2038,12 @@ static int remove_one_backend_file(
 
     int ret = remove(abs_file_name);
     int errno_cached = errno;
-    if (ret == 0)
+    if (ret != 0 && errno_cached == ENOENT && pack_remove(abs_file_name) == 0)
+    {
+        log_info("> remove packed file %s ok", abs_file_name);
+        return 0;
+    }
+    else if (ret == 0)
     {
         log_info("> remove file %s ok", abs_file_name);
         return 0;
@@ -1489,6 +2096,14 @@ static int handle_delete_request(
         ack_code = 200;
     }
 
+    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    get_filepath(abs_file_name, sizeof(abs_file_name),
+                 msg, (task_info_t *)msg->data,
+                 backend_dirs[0]);
+    metaidx_remove(abs_file_name);
+    hotcache_invalidate(abs_file_name);
+    fdcache_invalidate(abs_file_name);
+
     task_info_t * task_info = (task_info_t *)(msg->data);
     encode_task_info(task_info);
     msg->ack_code = ack_code;
@@ -1541,13 +2156,6 @@ static int handle_common1(
     }
 }
 
-static void backend_file_close_fd(struct backend_file *f)
-{
-    close(f->fd);
-    // log_info("> closed fd:%d", f->fd);
-    f->fd = -1;
-}
-
 static int backend_file_check_md5(struct backend_file *f)
 {
 #ifdef HAVE_CHECK_MD5
@@ -1567,7 +2175,12 @@ static int backend_file_check_md5(struct backend_file *f)
 
 static int close_and_check_md5(conn_info_t * c)
 {
-    int ret = 0;
+    if (c->pack != NULL) {
+        return finish_pack_upload(c);
+    }
+
+    // 上传完成响应表示所有数据都已经写入后端文件
+    int ret = close_write_buffer(c);
 
     int i;
     for (i = 0; i < backend_cnt; i++)
@@ -1575,10 +2188,19 @@ static int close_and_check_md5(conn_info_t * c)
         struct backend_file * f = &c->befiles[i];
         int rc1;
 
-        backend_file_close_fd(&c->befiles[i]);
+        if (f->lagging) {
+            // 退出了这次上传，上传完成后补齐
+            continue;
+        }
+        ret |= finish_backend_file(f);
+        rc1 = backend_file_check_md5(f);
+        if (f->direct) {
+            // 丢弃通过页缓存写入的尾部和校验 md5 时读入的缓存页
+            (void) posix_fadvise(f->fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        fdcache_close(&c->befiles[i]);
         // log_info("> closed %s", c->befiles[i].abs_file_name);
 
-        rc1 = backend_file_check_md5(f);
         if (rc1 == 0) {
             log_debug("%s successfully uploaded (%lld bytes)",
                       c->befiles[i].abs_file_name,
@@ -1590,6 +2212,11 @@ static int close_and_check_md5(conn_info_t * c)
         ret |= rc1;
     }
 
+    // 上传已经完成或者文件已经不可信，都不再续传
+    const char *key = backend_key(c->befiles[0].abs_file_name, NULL);
+    if (key != NULL) {
+        resume_clear(key);
+    }
     return ret;
 }
 
@@ -1598,18 +2225,12 @@ static int __handle_upload_data_request(
 {
     if (msg->length == msg->count + sizeof(msg_t))
     {
-        int i;
-        for (i = 0; i < backend_cnt; i++)
+        if (buffer_upload_data(conn_info, msg->offset,
+                               msg->data, msg->count) != 0)
         {
-            int nwrite = write_data(conn_info->befiles[i].fd,
-                                    msg->offset, msg->data, msg->count);
-            if (nwrite != (int)msg->count)
-            {
-                log_error("> write %s failed: %d want, %d write",
-                          conn_info->befiles[i].abs_file_name,
-                          (int)msg->count, nwrite);
-                return -1;
-            }
+            log_error("> write %s failed: %d bytes",
+                      conn_info->befiles[0].abs_file_name, (int)msg->count);
+            return -1;
         }
         msg->ack_code = 200;
         return send_response_message(events_poll, conn_info, msg, sizeof(msg_t));
@@ -1633,11 +2254,63 @@ static int __handle_download_data_request(
         new_msg->count = MAX_MSG_DATA_LEN;
     }
 
-    // 从第一个后端文件中读取数据
-    int i;
-    for (i = 0; i < backend_cnt; i++) {
-        int nread = read_data(conn_info->befiles[i].fd,
-                              new_msg->offset, new_msg->data, new_msg->count);
+    if (conn_info->hot != NULL) {
+        int nread = hot_file_read(conn_info->hot, new_msg->offset,
+                                  new_msg->data, new_msg->count);
+        if (nread > 0) {
+            uint32_t totallen = sizeof(msg_t) + nread;
+            new_msg->ack_code = 200;
+            return send_response_message(events_poll, conn_info,
+                                         new_msg, totallen);
+        } else {
+            log_error("read cached %s at %llu failed: end of file",
+                      conn_info->befiles[0].abs_file_name,
+                      (unsigned long long)new_msg->offset);
+            return -1;
+        }
+    }
+
+    detect_sequential_read(conn_info, new_msg->offset, new_msg->count);
+    if (conn_info->stripe != NULL) {
+        int nread = striped_read(conn_info, new_msg->offset,
+                                 new_msg->data, new_msg->count);
+        if (nread > 0) {
+            uint32_t totallen = sizeof(msg_t) + nread;
+            new_msg->ack_code = 200;
+            return send_response_message(events_poll, conn_info,
+                                         new_msg, totallen);
+        } else {
+            // 条带读取失败，逐个后端文件重新读取
+            log_warning("striped read at %llu failed, try backend files",
+                        (unsigned long long)new_msg->offset);
+        }
+    }
+
+    // 按后端的健康状况和平均耗时依次尝试打开的后端文件
+    int order[MAX_BACK_END];
+    int n = behealth_order(order, (1U << backend_cnt) - 1);
+    int k;
+    for (k = 0; k < n; k++) {
+        int i = order[k];
+        struct backend_file *f = &conn_info->befiles[i];
+        if (f->fd < 0) {
+            continue;
+        }
+        int count = new_msg->count;
+        if (f->packed && new_msg->offset + count > (uint64_t)f->filesize) {
+            // 不能读到段文件中的下一个文件
+            count = new_msg->offset < (uint64_t)f->filesize ?
+                f->filesize - new_msg->offset : 0;
+        }
+        uint64_t start = behealth_now_usecs();
+        int nread = f->direct ?
+            dio_pread(f->fd, new_msg->data, count, new_msg->offset) :
+            read_data(f->fd, f->base + new_msg->offset, new_msg->data, count);
+        if (nread != 0) {
+            behealth_record(i, behealth_now_usecs() - start, nread > 0);
+        } else {
+            // 读到文件末尾，不算后端出错，也不计入耗时
+        }
         if (nread > 0) {
             uint32_t totallen = sizeof(msg_t) + nread;
             new_msg->ack_code = 200;
@@ -1681,13 +2354,14 @@ static int __handle_upload_or_download_finish_request(
         int ret = close_and_check_md5(conn_info);
         if (ret == 0) {
             // log_info("%s uploading: 4/4", conn_info->befiles[0].md5);
-            struct backend_file *f = &conn_info->befiles[0];
+            struct backend_file *f = first_synced_file(conn_info);
 #if HAVE_SAVE_MD5
-            int rc = savemd5(f->abs_file_name, f->md5);
+            int rc = f->packed ? 0 : savemd5(f->abs_file_name, f->md5);
 #else
             int rc = 0;
 #endif
             if (rc == 0) {
+                index_uploaded_file(conn_info);
                 msg->ack_code = 200;
             } else {
                 msg->ack_code = 404;
@@ -1698,13 +2372,19 @@ static int __handle_upload_or_download_finish_request(
             msg->ack_code = 404;
             log_error("close_and_check_md5 on sock_fd:%d failed", conn_info->sock_fd);
         }
+        if (defer_upload_finish(conn_info, msg)) {
+            return 0;
+        }
     } else {
         int i;
         for (i = 0; i < backend_cnt; i++) {
             struct backend_file *f = &conn_info->befiles[i];
-            backend_file_close_fd(f);
+            fdcache_close(f);
         }
+        close_striped_read(conn_info);
+        end_cached_download(conn_info);
         log_info("%s successfully downloaded", conn_info->befiles[0].abs_file_name);
+        end_conn_transfer(conn_info);
         msg->ack_code = 200;
     }
 
@@ -1762,26 +2442,35 @@ static void advise_sequential(int fd)
     assert(rc1 == 0);
 }
 
-#ifdef CONFIG_WILLNEED
 static void advise_willneed(int fd)
 {
     int rc1 = posix_fadvise(
         fd, 0/*偏移*/, 0/*文件的所有内容*/, POSIX_FADV_WILLNEED);
     assert(rc1 == 0);
 }
-#endif
 
-#ifdef CONFIG_DONTNEED
 static void advise_dontneed(int fd)
 {
     int rc1 = posix_fadvise(
         fd, 0/*偏移*/, 0/*文件的所有内容*/, POSIX_FADV_DONTNEED);
     assert(rc1 == 0);
 }
-#endif
 
 static void advise_fitness(int fd)
 {
+    // 运行时用 -o seq_fadvise 指定，否则使用编译时的选择
+    if (seq_fadvise == 1) {
+        advise_sequential(fd);
+        return;
+    } else if (seq_fadvise == 2) {
+        advise_willneed(fd);
+        return;
+    } else if (seq_fadvise == 3) {
+        advise_dontneed(fd);
+        return;
+    } else {
+        // 使用编译时的选择
+    }
 #if defined(CONFIG_WILLNEED)
     // log_info("CONFIG_WILLNEED");
     advise_willneed(fd);
@@ -1794,6 +2483,86 @@ static void advise_fitness(int fd)
 #endif
 }
 
+/*
+ * 打开顺序下载的文件，key 是文件相对于后端目录的路径，见 backend_key()。从最快
+ * 的健康后端打开，打不开时尝试下一个。文件大小取 fstat() 和元数据索引中较小的，
+ * 正在重新上传的文件不会按索引中的大小发送；大小一致时使用索引中的 md5，不需要
+ * 读 md5sum.txt，否则 f->md5 为空，发送时再查找。成功返回文件所在的后端下标，
+ * *mask 是有这个文件的后端；失败返回 -1，errno 是最后一次打开的错误
+ */
+int open_seq_file(const char *key, struct backend_file *f, uint32_t *mask)
+{
+    char abs_file_name[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    snprintf(abs_file_name, sizeof(abs_file_name), "%s%s", backend_dirs[0], key);
+
+    struct metaidx_entry mx;
+    int indexed = metaidx_get(abs_file_name, &mx) == 0;
+    *mask = indexed && mx.mask != 0 ? (uint32_t)mx.mask : (1U << backend_cnt) - 1;
+
+    int order[MAX_BACK_END];
+    int n = behealth_order(order, *mask);
+    struct pack_extent x;
+    int packed = 0;
+    struct fd_handle *h = NULL;
+    int bfd = -1;
+    int b = 0;
+    int k;
+    for (k = 0; k < n && bfd < 0; k++) {
+        b = order[k];
+        snprintf(abs_file_name, sizeof(abs_file_name), "%s%s", backend_dirs[b], key);
+        packed = 0;
+        if (indexed && mx.packed) {
+            bfd = pack_open(abs_file_name, &x);
+        } else {
+            bfd = fdcache_open(abs_file_name, &h);
+            if (bfd < 0 && behealth_is_fault(errno)) {
+                behealth_record(b, 0, 0);
+            }
+        }
+        if (bfd < 0 && errno == ENOENT && (bfd = pack_open(abs_file_name, &x)) >= 0) {
+            packed = 1;
+        } else if (bfd >= 0 && indexed && mx.packed) {
+            packed = 1;
+        }
+    }
+    if (bfd < 0) {
+        return -1;
+    }
+
+    memset(f, 0, sizeof(struct backend_file));
+    f->fd = bfd;
+    f->cached = h;
+    f->packed = packed;
+    snprintf(f->abs_file_name, sizeof(f->abs_file_name), "%s", abs_file_name);
+    if (packed) {
+        f->base = x.offset;
+        f->filesize = x.len;
+        snprintf(f->md5, sizeof(f->md5), "%s", x.md5);
+    } else {
+        struct stat s;
+        if (fstat(bfd, &s) != 0) {
+            log_error("get %s file size failed: %s",
+                      abs_file_name, strerror(errno));
+            fdcache_close(f);
+            return -1;
+        }
+        f->filesize = indexed && mx.size < s.st_size ? mx.size : s.st_size;
+        if (indexed && s.st_size == mx.size) {
+            snprintf(f->md5, sizeof(f->md5), "%s", mx.md5);
+        } else if (indexed) {
+            // 正在重新上传，索引中的 md5 已经过时，发送时再查找
+            log_warning("%s size %lld differs from indexed %lld", abs_file_name,
+                        (long long int)s.st_size, (long long int)mx.size);
+        } else {
+            // 不在索引中，发送时再查找 md5
+        }
+    }
+    f->sndstate = 0; // 可以发送顺序文件消息的长度
+    f->fileleft = f->filesize;
+    f->filedone = 0;
+    return b;
+}
+
 /*
  * 处理客户端在一个连接内顺序下载文件的请求。
  *
@@ -1808,6 +2577,11 @@ static void advise_fitness(int fd)
  * 倍发送（8192），使用 sendfile() 避免用户空间的缓冲区拷贝，使用 posix_advise()
  * 告知内核文件将会以顺序的方式访问，同时，在接受客户端连接时，设置一个大的发送
  * 缓冲区。
+ *
+ * task_info 之后可以带最多 SEQ_RANGES_MAX 个区间，只发送这些区间的内容，每个区
+ * 间是 8 字节的偏移和 8 字节的长度，都是网络字节序，长度为 -1 表示到文件末尾。
+ * 这时的响应在 8 字节的消息长度和 md5 之后是 8 字节的文件大小、4 字节的区间个
+ * 数和每个区间实际发送的偏移和长度（截到文件末尾），然后依次是每个区间的内容。
  */
 static int handle_seq_download_request(
     events_poll_t *e, conn_info_t *c, msg_t *m)
@@ -1820,44 +2594,87 @@ static int handle_seq_download_request(
     // task_info_t *t = (task_info_t *)m->data;
     // log_info("message: %d bytes length, file_name: %s", m->length, t->file_name);
 
-    int bfd = open(abs_file_name, O_RDWR);
-    if (bfd >= 0) {
-        struct stat s;
-        int rc1 = fstat(bfd, &s);
-        if (rc1 == 0) {
-            advise_fitness(bfd); // 提前告知内核文件的访问方式
-            c->is_sequence = 1;
-            struct backend_file *f;
-            f = &c->befiles[0];
-            f->fd = bfd;
-            f->sndstate = 0; // 可以发送顺序文件消息的长度
-            f->filesize = s.st_size;
-            f->fileleft = s.st_size;
-            f->filedone = 0;
-            snprintf(f->abs_file_name, sizeof(f->abs_file_name), "%s", abs_file_name);
-            // 暂时停止接收消息事件，开始处理发送事件
-             stop_monitoring_recv(e, c->sock_fd);
-            start_monitoring_send(e, c->sock_fd);
-            return 0;
-        } else {
-            log_error("get %s file size failed: %s",
-                      abs_file_name, strerror(errno));
+    // 请求的区间
+    const uint8_t *p = m->data + sizeof(task_info_t);
+    int rangelen = (int)m->length - (int)sizeof(msg_t) - (int)sizeof(task_info_t);
+    int nr_ranges = rangelen > 0 ? rangelen / 16 : 0;
+    if (rangelen > 0 && (rangelen % 16 != 0 || nr_ranges > SEQ_RANGES_MAX)) {
+        log_error("invalid ranges of %s: %d bytes", abs_file_name, rangelen);
+        return -1;
+    }
+    int i;
+    for (i = 0; i < nr_ranges; i++) {
+        int64_t off, len;
+        memcpy(&off, p + i * 16, 8);
+        memcpy(&len, p + i * 16 + 8, 8);
+        c->ranges[i][0] = be64toh(off);
+        c->ranges[i][1] = be64toh(len);
+        if (c->ranges[i][0] < 0 || c->ranges[i][1] < -1) {
+            log_error("invalid range %lld+%lld of %s",
+                      (long long int)c->ranges[i][0],
+                      (long long int)c->ranges[i][1], abs_file_name);
             return -1;
         }
-    } else {
+    }
+
+    const char *key = backend_key(abs_file_name, NULL);
+    struct backend_file bf;
+    uint32_t mask = 0;
+    int b = open_seq_file(key, &bf, &mask);
+    if (b < 0) {
         log_error("open %s failed: %s",
                   abs_file_name, strerror(errno));
         return -1;
     }
+
+    // 区间截到文件末尾，先发送第一个区间
+    for (i = 0; i < nr_ranges; i++) {
+        int64_t *r = c->ranges[i];
+        if (r[0] > bf.filesize) {
+            r[0] = bf.filesize;
+        }
+        if (r[1] < 0 || r[1] > bf.filesize - r[0]) {
+            r[1] = bf.filesize - r[0];
+        }
+    }
+    c->nr_ranges = nr_ranges;
+    c->cur_range = 0;
+    if (nr_ranges > 0) {
+        bf.filedone = c->ranges[0][0];
+        bf.fileleft = c->ranges[0][1];
+    }
+
+    // 发送时根据下标记录后端的耗时，连接关闭时释放描述符
+    struct backend_file *f = &c->befiles[b];
+    *f = bf;
+    advise_fitness(f->fd); // 提前告知内核文件的访问方式
+    c->is_sequence = 1;
+    if (!f->packed && stripe_threshold > 0 && f->filesize >= stripe_threshold) {
+        // 大文件从所有镜像条带读取
+        char paths[MAX_BACK_END][MAX_PATH_LEN + MAX_NAME_LEN + 1];
+        const char *mirrors[MAX_BACK_END];
+        for (i = 0; i < backend_cnt; i++) {
+            snprintf(paths[i], sizeof(paths[i]), "%s%s", backend_dirs[i], key);
+            mirrors[i] = (mask & (1U << i)) ? paths[i] : NULL;
+        }
+        // 从第一个区间开始预取，不读区间之前的数据
+        (void) open_striped_read(c, mirrors, f->filesize, f->filedone);
+    }
+    (void) begin_conn_transfer(c);
+    // 暂时停止接收消息事件，开始处理发送事件
+     stop_monitoring_recv(e, c->sock_fd);
+    start_monitoring_send(e, c->sock_fd);
+    return 0;
 }
 
 /*
  * 消息包中的 filename 字段包含了 studyid/serial，根据 studyid 计算出路径名，然
- * 后遍历所有的可能的盘符路径目录，每一个目录路径名都获取一次文件列表。最后将获
- * 取的文件列表发送回客户端
+ * 后遍历所有的可能的盘符路径目录。只处理找到的第一个后端目录，因为其他的都是
+ * 镜像备份。返回目录个数，后端目录都不存在时返回 -1
  */
-static int handle_get_file_list_request(
-    events_poll_t *e, conn_info_t *c, msg_t *m)
+static int get_file_list_dirs(msg_t *m, char *pathbuf, int pathbuflen,
+                              const char **dirs, int maxdirs,
+                              const char **mountpoint)
 {
     /* 分割 studyid/serial */
     char *studyid, *serial;
@@ -1869,45 +2686,22 @@ static int handle_get_file_list_request(
     j = 0;
     for (i = 0; i < backend_cnt; i++) {
         if (!access(backend_dirs[i], F_OK)) {
-            /* 只处理找到的第一个后端目录，因为其他的都是镜像备份 */
-            const char *mountpoint = backend_dirs[i];
-            char pathbuf[65536];
-            int buflen = 65536;
-            calcpath(mountpoint, studyid, serial, pathbuf, &buflen);
+            *mountpoint = backend_dirs[i];
+            int buflen = pathbuflen;
+            calcpath(*mountpoint, studyid, serial, pathbuf, &buflen);
             // log_info("studyid: %s, serial: %s, buflen: %d", studyid, serial, buflen);
 
             /* 对每一个目录路径名，获取文件列表 */
-            char dirsbuf[4096];
-            const char **dirs = (const char **)&dirsbuf[0];
             int leftsize = buflen;
             char *next = pathbuf;
-            while (leftsize > 0) {
+            while (leftsize > 0 && j < maxdirs) {
                 int n = strlen(next);
                 dirs[j] = next;
                 j = j + 1;
                 leftsize = leftsize - n - 1;
                 next = next + n + 1;
             }
-            int k;
-            for (k = 0; k < j; k++) {
-                // log_info("dirpath: %s", dirs[k]);
-            }
-
-            struct file_list_result res;
-            char *file_list_buffer = fill_many_dir_list(mountpoint, dirs, j, &res);
-            if (file_list_buffer) {
-                int rc = send_message(e, c, (uint8_t *)file_list_buffer, res.used_buflen);
-                if (rc != res.used_buflen) {
-                    log_error("send_message failed: sendlen %d", rc);
-                } else {
-                    // 发送缓冲区完成，继续处理
-                }
-                free(file_list_buffer);
-                return rc;
-            } else {
-                log_error("fill_many_dir_list failed: file_list_buffer is NULL!");
-                return -1;
-            }
+            return j;
         } else {
             log_warning("skip %s: not exists", backend_dirs[i]);
         }
@@ -1917,6 +2711,152 @@ static int handle_get_file_list_request(
     return -1;
 }
 
+/*
+ * 获取的文件列表一次性发送回客户端
+ */
+static int handle_get_file_list_request(
+    events_poll_t *e, conn_info_t *c, msg_t *m)
+{
+    char pathbuf[65536];
+    const char *dirs[512];
+    const char *mountpoint = NULL;
+    int j = get_file_list_dirs(m, pathbuf, sizeof(pathbuf),
+                               dirs, 512, &mountpoint);
+    if (j < 0) {
+        return -1;
+    }
+
+    struct file_list_result res;
+    char *file_list_buffer = fill_many_dir_list(mountpoint, dirs, j, &res);
+    if (file_list_buffer) {
+        int rc = send_message(e, c, (uint8_t *)file_list_buffer, res.used_buflen);
+        if (rc != res.used_buflen) {
+            log_error("send_message failed: sendlen %d", rc);
+        } else {
+            // 发送缓冲区完成，继续处理
+        }
+        free(file_list_buffer);
+        return rc;
+    } else {
+        log_error("fill_many_dir_list failed: file_list_buffer is NULL!");
+        return -1;
+    }
+}
+
+/*
+ * 分段发送文件列表，边遍历目录边写入发送缓冲区，发送缓冲区满了就等待可写事
+ * 件再继续。发送期间暂停接收客户端的请求，保证响应的顺序。
+ *
+ * 先回复只有消息头的 CMD_GET_FILE_LIST_STREAM_RSP，ack_code 为 200 时后面紧跟
+ * 文件列表的各段，格式见 liststream.h；没有后端目录或者不能开始遍历时
+ * ack_code 为 404，后面没有数据
+ */
+static int handle_get_file_list_stream_request(
+    events_poll_t *e, conn_info_t *c, msg_t *m)
+{
+    char pathbuf[65536];
+    const char *dirs[512];
+    const char *mountpoint = NULL;
+    int j = get_file_list_dirs(m, pathbuf, sizeof(pathbuf),
+                               dirs, 512, &mountpoint);
+    if (j < 0 || open_file_list_stream(c, mountpoint, dirs, j) != 0) {
+        log_error("open_file_list_stream failed");
+        m->ack_code = 404;
+        return send_response_message(e, c, m, sizeof(msg_t));
+    }
+
+    m->ack_code = 200;
+    if (send_response_message(e, c, m, sizeof(msg_t)) < 0) {
+        close_file_list_stream(c);
+        return -1;
+    }
+    stop_monitoring_recv(e, c->sock_fd);
+    int rc = pump_file_list_stream(e, c);
+    if (rc == 0) {
+        // 文件列表很小，已经全部写入发送缓冲区
+        close_file_list_stream(c);
+        start_monitoring_recv(e, c->sock_fd);
+        return 0;
+    } else if (rc > 0) {
+        // 剩下的文件列表在可写事件中继续发送
+        return 0;
+    } else {
+        log_error("pump_file_list_stream failed");
+        return -1;
+    }
+}
+
+/*
+ * 批量下载检查或者系列下的所有文件，或者请求中 task_info 之后列出的文件，响应
+ * 的格式见 batchdl.h。发送期间暂停接收客户端的请求
+ */
+static int handle_batch_download_request(
+    events_poll_t *e, conn_info_t *c, msg_t *m)
+{
+    char pathbuf[65536];
+    const char *dirs[512];
+    const char *mountpoint = NULL;
+    int j = 0;
+
+    const char *list = (const char *)m->data + sizeof(task_info_t);
+    int listlen = (int)m->length - (int)sizeof(msg_t) - (int)sizeof(task_info_t);
+    if (listlen <= 0) {
+        j = get_file_list_dirs(m, pathbuf, sizeof(pathbuf),
+                               dirs, 512, &mountpoint);
+        if (j < 0) {
+            return -1;
+        }
+        listlen = 0;
+    } else {
+        // 列出的文件，每个文件名以 '\0' 结束
+    }
+
+    // 每个路径是后端目录、客户端号和文件名
+    int maxfiles = listlen / 2 + 1;
+    size_t pathslen = listlen + (size_t)maxfiles * (strlen(backend_dirs[0]) + 16);
+    const char **files = calloc(maxfiles, sizeof(char *));
+    char *paths = malloc(pathslen);
+    if (!files || !paths) {
+        log_error("malloc batch download file list failed");
+        free(files);
+        free(paths);
+        return -1;
+    }
+    int nr_files = 0;
+    size_t used = 0;
+    int pos = 0;
+    while (pos < listlen) {
+        char name[MAX_NAME_LEN + 1];
+        int n = strnlen(list + pos, listlen - pos);
+        if (n > 0 && n <= MAX_NAME_LEN) {
+            memcpy(name, list + pos, n);
+            name[n] = '\0';
+            char *p = paths + used;
+            get_named_filepath(p, pathslen - used, m, name, backend_dirs[0]);
+            used = used + strlen(p) + 1;
+            files[nr_files] = p;
+            nr_files = nr_files + 1;
+        } else if (n > MAX_NAME_LEN) {
+            log_warning("skip too long file name in batch download");
+        } else {
+            // 空的文件名
+        }
+        pos = pos + n + 1;
+    }
+
+    int rc = open_batch_download(c, dirs, j, files, nr_files);
+    free(files);
+    free(paths);
+    if (rc != 0) {
+        log_error("open_batch_download failed");
+        return -1;
+    }
+    (void) begin_conn_transfer(c);
+    stop_monitoring_recv(e, c->sock_fd);
+    start_monitoring_send(e, c->sock_fd);
+    return 0;
+}
+
 struct migoption
 {
     uint8_t old_sgw_ip[64];
@@ -2034,179 +2974,376 @@ static int handle_migration_start(
     }
 }
 
-// XXX: 这里的处理会引起安全问题，未经验证的客户端可以发送迁移完成消息来结束 sgw
-// 进程的执行
-static int handle_migration_finished(
-    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
-{
-    (void) events_poll;
-    (void) conn_info;
+// XXX: 这里的处理会引起安全问题，未经验证的客户端可以发送迁移完成消息来结束 sgw
+// 进程的执行
+static int handle_migration_finished(
+    events_poll_t * events_poll, conn_info_t * conn_info, msg_t * msg)
+{
+    (void) events_poll;
+    (void) conn_info;
+
+    int ack_code = msg->ack_code;
+    if (ack_code == 200) {
+        // log_info("migration finished! step down!");
+        msg->ack_code = 200;
+        migstate_set(S_MIGRATED);
+
+        sleep(1);
+        exit(0);  // 子进程会由 init 进程回收
+        return 0; // 避免编译警告
+    } else {
+        log_error("migration failed!");
+        return -1;
+    }
+}
+
+static int handle_common4(
+    events_poll_t *events_poll, conn_info_t *conn_info, msg_t *msg)
+{
+    if (msg->command == CMD_MIGRATION_START_REQ) {
+        return handle_migration_start(events_poll, conn_info, msg);
+    } else if (msg->command == CMD_MIGRATION_FINISHED_REQ) {
+        return handle_migration_finished(events_poll, conn_info, msg);
+    } else {
+        return 0;
+    }
+}
+
+static int backup_start_update(
+    events_poll_t *e, conn_info_t *c, msg_t *m)
+{
+    char oldpath[MAX_NAME_LEN+1];
+    char bakpath[MAX_NAME_LEN+1];
+    char clipath[MAX_PATH_LEN];
+    int rslen = m->length;
+    int rc;
+
+    task_info_t *dst;
+
+    // 上一次没有完成的上传在缓冲中的数据写入原来的文件
+    close_write_buffer(c);
+    abort_pack_upload(c);
+    c->write_quorum = 0;
+
+    // 原文件移到备份目录，上传完成后再记录新的文件
+    char idxpath[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    get_filepath(idxpath, sizeof(idxpath),
+                 m, (task_info_t *)m->data,
+                 backend_dirs[0]);
+    metaidx_remove(idxpath);
+    metaidx_invalidate(idxpath);
+    hotcache_invalidate(idxpath);
+    fdcache_invalidate(idxpath);
+
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        get_client_root(clipath, backend_dirs[i], m->src_id);
+        dst = (task_info_t *)m->data;
+        get_filepath(oldpath, sizeof(oldpath),
+                     m, dst,
+                     backend_dirs[i]);
+        rc = file_backup_delete(oldpath, bakpath, sizeof(bakpath));
+        //if (rc == 0) {
+            rc = create_one_backend_fd(c, m, i, 0);
+            if (rc == 0) {
+                cut_mount_path(bakpath, clipath);
+                snprintf(dst->file_name, sizeof(dst->file_name),
+                         "%s", bakpath);
+                m->ack_code = 200;
+                m->length = sizeof(msg_t) + sizeof(task_info_t);
+                rslen = m->length;
+            } else {
+                log_error("create_one_backend_fd failed");
+                goto failed;
+            }
+        //} else {
+        //    log_error("file_backup_delete failed: oldpath %s", oldpath);
+        //    goto failed;
+        //}
+    }
+    return send_response_message(e, c, m, rslen);
+
+failed:
+    m->ack_code = 404;
+    m->length = sizeof(msg_t);
+    return send_response_message(e, c, m, sizeof(msg_t));
+}
+
+/*
+ * 在一个后端目录上执行备份操作，在任务队列的执行线程中调用
+ */
+static int backup_one_dir(msg_t *m, int i, int *rslen)
+{
+    char oldpath[MAX_NAME_LEN+1];
+    char newpath[MAX_NAME_LEN+1];
+    char bakpath[MAX_NAME_LEN+1];
+    char clipath[MAX_PATH_LEN];
+    int rc;
+
+    task_info_t *src, *dst;
+
+    get_client_root(clipath, backend_dirs[i], m->src_id);
+    switch (m->command) {
+    case CMD_BK_DELETE_REQ:
+    case CMD_BK_DIR_DELETE_REQ:
+        dst = (task_info_t *)m->data;
+        get_filepath(oldpath, sizeof(oldpath),
+                     m, dst,
+                     backend_dirs[i]);
+        rc = file_backup_delete(oldpath, bakpath, sizeof(bakpath));
+        //if (rc == 0) {
+            cut_mount_path(bakpath, clipath);
+            snprintf(dst->file_name, sizeof(dst->file_name),
+                     "%s", bakpath);
+            m->ack_code = 200;
+            m->length = sizeof(msg_t) + sizeof(task_info_t);
+            *rslen = m->length;
+        //} else {
+        //    log_error("file_backup_delete failed: oldpath %s", oldpath);
+        //    return -1;
+        //}
+        break;
+    case CMD_BK_FILE_CRUSH_REQ:
+        get_filepath(oldpath, sizeof(oldpath),
+                     m, (task_info_t *)m->data,
+                     backend_dirs[i]);
+        rc = file_backup_crush(oldpath, CRUSH_FILE | CRUSH_BACK);
+        if (rc == 0) {
+            /* 文件粉碎成功 */
+            m->ack_code = 200;
+            m->length = sizeof(msg_t);
+            *rslen = sizeof(msg_t);
+        } else {
+            log_error("file_backup_crush failed: oldpath %s", oldpath);
+            return -1;
+        }
+        break;
+    case CMD_BK_RENAME_REQ:
+        src = (task_info_t *)m->data;
+        dst = src + 1;
+        get_filepath(oldpath, sizeof(oldpath),
+                     m, src,
+                     backend_dirs[i]);
+        get_filepath(newpath, sizeof(newpath),
+                     m, dst,
+                     backend_dirs[i]);
+        struct pack_extent x;
+        if (access(oldpath, F_OK) != 0 && pack_lookup(oldpath, &x) == 0) {
+            /* 打包存放的文件没有自己的 inode，不能重命名 */
+            log_error("rename packed file %s is not supported", oldpath);
+            return -1;
+        }
+        rc = file_backup_copy(oldpath, bakpath, sizeof(bakpath));
+        if (rc == 0) {
+            char dstpath[MAX_PATH_LEN];
+            set_rename_path(dstpath, oldpath, newpath, bakpath);
+            cut_mount_path(dstpath, clipath);
+            sprintf(bakpath, "%s", dstpath);
+        } else {
+            log_error("file_backup_copy failed: filepath %s", oldpath);
+            return -1;
+        }
+        rc = file_backup_rename(oldpath, newpath,
+                                BK_RENAME_FILE | BK_RENAME_BACK);
+        if (rc == 0) {
+            m->ack_code = 200;
+            m->length = sizeof(msg_t) + sizeof(task_info_t);
+            *rslen = sizeof(msg_t) + sizeof(task_info_t);
+            snprintf(src->file_name, sizeof(src->file_name), "%s", bakpath);
+        } else {
+            log_error("file_backup_rename failed: oldpath %s, newpath %s",
+                      oldpath, newpath);
+            return -1;
+        }
+        break;
+    case CMD_BK_DIR_RENAME_REQ:
+        src = (task_info_t *)m->data;
+        dst = src + 1;
+        get_filepath(oldpath, sizeof(oldpath),
+                     m, src,
+                     backend_dirs[i]);
+        get_filepath(newpath, sizeof(newpath),
+                     m, dst,
+                     backend_dirs[i]);
+        rc = dir_backup_rename(oldpath, newpath);
+        if (rc == 0) {
+            m->ack_code = 200;
+            m->length = sizeof(msg_t) + sizeof(task_info_t);
+            *rslen = m->length;
+        } else {
+            log_error("dir_backup_rename failed: oldpath %s, newpath %s",
+                      oldpath, newpath);
+            return -1;
+        }
+        break;
+    default:
+        log_error("unknown command 0x%x", m->command);
+        return -1;
+        break;
+    }
+    return 0;
+}
+
+// 后台执行的备份操作
+struct bkjob {
+    int async;      // 客户端不等待任务完成，只查询任务状态
+    int rslen;      // 响应消息的长度
+    msg_t msg;      // 请求消息，执行完毕后就是响应消息
+};
 
-    int ack_code = msg->ack_code;
-    if (ack_code == 200) {
-        // log_info("migration finished! step down!");
-        msg->ack_code = 200;
-        migstate_set(S_MIGRATED);
+#define BKJOB_MSG_SIZE (JOB_DATA_SIZE - offsetof(struct bkjob, msg))
 
-        sleep(1);
-        exit(0);  // 子进程会由 init 进程回收
-        return 0; // 避免编译警告
+/*
+ * 备份操作完成后更新元数据索引。备份操作在目录中产生或者移走了备份文件，所在
+ * 的目录需要重新遍历才能列出；操作失败时不知道做到了哪一步，索引中也删除原文
+ * 件和目标文件
+ */
+static void index_backup_operation(int command, const char *oldpath,
+                                   const char *newpath, int ok)
+{
+    int renamed = command == CMD_BK_RENAME_REQ || command == CMD_BK_DIR_RENAME_REQ;
+    if (ok && renamed) {
+        metaidx_rename(oldpath, newpath);
     } else {
-        log_error("migration failed!");
-        return -1;
+        metaidx_remove(oldpath);
+    }
+    metaidx_invalidate(oldpath);
+    hotcache_invalidate(oldpath);
+    if (renamed) {
+        if (!ok) {
+            metaidx_remove(newpath);
+        }
+        metaidx_invalidate(newpath);
+        hotcache_invalidate(newpath);
     }
+    // 重命名的目录中的文件仍然是原来的 inode，按路径缓存的描述符都要丢弃
+    fdcache_invalidate_all();
 }
 
-static int handle_common4(
-    events_poll_t *events_poll, conn_info_t *conn_info, msg_t *msg)
+static int run_backup_job(struct job *j)
 {
-    if (msg->command == CMD_MIGRATION_START_REQ) {
-        return handle_migration_start(events_poll, conn_info, msg);
-    } else if (msg->command == CMD_MIGRATION_FINISHED_REQ) {
-        return handle_migration_finished(events_poll, conn_info, msg);
+    struct bkjob *b = (struct bkjob *)j->data;
+    msg_t *m = &b->msg;
+
+    // 执行时消息中的文件名会被替换为备份文件名，先取得索引中的路径
+    char oldpath[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    char newpath[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    task_info_t *src = (task_info_t *)m->data;
+    get_filepath(oldpath, sizeof(oldpath), m, src, backend_dirs[0]);
+    if (m->command == CMD_BK_RENAME_REQ || m->command == CMD_BK_DIR_RENAME_REQ) {
+        get_filepath(newpath, sizeof(newpath), m, src + 1, backend_dirs[0]);
     } else {
-        return 0;
+        newpath[0] = '\0';
+    }
+
+    b->rslen = m->length;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        if (backup_one_dir(m, i, &b->rslen) < 0) {
+            index_backup_operation(m->command, oldpath, newpath, 0);
+            m->ack_code = 404;
+            m->length = sizeof(msg_t);
+            b->rslen = sizeof(msg_t);
+            j->result = 404;
+            return -1;
+        } else {
+            set_job_progress(j, i + 1);
+        }
+    }
+    index_backup_operation(m->command, oldpath, newpath, 1);
+    j->result = m->ack_code;
+    return 0;
+}
+
+static void finish_backup_job(events_poll_t *e, struct job *j)
+{
+    struct bkjob *b = (struct bkjob *)j->data;
+    if (b->async) {
+        // 已经回复了任务号，客户端通过任务号查询结果
+        return;
+    }
+
+    conn_info_t *c = &conns_info[j->sock_fd];
+    if (c->sock_fd != j->sock_fd || c->generation != j->generation ||
+        c->thread_id != get_thread_id()) {
+        log_warning("drop result of job %lu: sock_fd:%d already closed",
+                    j->id, j->sock_fd);
+        return;
+    }
+
+    c->pending_jobs = c->pending_jobs - 1;
+    touch_conn(c);
+    if (send_response_message(e, c, &b->msg, b->rslen) < 0) {
+        close_tcp_conn(e, c->sock_fd);
+    } else {
+        // 响应已经放入发送缓冲区
     }
 }
 
+/*
+ * 文件粉碎、重命名、删除可能耗时很长，交给任务队列执行，工作者线程不等待。
+ *
+ * 请求的 ack_code 为 202 时，立即回复 ack_code 202，total 是任务号，之后客户
+ * 端用 CMD_BK_JOB_STATUS_REQ 查询任务状态；否则任务完成后回复原来的响应。
+ */
 static int backup_operation(
     events_poll_t *e, conn_info_t *c, msg_t *m)
 {
     assert(backend_cnt > 0);
 
-    char oldpath[MAX_NAME_LEN+1];
-    char newpath[MAX_NAME_LEN+1];
-    char bakpath[MAX_NAME_LEN+1];
-    char clipath[MAX_PATH_LEN];
-    int rslen = m->length;
-    int rc;
-
-    task_info_t *src, *dst;
+    if (m->command == CMD_BK_START_UPDATE_REQ) {
+        // 需要在连接上打开后端文件，直接执行
+        return backup_start_update(e, c, m);
+    }
 
-    int i;
-    for (i = 0; i < backend_cnt; i++) {
-        get_client_root(clipath, backend_dirs[i], m->src_id);
-        switch (m->command) {
-        case CMD_BK_START_UPDATE_REQ:
-            dst = (task_info_t *)m->data;
-            get_filepath(oldpath, sizeof(oldpath),
-                         m, dst,
-                         backend_dirs[i]);
-            rc = file_backup_delete(oldpath, bakpath, sizeof(bakpath));
-            //if (rc == 0) {
-                rc = create_one_backend_fd(c, m, i);
-                if (rc == 0) {
-                    cut_mount_path(bakpath, clipath);
-                    snprintf(dst->file_name, sizeof(dst->file_name),
-                             "%s", bakpath);
-                    m->ack_code = 200;
-                    m->length = sizeof(msg_t) + sizeof(task_info_t);
-                    rslen = m->length;
-                } else {
-                    log_error("create_one_backend_fd failed");
-                    goto failed;
-                }
-            //} else {
-            //    log_error("file_backup_delete failed: oldpath %s", oldpath);
-            //    goto failed;
-            //}
-            break;
-        case CMD_BK_DELETE_REQ:
-        case CMD_BK_DIR_DELETE_REQ:
-            dst = (task_info_t *)m->data;
-            get_filepath(oldpath, sizeof(oldpath),
-                         m, dst,
-                         backend_dirs[i]);
-            rc = file_backup_delete(oldpath, bakpath, sizeof(bakpath));
-            //if (rc == 0) {
-                cut_mount_path(bakpath, clipath);
-                snprintf(dst->file_name, sizeof(dst->file_name),
-                         "%s", bakpath);
-                m->ack_code = 200;
-                m->length = sizeof(msg_t) + sizeof(task_info_t);
-                rslen = m->length;
-            //} else {
-            //    log_error("file_backup_delete failed: oldpath %s", oldpath);
-            //    goto failed;
-            //}
-            break;
-        case CMD_BK_FILE_CRUSH_REQ:
-            get_filepath(oldpath, sizeof(oldpath),
-                         m, (task_info_t *)m->data,
-                         backend_dirs[i]);
-            rc = file_backup_crush(oldpath, CRUSH_FILE | CRUSH_BACK);
-            if (rc == 0) {
-                /* 文件粉碎成功 */
-                m->ack_code = 200;
-                m->length = sizeof(msg_t);
-                rslen = sizeof(msg_t);
-            } else {
-                log_error("file_backup_crush failed: oldpath %s", oldpath);
-                goto failed;
-            }
-            break;
-        case CMD_BK_RENAME_REQ:
-            src = (task_info_t *)m->data;
-            dst = src + 1;
-            get_filepath(oldpath, sizeof(oldpath),
-                         m, src,
-                         backend_dirs[i]);
-            get_filepath(newpath, sizeof(newpath),
-                         m, dst,
-                         backend_dirs[i]);
-            rc = file_backup_copy(oldpath, bakpath, sizeof(bakpath));
-            if (rc == 0) {
-                char dstpath[MAX_PATH_LEN];
-                set_rename_path(dstpath, oldpath, newpath, bakpath);
-                cut_mount_path(dstpath, clipath);
-                sprintf(bakpath, "%s", dstpath);
-            } else {
-                log_error("file_backup_copy failed: filepath %s", oldpath);
-                goto failed;
-            }
-            rc = file_backup_rename(oldpath, newpath,
-                                    BK_RENAME_FILE | BK_RENAME_BACK);
-            if (rc == 0) {
-                m->ack_code = 200;
-                m->length = sizeof(msg_t) + sizeof(task_info_t);
-                rslen = sizeof(msg_t) + sizeof(task_info_t);
-                snprintf(src->file_name, sizeof(src->file_name), "%s", bakpath);
-            } else {
-                log_error("file_backup_rename failed: oldpath %s, newpath %s",
-                          oldpath, newpath);
-                goto failed;
-            }
-            break;
-        case CMD_BK_DIR_RENAME_REQ:
-            src = (task_info_t *)m->data;
-            dst = src + 1;
-            get_filepath(oldpath, sizeof(oldpath),
-                         m, src,
-                         backend_dirs[i]);
-            get_filepath(newpath, sizeof(newpath),
-                         m, dst,
-                         backend_dirs[i]);
-            rc = dir_backup_rename(oldpath, newpath);
-            if (rc == 0) {
-                m->ack_code = 200;
-                m->length = sizeof(msg_t) + sizeof(task_info_t);
-                rslen = m->length;
-            } else {
-                log_error("dir_backup_rename failed: oldpath %s, newpath %s",
-                          oldpath, newpath);
-                goto failed;
-            }
-            break;
-        default:
-            log_error("unknown command 0x%x", m->command);
-            goto failed;
-            break;
+    struct job *j = NULL;
+    if (m->length > BKJOB_MSG_SIZE) {
+        log_error("%s: message too long: %u bytes",
+                  command_string(m->command), m->length);
+        m->ack_code = 404;
+    } else if ((j = alloc_job()) == NULL) {
+        // 任务太多，让客户端稍后重试
+        m->ack_code = 503;
+    } else {
+        struct bkjob *b = (struct bkjob *)j->data;
+        memcpy(&b->msg, m, m->length);
+        b->async = (m->ack_code == 202);
+        j->sock_fd = c->sock_fd;
+        j->generation = c->generation;
+        j->total_steps = backend_cnt;
+        j->run = run_backup_job;
+        j->done = finish_backup_job;
+        uint64_t id = submit_job(j);
+        if (b->async) {
+            m->ack_code = 202;
+            m->total = id;
+        } else {
+            c->pending_jobs = c->pending_jobs + 1;
+            return 0;
         }
     }
-    return send_response_message(e, c, m, rslen);
+    m->length = sizeof(msg_t);
+    return send_response_message(e, c, m, sizeof(msg_t));
+}
 
-failed:
-    m->ack_code = 404;
+/*
+ * 查询后台任务的状态。ack_code 为 200 表示执行成功，202 表示还在排队或执行，
+ * 404 表示执行失败或者任务不存在。offset 和 count 是已经完成的步骤和总的步骤
+ */
+static int handle_job_status_request(
+    events_poll_t *e, conn_info_t *c, msg_t *m)
+{
+    struct job_status st;
+    get_job_status(m->total, &st);
+    if (st.state == JOB_DONE) {
+        m->ack_code = 200;
+    } else if (st.state == JOB_QUEUED || st.state == JOB_RUNNING) {
+        m->ack_code = 202;
+    } else {
+        m->ack_code = 404;
+    }
+    m->offset = st.done_steps;
+    m->count = st.total_steps;
     m->length = sizeof(msg_t);
     return send_response_message(e, c, m, sizeof(msg_t));
 }
@@ -2256,9 +3393,15 @@ int deal_client_message(events_poll_t *events_poll,
     case CMD_GET_FILE_LIST_REQ:
         return handle_get_file_list_request(events_poll, conn_info, msg);
         break;
+    case CMD_GET_FILE_LIST_STREAM_REQ:
+        return handle_get_file_list_stream_request(events_poll, conn_info, msg);
+        break;
     case CMD_SEQ_DOWNLOAD_REQ:
         return handle_seq_download_request(events_poll, conn_info, msg);
         break;
+    case CMD_BATCH_DOWNLOAD_REQ:
+        return handle_batch_download_request(events_poll, conn_info, msg);
+        break;
     case CMD_BK_START_UPDATE_REQ:
     case CMD_BK_DELETE_REQ:
     case CMD_BK_FILE_CRUSH_REQ:
@@ -2267,6 +3410,9 @@ int deal_client_message(events_poll_t *events_poll,
     case CMD_BK_DIR_RENAME_REQ:
         return backup_operation(events_poll, conn_info, msg);
         break;
+    case CMD_BK_JOB_STATUS_REQ:
+        return handle_job_status_request(events_poll, conn_info, msg);
+        break;
     default:
         log_warning("recv command:0x%08X from client{%s:%d} ",
                     msg->command, conn_info->peer_ip, conn_info->peer_port);
@@ -2344,6 +3490,12 @@ void * worker_thread(void * argv)
 	}
     log_info("add_to_events_poll success");
 
+    if (attach_jobq(&events_polls[thread_id], thread_id) < 0) {
+        log_crit("attach thread:%d to job queue fail, exit!!!", thread_id);
+        return NULL;
+    }
+    log_info("attach_jobq success");
+
     run_events_loop(thread_id);
     return NULL;
 }
@@ -2475,7 +3627,7 @@ static void signal_init_daemon(void)
 
 static int global_init(int argc, char ** argv)
 {
-    char * option = (char *)"r:s:g:l:c:a:b:w:p:d";
+    char * option = (char *)"r:s:g:l:c:a:b:w:p:o:d";
     int result = 0;
     int noerror = 1;
     int rc;
@@ -2525,6 +3677,11 @@ static int global_init(int argc, char ** argv)
         } else if (result == 'p') {
             snprintf(log_file, MAX_NAME_LEN, "%s", optarg);
             is_specified_log_file = 1;
+        } else if (result == 'o') {
+            rc = set_tunables(optarg);
+            if (rc == -1) {
+                noerror = 0;
+            }
         } else {
             printf("invalid option: %c\n", result);
             return -1;
@@ -2545,26 +3702,49 @@ struct asm_hb {
     uint8_t body[0];
 };
 
+// 上传完成的文件统计，extents / files 反映预分配对碎片的影响
+static int upload_stats_json(char *buf, int len)
+{
+    int n = snprintf(buf, len, "{\"files\": %lu, \"bytes\": %lu, \"extents\": %lu}",
+                     upload_stats.files, upload_stats.bytes, upload_stats.extents);
+    return n < len ? n : len - 1;
+}
+
 static int setup_asm_hb(uint8_t *buffer, int buflen, conn_info_t * conn_info)
 {
     (void) conn_info;
 
     struct asm_hb *m = (struct asm_hb *)buffer;
     m->command = htonl(0x00080001);
+    char backends[2048];
+    behealth_json(backends, sizeof(backends));
+    char catchup[256];
+    catchup_json(catchup, sizeof(catchup));
+    char hotcache[512];
+    hotcache_json(hotcache, sizeof(hotcache));
+    char timeouts[128];
+    conn_timeouts_json(timeouts, sizeof(timeouts));
+    char copies[512];
+    copy_stats_json(copies, sizeof(copies));
+    char uploads[128];
+    upload_stats_json(uploads, sizeof(uploads));
     int bodylen = snprintf(
         (char *)&m->body[0], buflen-sizeof(struct asm_hb),
         "{\"region_id\": %u, \"system_id\": %u, "
         "\"group_id\": %u, \"conn_state\": %lu, \"conn_dealed\": %lu, "
-        "\"connect_ip\": \"%s\", \"connect_port\": %u}",
+        "\"connect_ip\": \"%s\", \"connect_port\": %u, "
+        "\"backends\": %s, \"catchup\": %s, \"hotcache\": %s, "
+        "\"timeouts\": %s, \"copies\": %s, \"uploads\": %s}",
         region_id, system_id, group_id, connections, accepts,
-        connect_ip, connect_port);
+        connect_ip, connect_port, backends, catchup, hotcache, timeouts, copies,
+        uploads);
     m->totallen = htonl(8 + bodylen);
     return sizeof(struct asm_hb) + bodylen;
 }
 
 static int send_hb_to_asm(conn_info_t * c)
 {
-    uint8_t buffer[1024];
+    uint8_t buffer[8192];
     memset(buffer, 0, sizeof(buffer));
 
     int bufflen = setup_asm_hb(buffer, sizeof(buffer), c);
@@ -2665,6 +3845,81 @@ static int asm_init_timer(void)
     }
 }
 
+static int on_behealth_timer(void * timer)
+{
+    (void) timer;
+    behealth_probe();
+    return 0;
+}
+
+static volatile int resume_gc_running = 0;
+
+static int run_resume_gc(struct job *j)
+{
+    (void) j;
+    int n = resume_gc();
+    if (n > 0) {
+        log_info("remove %d expired interrupted uploads", n);
+    }
+    resume_gc_running = 0;
+    return 0;
+}
+
+// 在任务队列中清理过期的续传记录，上一次还没有完成时跳过
+static int on_resume_timer(void * timer)
+{
+    (void) timer;
+    if (upload_resume_ttl <= 0 || resume_gc_running) {
+        return 0;
+    }
+    struct job *j = alloc_job();
+    if (j == NULL) {
+        return 0;
+    }
+    j->run = run_resume_gc;
+    j->done = NULL;
+    resume_gc_running = 1;
+    submit_job(j);
+    return 0;
+}
+
+static int resume_init_timer(void)
+{
+    user_timer_t t;
+    memset(&t, 0, sizeof(user_timer_t));
+    t.loop_cnt = 0xFFFFFFFF;
+    t.hold_time = RESUME_GC_INTERVAL * 1000;
+    t.call_back = on_resume_timer;
+    t.pv_param1 = t.pv_param2 = t.pv_param3 = t.pv_param4 = t.pv_param5 = NULL;
+    int timer_id = create_one_timer(timer_sets[0], &t);
+    if (timer_id > 0) {
+        log_info("> create timer %d for upload resume success", timer_id);
+        return 0;
+    } else {
+        log_crit("create upload resume timer failed");
+        return -1;
+    }
+}
+
+// 每秒检查一次隔离的后端是否需要探测
+static int behealth_init_timer(void)
+{
+    user_timer_t t;
+    memset(&t, 0, sizeof(user_timer_t));
+    t.loop_cnt = 0xFFFFFFFF;
+    t.hold_time = 1000; // 1s
+    t.call_back = on_behealth_timer;
+    t.pv_param1 = t.pv_param2 = t.pv_param3 = t.pv_param4 = t.pv_param5 = NULL;
+    int timer_id = create_one_timer(timer_sets[0], &t);
+    if (timer_id > 0) {
+        log_info("> create timer %d for backend health success", timer_id);
+        return 0;
+    } else {
+        log_crit("create backend health timer failed");
+        return -1;
+    }
+}
+
 static int asm_init(void)
 {
     return asm_init_timer();
@@ -2690,6 +3945,8 @@ static void usage(const char *progname)
     printf("      -a : asm server address \r\n");
     printf("      -b : back_end dirs list \r\n");
     printf("      -w : workers count \r\n");
+    printf("      -o : tunables, key=value[,key=value...] \r\n");
+    print_tunables();
     printf("      -d : daemon \r\n\r\n");
 }
 
@@ -2758,6 +4015,7 @@ static void init1(char *progpath)
         exit(EXIT_FAILURE);
     } else {
         log_info("-------- Storage Gateway start (version %s) --------", VERSION);
+        log_tunables();
     }
 }
 
@@ -2800,17 +4058,108 @@ static void init2(void)
     log_info("init_tcp_server success");
 }
 
+static int run_rebuild_job(struct job *j)
+{
+    const char *dirpath = j->data;
+    int n = bkindex_rebuild_tree(dirpath);
+    if (n >= 0) {
+        log_info("rebuild %d backup indexes under %s", n, dirpath);
+        return 0;
+    } else {
+        log_error("rebuild backup indexes under %s failed", dirpath);
+        return -1;
+    }
+}
+
+// 在任务队列中重建所有后端目录的备份索引，不影响启动
+static void rebuild_backup_indexes(void)
+{
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct job *j = alloc_job();
+        if (j == NULL) {
+            log_error("rebuild backup indexes under %s failed", backend_dirs[i]);
+            continue;
+        }
+        snprintf(j->data, sizeof(j->data), "%s", backend_dirs[i]);
+        j->run = run_rebuild_job;
+        j->done = NULL;
+        submit_job(j);
+    }
+}
+
+#define NOFILE_LIMIT_MAX    (1024 * 1024)
+#define NOFILE_LIMIT_SPARE  1024    // 包、条带读取和补齐等使用的高位描述符
+
+/*
+ * 连接只使用 MAX_CONNS_CNT 以下的描述符，目录缓存、描述符缓存、包和条带读取的
+ * 描述符都移到 MAX_CONNS_CNT 以上，移不上去时不缓存。默认的软限制 1024 只留下
+ * 24 个，启动时把软限制提高到硬限制
+ */
+static void raise_nofile_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        log_warning("getrlimit RLIMIT_NOFILE failed: %s", strerror(errno));
+        return;
+    }
+    rlim_t want = rl.rlim_max;
+    if (want == RLIM_INFINITY || want > NOFILE_LIMIT_MAX) {
+        want = NOFILE_LIMIT_MAX;
+    }
+    if (rl.rlim_cur < want) {
+        rl.rlim_cur = want;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+            log_warning("raise RLIMIT_NOFILE to %llu failed: %s",
+                        (unsigned long long)want, strerror(errno));
+            (void) getrlimit(RLIMIT_NOFILE, &rl);
+        }
+    } else {
+        // 软限制已经足够
+    }
+
+    // 每个工作者线程的目录缓存和描述符缓存，再给包和条带读取留一些
+    unsigned long long need = MAX_CONNS_CNT +
+        (unsigned long long)(dircache_size + fdcache_size) * workers +
+        NOFILE_LIMIT_SPARE;
+    log_info("RLIMIT_NOFILE %llu, %llu wanted", (unsigned long long)rl.rlim_cur, need);
+    if (rl.rlim_cur < need) {
+        log_warning("RLIMIT_NOFILE %llu is too low, cached descriptors "
+                    "will fall back to uncached", (unsigned long long)rl.rlim_cur);
+    }
+}
+
 static void init3(void)
 {
     migstate_init();
+    init_behealth();
+    if (init_hotcache() < 0) {
+        printf("init hot file cache fail \r\n");
+        log_crit("init hot file cache fail ");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+
+    if (metaidx_enabled) {
+        if (init_metaidx() < 0) {
+            printf("open metadata index fail \r\n");
+            log_crit("open metadata index fail ");
+            sleep(1);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        drop_metaidx();
+    }
 
     if (workers < 4) {
         workers = 4;
-    } else if (workers > MAX_WORKERS) {
-        workers = MAX_WORKERS;
+    } else if (workers > MAX_WORKERS - jobq_threads - MAX_BACK_END - stripe_threads - 1) {
+        // 任务执行线程、同步线程、条带读取线程和补齐线程的线程号排在工作者线程之后
+        workers = MAX_WORKERS - jobq_threads - MAX_BACK_END - stripe_threads - 1;
     } else {
         // workers remains
     }
+    raise_nofile_limit();
 
     int i;
     for (i = 1; i <= workers; i++) {
@@ -2825,6 +4174,66 @@ static void init3(void)
         }
         log_info("worker%d: create success", i);
     }
+
+    if (init_jobq(jobq_threads, workers + 1) < 0) {
+        printf("create job threads fail \r\n");
+        log_crit("create job threads fail ");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+    log_info("init_jobq success: %d threads", (int)jobq_threads);
+
+    if (upload_durability == DURABILITY_GROUP) {
+        if (init_group_commit(workers + jobq_threads + 1) < 0) {
+            printf("create sync threads fail \r\n");
+            log_crit("create sync threads fail ");
+            sleep(1);
+            exit(EXIT_FAILURE);
+        }
+        log_info("init_group_commit success: %d threads", backend_cnt);
+    } else {
+        // 不需要同步线程
+    }
+
+    if (stripe_threshold > 0 || readahead_depth > 0) {
+        if (init_stripe_pool(stripe_threads,
+                             workers + jobq_threads + MAX_BACK_END + 1) < 0) {
+            printf("create stripe threads fail \r\n");
+            log_crit("create stripe threads fail ");
+            sleep(1);
+            exit(EXIT_FAILURE);
+        }
+        log_info("init_stripe_pool success: %d threads", (int)stripe_threads);
+    } else {
+        // 不使用条带读取和预读
+    }
+
+    // 以前没有完成的补齐在 write_quorum 为 0 时也要继续
+    if (init_catchup(workers + jobq_threads + MAX_BACK_END + stripe_threads + 1) < 0) {
+        printf("create catchup thread fail \r\n");
+        log_crit("create catchup thread fail ");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+    log_info("init_catchup success");
+
+    if (behealth_init_timer() < 0) {
+        printf("create backend health timer fail \r\n");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+
+    if (resume_init_timer() < 0) {
+        printf("create upload resume timer fail \r\n");
+        sleep(1);
+        exit(EXIT_FAILURE);
+    }
+
+    if (bkindex_rebuild_all) {
+        rebuild_backup_indexes();
+    } else {
+        // 索引不存在时，查找备份时再重建
+    }
 }
 
 static void init4(void)
@@ -2847,25 +4256,56 @@ void init_or_die(int argc, char **argv)
     init4();
 }
 
+// 根据定时器集合中最近到期的定时器计算 epoll_wait() 的等待时间，没有定时器
+// 到期时线程一直睡眠，醒来后一次性补上经过的节拍
+static int get_events_wait_time(timer_set_t *ts, uint64_t curr, uint64_t next)
+{
+    uint32_t ticks = get_timer_set_idle_ticks(ts);
+    if (ticks == TIMER_SET_NO_EXPIRY) {
+        return -1;
+    } else {
+        uint64_t expire = next + (uint64_t)(ticks - 1) * MS_PER_TICK;
+        if (expire <= curr) {
+            return 0;
+        } else if (expire - curr > INT_MAX) {
+            return INT_MAX;
+        } else {
+            return (int)(expire - curr);
+        }
+    }
+}
+
 void run_events_loop(int thread_id)
 {
+    timer_set_t *ts = timer_sets[thread_id];
     uint64_t curr = get_curr_time();
-    uint64_t next = curr + MS_PER_TICK;
+    uint64_t next = curr + MS_PER_TICK; // 下一个节拍的时间
     while (1) {
         // 处理监听事件
-        run_events_poll(&events_polls[thread_id], MS_PER_TICK);
+        int wait_time = get_events_wait_time(ts, curr, next);
+        run_events_poll(&events_polls[thread_id], wait_time);
 
         // 定时器任务
         // 可以处理时间往回跳变的情况
+        uint64_t last = curr;
         curr = get_curr_time();
-        if (next - 2*MS_PER_TICK <= curr && curr <= next + 2*MS_PER_TICK) {
-            while (next < curr) {
-                next = next + MS_PER_TICK;
-                run_timer_set(timer_sets[thread_id]);
+        if (curr < next) {
+            if (curr + 2*MS_PER_TICK < last) {
+                // 时间往回跳变
+                next = curr + MS_PER_TICK;
+                run_timer_set(ts);
+            } else {
+                // 节拍还没到，不用处理定时器
             }
-        } else {
+        } else if (wait_time >= 0 &&
+                   curr > last + (uint64_t)wait_time + 2*MS_PER_TICK) {
+            // 时间往前跳变
             next = curr + MS_PER_TICK;
-            run_timer_set(timer_sets[thread_id]);
+            run_timer_set(ts);
+        } else {
+            uint64_t ticks = (curr - next) / MS_PER_TICK + 1;
+            next = next + ticks * MS_PER_TICK;
+            run_timer_set_ticks(ts, ticks);
         }
     }
 }
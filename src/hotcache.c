@@ -0,0 +1,538 @@
+
+// hotcache.c
+
+#include <sys/mman.h>
+
+#include "mt_log.h"
+#include "public.h"
+#include "tunables.h"
+#include "pack.h"
+#include "hotcache.h"
+
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+extern const char *backend_key(const char *path, int *index);
+
+#define SKETCH_MAX  15      // 计数的上限，和 4 位计数器一样
+
+struct hot_file {
+    int refs;               // 缓存一个，每个正在下载的连接一个
+    int backend;            // 映射的文件所在的后端
+    int packed;
+    int64_t size;
+    int64_t base;           // 打包存放的文件在段文件中的偏移
+    uint8_t *map;           // 文件的内容
+    size_t maplen;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    uint64_t checked;       // 上次检查的时间（毫秒）
+    uint32_t hash;
+    struct hot_file *hnext;
+    struct hot_file *prev;  // LRU 链表，表头是最近使用的
+    struct hot_file *next;
+    char key[0];            // 相对于后端目录的路径，以 '/' 开头
+};
+
+static pthread_mutex_t hot_lock = PTHREAD_MUTEX_INITIALIZER;
+static int hot_enabled = 0;
+static int nbuckets = 0;
+static struct hot_file **buckets = NULL;
+static struct hot_file *lru_head = NULL;
+static struct hot_file *lru_tail = NULL;
+static int nr_files = 0;
+static int64_t nr_bytes = 0;
+
+static uint8_t *sketch = NULL;      // HOTCACHE_SKETCH_ROWS 行计数
+static uint32_t sketch_width = 0;
+static uint64_t samples = 0;
+static uint64_t sample_limit = 0;
+
+static uint64_t nr_hits = 0;
+static uint64_t nr_misses = 0;
+static uint64_t hit_bytes = 0;      // 从缓存回复的字节数
+static uint64_t nr_admitted = 0;
+static uint64_t nr_rejected = 0;    // 访问次数不如要淘汰的文件，没有缓存
+static uint64_t nr_evicted = 0;
+static uint64_t nr_stale = 0;       // 检查时发现文件已经变化
+
+static uint64_t now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000UL + tv.tv_usec / 1000;
+}
+
+static uint32_t hash_key(const char *key)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261U;
+    const char *p;
+    for (p = key; *p != '\0'; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619U;
+    }
+    return h;
+}
+
+// 第 row 行计数器的下标，每行使用不同的散列
+static uint32_t sketch_slot(uint32_t hash, int row)
+{
+    uint32_t h = hash + row * ((hash >> 16 | hash << 16) * 0x9E3779B1U);
+    return row * sketch_width + (h & (sketch_width - 1));
+}
+
+// 调用者持有 hot_lock
+static void sketch_add(uint32_t hash)
+{
+    int row;
+    for (row = 0; row < HOTCACHE_SKETCH_ROWS; row++) {
+        uint8_t *c = &sketch[sketch_slot(hash, row)];
+        if (*c < SKETCH_MAX) {
+            *c = *c + 1;
+        }
+    }
+    samples = samples + 1;
+    if (samples >= sample_limit) {
+        // 所有计数减半，最近的请求比以前的请求更重要
+        uint32_t i;
+        for (i = 0; i < HOTCACHE_SKETCH_ROWS * sketch_width; i++) {
+            sketch[i] = sketch[i] >> 1;
+        }
+        samples = samples / 2;
+    }
+}
+
+// 调用者持有 hot_lock。估计的请求次数是各行计数的最小值
+static int sketch_estimate(uint32_t hash)
+{
+    int freq = SKETCH_MAX;
+    int row;
+    for (row = 0; row < HOTCACHE_SKETCH_ROWS; row++) {
+        int c = sketch[sketch_slot(hash, row)];
+        if (c < freq) {
+            freq = c;
+        }
+    }
+    return freq;
+}
+
+static struct hot_file *lookup(const char *key, uint32_t hash)
+{
+    struct hot_file *e = buckets[hash & (nbuckets - 1)];
+    while (e != NULL && (e->hash != hash || strcmp(e->key, key) != 0)) {
+        e = e->hnext;
+    }
+    return e;
+}
+
+static void lru_unlink(struct hot_file *e)
+{
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        lru_head = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        lru_tail = e->prev;
+    }
+}
+
+static void lru_push(struct hot_file *e)
+{
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->prev = e;
+    } else {
+        lru_tail = e;
+    }
+    lru_head = e;
+}
+
+static void free_hot_file(struct hot_file *e)
+{
+    munmap(e->map, e->maplen);
+    free(e);
+}
+
+// 调用者持有 hot_lock。从缓存中移走，正在下载的连接释放引用后才解除映射
+static void drop_hot_file(struct hot_file *e)
+{
+    struct hot_file **p = &buckets[e->hash & (nbuckets - 1)];
+    while (*p != e) {
+        p = &(*p)->hnext;
+    }
+    *p = e->hnext;
+    lru_unlink(e);
+    nr_files = nr_files - 1;
+    nr_bytes = nr_bytes - e->size;
+    e->refs = e->refs - 1;
+    if (e->refs == 0) {
+        free_hot_file(e);
+    }
+}
+
+// 文件是否已经被修改、替换或者删除。调用者持有 e 的引用，不需要持有 hot_lock，
+// 这里用到的字段在缓存以后不再改变
+static int hot_file_stale(struct hot_file *e)
+{
+    char path[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    snprintf(path, sizeof(path), "%s%s", backend_dirs[e->backend], e->key);
+    if (e->packed) {
+        struct pack_extent x;
+        return pack_lookup(path, &x) != 0 || x.offset != e->base || x.len != e->size;
+    }
+    struct stat st;
+    return stat(path, &st) != 0 || st.st_size != e->size ||
+        st.st_dev != e->dev || st.st_ino != e->ino ||
+        st.st_mtim.tv_sec != e->mtime.tv_sec ||
+        st.st_mtim.tv_nsec != e->mtime.tv_nsec;
+}
+
+int init_hotcache(void)
+{
+    if (hotcache_bytes == 0) {
+        return 0;
+    }
+
+    nbuckets = 1;
+    while (nbuckets < hotcache_files * 2) {
+        nbuckets = nbuckets * 2;
+    }
+    sketch_width = 1024;
+    while (sketch_width < hotcache_files * 2) {
+        sketch_width = sketch_width * 2;
+    }
+    buckets = calloc(nbuckets, sizeof(struct hot_file *));
+    sketch = calloc(HOTCACHE_SKETCH_ROWS, sketch_width);
+    if (buckets == NULL || sketch == NULL) {
+        log_error("malloc hot file cache failed");
+        free(buckets);
+        free(sketch);
+        buckets = NULL;
+        sketch = NULL;
+        return -1;
+    }
+    sample_limit = HOTCACHE_SAMPLE_FACTOR * hotcache_files;
+    hot_enabled = 1;
+    return 0;
+}
+
+struct hot_file *hotcache_get(const char *path)
+{
+    int b;
+    const char *key;
+    if (!hot_enabled || (key = backend_key(path, &b)) == NULL) {
+        return NULL;
+    }
+    uint32_t hash = hash_key(key);
+
+    pthread_mutex_lock(&hot_lock);
+    sketch_add(hash);
+    struct hot_file *e = lookup(key, hash);
+    uint64_t now = now_ms();
+    if (e != NULL && now - e->checked >= (uint64_t)hotcache_check_ms) {
+        // stat() 可能很慢，不持有 hot_lock。先取得引用，检查期间不会被释放；
+        // 更新检查时间，其他连接不再重复检查
+        e->checked = now;
+        e->refs = e->refs + 1;
+        pthread_mutex_unlock(&hot_lock);
+        int stale = hot_file_stale(e);
+        pthread_mutex_lock(&hot_lock);
+        e->refs = e->refs - 1;
+        if (stale) {
+            log_debug("hot file %s changed", e->key);
+            if (lookup(key, hash) == e) {
+                drop_hot_file(e);
+                nr_stale = nr_stale + 1;
+            } else if (e->refs == 0) {
+                // 检查期间已经被淘汰，最后一个引用
+                free_hot_file(e);
+            } else {
+                // 检查期间已经被淘汰，正在下载的连接释放引用
+            }
+            e = NULL;
+        } else if (lookup(key, hash) != e) {
+            // 检查期间已经被淘汰或者替换，重新查找
+            if (e->refs == 0) {
+                free_hot_file(e);
+            }
+            e = lookup(key, hash);
+        } else {
+            // 没有变化，继续使用
+        }
+    }
+    if (e != NULL) {
+        lru_unlink(e);
+        lru_push(e);
+        e->refs = e->refs + 1;
+        nr_hits = nr_hits + 1;
+    } else {
+        nr_misses = nr_misses + 1;
+    }
+    pthread_mutex_unlock(&hot_lock);
+    return e;
+}
+
+// 调用者持有 hot_lock。腾出 size 字节的空间，LRU 末尾的文件比新文件更常用时拒绝
+static int admit_test(uint32_t hash, int64_t size)
+{
+    int freq = sketch_estimate(hash);
+    int files = nr_files;
+    int64_t bytes = nr_bytes;
+    struct hot_file *v = lru_tail;
+    while (v != NULL && (files + 1 > hotcache_files || bytes + size > hotcache_bytes)) {
+        if (sketch_estimate(v->hash) >= freq) {
+            return -1;
+        }
+        files = files - 1;
+        bytes = bytes - v->size;
+        v = v->prev;
+    }
+    return 0;
+}
+
+void hotcache_admit(const char *path, int index, int fd, int64_t base,
+                    int64_t size, int packed)
+{
+    const char *key;
+    int b;
+    if (!hot_enabled || size <= 0 || size > hotcache_file_max ||
+        size > hotcache_bytes || (key = backend_key(path, &b)) == NULL) {
+        return;
+    }
+    uint32_t hash = hash_key(key);
+
+    pthread_mutex_lock(&hot_lock);
+    int rc = lookup(key, hash) != NULL ? 1 : admit_test(hash, size);
+    if (rc < 0) {
+        nr_rejected = nr_rejected + 1;
+    }
+    pthread_mutex_unlock(&hot_lock);
+    if (rc != 0) {
+        return;
+    }
+
+    // 读入文件的时候不持有锁，先取得文件的状态，读取期间的修改在下次检查时发现
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return;
+    }
+    struct hot_file *e = calloc(1, sizeof(struct hot_file) + strlen(key) + 1);
+    if (e == NULL) {
+        return;
+    }
+    // 复制到匿名映射中，上传截断或者覆盖文件时不会影响正在下载的连接
+    e->maplen = size;
+    e->map = mmap(NULL, e->maplen, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (e->map == MAP_FAILED) {
+        log_debug("mmap %lld bytes for %s failed: %s", (long long int)size,
+                  path, strerror(errno));
+        free(e);
+        return;
+    }
+    int64_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, e->map + done, size - done, base + done);
+        if (n > 0) {
+            done = done + n;
+        } else if (n < 0 && errno == EINTR) {
+            // 系统调用被中断，继续读取
+        } else {
+            break;
+        }
+    }
+    if (done < size) {
+        log_debug("read %s for hot file cache failed", path);
+        free_hot_file(e);
+        return;
+    }
+    (void) mprotect(e->map, e->maplen, PROT_READ);
+    if (mlock(e->map, e->maplen) != 0) {
+        // 超过 RLIMIT_MEMLOCK，内存仍然可能被换出
+        log_debug("mlock %s failed: %s", path, strerror(errno));
+    }
+    e->refs = 1;
+    e->backend = index;
+    e->packed = packed;
+    e->size = size;
+    e->base = base;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->mtime = st.st_mtim;
+    e->checked = now_ms();
+    e->hash = hash;
+    strcpy(e->key, key);
+
+    pthread_mutex_lock(&hot_lock);
+    if (lookup(key, hash) != NULL) {
+        // 其他连接已经缓存了这个文件
+        pthread_mutex_unlock(&hot_lock);
+        free_hot_file(e);
+        return;
+    }
+    while (lru_tail != NULL &&
+           (nr_files + 1 > hotcache_files || nr_bytes + size > hotcache_bytes)) {
+        drop_hot_file(lru_tail);
+        nr_evicted = nr_evicted + 1;
+    }
+    struct hot_file **p = &buckets[hash & (nbuckets - 1)];
+    e->hnext = *p;
+    *p = e;
+    lru_push(e);
+    nr_files = nr_files + 1;
+    nr_bytes = nr_bytes + size;
+    nr_admitted = nr_admitted + 1;
+    pthread_mutex_unlock(&hot_lock);
+    log_debug("cache hot file %s (%lld bytes)", path, (long long int)size);
+}
+
+int64_t hot_file_size(struct hot_file *h)
+{
+    return h->size;
+}
+
+int hot_file_read(struct hot_file *h, uint64_t offset, uint8_t *buf, int len)
+{
+    if (offset >= (uint64_t)h->size) {
+        return 0;
+    }
+    if ((uint64_t)len > h->size - offset) {
+        len = h->size - offset;
+    }
+    memcpy(buf, h->map + offset, len);
+    __sync_add_and_fetch(&hit_bytes, (uint64_t)len);
+    return len;
+}
+
+void hotcache_release(struct hot_file *h)
+{
+    pthread_mutex_lock(&hot_lock);
+    h->refs = h->refs - 1;
+    int last = h->refs == 0;
+    pthread_mutex_unlock(&hot_lock);
+    if (last) {
+        free_hot_file(h);
+    }
+}
+
+void hotcache_invalidate(const char *path)
+{
+    const char *key;
+    int b;
+    if (!hot_enabled || (key = backend_key(path, &b)) == NULL) {
+        return;
+    }
+    int len = strlen(key);
+    while (len > 0 && key[len - 1] == '/') {
+        len = len - 1;
+    }
+
+    pthread_mutex_lock(&hot_lock);
+    if (nr_files == 0) {
+        pthread_mutex_unlock(&hot_lock);
+        return;
+    }
+    struct hot_file *e = lru_head;
+    while (e != NULL) {
+        struct hot_file *next = e->next;
+        if (!strncmp(e->key, key, len) && (e->key[len] == '\0' || e->key[len] == '/')) {
+            drop_hot_file(e);
+        }
+        e = next;
+    }
+    pthread_mutex_unlock(&hot_lock);
+}
+
+int hotcache_json(char *buf, int len)
+{
+    pthread_mutex_lock(&hot_lock);
+    uint64_t lookups = nr_hits + nr_misses;
+    int n = snprintf(buf, len, "{\"files\": %d, \"bytes\": %lld, \"hits\": %lu, "
+                     "\"misses\": %lu, \"hit_ratio\": %.3f, \"hit_bytes\": %lu, "
+                     "\"admitted\": %lu, \"rejected\": %lu, \"evicted\": %lu, "
+                     "\"stale\": %lu}",
+                     nr_files, (long long int)nr_bytes, nr_hits, nr_misses,
+                     lookups > 0 ? (double)nr_hits / lookups : 0.0, hit_bytes,
+                     nr_admitted, nr_rejected, nr_evicted, nr_stale);
+    pthread_mutex_unlock(&hot_lock);
+    return n < len ? n : len - 1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// 测试用例
+////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_UNITTEST
+
+#include <assert.h>
+
+static int test_file(const char *path, int size)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    char buf[4096];
+    memset(buf, path[strlen(path) - 1], sizeof(buf));
+    assert(write(fd, buf, size) == size);
+    return fd;
+}
+
+void test_hotcache(void)
+{
+    printf("test_hotcache: ");
+
+    backend_cnt = 1;
+    snprintf(backend_dirs[0], sizeof(backend_dirs[0]), "/tmp");
+    hotcache_bytes = 8192;
+    hotcache_files = 2;
+    hotcache_file_max = 4096;
+    hotcache_check_ms = 0;
+    assert(init_hotcache() == 0);
+
+    /* 缓存没有满时直接缓存 */
+    int fa = test_file("/tmp/test_hotcache_a", 4096);
+    int fb = test_file("/tmp/test_hotcache_b", 100);
+    assert(hotcache_get("/tmp/test_hotcache_a") == NULL);
+    hotcache_admit("/tmp/test_hotcache_a", 0, fa, 0, 4096, 0);
+    assert(hotcache_get("/tmp/test_hotcache_b") == NULL);
+    hotcache_admit("/tmp/test_hotcache_b", 0, fb, 0, 100, 0);
+    struct hot_file *h = hotcache_get("/tmp/test_hotcache_a");
+    assert(h != NULL && hot_file_size(h) == 4096);
+    uint8_t buf[4096];
+    assert(hot_file_read(h, 4000, buf, 1000) == 96 && buf[0] == 'a');
+    hotcache_release(h);
+
+    /* 只请求过一次的文件不能挤掉更常用的文件 */
+    int fc = test_file("/tmp/test_hotcache_c", 100);
+    assert(hotcache_get("/tmp/test_hotcache_c") == NULL);
+    hotcache_admit("/tmp/test_hotcache_c", 0, fc, 0, 100, 0);
+    assert(nr_files == 2 && nr_rejected == 1);
+    assert(hotcache_get("/tmp/test_hotcache_c") == NULL);
+    assert(hotcache_get("/tmp/test_hotcache_c") == NULL);
+    hotcache_admit("/tmp/test_hotcache_c", 0, fc, 0, 100, 0);
+    assert(nr_admitted == 3 && nr_evicted == 1);
+    h = hotcache_get("/tmp/test_hotcache_c");
+    assert(h != NULL);
+
+    /* 修改过的文件不再使用，正在使用的引用仍然有效 */
+    assert(write(fc, "x", 1) == 1);
+    assert(hotcache_get("/tmp/test_hotcache_c") == NULL);
+    assert(hot_file_read(h, 0, buf, 100) == 100 && buf[99] == 'c');
+    hotcache_release(h);
+
+    hotcache_invalidate("/tmp/");
+    assert(nr_files == 0);
+
+    close(fa);
+    close(fb);
+    close(fc);
+    unlink("/tmp/test_hotcache_a");
+    unlink("/tmp/test_hotcache_b");
+    unlink("/tmp/test_hotcache_c");
+    printf("success\n");
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef HOTCACHE_H
+#define HOTCACHE_H
+
+#include <stdint.h>
+
+/*
+ * 热点文件缓存
+ *
+ * 同一批检查会被反复打开，每次分块下载都要 stat() 每个后端的文件、打开文件、
+ * 再逐块读取。不大于 hotcache_file_max 的文件在第一次下载后可以读入内存（匿
+ * 名映射，尽量 mlock()），之后的下载直接从内存回复，不再访问后端。缓存的是文
+ * 件的副本，上传截断或者覆盖文件不会影响正在从缓存下载的连接：
+ *
+ * - 键是文件相对于后端目录的路径，任何一个后端的镜像都可以；
+ * - 缓存的总大小不超过 hotcache_bytes，文件个数不超过 hotcache_files；
+ * - 准入使用 TinyLFU：用 count-min sketch 估计每个文件最近被请求的次数，缓存
+ *   满了时，新文件的次数多于 LRU 末尾要淘汰的文件才被缓存。批量迁移中只读一次
+ *   的文件因此不会把热点文件挤出去。每记录 HOTCACHE_SAMPLE_FACTOR 倍
+ *   hotcache_files 次请求，所有的计数减半，旧的热点逐渐冷却；
+ * - 命中时距离上次检查超过 hotcache_check_ms 就重新 stat() 映射的文件，大小、
+ *   inode 或者修改时间变了就丢弃。上传、删除、重命名和备份操作还会立即使对应
+ *   的文件或者目录失效。
+ *
+ * 正在下载的连接持有缓存文件的引用，文件失效或者被淘汰后，最后一个引用释放时
+ * 才解除映射。命中率和字节数随心跳消息发送给 asm。
+ */
+
+#define HOTCACHE_SAMPLE_FACTOR  10
+#define HOTCACHE_SKETCH_ROWS    4
+
+struct hot_file;
+
+/*
+ * 按 tunable 分配缓存和计数，hotcache_bytes 为 0 时不启用。成功返回 0，失败返
+ * 回 -1
+ */
+extern int init_hotcache(void);
+
+/*
+ * 记录一次对绝对路径 path 的请求并查找缓存。命中并且仍然有效时返回文件的引用，
+ * 否则返回 NULL
+ */
+extern struct hot_file *hotcache_get(const char *path);
+
+/*
+ * 未命中的文件已经在后端 index 中打开，fd 从 base 开始的 size 字节是文件的内
+ * 容（打包存放的文件在段文件中）。按准入策略决定是否缓存，调用者仍然拥有 fd
+ */
+extern void hotcache_admit(const char *path, int index, int fd, int64_t base,
+                           int64_t size, int packed);
+
+extern int64_t hot_file_size(struct hot_file *h);
+
+/*
+ * 从缓存的文件中读取 offset 开始的最多 len 字节，返回复制的字节数
+ */
+extern int hot_file_read(struct hot_file *h, uint64_t offset, uint8_t *buf, int len);
+
+/*
+ * 释放 hotcache_get() 返回的引用
+ */
+extern void hotcache_release(struct hot_file *h);
+
+/*
+ * 绝对路径 path 的文件或者目录中所有的文件失效，path 可以在任何一个后端目录中
+ */
+extern void hotcache_invalidate(const char *path);
+
+/*
+ * 缓存的统计写成 JSON，返回写入的长度
+ */
+extern int hotcache_json(char *buf, int len);
+
+#endif  /* HOTCACHE_H */
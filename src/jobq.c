@@ -0,0 +1,268 @@
+
+// jobq.c
+
+#include <sys/eventfd.h>
+
+#include "mt_log.h"
+#include "public.h"
+#include "conn_mgmt.h"
+#include "jobq.h"
+#include "tunables.h"
+
+extern void init_mt_cntt(int thread_id);
+extern int get_thread_id(void);
+
+#define JOBQ_HISTORY 4096   // 保存状态的最近任务个数
+
+static pthread_mutex_t jobq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobq_cond = PTHREAD_COND_INITIALIZER;
+
+static struct job *queue_head = NULL;   // 等待执行的任务
+static struct job *queue_tail = NULL;
+static int64_t nr_jobs = 0;             // 已经分配还没有释放的任务
+static uint64_t next_job_id = 1;
+
+// 每个工作者线程已经完成，等待处理的任务
+static struct job *done_heads[MAX_WORKERS+1] = {NULL};
+static struct job *done_tails[MAX_WORKERS+1] = {NULL};
+static int job_efds[MAX_WORKERS+1] = {0};
+
+static struct job_status history[JOBQ_HISTORY];
+
+const char *job_state_string(int state)
+{
+    switch (state) {
+    case JOB_QUEUED:  return "queued";
+    case JOB_RUNNING: return "running";
+    case JOB_DONE:    return "done";
+    case JOB_FAILED:  return "failed";
+    default:          return "unknown";
+    }
+}
+
+// 调用者持有 jobq_lock
+static void save_job_status(struct job *j)
+{
+    struct job_status *st = &history[j->id % JOBQ_HISTORY];
+    st->id = j->id;
+    st->state = j->state;
+    st->result = j->result;
+    st->done_steps = j->done_steps;
+    st->total_steps = j->total_steps;
+}
+
+struct job *alloc_job(void)
+{
+    pthread_mutex_lock(&jobq_lock);
+    if (nr_jobs >= jobq_depth) {
+        pthread_mutex_unlock(&jobq_lock);
+        log_warning("job queue is full: %lld jobs", (long long int)nr_jobs);
+        return NULL;
+    } else {
+        nr_jobs = nr_jobs + 1;
+        pthread_mutex_unlock(&jobq_lock);
+    }
+
+    struct job *j = calloc(1, sizeof(struct job));
+    if (j == NULL) {
+        log_error("malloc job failed");
+        pthread_mutex_lock(&jobq_lock);
+        nr_jobs = nr_jobs - 1;
+        pthread_mutex_unlock(&jobq_lock);
+        return NULL;
+    }
+    j->thread_id = get_thread_id();
+    j->sock_fd = -1;
+    return j;
+}
+
+static void free_job(struct job *j)
+{
+    pthread_mutex_lock(&jobq_lock);
+    nr_jobs = nr_jobs - 1;
+    pthread_mutex_unlock(&jobq_lock);
+    free(j);
+}
+
+uint64_t submit_job(struct job *j)
+{
+    pthread_mutex_lock(&jobq_lock);
+    j->id = next_job_id++;
+    j->state = JOB_QUEUED;
+    j->next = NULL;
+    save_job_status(j);
+    if (queue_tail != NULL) {
+        queue_tail->next = j;
+    } else {
+        queue_head = j;
+    }
+    queue_tail = j;
+    pthread_cond_signal(&jobq_cond);
+    pthread_mutex_unlock(&jobq_lock);
+    return j->id;
+}
+
+void set_job_progress(struct job *j, uint32_t done_steps)
+{
+    pthread_mutex_lock(&jobq_lock);
+    j->done_steps = done_steps;
+    save_job_status(j);
+    pthread_mutex_unlock(&jobq_lock);
+}
+
+void get_job_status(uint64_t id, struct job_status *st)
+{
+    pthread_mutex_lock(&jobq_lock);
+    struct job_status *h = &history[id % JOBQ_HISTORY];
+    if (id != 0 && h->id == id) {
+        *st = *h;
+    } else {
+        memset(st, 0, sizeof(struct job_status));
+        st->id = id;
+        st->state = JOB_UNKNOWN;
+    }
+    pthread_mutex_unlock(&jobq_lock);
+}
+
+// 把执行完的任务交还给提交任务的工作者线程
+void finish_job(struct job *j, int rc)
+{
+    int tid = j->thread_id;
+
+    pthread_mutex_lock(&jobq_lock);
+    j->state = rc == 0 ? JOB_DONE : JOB_FAILED;
+    if (j->id != 0) {
+        save_job_status(j);
+    } else {
+        // 没有提交到任务队列的任务，不记录状态
+    }
+    if (j->done == NULL) {
+        // 不需要在工作者线程中处理执行结果，直接释放
+        pthread_mutex_unlock(&jobq_lock);
+        free_job(j);
+        return;
+    }
+    j->next = NULL;
+    if (done_tails[tid] != NULL) {
+        done_tails[tid]->next = j;
+    } else {
+        done_heads[tid] = j;
+    }
+    done_tails[tid] = j;
+    pthread_mutex_unlock(&jobq_lock);
+
+    uint64_t one = 1;
+    if (write(job_efds[tid], &one, sizeof(one)) != sizeof(one)) {
+        // 计数器溢出之前工作者线程一定会处理，不应该发生
+        log_error("notify worker:%d of job %lu failed: %s",
+                  tid, j->id, strerror(errno));
+    } else {
+        // 通知成功
+    }
+}
+
+static void *job_thread(void *arg)
+{
+    int thread_id = (int)(intptr_t)arg;
+    init_mt_cntt(thread_id);
+    log_info("job thread:%d start", thread_id);
+
+    while (1) {
+        pthread_mutex_lock(&jobq_lock);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&jobq_cond, &jobq_lock);
+        }
+        struct job *j = queue_head;
+        queue_head = j->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        } else {
+            // 队列中还有任务
+        }
+        j->state = JOB_RUNNING;
+        save_job_status(j);
+        pthread_mutex_unlock(&jobq_lock);
+
+        uint64_t start = get_curr_time();
+        int rc = j->run(j);
+        log_info("job %lu %s in %lu ms, %u/%u steps", j->id,
+                 rc == 0 ? "done" : "failed", get_curr_time() - start,
+                 j->done_steps, j->total_steps);
+        finish_job(j, rc);
+    }
+    return NULL;
+}
+
+int init_jobq(int nr, int first_thread_id)
+{
+    int i;
+    for (i = 0; i < nr; i++) {
+        pthread_t tid;
+        int ret = pthread_create(&tid, NULL, job_thread,
+                                 (void *)(intptr_t)(first_thread_id + i));
+        if (ret != 0) {
+            log_crit("create job thread:%d failed", first_thread_id + i);
+            return -1;
+        } else {
+            pthread_detach(tid);
+        }
+    }
+    return 0;
+}
+
+int attach_jobq(events_poll_t *e, int thread_id)
+{
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0) {
+        log_error("eventfd failed: %s", strerror(errno));
+        return -1;
+    } else if (efd >= MAX_CONNS_CNT) {
+        log_error("eventfd %d out of range", efd);
+        close(efd);
+        return -1;
+    }
+
+    conns_info[efd].peer_type = NODE_TYPE_JOBQ;
+    conns_info[efd].sock_fd = efd;
+    conns_info[efd].thread_id = thread_id;
+    job_efds[thread_id] = efd;
+
+    if (add_to_events_poll(e, efd, EPOLLIN) != 1) {
+        log_error("add job eventfd:%d to events poll failed", efd);
+        return -1;
+    } else {
+        return 0;
+    }
+}
+
+int on_jobq_events(events_poll_t *e, int efd)
+{
+    uint64_t n;
+    if (read(efd, &n, sizeof(n)) != sizeof(n)) {
+        if (errno == EAGAIN) {
+            return 0;
+        } else {
+            log_error("read job eventfd:%d failed: %s", efd, strerror(errno));
+            return -1;
+        }
+    }
+
+    int tid = get_thread_id();
+    pthread_mutex_lock(&jobq_lock);
+    struct job *j = done_heads[tid];
+    done_heads[tid] = NULL;
+    done_tails[tid] = NULL;
+    pthread_mutex_unlock(&jobq_lock);
+
+    while (j != NULL) {
+        struct job *next = j->next;
+        if (j->done != NULL) {
+            j->done(e, j);
+        } else {
+            // 不需要处理执行结果
+        }
+        free_job(j);
+        j = next;
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+#ifndef JOBQ_H
+#define JOBQ_H
+
+#include <stdint.h>
+
+#include "events_poll.h"
+
+/*
+ * 后台任务队列
+ *
+ * 文件粉碎、重命名、删除这类操作可能耗时很长（多遍覆写加 fdatasync()，递归遍
+ * 历备份目录），不能在工作者线程中执行，否则整个工作者线程上的连接都会被阻塞。
+ * 工作者线程把任务提交到任务队列，由固定数量的执行线程执行。执行完毕后，任务
+ * 通过 eventfd 交还给提交任务的工作者线程，在工作者线程中发送响应。
+ *
+ * 最近完成的任务的状态保存在一个固定大小的表中，客户端可以按任务号查询。
+ */
+
+#define JOB_QUEUED   0    // 等待执行
+#define JOB_RUNNING  1    // 正在执行
+#define JOB_DONE     2    // 执行成功
+#define JOB_FAILED   3    // 执行失败
+#define JOB_UNKNOWN  4    // 任务号不存在，或者已经从状态表中淘汰
+
+#define JOB_DATA_SIZE 1024  // 任务自带的数据，足够保存请求消息
+
+struct job;
+
+// 在执行线程中执行任务，成功返回 0，失败返回 -1
+typedef int (*job_run_t)(struct job *j);
+
+// 在提交任务的工作者线程中处理执行结果，之后任务被释放。为 NULL 时任务在执
+// 行线程中直接释放
+typedef void (*job_done_t)(events_poll_t *e, struct job *j);
+
+struct job {
+    uint64_t id;            // 任务号，从 1 开始递增
+    int state;
+    int thread_id;          // 提交任务的工作者线程
+    int sock_fd;            // 提交任务的连接
+    uint32_t generation;    // 提交任务时连接的 generation
+    uint32_t done_steps;    // 已经完成的步骤，执行线程更新
+    uint32_t total_steps;   // 总的步骤数
+    int result;             // 任务自己定义的执行结果
+    job_run_t run;
+    job_done_t done;
+    struct job *next;
+    char data[JOB_DATA_SIZE];
+};
+
+struct job_status {
+    uint64_t id;
+    int state;
+    int result;
+    uint32_t done_steps;
+    uint32_t total_steps;
+};
+
+/*
+ * 启动 nr 个执行线程，线程号从 first_thread_id 开始。成功返回 0，失败返回 -1
+ */
+extern int init_jobq(int nr, int first_thread_id);
+
+/*
+ * 工作者线程接收任务完成通知，在工作者线程启动时调用。成功返回 0，失败返回 -1
+ */
+extern int attach_jobq(events_poll_t *e, int thread_id);
+
+/*
+ * 分配一个任务，队列中的任务已经达到上限时返回 NULL
+ */
+extern struct job *alloc_job(void);
+
+/*
+ * 提交任务，任务号在这里分配。提交之后任务就属于任务队列了
+ */
+extern uint64_t submit_job(struct job *j);
+
+/*
+ * 任务执行完毕，交还给提交任务的工作者线程处理结果。没有通过 submit_job() 提交
+ * 的任务（任务号为 0）也可以这样交还，例如组提交（gcommit.h）中等待同步的任务
+ */
+extern void finish_job(struct job *j, int rc);
+
+/*
+ * 执行线程更新任务进度
+ */
+extern void set_job_progress(struct job *j, uint32_t done_steps);
+
+/*
+ * 工作者线程收到完成通知时调用，处理所有已经完成的任务
+ */
+extern int on_jobq_events(events_poll_t *e, int efd);
+
+/*
+ * 查询任务状态，任务不存在时 state 为 JOB_UNKNOWN
+ */
+extern void get_job_status(uint64_t id, struct job_status *st);
+
+extern const char *job_state_string(int state);
+
+#endif  /* JOBQ_H */
@@ -0,0 +1,192 @@
+
+// liststream.c
+
+#include "mt_log.h"
+#include "public.h"
+#include "pathops.h"
+#include "liststream.h"
+
+extern char *default_md5sum_filename;
+
+#define LIST_FRAME_SIZE   (64 * 1024) // 每一段的最大长度
+#define LIST_FRAME_HEAD   8           // 段长度和文件个数
+#define LIST_ENTRY_MAX    (2 + DIRWALK_PATH_MAX + 8)
+#define LIST_PUMP_FRAMES  16          // 每次最多填充的段数，避免长时间占用工作线程
+
+struct file_list_stream {
+    struct dirwalk *w;    // 正在遍历的目录
+    int cut;              // 正在遍历的目录中挂载点的长度
+    int curr;             // 下一个要遍历的目录
+    int nr_dir;
+    char **dirs;
+    char *mountpath;
+    uint32_t nr_files;    // 已经发送的文件个数
+    int done;             // 所有目录都已经遍历完毕
+    char frame[LIST_FRAME_SIZE];
+};
+
+static void free_stream(struct file_list_stream *s)
+{
+    if (s->w) {
+        dirwalk_close(s->w);
+    }
+    int i;
+    for (i = 0; i < s->nr_dir; i++) {
+        free(s->dirs[i]);
+    }
+    free(s->dirs);
+    free(s->mountpath);
+    free(s);
+}
+
+int open_file_list_stream(conn_info_t *c, const char *mountpath,
+                          const char *dirs[], int nr_dir)
+{
+    if (c->list_stream != NULL) {
+        log_error("sock_fd:%d is already streaming file list", c->sock_fd);
+        return -1;
+    }
+
+    struct file_list_stream *s = calloc(1, sizeof(struct file_list_stream));
+    if (!s) {
+        log_error("malloc file list stream failed");
+        return -1;
+    }
+    s->dirs = calloc(nr_dir > 0 ? nr_dir : 1, sizeof(char *));
+    s->mountpath = strdup(mountpath);
+    if (!s->dirs || !s->mountpath) {
+        log_error("malloc file list stream failed");
+        free_stream(s);
+        return -1;
+    }
+    int i;
+    for (i = 0; i < nr_dir; i++) {
+        s->dirs[i] = strdup(dirs[i]);
+        if (!s->dirs[i]) {
+            log_error("malloc file list stream failed");
+            free_stream(s);
+            return -1;
+        }
+        s->nr_dir = i + 1;
+    }
+
+    c->list_stream = s;
+    return 0;
+}
+
+void close_file_list_stream(conn_info_t *c)
+{
+    if (c->list_stream != NULL) {
+        free_stream(c->list_stream);
+        c->list_stream = NULL;
+    } else {
+        // 没有正在发送的文件列表
+    }
+}
+
+static int write_frame_head(char *frame, uint32_t len, uint32_t count)
+{
+    *((uint32_t *)&frame[0]) = htobe32(len);
+    *((uint32_t *)&frame[4]) = htobe32(count);
+    return LIST_FRAME_HEAD;
+}
+
+/*
+ * 填充一段文件列表，返回段的长度，没有文件时返回 0
+ */
+static int fill_frame(struct file_list_stream *s)
+{
+    char *frame = s->frame;
+    char *end = frame + LIST_FRAME_SIZE;
+    char *out = frame + LIST_FRAME_HEAD;
+    uint32_t count = 0;
+
+    while (out + LIST_ENTRY_MAX <= end) {
+        if (s->w == NULL) {
+            if (s->curr >= s->nr_dir) {
+                s->done = 1;
+                break;
+            }
+            const char *dirpath = s->dirs[s->curr];
+            s->curr = s->curr + 1;
+            s->w = dirwalk_open(dirpath);
+            if (s->w == NULL) {
+                log_error("skip %s: open directory failed", dirpath);
+                continue;
+            }
+            s->cut = mount_prefix_len(dirpath, s->mountpath);
+        } else {
+            // 继续遍历当前目录
+        }
+
+        struct dirwalk_entry e;
+        int rc = dirwalk_next(s->w, &e);
+        if (rc > 0) {
+            if (!strcmp(e.name, default_md5sum_filename)) {
+                /* 不返回生成的，用来记录 md5 校验和的文件 */
+                continue;
+            }
+            out += fill_file_list(out, end, e.path + s->cut,
+                                  e.pathlen - s->cut, e.size);
+            count = count + 1;
+        } else {
+            if (rc < 0) {
+                // 已经发送的文件列表无法收回，跳过目录中剩下的文件
+                log_error("skip rest of %s: read directory failed",
+                          s->dirs[s->curr - 1]);
+            } else {
+                // 当前目录遍历完毕
+            }
+            dirwalk_close(s->w);
+            s->w = NULL;
+        }
+    }
+
+    if (count > 0) {
+        int len = out - frame;
+        write_frame_head(frame, len, count);
+        s->nr_files = s->nr_files + count;
+        return len;
+    } else {
+        return 0;
+    }
+}
+
+int pump_file_list_stream(events_poll_t *e, conn_info_t *c)
+{
+    struct file_list_stream *s = c->list_stream;
+    if (s == NULL) {
+        return 0;
+    }
+
+    int n;
+    for (n = 0; n < LIST_PUMP_FRAMES && !s->done; n++) {
+        if (get_ring_free_size(c->send) < LIST_FRAME_SIZE) {
+            // 发送缓冲区没有足够的空间，等待可写事件再继续
+            break;
+        }
+        int len = fill_frame(s);
+        if (len > 0) {
+            write_ring(c->send, (uint8_t *)s->frame, len);
+        } else {
+            // 没有文件了，s->done 已经设置
+        }
+    }
+
+    if (s->done) {
+        if (get_ring_free_size(c->send) < LIST_FRAME_HEAD) {
+            start_monitoring_send(e, c->sock_fd);
+            return 1;
+        }
+        char trailer[LIST_FRAME_HEAD];
+        write_frame_head(trailer, LIST_FRAME_HEAD, s->nr_files);
+        write_ring(c->send, (uint8_t *)trailer, LIST_FRAME_HEAD);
+        log_info("sock_fd:%d streamed %u files from %d directories",
+                 c->sock_fd, s->nr_files, s->nr_dir);
+        start_monitoring_send(e, c->sock_fd);
+        return 0;
+    } else {
+        start_monitoring_send(e, c->sock_fd);
+        return 1;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef LISTSTREAM_H
+#define LISTSTREAM_H
+
+#include "conn_mgmt.h"
+
+/*
+ * 分段发送文件列表（CMD_GET_FILE_LIST_STREAM_REQ）
+ *
+ * 一边遍历目录，一边把文件列表项直接写入连接的发送缓冲区，不再先把整个文件
+ * 列表放到一个大缓冲区里。响应先是只有消息头的 CMD_GET_FILE_LIST_STREAM_RSP，
+ * ack_code 为 200 时后面是文件列表的各段，404 时没有后面的数据。每一段的格
+ * 式如下，都是网络字节序：
+ *
+ * (4 字节段长度，包括段头) (4 字节文件个数) (2 name 8) (2 name 8) ...
+ *
+ * 最后一段只有段头，段长度为 8，文件个数是所有段的文件总数。
+ */
+
+struct file_list_stream;
+
+/*
+ * 开始遍历 dirs 中的目录，目录路径会被复制。成功返回 0，失败返回 -1
+ */
+extern int open_file_list_stream(conn_info_t *c, const char *mountpath,
+                                 const char *dirs[], int nr_dir);
+
+/*
+ * 在发送缓冲区有空间时继续遍历目录并填充文件列表。返回 1 表示还没有结束，
+ * 返回 0 表示已经写入最后一段，返回 -1 表示出错
+ */
+extern int pump_file_list_stream(events_poll_t *e, conn_info_t *c);
+
+/*
+ * 结束遍历，释放资源，连接关闭时也会调用
+ */
+extern void close_file_list_stream(conn_info_t *c);
+
+#endif  /* LISTSTREAM_H */
@@ -0,0 +1,1282 @@
+
+// metaidx.c
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "mt_log.h"
+#include "public.h"
+#include "tunables.h"
+#include "gcommit.h"
+#include "metaidx.h"
+
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+#define MI_MAGIC        "SGWMIDX1"
+#define MI_TABLE_NAME   "metaidx.tbl"
+#define MI_WAL_NAME     "metaidx.wal"
+#define MI_HEADER_SIZE  4096
+#define MI_SLOT_SIZE    512
+#define MI_KEY_MAX      (MI_SLOT_SIZE - 66)
+#define MI_DEPTH_MAX    64          // 路径名最多的层数，也是一次修改最多新增的槽数
+#define MI_WALBUF_SIZE  (64 * 1024)
+#define MI_RECORD_HEAD  66
+
+// 槽的状态
+#define MI_EMPTY   0
+#define MI_USED    1
+#define MI_DEAD    2        // 删除的槽，查找时继续向后探测
+
+// 槽的类型
+#define MI_FILE    1
+#define MI_DIR     2
+
+// 槽的标志
+#define MI_PACKED    0x01
+#define MI_COMPLETE  0x02   // 目录树中的所有文件都在索引中
+
+// 日志记录的操作
+#define MI_OP_SET  1        // 设置文件的属性
+#define MI_OP_DEL  2        // 删除文件或者目录树
+#define MI_OP_DIR  3        // 设置目录的标志
+
+struct mi_header {
+    char magic[8];
+    uint32_t slot_size;
+    uint32_t reserved;
+    uint64_t nslots;        // 2 的幂
+};
+
+struct mi_slot {
+    uint32_t crc;           // 从 state 到路径名结束的校验和
+    uint8_t state;
+    uint8_t type;
+    uint8_t flags;
+    uint8_t mask;           // 保存了这个文件的后端
+    uint32_t stamp;         // 最后一次看到这个文件的遍历编号
+    uint32_t reserved;
+    int64_t size;
+    int64_t mtime;
+    char md5[MD5_LEN];      // 全 0 表示不知道 md5
+    uint16_t keylen;
+    char key[MI_KEY_MAX];   // 文件在后端目录下的路径，以 '/' 开头
+};
+
+typedef char mi_slot_size_check[sizeof(struct mi_slot) == MI_SLOT_SIZE ? 1 : -1];
+
+// 日志记录，写入日志时只写出前 MI_RECORD_HEAD 字节，后面紧接着路径名
+struct mi_record {
+    uint32_t len;           // 记录的总长度，包括路径名
+    uint32_t crc;           // 从 op 到路径名结束的校验和
+    uint8_t op;
+    uint8_t flags;
+    uint8_t mask;
+    uint8_t pad;
+    uint32_t stamp;
+    int64_t size;
+    int64_t mtime;
+    char md5[MD5_LEN];
+    uint16_t keylen;
+};
+
+// 目录树的链接只在内存中，0 表示没有，否则是槽的下标加 1
+struct mi_link {
+    uint32_t parent;
+    uint32_t child;         // 第一个子项
+    uint32_t next;          // 同一个目录中的下一项
+    uint32_t prev;
+};
+
+struct mi_snapshot {
+    char *buf;
+    size_t used;
+    size_t cap;
+    int nr;
+};
+
+static pthread_mutex_t mi_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sync_lock = PTHREAD_MUTEX_INITIALIZER;  // 持久化日志，在 mi_lock 之前取得
+static int mi_enabled = 0;
+static char mi_dir[MAX_PATH_LEN + 1];
+static int dir_fd = -1;
+static int tbl_fd = -1;
+static int wal_fd = -1;
+static size_t map_len = 0;
+static struct mi_header *hdr = NULL;
+static struct mi_slot *slots = NULL;
+static struct mi_link *links = NULL;
+static uint64_t nslots = 0;
+static uint64_t nr_used = 0;
+static uint64_t nr_dead = 0;
+static uint32_t scan_clock = 0;     // 最近一次开始的遍历的编号
+static uint32_t changed_at = 0;     // 最近一次删除、重命名或者标记不完整时的 scan_clock
+static char walbuf[MI_WALBUF_SIZE];
+static int wal_used = 0;
+static int64_t wal_size = 0;
+static uint64_t wal_written = 0;    // 写入日志文件的总字节数，mi_lock 保护
+static uint64_t wal_synced = 0;     // 已经持久化的字节数，sync_lock 保护
+
+static uint64_t hash_key(const char *key, int len)
+{
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ULL;
+    int i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)key[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+/* 槽和日志记录的校验和，pathops.c 的 crc32() 只适用于路径名 */
+static uint32_t checksum(const char *p, size_t len)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261U;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)p[i]) * 16777619U;
+    }
+    return h;
+}
+
+static uint32_t slot_crc(const struct mi_slot *s)
+{
+    return checksum((const char *)s + 4, offsetof(struct mi_slot, key) - 4 + s->keylen);
+}
+
+static void seal(struct mi_slot *s)
+{
+    s->crc = slot_crc(s);
+}
+
+/*
+ * 把绝对路径转换为索引中的路径：去掉后端目录，合并重复的 '/'，去掉结尾的 '/'。
+ * 返回路径的长度，不在后端目录下、包含 "." 或 ".."、太长太深时返回 -1
+ */
+static int make_key(const char *path, char *key, int *bit)
+{
+    int b;
+    int n = 0;
+    for (b = 0; b < backend_cnt; b++) {
+        n = strlen(backend_dirs[b]);
+        while (n > 1 && backend_dirs[b][n - 1] == '/') {
+            n = n - 1;
+        }
+        if (n > 0 && !strncmp(path, backend_dirs[b], n) && path[n] == '/') {
+            break;
+        } else {
+            // 不在这个后端目录下
+        }
+    }
+    if (b == backend_cnt) {
+        return -1;
+    }
+
+    int len = 0;
+    int depth = 0;
+    const char *p = path + n;
+    while (*p != '\0') {
+        while (*p == '/') {
+            p = p + 1;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        const char *q = p;
+        while (*q != '\0' && *q != '/') {
+            q = q + 1;
+        }
+        int clen = q - p;
+        if ((clen == 1 && p[0] == '.') || (clen == 2 && p[0] == '.' && p[1] == '.')) {
+            return -1;
+        }
+        depth = depth + 1;
+        if (depth > MI_DEPTH_MAX || len + 1 + clen > MI_KEY_MAX) {
+            return -1;
+        }
+        key[len] = '/';
+        memcpy(&key[len + 1], p, clen);
+        len = len + 1 + clen;
+        p = q;
+    }
+    if (len == 0) {
+        // 后端目录本身
+        return -1;
+    }
+    if (bit != NULL) {
+        *bit = 1 << b;
+    }
+    return len;
+}
+
+/* 上级目录的路径长度，顶层目录返回 0 */
+static int parent_len(const char *key, int len)
+{
+    int i = len - 1;
+    while (i > 0 && key[i] != '/') {
+        i = i - 1;
+    }
+    return i;
+}
+
+static int64_t find_key(const char *key, int len)
+{
+    uint64_t i = hash_key(key, len) & (nslots - 1);
+    uint64_t n;
+    for (n = 0; n < nslots; n++) {
+        struct mi_slot *s = &slots[i];
+        if (s->state == MI_EMPTY) {
+            return -1;
+        } else if (s->state == MI_USED && s->keylen == len &&
+                   !memcmp(s->key, key, len)) {
+            return i;
+        } else {
+            // 继续向后探测
+        }
+        i = (i + 1) & (nslots - 1);
+    }
+    return -1;
+}
+
+/* 分配一个新的槽，不链接到上级目录 */
+static int64_t new_slot(const char *key, int len, int type)
+{
+    if (nr_used + nr_dead + 1 >= nslots) {
+        log_error("metaidx is full: %lu slots", nslots);
+        return -1;
+    }
+    uint64_t i = hash_key(key, len) & (nslots - 1);
+    while (slots[i].state == MI_USED) {
+        i = (i + 1) & (nslots - 1);
+    }
+    struct mi_slot *s = &slots[i];
+    if (s->state == MI_DEAD) {
+        nr_dead = nr_dead - 1;
+    } else {
+        // 空的槽
+    }
+    memset(s, 0, offsetof(struct mi_slot, key));
+    s->state = MI_USED;
+    s->type = type;
+    s->keylen = len;
+    memcpy(s->key, key, len);
+    seal(s);
+    memset(&links[i], 0, sizeof(struct mi_link));
+    nr_used = nr_used + 1;
+    return i;
+}
+
+static void link_child(uint64_t p, uint64_t i)
+{
+    struct mi_link *l = &links[i];
+    l->parent = p + 1;
+    l->prev = 0;
+    l->next = links[p].child;
+    if (l->next != 0) {
+        links[l->next - 1].prev = i + 1;
+    }
+    links[p].child = i + 1;
+}
+
+static void unlink_child(uint64_t i)
+{
+    struct mi_link *l = &links[i];
+    if (l->prev != 0) {
+        links[l->prev - 1].next = l->next;
+    } else if (l->parent != 0) {
+        links[l->parent - 1].child = l->next;
+    } else {
+        // 顶层目录
+    }
+    if (l->next != 0) {
+        links[l->next - 1].prev = l->prev;
+    }
+    l->parent = 0;
+    l->prev = 0;
+    l->next = 0;
+}
+
+static void remove_slot(uint64_t i)
+{
+    while (links[i].child != 0) {
+        remove_slot(links[i].child - 1);
+    }
+    unlink_child(i);
+    slots[i].state = MI_DEAD;
+    seal(&slots[i]);
+    nr_used = nr_used - 1;
+    nr_dead = nr_dead + 1;
+}
+
+/* 新增一项，不存在的上级目录也一起新增 */
+static int64_t insert_key(const char *key, int len, int type)
+{
+    int64_t p = -1;
+    int plen = parent_len(key, len);
+    if (plen > 0) {
+        p = find_key(key, plen);
+        if (p >= 0 && slots[p].type != MI_DIR) {
+            // 同名的文件被目录取代
+            remove_slot(p);
+            p = -1;
+        }
+        if (p < 0) {
+            p = insert_key(key, plen, MI_DIR);
+        }
+        if (p < 0) {
+            return -1;
+        }
+    } else {
+        // 顶层目录没有上级目录
+    }
+    int64_t i = new_slot(key, len, type);
+    if (i >= 0 && p >= 0) {
+        link_child(p, i);
+    }
+    return i;
+}
+
+/* 启动时确保上级目录存在，这时还没有链接 */
+static int64_t ensure_dir(const char *key, int len)
+{
+    int64_t p = find_key(key, len);
+    if (p >= 0 && slots[p].type == MI_DIR) {
+        return p;
+    } else if (p >= 0) {
+        remove_slot(p);
+    } else {
+        // 崩溃时丢失的目录
+    }
+    int plen = parent_len(key, len);
+    if (plen > 0 && ensure_dir(key, plen) < 0) {
+        return -1;
+    }
+    return new_slot(key, len, MI_DIR);
+}
+
+static void rebuild_links(void)
+{
+    memset(links, 0, nslots * sizeof(struct mi_link));
+    uint64_t i;
+    for (i = 0; i < nslots; i++) {
+        struct mi_slot *s = &slots[i];
+        int plen = s->state == MI_USED ? parent_len(s->key, s->keylen) : 0;
+        if (plen > 0 && ensure_dir(s->key, plen) < 0) {
+            s->state = MI_DEAD;
+            seal(s);
+            nr_used = nr_used - 1;
+            nr_dead = nr_dead + 1;
+        }
+    }
+    for (i = 0; i < nslots; i++) {
+        struct mi_slot *s = &slots[i];
+        int plen = s->state == MI_USED ? parent_len(s->key, s->keylen) : 0;
+        if (plen > 0) {
+            link_child(find_key(s->key, plen), i);
+        }
+    }
+}
+
+/* 目录本身或者上级目录是完整的 */
+static int is_complete(uint64_t i)
+{
+    uint32_t j;
+    for (j = i + 1; j != 0; j = links[j - 1].parent) {
+        if (slots[j - 1].flags & MI_COMPLETE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int map_table(int fd, uint64_t n)
+{
+    size_t len = MI_HEADER_SIZE + n * MI_SLOT_SIZE;
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        log_error("mmap %s %lu bytes failed: %s", MI_TABLE_NAME, len, strerror(errno));
+        return -1;
+    }
+    struct mi_link *l = calloc(n, sizeof(struct mi_link));
+    if (l == NULL) {
+        log_error("malloc %lu links failed", n);
+        munmap(map, len);
+        return -1;
+    }
+    if (hdr != NULL) {
+        munmap(hdr, map_len);
+    }
+    free(links);
+    hdr = (struct mi_header *)map;
+    slots = (struct mi_slot *)((char *)map + MI_HEADER_SIZE);
+    links = l;
+    nslots = n;
+    map_len = len;
+    return 0;
+}
+
+/* 散列表的内容写入磁盘，之后日志中的记录都不再需要 */
+static int checkpoint(void)
+{
+    struct timeval t0, t1;
+    gettimeofday(&t0, NULL);
+    wal_used = 0;
+    if (msync(hdr, map_len, MS_SYNC) != 0) {
+        log_error("msync %s failed: %s", MI_TABLE_NAME, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(wal_fd, 0) != 0 || fdatasync(wal_fd) != 0) {
+        log_error("truncate %s failed: %s", MI_WAL_NAME, strerror(errno));
+        return -1;
+    }
+    gettimeofday(&t1, NULL);
+    log_info("metaidx checkpoint: %lu entries, %ld bytes of log in %.3f ms",
+             nr_used, wal_size,
+             (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_usec - t0.tv_usec) / 1000.0);
+    wal_size = 0;
+    return 0;
+}
+
+/*
+ * 换一个更大的散列表，同时清除删除的槽。新的散列表写入临时文件后替换原来的文
+ * 件，相当于一次 checkpoint()
+ */
+static int grow_table(void)
+{
+    uint64_t n = nslots;
+    while ((nr_used + MI_DEPTH_MAX) * 2 > n) {
+        n = n * 2;
+    }
+
+    char path[MAX_PATH_LEN + 32];
+    char tmp[MAX_PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", mi_dir, MI_TABLE_NAME);
+    snprintf(tmp, sizeof(tmp), "%s/%s.new", mi_dir, MI_TABLE_NAME);
+    size_t len = MI_HEADER_SIZE + n * MI_SLOT_SIZE;
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, len) != 0) {
+        log_error("create %s failed: %s", tmp, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        return -1;
+    }
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        log_error("mmap %s %lu bytes failed: %s", tmp, len, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+
+    struct mi_header *h = (struct mi_header *)map;
+    struct mi_slot *s = (struct mi_slot *)((char *)map + MI_HEADER_SIZE);
+    memcpy(h, hdr, sizeof(struct mi_header));
+    h->nslots = n;
+    uint64_t i;
+    for (i = 0; i < nslots; i++) {
+        if (slots[i].state == MI_USED) {
+            uint64_t j = hash_key(slots[i].key, slots[i].keylen) & (n - 1);
+            while (s[j].state != MI_EMPTY) {
+                j = (j + 1) & (n - 1);
+            }
+            memcpy(&s[j], &slots[i], MI_SLOT_SIZE);
+        }
+    }
+    if (msync(map, len, MS_SYNC) != 0 || rename(tmp, path) != 0) {
+        log_error("replace %s failed: %s", path, strerror(errno));
+        munmap(map, len);
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    (void) fsync(dir_fd);
+    munmap(map, len);
+
+    uint64_t old = nslots;
+    if (map_table(fd, n) != 0) {
+        // 原来的映射还在，继续使用，重启后使用新的文件
+        close(fd);
+        return -1;
+    }
+    close(tbl_fd);
+    tbl_fd = fd;
+    nr_dead = 0;
+    rebuild_links();
+    wal_used = 0;
+    wal_size = 0;
+    if (ftruncate(wal_fd, 0) != 0) {
+        log_error("truncate %s failed: %s", MI_WAL_NAME, strerror(errno));
+    }
+    log_info("metaidx grows from %lu to %lu slots, %lu entries", old, n, nr_used);
+    return 0;
+}
+
+/* 保证一次修改有足够的空槽，装载因子超过 3/4 时换更大的散列表 */
+static void reserve(void)
+{
+    if ((nr_used + nr_dead + MI_DEPTH_MAX) * 4 > nslots * 3) {
+        (void) grow_table();
+    } else {
+        // 空槽足够
+    }
+}
+
+static int64_t apply_record(const struct mi_record *r, const char *key)
+{
+    int len = r->keylen;
+    int64_t i = find_key(key, len);
+    int type = r->op == MI_OP_SET ? MI_FILE : MI_DIR;
+    struct mi_slot *s;
+
+    switch (r->op) {
+    case MI_OP_SET:
+    case MI_OP_DIR:
+        if (i >= 0 && slots[i].type != type) {
+            remove_slot(i);
+            i = -1;
+        }
+        if (i < 0) {
+            i = insert_key(key, len, type);
+        }
+        if (i < 0) {
+            return -1;
+        }
+        s = &slots[i];
+        s->flags = r->flags;
+        if (r->op == MI_OP_SET) {
+            s->mask = r->mask;
+            s->stamp = r->stamp;
+            s->size = r->size;
+            s->mtime = r->mtime;
+            memcpy(s->md5, r->md5, MD5_LEN);
+            if (r->stamp > scan_clock) {
+                scan_clock = r->stamp;
+            }
+        }
+        seal(s);
+        return i;
+    case MI_OP_DEL:
+        if (i >= 0) {
+            remove_slot(i);
+        }
+        return i;
+    default:
+        log_error("unknown metaidx record %d", r->op);
+        return -1;
+    }
+}
+
+/* 调用者持有 mi_lock，日志缓冲区中的记录写入日志文件 */
+static int flush_wal(void)
+{
+    int done = 0;
+    while (done < wal_used) {
+        ssize_t n = write(wal_fd, walbuf + done, wal_used - done);
+        if (n > 0) {
+            done = done + n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            log_error("write %s failed: %s", MI_WAL_NAME, strerror(errno));
+            wal_used = 0;
+            return -1;
+        }
+    }
+    wal_size = wal_size + wal_used;
+    wal_written = wal_written + wal_used;
+    wal_used = 0;
+    if (wal_size >= METAIDX_WAL_MAX) {
+        return checkpoint();
+    }
+    return 0;
+}
+
+/*
+ * 不持有 mi_lock，按 upload_durability 持久化 written（写入时的 wal_written）之
+ * 前的日志。fdatasync() 期间其他线程照常查找和修改索引，同时等待的修改只需要
+ * 一次 fdatasync()；这之间 checkpoint() 截断了日志也没有关系，记录已经在散列表中
+ */
+static void sync_wal(uint64_t written)
+{
+    if (upload_durability != DURABILITY_FSYNC) {
+        return;
+    }
+    pthread_mutex_lock(&sync_lock);
+    if (wal_synced < written) {
+        pthread_mutex_lock(&mi_lock);
+        uint64_t target = wal_written;
+        int fd = wal_fd;
+        pthread_mutex_unlock(&mi_lock);
+        if (fdatasync(fd) == 0) {
+            wal_synced = target;
+        } else {
+            log_error("fdatasync %s failed: %s", MI_WAL_NAME, strerror(errno));
+        }
+    } else {
+        // 其他线程已经持久化了这些记录
+    }
+    pthread_mutex_unlock(&sync_lock);
+}
+
+static void log_record(struct mi_record *r, const char *key)
+{
+    r->len = MI_RECORD_HEAD + r->keylen;
+    if (wal_used + (int)r->len > MI_WALBUF_SIZE) {
+        (void) flush_wal();
+    }
+    char *p = walbuf + wal_used;
+    memcpy(p, r, MI_RECORD_HEAD);
+    memcpy(p + MI_RECORD_HEAD, key, r->keylen);
+    uint32_t crc = checksum(p + 8, r->len - 8);
+    memcpy(p + 4, &crc, 4);
+    wal_used = wal_used + r->len;
+}
+
+/* 修改散列表，然后把修改追加到日志 */
+static int64_t do_record(struct mi_record *r, const char *key, int len)
+{
+    r->keylen = len;
+    reserve();
+    int64_t i = apply_record(r, key);
+    log_record(r, key);
+    return i;
+}
+
+static void init_record(struct mi_record *r, int op)
+{
+    memset(r, 0, sizeof(struct mi_record));
+    r->op = op;
+}
+
+static int replay_wal(void)
+{
+    struct stat st;
+    if (fstat(wal_fd, &st) != 0) {
+        log_error("stat %s failed: %s", MI_WAL_NAME, strerror(errno));
+        return -1;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+    char *buf = malloc(st.st_size);
+    if (buf == NULL) {
+        log_error("malloc %ld bytes failed", (long)st.st_size);
+        return -1;
+    }
+    ssize_t n = pread(wal_fd, buf, st.st_size, 0);
+    if (n < 0) {
+        log_error("read %s failed: %s", MI_WAL_NAME, strerror(errno));
+        free(buf);
+        return -1;
+    }
+
+    int nr = 0;
+    ssize_t pos = 0;
+    while (pos + MI_RECORD_HEAD <= n) {
+        struct mi_record r;
+        memcpy(&r, buf + pos, MI_RECORD_HEAD);
+        uint32_t crc;
+        if (r.len != MI_RECORD_HEAD + (uint32_t)r.keylen || r.keylen > MI_KEY_MAX ||
+            pos + (ssize_t)r.len > n) {
+            break;
+        }
+        crc = checksum(buf + pos + 8, r.len - 8);
+        if (crc != r.crc) {
+            break;
+        }
+        reserve();
+        (void) apply_record(&r, buf + pos + MI_RECORD_HEAD);
+        pos = pos + r.len;
+        nr = nr + 1;
+    }
+    if (pos < n) {
+        log_warning("%s: drop %ld bytes of torn records", MI_WAL_NAME, (long)(n - pos));
+    }
+    free(buf);
+    log_info("metaidx replayed %d records", nr);
+    return nr;
+}
+
+/* 丢弃崩溃时没有完整写入的槽 */
+static void check_slots(void)
+{
+    uint64_t torn = 0;
+    uint64_t i;
+    nr_used = 0;
+    nr_dead = 0;
+    for (i = 0; i < nslots; i++) {
+        struct mi_slot *s = &slots[i];
+        if (s->state == MI_EMPTY) {
+            continue;
+        }
+        if (s->state > MI_DEAD || s->keylen == 0 || s->keylen > MI_KEY_MAX ||
+            s->crc != slot_crc(s)) {
+            if (s->state == MI_USED) {
+                torn = torn + 1;
+            }
+            s->state = MI_DEAD;
+            s->keylen = 0;
+            seal(s);
+        }
+        if (s->state == MI_USED) {
+            nr_used = nr_used + 1;
+            if (s->stamp > scan_clock) {
+                scan_clock = s->stamp;
+            }
+        } else {
+            nr_dead = nr_dead + 1;
+        }
+    }
+    if (torn > 0) {
+        log_warning("metaidx: drop %lu torn slots", torn);
+    }
+}
+
+static int open_table(void)
+{
+    char path[MAX_PATH_LEN + 32];
+    snprintf(path, sizeof(path), "%s/%s", mi_dir, MI_TABLE_NAME);
+    tbl_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (tbl_fd < 0) {
+        log_error("open %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct mi_header h;
+    struct stat st;
+    memset(&h, 0, sizeof(h));
+    if (fstat(tbl_fd, &st) != 0 || pread(tbl_fd, &h, sizeof(h), 0) < 0) {
+        log_error("read %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+    uint64_t n = h.nslots;
+    if (memcmp(h.magic, MI_MAGIC, 8) != 0 || h.slot_size != MI_SLOT_SIZE ||
+        n == 0 || (n & (n - 1)) != 0 ||
+        (uint64_t)st.st_size != MI_HEADER_SIZE + n * MI_SLOT_SIZE) {
+        if (st.st_size > 0) {
+            log_warning("%s is not a valid index, create a new one", path);
+        }
+        n = 1024;
+        while (n < (uint64_t)metaidx_slots) {
+            n = n * 2;
+        }
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, MI_MAGIC, 8);
+        h.slot_size = MI_SLOT_SIZE;
+        h.nslots = n;
+        if (ftruncate(tbl_fd, 0) != 0 ||
+            ftruncate(tbl_fd, MI_HEADER_SIZE + n * MI_SLOT_SIZE) != 0 ||
+            pwrite(tbl_fd, &h, sizeof(h), 0) != sizeof(h)) {
+            log_error("create %s failed: %s", path, strerror(errno));
+            return -1;
+        }
+        // 新的散列表不能重放原来的日志
+        char wal[MAX_PATH_LEN + 32];
+        snprintf(wal, sizeof(wal), "%s/%s", mi_dir, MI_WAL_NAME);
+        (void) unlink(wal);
+    } else {
+        // 使用已有的散列表
+    }
+    return map_table(tbl_fd, n);
+}
+
+int init_metaidx(void)
+{
+    snprintf(mi_dir, sizeof(mi_dir), "%s/%s", backend_dirs[0], METAIDX_DIR);
+    if (mkdir(mi_dir, 0755) != 0 && errno != EEXIST) {
+        log_error("mkdir %s failed: %s", mi_dir, strerror(errno));
+        return -1;
+    }
+    dir_fd = open(mi_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        log_error("open %s failed: %s", mi_dir, strerror(errno));
+        return -1;
+    }
+    if (open_table() != 0) {
+        return -1;
+    }
+    check_slots();
+    rebuild_links();
+
+    char wal[MAX_PATH_LEN + 32];
+    snprintf(wal, sizeof(wal), "%s/%s", mi_dir, MI_WAL_NAME);
+    wal_fd = open(wal, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (wal_fd < 0) {
+        log_error("open %s failed: %s", wal, strerror(errno));
+        return -1;
+    }
+    if (replay_wal() < 0 || checkpoint() != 0) {
+        return -1;
+    }
+    mi_enabled = 1;
+    log_info("metaidx %s: %lu entries in %lu slots", mi_dir, nr_used, nslots);
+    return 0;
+}
+
+void drop_metaidx(void)
+{
+    const char *names[] = {MI_TABLE_NAME, MI_WAL_NAME};
+    char path[MAX_PATH_LEN + 32];
+    int i;
+    for (i = 0; i < 2 && backend_cnt > 0; i++) {
+        snprintf(path, sizeof(path), "%s/%s/%s", backend_dirs[0], METAIDX_DIR, names[i]);
+        if (unlink(path) == 0) {
+            log_info("metaidx is off, drop %s", path);
+        } else {
+            // 没有使用过索引
+        }
+    }
+}
+
+int metaidx_get(const char *path, struct metaidx_entry *e)
+{
+    char key[MI_KEY_MAX];
+    int len;
+    if (!mi_enabled || (len = make_key(path, key, NULL)) < 0) {
+        return -1;
+    }
+
+    int ret = -1;
+    pthread_mutex_lock(&mi_lock);
+    int64_t i = find_key(key, len);
+    if (i >= 0 && slots[i].type == MI_FILE) {
+        struct mi_slot *s = &slots[i];
+        e->size = s->size;
+        e->mtime = s->mtime;
+        memcpy(e->md5, s->md5, MD5_LEN);
+        e->md5[MD5_LEN] = '\0';
+        e->packed = (s->flags & MI_PACKED) != 0;
+        e->mask = s->mask;
+        ret = 0;
+    } else {
+        // 不在索引中
+    }
+    pthread_mutex_unlock(&mi_lock);
+    return ret;
+}
+
+void metaidx_put(const char *path, int64_t size, const char *md5, int packed)
+{
+    char key[MI_KEY_MAX];
+    int len;
+    if (!mi_enabled || (len = make_key(path, key, NULL)) < 0) {
+        return;
+    }
+
+    struct mi_record r;
+    init_record(&r, MI_OP_SET);
+    r.flags = packed ? MI_PACKED : 0;
+    r.mask = (1 << backend_cnt) - 1;
+    r.size = size;
+    r.mtime = time(NULL);
+    memcpy(r.md5, md5, strnlen(md5, MD5_LEN));
+
+    pthread_mutex_lock(&mi_lock);
+    r.stamp = scan_clock;
+    (void) do_record(&r, key, len);
+    (void) flush_wal();
+    uint64_t written = wal_written;
+    pthread_mutex_unlock(&mi_lock);
+    sync_wal(written);
+}
+
+static void remove_locked(const char *key, int len)
+{
+    if (find_key(key, len) >= 0) {
+        struct mi_record r;
+        init_record(&r, MI_OP_DEL);
+        (void) do_record(&r, key, len);
+    } else {
+        // 不在索引中
+    }
+}
+
+static void invalidate_locked(const char *key, int len)
+{
+    int l;
+    for (l = len; l > 0; l = parent_len(key, l)) {
+        int64_t i = find_key(key, l);
+        if (i >= 0 && slots[i].type == MI_DIR && (slots[i].flags & MI_COMPLETE)) {
+            struct mi_record r;
+            init_record(&r, MI_OP_DIR);
+            r.flags = slots[i].flags & ~MI_COMPLETE;
+            (void) do_record(&r, key, l);
+        } else {
+            // 不完整的目录不需要修改
+        }
+    }
+    changed_at = scan_clock;
+}
+
+void metaidx_remove(const char *path)
+{
+    char key[MI_KEY_MAX];
+    int len;
+    if (!mi_enabled || (len = make_key(path, key, NULL)) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&mi_lock);
+    remove_locked(key, len);
+    changed_at = scan_clock;
+    (void) flush_wal();
+    uint64_t written = wal_written;
+    pthread_mutex_unlock(&mi_lock);
+    sync_wal(written);
+}
+
+void metaidx_rename(const char *oldpath, const char *newpath)
+{
+    char oldkey[MI_KEY_MAX];
+    char newkey[MI_KEY_MAX];
+    int oldlen, newlen;
+    if (!mi_enabled) {
+        return;
+    }
+    oldlen = make_key(oldpath, oldkey, NULL);
+    newlen = make_key(newpath, newkey, NULL);
+
+    pthread_mutex_lock(&mi_lock);
+    int64_t i = oldlen > 0 ? find_key(oldkey, oldlen) : -1;
+    if (i >= 0 && slots[i].type == MI_FILE && newlen > 0) {
+        // 文件的属性不变
+        struct mi_slot *s = &slots[i];
+        struct mi_record r;
+        init_record(&r, MI_OP_SET);
+        r.flags = s->flags & MI_PACKED;
+        r.mask = s->mask;
+        r.stamp = scan_clock;
+        r.size = s->size;
+        r.mtime = s->mtime;
+        memcpy(r.md5, s->md5, MD5_LEN);
+        remove_locked(oldkey, oldlen);
+        (void) do_record(&r, newkey, newlen);
+    } else {
+        if (oldlen > 0) {
+            remove_locked(oldkey, oldlen);
+        }
+        if (newlen > 0) {
+            remove_locked(newkey, newlen);
+            invalidate_locked(newkey, newlen);
+        }
+    }
+    changed_at = scan_clock;
+    (void) flush_wal();
+    uint64_t written = wal_written;
+    pthread_mutex_unlock(&mi_lock);
+    sync_wal(written);
+}
+
+void metaidx_invalidate(const char *path)
+{
+    char key[MI_KEY_MAX];
+    int len;
+    if (!mi_enabled || (len = make_key(path, key, NULL)) < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&mi_lock);
+    invalidate_locked(key, len);
+    (void) flush_wal();
+    uint64_t written = wal_written;
+    pthread_mutex_unlock(&mi_lock);
+    sync_wal(written);
+}
+
+static int snapshot_add(struct mi_snapshot *b, const struct mi_slot *s, int cut)
+{
+    size_t need = 8 + (s->keylen - cut) + 1;
+    if (b->used + need > b->cap) {
+        size_t cap = b->cap > 0 ? b->cap * 2 : 64 * 1024;
+        while (b->used + need > cap) {
+            cap = cap * 2;
+        }
+        char *p = realloc(b->buf, cap);
+        if (p == NULL) {
+            log_error("malloc %lu bytes failed", cap);
+            return -1;
+        }
+        b->buf = p;
+        b->cap = cap;
+    }
+    memcpy(b->buf + b->used, &s->size, 8);
+    memcpy(b->buf + b->used + 8, s->key + cut, s->keylen - cut);
+    b->buf[b->used + need - 1] = '\0';
+    b->used = b->used + need;
+    b->nr = b->nr + 1;
+    return 0;
+}
+
+static int snapshot_tree(struct mi_snapshot *b, uint64_t i, int cut)
+{
+    uint32_t c;
+    for (c = links[i].child; c != 0; c = links[c - 1].next) {
+        const struct mi_slot *s = &slots[c - 1];
+        int rc = s->type == MI_FILE ? snapshot_add(b, s, cut) : snapshot_tree(b, c - 1, cut);
+        if (rc != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+char *metaidx_list(const char *dirpath, int *nr, uint32_t *scan)
+{
+    char key[MI_KEY_MAX];
+    int len;
+    *nr = 0;
+    *scan = 0;
+    if (!mi_enabled || (len = make_key(dirpath, key, NULL)) < 0) {
+        return NULL;
+    }
+
+    struct mi_snapshot b;
+    memset(&b, 0, sizeof(b));
+    int found = 0;
+    pthread_mutex_lock(&mi_lock);
+    int64_t i = find_key(key, len);
+    if (i >= 0 && slots[i].type == MI_DIR && is_complete(i)) {
+        found = snapshot_tree(&b, i, len + 1) == 0;
+    } else {
+        // 需要遍历目录
+    }
+    if (!found) {
+        scan_clock = scan_clock + 1;
+        *scan = scan_clock;
+    }
+    pthread_mutex_unlock(&mi_lock);
+
+    if (found && b.buf == NULL) {
+        // 空的目录
+        b.buf = malloc(1);
+        found = b.buf != NULL;
+    }
+    if (found) {
+        *nr = b.nr;
+        return b.buf;
+    } else {
+        free(b.buf);
+        return NULL;
+    }
+}
+
+void metaidx_import(const char *path, int64_t size, int64_t mtime,
+                    int packed, uint32_t scan)
+{
+    char key[MI_KEY_MAX];
+    int len, bit;
+    if (!mi_enabled || scan == 0 || (len = make_key(path, key, &bit)) < 0) {
+        return;
+    }
+
+    struct mi_record r;
+    init_record(&r, MI_OP_SET);
+    r.flags = packed ? MI_PACKED : 0;
+    r.mask = bit;
+    r.stamp = scan;
+    r.size = size;
+    r.mtime = mtime;
+
+    pthread_mutex_lock(&mi_lock);
+    int64_t i = find_key(key, len);
+    if (i >= 0 && slots[i].type == MI_FILE) {
+        struct mi_slot *s = &slots[i];
+        if (s->size == size && (s->mask & bit) && (s->flags & MI_PACKED) == r.flags) {
+            // 索引中的记录没有变化，只记下这次遍历看到了这个文件
+            if (s->stamp < scan) {
+                s->stamp = scan;
+                seal(s);
+            }
+            pthread_mutex_unlock(&mi_lock);
+            return;
+        }
+        // 后端的文件和索引不一致，以后端的文件为准
+        r.mask = s->mask | bit;
+        r.stamp = s->stamp > scan ? s->stamp : scan;
+        if (s->size == size) {
+            r.mtime = s->mtime;
+            memcpy(r.md5, s->md5, MD5_LEN);
+        }
+    }
+    (void) do_record(&r, key, len);
+    pthread_mutex_unlock(&mi_lock);
+}
+
+static int collect_stale(uint64_t i, uint32_t scan, uint64_t **out, int *nr, int *cap)
+{
+    uint32_t c;
+    for (c = links[i].child; c != 0; c = links[c - 1].next) {
+        const struct mi_slot *s = &slots[c - 1];
+        if (s->type == MI_DIR) {
+            if (collect_stale(c - 1, scan, out, nr, cap) != 0) {
+                return -1;
+            }
+        } else if (s->stamp < scan) {
+            if (*nr == *cap) {
+                int n = *cap > 0 ? *cap * 2 : 64;
+                uint64_t *p = realloc(*out, n * sizeof(uint64_t));
+                if (p == NULL) {
+                    log_error("malloc %d stale entries failed", n);
+                    return -1;
+                }
+                *out = p;
+                *cap = n;
+            }
+            (*out)[*nr] = c - 1;
+            *nr = *nr + 1;
+        } else {
+            // 这次遍历看到了，或者遍历开始以后上传的
+        }
+    }
+    return 0;
+}
+
+void metaidx_complete(const char *dirpath, uint32_t scan)
+{
+    char key[MI_KEY_MAX];
+    int len;
+    if (!mi_enabled || scan == 0 || (len = make_key(dirpath, key, NULL)) < 0) {
+        return;
+    }
+
+    uint64_t *stale = NULL;
+    int nr = 0, cap = 0;
+    pthread_mutex_lock(&mi_lock);
+    int64_t i = find_key(key, len);
+    if (i >= 0 && slots[i].type == MI_DIR &&
+        collect_stale(i, scan, &stale, &nr, &cap) == 0) {
+        // 删除后端已经没有的文件，删除文件不会移动其他槽
+        int k;
+        for (k = 0; k < nr; k++) {
+            struct mi_slot *s = &slots[stale[k]];
+            struct mi_record r;
+            init_record(&r, MI_OP_DEL);
+            r.keylen = s->keylen;
+            log_record(&r, s->key);
+            remove_slot(stale[k]);
+        }
+    }
+    free(stale);
+
+    if (changed_at < scan) {
+        struct mi_record r;
+        init_record(&r, MI_OP_DIR);
+        r.flags = MI_COMPLETE;
+        (void) do_record(&r, key, len);
+    } else {
+        // 遍历期间有删除或者重命名，遍历的结果可能已经过时
+    }
+    (void) flush_wal();
+    pthread_mutex_unlock(&mi_lock);
+    log_debug("metaidx: %s listed, %d stale entries removed", dirpath, nr);
+}
+
+#ifdef CONFIG_UNITTEST
+
+static void close_metaidx(void)
+{
+    mi_enabled = 0;
+    munmap(hdr, map_len);
+    hdr = NULL;
+    slots = NULL;
+    free(links);
+    links = NULL;
+    close(tbl_fd);
+    close(wal_fd);
+    close(dir_fd);
+    nslots = 0;
+    scan_clock = 0;
+    changed_at = 0;
+    wal_used = 0;
+    wal_size = 0;
+}
+
+void test_metaidx(void)
+{
+    char root[] = "/tmp/test_metaidx.XXXXXX";
+    assert(mkdtemp(root) != NULL);
+    backend_cnt = 1;
+    snprintf(backend_dirs[0], sizeof(backend_dirs[0]), "%s", root);
+    metaidx_slots = 1024;
+    assert(init_metaidx() == 0);
+
+    char path[MAX_PATH_LEN];
+    struct metaidx_entry e;
+    int i;
+    for (i = 0; i < 3000; i++) {
+        snprintf(path, sizeof(path), "%s/62/17/4/22/P1/s%d/f%04d", root, i % 3, i);
+        metaidx_put(path, 1000 + i, "0123456789abcdef0123456789abcdef", i % 2);
+    }
+    assert(nslots > 1024);
+    snprintf(path, sizeof(path), "%s/62//17/4/22/P1/s1/f0100/", root);
+    assert(metaidx_get(path, &e) == 0);
+    assert(e.size == 1100 && e.packed == 0 && !strcmp(e.md5, "0123456789abcdef0123456789abcdef"));
+
+    // 第一次列出时遍历，导入以后从索引中列出，没有看到的文件被删除
+    int nr;
+    uint32_t scan;
+    snprintf(path, sizeof(path), "%s/62/17/4/22/P1", root);
+    assert(metaidx_list(path, &nr, &scan) == NULL && scan > 0);
+    char file[MAX_PATH_LEN];
+    snprintf(file, sizeof(file), "%s/62/17/4/22/P1/s0/bak", root);
+    metaidx_import(file, 7, 0, 0, scan);
+    for (i = 1; i < 3000; i++) {
+        snprintf(file, sizeof(file), "%s/62/17/4/22/P1/s%d/f%04d", root, i % 3, i);
+        metaidx_import(file, 1000 + i, 0, i % 2, scan);
+    }
+    metaidx_complete(path, scan);
+    char *list = metaidx_list(path, &nr, &scan);
+    assert(list != NULL && nr == 3000);
+    free(list);
+    snprintf(file, sizeof(file), "%s/62/17/4/22/P1/s0/f0000", root);
+    assert(metaidx_get(file, &e) == -1);
+
+    // 删除和重命名，重启后重放日志
+    snprintf(file, sizeof(file), "%s/62/17/4/22/P1/s1/f0001", root);
+    metaidx_remove(file);
+    snprintf(file, sizeof(file), "%s/62/17/4/22/P1/s2/f0002", root);
+    snprintf(path, sizeof(path), "%s/62/17/4/22/P1/s2/g0002", root);
+    metaidx_rename(file, path);
+    snprintf(file, sizeof(file), "%s/62/17/4/22/P1/s1", root);
+    metaidx_remove(file);
+    close_metaidx();
+    assert(init_metaidx() == 0);
+    assert(metaidx_get(path, &e) == 0 && e.size == 1002);
+    snprintf(file, sizeof(file), "%s/62/17/4/22/P1/s1/f0004", root);
+    assert(metaidx_get(file, &e) == -1);
+    snprintf(path, sizeof(path), "%s/62/17/4/22/P1", root);
+    list = metaidx_list(path, &nr, &scan);
+    assert(list != NULL && nr == 2000);
+    free(list);
+
+    // 备份操作之后目录需要重新遍历
+    snprintf(file, sizeof(file), "%s/62/17/4/22/P1/s0", root);
+    metaidx_invalidate(file);
+    assert(metaidx_list(path, &nr, &scan) == NULL);
+    close_metaidx();
+
+    char command[256];
+    snprintf(command, sizeof(command), "rm -rf %s", root);
+    assert(system(command) == 0);
+}
+
+#endif  /* CONFIG_UNITTEST */
@@ -0,0 +1,110 @@
+#ifndef METAIDX_H
+#define METAIDX_H
+
+#include <stdint.h>
+
+/*
+ * 文件元数据索引
+ *
+ * tunable metaidx 打开时，所有上传完成的文件都记录在一个嵌入的索引中：用户 id
+ * 和文件名（也就是文件在后端目录下的路径）对应文件的大小、md5、上传时间和存
+ * 放位置（哪些后端，是否打包存放）。开始下载、顺序下载和获取文件列表时先查找
+ * 索引，找到了就不再 stat()/access() 每个后端上的文件，也不再读 md5sum.txt。
+ *
+ * 索引保存在第一个后端目录的 METAIDX_DIR 中：
+ *
+ *   metaidx.tbl  用 mmap() 映射的开放寻址散列表，每个文件和目录一个槽，每个
+ *                槽带有校验和
+ *   metaidx.wal  预写日志，每次修改先应用到散列表，再追加一条记录。日志超过
+ *                METAIDX_WAL_MAX 时 msync() 散列表，然后清空日志
+ *
+ * 启动时丢弃校验和不对的槽（崩溃时没有完整写入），然后按顺序重放日志，日志
+ * 尾部不完整的记录被丢弃。日志的持久化跟随 upload_durability：fsync 模式下每
+ * 条记录 fdatasync()，group 模式下由组提交对后端文件系统的 syncfs() 一起写入
+ * 磁盘，所以上传完成响应发出时，索引中的记录和文件一样已经写入磁盘。
+ *
+ * 目录的父子关系只保存在内存中，启动时根据路径名重建。
+ *
+ * 获取文件列表：一个目录第一次被列出时仍然遍历文件系统，同时把遍历到的文件导
+ * 入索引；遍历成功后目录标记为完整，之后直接从索引中列出这个目录树。上传、删
+ * 除、重命名和备份操作同时更新索引；备份操作会在目录中产生新的备份文件，所在
+ * 的目录以及上级目录被标记为不完整，下次列出时重新遍历。metaidx 关闭时启动会
+ * 删除已有的索引，因为这期间的上传和删除没有记录在索引中。
+ *
+ * 索引中找不到的文件仍然到后端目录中查找，索引只是减少文件系统访问，不改变请
+ * 求的结果。
+ */
+
+#define METAIDX_DIR      ".sgwmeta"
+#define METAIDX_WAL_MAX  (16 * 1024 * 1024)
+
+/* 索引中的一个文件 */
+struct metaidx_entry {
+    int64_t size;
+    int64_t mtime;          // 上传完成的时间，导入的文件是修改时间
+    char md5[32 + 1];       // MD5_LEN + 1，空字符串表示不知道 md5
+    int packed;             // 文件打包存放，见 pack.h
+    int mask;               // 保存了这个文件的后端，第 i 位对应 backend_dirs[i]
+};
+
+/*
+ * 打开或者创建索引，重放日志。成功返回 0，失败返回 -1
+ */
+extern int init_metaidx(void);
+
+/*
+ * 查找绝对路径 path 对应的文件。找到返回 0，不在索引中或者索引没有打开返回 -1
+ */
+extern int metaidx_get(const char *path, struct metaidx_entry *e);
+
+/*
+ * 记录上传完成的文件
+ */
+extern void metaidx_put(const char *path, int64_t size, const char *md5,
+                        int packed);
+
+/*
+ * 删除文件，path 是目录时删除整个目录树
+ */
+extern void metaidx_remove(const char *path);
+
+/*
+ * 文件被重命名。path 是目录或者不在索引中时，删除 oldpath，newpath 所在的目录
+ * 标记为不完整
+ */
+extern void metaidx_rename(const char *oldpath, const char *newpath);
+
+/*
+ * path 以及上级目录标记为不完整，下次列出时重新遍历
+ */
+extern void metaidx_invalidate(const char *path);
+
+/*
+ * metaidx 关闭时删除已有的索引
+ */
+extern void drop_metaidx(void);
+
+/*
+ * 列出完整的目录 dirpath 下的所有文件。返回的缓冲区中依次是 8 字节的文件大小
+ * 和以 '\0' 结尾的、相对于 dirpath 的路径名，由调用者 free()，文件个数保存在
+ * *nr 中。
+ *
+ * 目录不完整时返回 NULL，*scan 是这次遍历的编号，遍历到的文件用
+ * metaidx_import() 导入，遍历成功后调用 metaidx_complete()；索引没有打开，或者
+ * 目录不在后端目录下时 *scan 为 0，不需要导入
+ */
+extern char *metaidx_list(const char *dirpath, int *nr, uint32_t *scan);
+
+/*
+ * 导入遍历到的文件
+ */
+extern void metaidx_import(const char *path, int64_t size, int64_t mtime,
+                           int packed, uint32_t scan);
+
+/*
+ * 遍历 dirpath 成功。目录下这次遍历没有看到的文件从索引中删除，遍历期间没有
+ * 删除和重命名时把目录标记为完整
+ */
+extern void metaidx_complete(const char *dirpath, uint32_t scan);
+
+#endif  /* METAIDX_H */
@@ -0,0 +1,1348 @@
+
+// pack.c
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#include "config.h"
+#include "mt_log.h"
+#include "public.h"
+#include "conn_mgmt.h"
+#include "tunables.h"
+#include "jobq.h"
+#include "gcommit.h"
+#include "pack.h"
+
+extern int backend_cnt;
+extern int range_crush(int fd, off_t offset, off_t size, int nr_crush);
+
+#define PACK_CACHE_MAX      128     // 缓存的包的个数
+#define PACK_CACHE_BUCKETS  256
+#define PACK_NIL            (-1)
+#define PACK_COPY_CHUNK     (1024 * 1024)
+
+struct pack_upload {
+    int64_t size;
+    uint8_t data[];
+};
+
+// 包中的一个文件，seg 为 -1 表示已经删除
+struct pack_file {
+    char *name;
+    int seg;
+    int64_t offset;
+    int64_t len;
+    char md5[MD5_LEN + 1];
+    int hnext;
+};
+
+// 一个目录的包，索引在第一次使用时读入内存
+struct pack {
+    char *dir;
+    int dirlen;
+    uint32_t hash;
+    int refs;
+    int stale;              // 已经从缓存中移除，最后一个使用者释放
+    int dead;               // 已经失效，不能再修改，由 lock 保护
+    struct pack *hnext;
+    struct pack *prev;      // LRU 链表，表头是最近使用的
+    struct pack *next;
+
+    pthread_mutex_t lock;
+    int idx_fd;             // 索引，-1 表示还没有创建
+    int seg;                // 当前追加的段号
+    int seg_fd;             // 当前追加的段，-1 表示还没有打开
+    int64_t seg_size;
+    int compacting;         // 已经提交了压缩任务
+
+    int nr_files;           // files 中使用的个数，包括已经删除的
+    int cap;
+    int nbuckets;
+    int *buckets;
+    struct pack_file *files;
+    int64_t live_bytes;     // 有效文件的字节数
+    int64_t dead_bytes;     // 被删除和覆盖的字节数
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pack *cache_buckets[PACK_CACHE_BUCKETS];
+static struct pack *lru_head = NULL;
+static struct pack *lru_tail = NULL;
+static int nr_cached = 0;
+static uint64_t cache_gen = 0;      // 每移除一个包加一，锁外读入的索引可能过时
+
+static uint32_t hash_name(const char *s, int len)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261U;
+    int i;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)s[i]) * 16777619U;
+    }
+    return h;
+}
+
+int is_pack_file(const char *name)
+{
+    // 索引和压缩时写出的临时索引都以 PACK_INDEX_NAME 开头
+    return !strncmp(name, PACK_INDEX_NAME, strlen(PACK_INDEX_NAME)) ||
+        !strncmp(name, PACK_SEGMENT_PREFIX, strlen(PACK_SEGMENT_PREFIX));
+}
+
+// 缓存的描述符移到 MAX_CONNS_CNT 以上，不占用连接表使用的描述符
+static int high_fd(int fd)
+{
+    if (fd < 0 || fd >= MAX_CONNS_CNT) {
+        return fd;
+    }
+    int hfd = fcntl(fd, F_DUPFD_CLOEXEC, MAX_CONNS_CNT);
+    if (hfd >= 0) {
+        close(fd);
+        return hfd;
+    } else {
+        return fd;
+    }
+}
+
+static void pack_path(char *out, size_t maxlen, struct pack *p, const char *name)
+{
+    snprintf(out, maxlen, "%.*s/%s", p->dirlen, p->dir, name);
+}
+
+static void segment_path(char *out, size_t maxlen, struct pack *p, int seg)
+{
+    snprintf(out, maxlen, "%.*s/%s%d", p->dirlen, p->dir, PACK_SEGMENT_PREFIX, seg);
+}
+
+static int find_file(struct pack *p, const char *name)
+{
+    int len = strlen(name);
+    int i = p->buckets[hash_name(name, len) & (p->nbuckets - 1)];
+    while (i != PACK_NIL) {
+        if (!strcmp(p->files[i].name, name)) {
+            return i;
+        }
+        i = p->files[i].hnext;
+    }
+    return PACK_NIL;
+}
+
+static void unlink_file(struct pack *p, int i)
+{
+    struct pack_file *f = &p->files[i];
+    int *q = &p->buckets[hash_name(f->name, strlen(f->name)) & (p->nbuckets - 1)];
+    while (*q != i) {
+        q = &p->files[*q].hnext;
+    }
+    *q = f->hnext;
+    p->live_bytes = p->live_bytes - f->len;
+    p->dead_bytes = p->dead_bytes + f->len;
+    f->seg = -1;
+}
+
+static int rehash_files(struct pack *p, int nbuckets)
+{
+    int *buckets = malloc(nbuckets * sizeof(int));
+    if (buckets == NULL) {
+        log_error("malloc %d buckets failed", nbuckets);
+        return -1;
+    }
+    int i;
+    for (i = 0; i < nbuckets; i++) {
+        buckets[i] = PACK_NIL;
+    }
+    for (i = 0; i < p->nr_files; i++) {
+        struct pack_file *f = &p->files[i];
+        if (f->seg >= 0) {
+            int b = hash_name(f->name, strlen(f->name)) & (nbuckets - 1);
+            f->hnext = buckets[b];
+            buckets[b] = i;
+        } else {
+            // 已经删除的文件不在哈希链表中
+        }
+    }
+    free(p->buckets);
+    p->buckets = buckets;
+    p->nbuckets = nbuckets;
+    return 0;
+}
+
+// 记录一个文件，覆盖同名的文件
+static int add_file(struct pack *p, const char *name, int seg,
+                    int64_t offset, int64_t len, const char *md5)
+{
+    int old = find_file(p, name);
+    if (old != PACK_NIL) {
+        unlink_file(p, old);
+    }
+    if (p->nr_files == p->cap) {
+        int cap = p->cap ? p->cap * 2 : 64;
+        struct pack_file *files = realloc(p->files, cap * sizeof(struct pack_file));
+        if (files == NULL) {
+            log_error("malloc %d pack files failed", cap);
+            return -1;
+        }
+        p->files = files;
+        p->cap = cap;
+    }
+    if (p->nr_files >= p->nbuckets / 2 && rehash_files(p, p->nbuckets * 2) != 0) {
+        return -1;
+    }
+
+    struct pack_file *f = &p->files[p->nr_files];
+    f->name = strdup(name);
+    if (f->name == NULL) {
+        return -1;
+    }
+    f->seg = seg;
+    f->offset = offset;
+    f->len = len;
+    snprintf(f->md5, sizeof(f->md5), "%s", md5);
+    int b = hash_name(name, strlen(name)) & (p->nbuckets - 1);
+    f->hnext = p->buckets[b];
+    p->buckets[b] = p->nr_files;
+    p->nr_files = p->nr_files + 1;
+    p->live_bytes = p->live_bytes + len;
+    return 0;
+}
+
+static void clear_files(struct pack *p)
+{
+    int i;
+    for (i = 0; i < p->nr_files; i++) {
+        free(p->files[i].name);
+    }
+    p->nr_files = 0;
+    for (i = 0; i < p->nbuckets; i++) {
+        p->buckets[i] = PACK_NIL;
+    }
+    p->live_bytes = 0;
+    p->dead_bytes = 0;
+}
+
+// 解析索引中的一行，行尾的换行符已经去掉
+static int parse_record(struct pack *p, char *line)
+{
+    if (line[0] == '-' && line[1] == ' ') {
+        int i = find_file(p, line + 2);
+        if (i != PACK_NIL) {
+            unlink_file(p, i);
+        }
+        return 0;
+    }
+
+    int seg;
+    long long offset, len;
+    char md5[MD5_LEN + 1];
+    int n = 0;
+    if (line[0] == '+' &&
+        sscanf(line, "+ %d %lld %lld %32s %n", &seg, &offset, &len, md5, &n) == 4 &&
+        n > 0 && line[n] != '\0') {
+        if (seg > p->seg) {
+            p->seg = seg;
+        }
+        return add_file(p, line + n, seg, offset, len, md5);
+    } else {
+        log_error("%.*s/%s: bad record: %s", p->dirlen, p->dir, PACK_INDEX_NAME, line);
+        return 0;
+    }
+}
+
+// 读入索引。没有写完的最后一行被截掉，之后追加的记录从新的一行开始
+static int load_index(struct pack *p)
+{
+    char path[MAX_PATH_LEN + 1];
+    pack_path(path, sizeof(path), p, PACK_INDEX_NAME);
+    int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            return 0;
+        }
+        log_error("open %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) != 0 || (buf = malloc(st.st_size + 1)) == NULL) {
+        log_error("read %s failed: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    int64_t done = 0;
+    while (done < st.st_size) {
+        ssize_t n = pread(fd, buf + done, st.st_size - done, done);
+        if (n > 0) {
+            done = done + n;
+        } else if (n < 0 && errno == EINTR) {
+            // 系统调用被中断，继续读取
+        } else {
+            break;
+        }
+    }
+
+    int64_t end = done;
+    while (end > 0 && buf[end - 1] != '\n') {
+        end = end - 1;
+    }
+    if (end < done) {
+        log_warning("%s: drop %lld bytes of incomplete record", path,
+                    (long long int)(done - end));
+        if (ftruncate(fd, end) != 0) {
+            log_error("truncate %s failed: %s", path, strerror(errno));
+        }
+    }
+
+    char *line = buf;
+    while (line < buf + end) {
+        char *nl = memchr(line, '\n', buf + end - line);
+        *nl = '\0';
+        if (parse_record(p, line) != 0) {
+            free(buf);
+            close(fd);
+            return -1;
+        }
+        line = nl + 1;
+    }
+    free(buf);
+    p->idx_fd = high_fd(fd);
+    return 0;
+}
+
+static void free_pack(struct pack *p)
+{
+    clear_files(p);
+    if (p->idx_fd >= 0) {
+        close(p->idx_fd);
+    }
+    if (p->seg_fd >= 0) {
+        close(p->seg_fd);
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p->files);
+    free(p->buckets);
+    free(p->dir);
+    free(p);
+}
+
+static struct pack *create_pack(const char *dir, int dirlen, uint32_t hash)
+{
+    struct pack *p = calloc(1, sizeof(struct pack));
+    if (p == NULL) {
+        log_error("malloc pack failed");
+        return NULL;
+    }
+    p->dir = strndup(dir, dirlen);
+    p->dirlen = dirlen;
+    p->hash = hash;
+    p->idx_fd = -1;
+    p->seg_fd = -1;
+    pthread_mutex_init(&p->lock, NULL);
+    if (p->dir == NULL || rehash_files(p, 64) != 0 || load_index(p) != 0) {
+        free_pack(p);
+        return NULL;
+    }
+    return p;
+}
+
+// 调用者持有 cache_lock
+static void lru_unlink(struct pack *p)
+{
+    if (p->prev != NULL) {
+        p->prev->next = p->next;
+    } else {
+        lru_head = p->next;
+    }
+    if (p->next != NULL) {
+        p->next->prev = p->prev;
+    } else {
+        lru_tail = p->prev;
+    }
+}
+
+static void lru_push(struct pack *p)
+{
+    p->prev = NULL;
+    p->next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->prev = p;
+    } else {
+        lru_tail = p;
+    }
+    lru_head = p;
+}
+
+/*
+ * 调用者持有 cache_lock，把包从缓存中移除，没有使用者时释放。等待正在进行的修
+ * 改完成后标记为失效，之后的修改重新读入索引，不会和新的包追加到同一个位置
+ */
+static void drop_pack(struct pack *p)
+{
+    struct pack **q = &cache_buckets[p->hash % PACK_CACHE_BUCKETS];
+    while (*q != p) {
+        q = &(*q)->hnext;
+    }
+    *q = p->hnext;
+    lru_unlink(p);
+    nr_cached = nr_cached - 1;
+    cache_gen = cache_gen + 1;
+    p->stale = 1;
+    pthread_mutex_lock(&p->lock);
+    p->dead = 1;
+    pthread_mutex_unlock(&p->lock);
+    if (p->refs == 0) {
+        free_pack(p);
+    } else {
+        // 最后一个使用者释放
+    }
+}
+
+// 调用者持有 cache_lock
+static struct pack *find_pack(const char *dir, int dirlen, uint32_t hash)
+{
+    struct pack *p = cache_buckets[hash % PACK_CACHE_BUCKETS];
+    while (p != NULL) {
+        if (p->hash == hash && p->dirlen == dirlen && !memcmp(p->dir, dir, dirlen)) {
+            break;
+        }
+        p = p->hnext;
+    }
+    return p;
+}
+
+/*
+ * 取得目录 dir[0, dirlen) 的包，用完后调用 put_pack()。索引在 cache_lock 之外
+ * 读入，读入期间有包被移除时重新读入
+ */
+static struct pack *get_pack(const char *dir, int dirlen)
+{
+    uint32_t hash = hash_name(dir, dirlen);
+    struct pack *fresh = NULL;
+    uint64_t gen = 0;
+    pthread_mutex_lock(&cache_lock);
+    struct pack *p = find_pack(dir, dirlen, hash);
+    while (p == NULL && (fresh == NULL || gen != cache_gen)) {
+        gen = cache_gen;
+        pthread_mutex_unlock(&cache_lock);
+        if (fresh != NULL) {
+            free_pack(fresh);
+        }
+        fresh = create_pack(dir, dirlen, hash);
+        if (fresh == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&cache_lock);
+        p = find_pack(dir, dirlen, hash);
+    }
+
+    if (p != NULL) {
+        lru_unlink(p);
+    } else {
+        p = fresh;
+        fresh = NULL;
+        p->hnext = cache_buckets[hash % PACK_CACHE_BUCKETS];
+        cache_buckets[hash % PACK_CACHE_BUCKETS] = p;
+        nr_cached = nr_cached + 1;
+
+        /* 淘汰最久没有使用的包 */
+        struct pack *victim = lru_tail;
+        while (nr_cached > PACK_CACHE_MAX && victim != NULL) {
+            struct pack *prev = victim->prev;
+            if (victim->refs == 0) {
+                drop_pack(victim);
+            }
+            victim = prev;
+        }
+    }
+    lru_push(p);
+    p->refs = p->refs + 1;
+    pthread_mutex_unlock(&cache_lock);
+    if (fresh != NULL) {
+        // 其他线程同时读入了同一个目录的包
+        free_pack(fresh);
+    }
+    return p;
+}
+
+static void put_pack(struct pack *p)
+{
+    pthread_mutex_lock(&cache_lock);
+    p->refs = p->refs - 1;
+    if (p->stale && p->refs == 0) {
+        free_pack(p);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// 取得并锁住目录的包，包已经失效时重新取得。用完后调用 unlock_pack()
+static struct pack *lock_pack(const char *dir, int dirlen)
+{
+    for (;;) {
+        struct pack *p = get_pack(dir, dirlen);
+        if (p == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&p->lock);
+        if (!p->dead) {
+            return p;
+        }
+        pthread_mutex_unlock(&p->lock);
+        put_pack(p);
+    }
+}
+
+static void unlock_pack(struct pack *p)
+{
+    pthread_mutex_unlock(&p->lock);
+    put_pack(p);
+}
+
+void pack_invalidate(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    while (lru_head != NULL) {
+        drop_pack(lru_head);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// 把绝对路径分成目录和文件名，返回目录的长度，路径中没有目录时返回 -1
+static int split_path(const char *path, const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL || slash[1] == '\0') {
+        return -1;
+    }
+    *name = slash + 1;
+    return slash == path ? 1 : slash - path;
+}
+
+static int write_all(int fd, const void *data, int64_t len, int64_t offset)
+{
+    int64_t done = 0;
+    while (done < len) {
+        ssize_t n = offset >= 0 ?
+            pwrite(fd, (const char *)data + done, len - done, offset + done) :
+            write(fd, (const char *)data + done, len - done);
+        if (n > 0) {
+            done = done + n;
+        } else if (n < 0 && errno == EINTR) {
+            // 系统调用被中断，继续写入
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 打开或者创建目录中的文件，目录不存在时创建
+static int open_in_dir(struct pack *p, const char *path, int flags)
+{
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == ENOENT && (flags & O_CREAT)) {
+        char dir[MAX_PATH_LEN + 1];
+        snprintf(dir, sizeof(dir), "%.*s", p->dirlen, p->dir);
+        char *s;
+        for (s = dir + 1; *s != '\0'; s++) {
+            if (*s == '/') {
+                *s = '\0';
+                (void) mkdir(dir, 0755);
+                *s = '/';
+            }
+        }
+        (void) mkdir(dir, 0755);
+        fd = open(path, flags | O_CLOEXEC, 0644);
+    }
+    if (fd < 0) {
+        log_error("open %s failed: %s", path, strerror(errno));
+    }
+    return fd;
+}
+
+/*
+ * 调用者持有 p->lock，把数据追加到当前的段，当前的段满了换下一个段。成功返
+ * 回 0，位置保存在 *seg 和 *offset 中
+ */
+static int append_segment(struct pack *p, const uint8_t *data, int64_t len,
+                          int *seg, int64_t *offset)
+{
+    if (p->seg_fd >= 0 && p->seg_size > 0 && p->seg_size + len > pack_segment_size) {
+        close(p->seg_fd);
+        p->seg_fd = -1;
+        p->seg = p->seg + 1;
+    }
+    char path[MAX_PATH_LEN + 1];
+    if (p->seg_fd < 0) {
+        segment_path(path, sizeof(path), p, p->seg);
+        int fd = open_in_dir(p, path, O_RDWR | O_CREAT);
+        if (fd < 0) {
+            return -1;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close(fd);
+            return -1;
+        }
+        p->seg_fd = high_fd(fd);
+        p->seg_size = st.st_size;
+        if (p->seg_size > 0 && p->seg_size + len > pack_segment_size) {
+            // 重新打开的段已经满了
+            return append_segment(p, data, len, seg, offset);
+        }
+    }
+
+    if (write_all(p->seg_fd, data, len, p->seg_size) != 0) {
+        segment_path(path, sizeof(path), p, p->seg);
+        log_error("write %lld bytes to %s failed: %s", (long long int)len,
+                  path, strerror(errno));
+        return -1;
+    }
+    if (upload_durability == DURABILITY_FSYNC && fdatasync(p->seg_fd) != 0) {
+        log_error("fdatasync segment %d of %.*s failed: %s", p->seg,
+                  p->dirlen, p->dir, strerror(errno));
+        return -1;
+    }
+    *seg = p->seg;
+    *offset = p->seg_size;
+    p->seg_size = p->seg_size + len;
+    return 0;
+}
+
+// 调用者持有 p->lock，向索引追加一条记录
+static int append_record(struct pack *p, const char *record, int len)
+{
+    if (p->idx_fd < 0) {
+        char path[MAX_PATH_LEN + 1];
+        pack_path(path, sizeof(path), p, PACK_INDEX_NAME);
+        int fd = open_in_dir(p, path, O_RDWR | O_CREAT | O_APPEND);
+        if (fd < 0) {
+            return -1;
+        }
+        p->idx_fd = high_fd(fd);
+    }
+    if (write_all(p->idx_fd, record, len, -1) != 0) {
+        log_error("write %.*s/%s failed: %s", p->dirlen, p->dir,
+                  PACK_INDEX_NAME, strerror(errno));
+        return -1;
+    }
+    if (upload_durability == DURABILITY_FSYNC && fdatasync(p->idx_fd) != 0) {
+        log_error("fdatasync %.*s/%s failed: %s", p->dirlen, p->dir,
+                  PACK_INDEX_NAME, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int pack_append(const char *path, const uint8_t *data, int64_t len,
+                       const char *md5)
+{
+    const char *name;
+    int dirlen = split_path(path, &name);
+    if (dirlen < 0 || strchr(name, '\n') != NULL) {
+        log_error("can not pack %s", path);
+        return -1;
+    }
+    struct pack *p = lock_pack(path, dirlen);
+    if (p == NULL) {
+        return -1;
+    }
+
+    int seg;
+    int64_t offset;
+    char record[MAX_NAME_LEN + 128];
+    int rc = append_segment(p, data, len, &seg, &offset);
+    if (rc == 0) {
+        int n = snprintf(record, sizeof(record), "+ %d %lld %lld %s %s\n",
+                         seg, (long long int)offset, (long long int)len, md5, name);
+        rc = append_record(p, record, n);
+    }
+    if (rc == 0) {
+        rc = add_file(p, name, seg, offset, len, md5);
+    }
+    unlock_pack(p);
+
+    if (rc == 0 && unlink(path) != 0 && errno != ENOENT) {
+        log_warning("remove %s shadowing the packed file failed: %s",
+                    path, strerror(errno));
+    }
+    return rc;
+}
+
+static int compact_pack(struct pack *p);
+
+static int run_compact_job(struct job *j)
+{
+    const char *dir = j->data;
+    struct pack *p = get_pack(dir, strlen(dir));
+    if (p == NULL) {
+        return -1;
+    }
+    int rc = compact_pack(p);
+    pthread_mutex_lock(&p->lock);
+    p->compacting = 0;
+    pthread_mutex_unlock(&p->lock);
+    put_pack(p);
+    return rc;
+}
+
+// 调用者持有 p->lock，被删除和覆盖的数据超过一半时提交压缩任务
+static void maybe_compact(struct pack *p)
+{
+    if (p->compacting || p->dead_bytes == 0 || p->dead_bytes < p->live_bytes ||
+        p->dirlen >= JOB_DATA_SIZE) {
+        return;
+    }
+    struct job *j = alloc_job();
+    if (j == NULL) {
+        // 任务队列满了，下次删除时再压缩
+        return;
+    }
+    snprintf(j->data, sizeof(j->data), "%.*s", p->dirlen, p->dir);
+    j->run = run_compact_job;
+    j->done = NULL;
+    p->compacting = 1;
+    submit_job(j);
+}
+
+int pack_remove(const char *path)
+{
+    const char *name;
+    int dirlen = split_path(path, &name);
+    if (dirlen < 0) {
+        return -1;
+    }
+    struct pack *p = lock_pack(path, dirlen);
+    if (p == NULL) {
+        return -1;
+    }
+
+    int rc = -1;
+    int i = find_file(p, name);
+    if (i != PACK_NIL) {
+        char record[MAX_NAME_LEN + 8];
+        int n = snprintf(record, sizeof(record), "- %s\n", name);
+        rc = append_record(p, record, n);
+        if (rc == 0) {
+            unlink_file(p, i);
+            maybe_compact(p);
+        }
+    } else {
+        // 文件不在包中
+    }
+    unlock_pack(p);
+    return rc;
+}
+
+int pack_lookup(const char *path, struct pack_extent *x)
+{
+    const char *name;
+    int dirlen = split_path(path, &name);
+    if (dirlen < 0) {
+        return -1;
+    }
+    struct pack *p = lock_pack(path, dirlen);
+    if (p == NULL) {
+        return -1;
+    }
+
+    int i = find_file(p, name);
+    if (i != PACK_NIL) {
+        x->offset = p->files[i].offset;
+        x->len = p->files[i].len;
+        snprintf(x->md5, sizeof(x->md5), "%s", p->files[i].md5);
+    }
+    unlock_pack(p);
+    return i != PACK_NIL ? 0 : -1;
+}
+
+int pack_open(const char *path, struct pack_extent *x)
+{
+    const char *name;
+    int dirlen = split_path(path, &name);
+    if (dirlen < 0) {
+        return -1;
+    }
+    // 持有锁打开段文件，压缩不会在这之间删除它
+    struct pack *p = lock_pack(path, dirlen);
+    if (p == NULL) {
+        return -1;
+    }
+
+    int fd = -1;
+    int i = find_file(p, name);
+    if (i != PACK_NIL) {
+        char segpath[MAX_PATH_LEN + 1];
+        segment_path(segpath, sizeof(segpath), p, p->files[i].seg);
+        fd = open(segpath, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            x->offset = p->files[i].offset;
+            x->len = p->files[i].len;
+            snprintf(x->md5, sizeof(x->md5), "%s", p->files[i].md5);
+        } else {
+            log_error("open %s for %s failed: %s", segpath, path, strerror(errno));
+        }
+    }
+    unlock_pack(p);
+    return fd;
+}
+
+char *pack_list(const char *dirpath, int dirlen, int *nr)
+{
+    struct pack *p = lock_pack(dirpath, dirlen);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    int64_t size = 0;
+    int i;
+    for (i = 0; i < p->nr_files; i++) {
+        if (p->files[i].seg >= 0) {
+            size = size + 8 + strlen(p->files[i].name) + 1;
+        }
+    }
+    char *buf = size > 0 ? malloc(size) : NULL;
+    int n = 0;
+    if (buf != NULL) {
+        char *out = buf;
+        for (i = 0; i < p->nr_files; i++) {
+            struct pack_file *f = &p->files[i];
+            if (f->seg >= 0) {
+                int len = strlen(f->name) + 1;
+                memcpy(out, &f->len, 8);
+                memcpy(out + 8, f->name, len);
+                out = out + 8 + len;
+                n = n + 1;
+            }
+        }
+    }
+    unlock_pack(p);
+    *nr = n;
+    return buf;
+}
+
+// 删除段号在 [first, last] 中的段
+static void remove_segments(struct pack *p, int first, int last)
+{
+    char path[MAX_PATH_LEN + 1];
+    int seg;
+    for (seg = first; seg <= last; seg++) {
+        segment_path(path, sizeof(path), p, seg);
+        if (unlink(path) != 0 && errno != ENOENT) {
+            log_warning("remove %s failed: %s", path, strerror(errno));
+        }
+    }
+}
+
+// 压缩时复制的一个文件
+struct compact_file {
+    int i;                  // 在 p->files 中的下标
+    int seg;                // 复制前的位置
+    int64_t offset;
+    int64_t len;
+    int new_seg;            // 复制后的位置
+    int64_t new_offset;
+};
+
+// 压缩时写出的段，和追加的段分开编号
+struct compact_out {
+    int seg;
+    int fd;
+    int64_t size;
+    int64_t max;
+};
+
+// 把一个文件复制到压缩后的段，不持有 p->lock
+static int compact_copy(struct pack *p, struct compact_out *out, int src_fd,
+                        struct compact_file *cf, uint8_t *buf)
+{
+    char path[MAX_PATH_LEN + 1];
+    if (out->fd >= 0 && out->size > 0 && out->size + cf->len > out->max) {
+        int rc = fdatasync(out->fd);
+        close(out->fd);
+        out->fd = -1;
+        if (rc != 0) {
+            log_error("sync compacted %.*s failed: %s", p->dirlen, p->dir,
+                      strerror(errno));
+            return -1;
+        }
+        out->seg = out->seg + 1;
+    }
+    if (out->fd < 0) {
+        segment_path(path, sizeof(path), p, out->seg);
+        out->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out->fd < 0) {
+            log_error("open %s failed: %s", path, strerror(errno));
+            return -1;
+        }
+        out->size = 0;
+    }
+
+    // 大于缓冲区的文件逐段复制到同一个段
+    int64_t done = 0;
+    while (done < cf->len) {
+        int64_t want = cf->len - done < PACK_COPY_CHUNK ? cf->len - done : PACK_COPY_CHUNK;
+        ssize_t n = pread(src_fd, buf, want, cf->offset + done);
+        if (n != want) {
+            log_error("read segment %d of %.*s failed", cf->seg, p->dirlen, p->dir);
+            return -1;
+        }
+        if (write_all(out->fd, buf, n, out->size + done) != 0) {
+            segment_path(path, sizeof(path), p, out->seg);
+            log_error("write %s failed: %s", path, strerror(errno));
+            return -1;
+        }
+        done = done + n;
+    }
+    cf->new_seg = out->seg;
+    cf->new_offset = out->size;
+    out->size = out->size + cf->len;
+    return 0;
+}
+
+/*
+ * 调用者持有 p->lock，写出新的索引替换旧的索引。压缩期间没有变化的文件使用复
+ * 制后的位置，这期间追加的文件仍然在原来的位置，删除的文件不再写出
+ */
+static int compact_swap(struct pack *p, struct compact_file *cf, int nr)
+{
+    char path[MAX_PATH_LEN + 1];
+    char tmppath[MAX_PATH_LEN + 1];
+    pack_path(path, sizeof(path), p, PACK_INDEX_NAME);
+    pack_path(tmppath, sizeof(tmppath), p, PACK_INDEX_NAME ".tmp");
+    int tfd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tfd < 0) {
+        log_error("open %s failed: %s", tmppath, strerror(errno));
+        return -1;
+    }
+
+    // cf 按照下标排序，和 p->files 同时遍历
+    int rc = 0;
+    int k = 0;
+    int i;
+    for (i = 0; i < p->nr_files && rc == 0; i++) {
+        struct pack_file *f = &p->files[i];
+        while (k < nr && cf[k].i < i) {
+            k = k + 1;
+        }
+        if (k < nr && cf[k].i == i && (f->seg != cf[k].seg || f->offset != cf[k].offset)) {
+            // 压缩期间被删除或者覆盖了，复制的数据作废
+            cf[k].new_seg = -1;
+        }
+        if (f->seg < 0) {
+            continue;
+        }
+        int seg = f->seg;
+        int64_t offset = f->offset;
+        if (k < nr && cf[k].i == i) {
+            seg = cf[k].new_seg;
+            offset = cf[k].new_offset;
+        }
+        char record[MAX_NAME_LEN + 128];
+        int len = snprintf(record, sizeof(record), "+ %d %lld %lld %s %s\n",
+                           seg, (long long int)offset, (long long int)f->len,
+                           f->md5, f->name);
+        rc = write_all(tfd, record, len, -1);
+    }
+    if (rc == 0 && fdatasync(tfd) != 0) {
+        rc = -1;
+    }
+    close(tfd);
+    if (rc == 0 && rename(tmppath, path) != 0) {
+        rc = -1;
+    }
+    if (rc != 0) {
+        log_error("write %s failed: %s", path, strerror(errno));
+        (void) unlink(tmppath);
+        return -1;
+    }
+
+    for (k = 0; k < nr; k++) {
+        if (cf[k].new_seg >= 0) {
+            p->files[cf[k].i].seg = cf[k].new_seg;
+            p->files[cf[k].i].offset = cf[k].new_offset;
+        }
+    }
+    if (p->idx_fd >= 0) {
+        close(p->idx_fd);
+    }
+    p->idx_fd = high_fd(open(path, O_RDWR | O_APPEND | O_CLOEXEC));
+
+    // 去掉已经删除的文件
+    int n = 0;
+    for (i = 0; i < p->nr_files; i++) {
+        if (p->files[i].seg >= 0) {
+            p->files[n++] = p->files[i];
+        } else {
+            free(p->files[i].name);
+        }
+    }
+    p->nr_files = n;
+    p->dead_bytes = 0;
+    (void) rehash_files(p, p->nbuckets);
+    return 0;
+}
+
+/*
+ * 有效的文件复制到新的段，写出新的索引后替换旧的索引，再删除旧的段。复制时不
+ * 持有 p->lock，上传和删除照常进行：压缩开始时记下有效的文件，之后的追加从为
+ * 压缩预留的段号之后开始，替换索引时再持有锁合并这期间的变化。已经打开旧的段
+ * 的下载不受影响
+ */
+static int compact_pack(struct pack *p)
+{
+    pthread_mutex_lock(&p->lock);
+    if (p->dead || p->dead_bytes == 0) {
+        pthread_mutex_unlock(&p->lock);
+        return 0;
+    }
+    int old_last = p->seg;
+    int64_t dead = p->dead_bytes;
+    if (p->seg_fd >= 0) {
+        close(p->seg_fd);
+        p->seg_fd = -1;
+    }
+
+    char path[MAX_PATH_LEN + 1];
+    if (p->live_bytes == 0) {
+        // 所有文件都已经删除，删除整个包
+        pack_path(path, sizeof(path), p, PACK_INDEX_NAME);
+        int rc = unlink(path) != 0 && errno != ENOENT ? -1 : 0;
+        if (rc == 0) {
+            if (p->idx_fd >= 0) {
+                close(p->idx_fd);
+                p->idx_fd = -1;
+            }
+            remove_segments(p, 0, old_last);
+            clear_files(p);
+            p->seg = 0;
+            log_info("%.*s: removed empty pack", p->dirlen, p->dir);
+        } else {
+            log_error("remove %s failed: %s", path, strerror(errno));
+        }
+        pthread_mutex_unlock(&p->lock);
+        return rc;
+    }
+
+    int nr = 0;
+    int i;
+    for (i = 0; i < p->nr_files; i++) {
+        nr = nr + (p->files[i].seg >= 0);
+    }
+    struct compact_file *cf = malloc(nr * sizeof(struct compact_file));
+    uint8_t *buf = malloc(PACK_COPY_CHUNK);
+    if (cf == NULL || buf == NULL) {
+        log_error("compact %.*s failed: out of memory", p->dirlen, p->dir);
+        pthread_mutex_unlock(&p->lock);
+        free(cf);
+        free(buf);
+        return -1;
+    }
+    int k = 0;
+    for (i = 0; i < p->nr_files; i++) {
+        struct pack_file *f = &p->files[i];
+        if (f->seg >= 0) {
+            cf[k].i = i;
+            cf[k].seg = f->seg;
+            cf[k].offset = f->offset;
+            cf[k].len = f->len;
+            k = k + 1;
+        }
+    }
+
+    /*
+     * 每个新的段和下一个段加起来超过段的大小，复制 live_bytes 字节最多用
+     * 2 * live_bytes / 段的大小 + 1 个段
+     */
+    struct compact_out out;
+    out.seg = old_last + 1;
+    out.fd = -1;
+    out.size = 0;
+    out.max = pack_segment_size;
+    p->seg = old_last + 1 + 2 * (p->live_bytes / out.max) + 2;
+    p->seg_size = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    int src_seg = -1;
+    int src_fd = -1;
+    int rc = 0;
+    for (k = 0; k < nr && rc == 0; k++) {
+        if (cf[k].seg != src_seg) {
+            if (src_fd >= 0) {
+                close(src_fd);
+            }
+            segment_path(path, sizeof(path), p, cf[k].seg);
+            src_fd = open(path, O_RDONLY | O_CLOEXEC);
+            src_seg = cf[k].seg;
+            if (src_fd < 0) {
+                log_error("open %s failed: %s", path, strerror(errno));
+                rc = -1;
+                break;
+            }
+        }
+        rc = compact_copy(p, &out, src_fd, &cf[k], buf);
+    }
+    if (src_fd >= 0) {
+        close(src_fd);
+    }
+    free(buf);
+    if (out.fd >= 0) {
+        if (rc == 0 && fdatasync(out.fd) != 0) {
+            log_error("sync compacted %.*s failed: %s", p->dirlen, p->dir,
+                      strerror(errno));
+            rc = -1;
+        }
+        close(out.fd);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (rc == 0 && p->dead) {
+        // 目录被删除或者重命名了
+        rc = -1;
+    }
+    if (rc == 0) {
+        rc = compact_swap(p, cf, nr);
+    }
+    pthread_mutex_unlock(&p->lock);
+    free(cf);
+
+    if (rc != 0) {
+        // 旧的索引仍然有效，丢弃复制了一半的新段
+        remove_segments(p, old_last + 1, out.seg);
+        return -1;
+    }
+    // 索引中已经没有旧的段，之后的下载不会再打开它们
+    remove_segments(p, 0, old_last);
+    log_info("%.*s: compacted %d files, %lld bytes freed", p->dirlen, p->dir,
+             nr, (long long int)dead);
+    return 0;
+}
+
+int pack_crush(const char *path, int nr_crush)
+{
+    const char *name;
+    int dirlen = split_path(path, &name);
+    if (dirlen < 0) {
+        return -1;
+    }
+    struct pack *p = lock_pack(path, dirlen);
+    if (p == NULL) {
+        return -1;
+    }
+
+    int rc = -1;
+    int i = find_file(p, name);
+    if (i == PACK_NIL) {
+        // 文件不在包中
+    } else if (p->compacting) {
+        // 压缩会在锁外复制文件的内容，粉碎后还会留下一份
+        log_error("crush %s failed: pack is being compacted", path);
+    } else {
+        char segpath[MAX_PATH_LEN + 1];
+        segment_path(segpath, sizeof(segpath), p, p->files[i].seg);
+        int fd = open(segpath, O_RDWR | O_CLOEXEC);
+        if (fd >= 0) {
+            rc = range_crush(fd, p->files[i].offset, p->files[i].len, nr_crush);
+            close(fd);
+        } else {
+            log_error("open %s for %s failed: %s", segpath, path, strerror(errno));
+        }
+        if (rc == 0) {
+            char record[MAX_NAME_LEN + 8];
+            int n = snprintf(record, sizeof(record), "- %s\n", name);
+            rc = append_record(p, record, n);
+        }
+        if (rc == 0) {
+            unlink_file(p, i);
+            maybe_compact(p);
+        }
+    }
+    unlock_pack(p);
+    return rc;
+}
+
+////////////////////////////////////////////////////////////////////////
+// 打包上传
+////////////////////////////////////////////////////////////////////////
+
+int pack_upload_wanted(int64_t size)
+{
+    return pack_threshold > 0 && size > 0 && size < pack_threshold;
+}
+
+int begin_pack_upload(conn_info_t *c, int64_t size)
+{
+    abort_pack_upload(c);
+    struct pack_upload *u = malloc(sizeof(struct pack_upload) + size);
+    if (u == NULL) {
+        log_error("malloc %lld bytes for packed upload failed", (long long int)size);
+        return -1;
+    }
+    u->size = size;
+    c->pack = u;
+    return 0;
+}
+
+int pack_upload_data(conn_info_t *c, uint64_t offset,
+                     const uint8_t *data, int len)
+{
+    struct pack_upload *u = c->pack;
+    if (offset + len > (uint64_t)u->size) {
+        log_error("upload data at %llu (%d bytes) exceeds file size %lld",
+                  (unsigned long long)offset, len, (long long int)u->size);
+        return -1;
+    }
+    memcpy(u->data + offset, data, len);
+    return 0;
+}
+
+int finish_pack_upload(conn_info_t *c)
+{
+    struct pack_upload *u = c->pack;
+    c->pack = NULL;
+
+#ifdef HAVE_CHECK_MD5
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int dlen = 0;
+    char md5[MD5_LEN + 1];
+    EVP_Digest(u->data, u->size, digest, &dlen, EVP_md5(), NULL);
+    unsigned int i;
+    for (i = 0; i < dlen && i * 2 < MD5_LEN; i++) {
+        sprintf(&md5[i * 2], "%02x", (unsigned int)digest[i]);
+    }
+    if (strcmp(md5, c->befiles[0].md5) != 0) {
+        log_error("%s check md5 failed", c->befiles[0].abs_file_name);
+        free(u);
+        return -1;
+    }
+#endif
+
+    int ret = 0;
+    int b;
+    for (b = 0; b < backend_cnt; b++) {
+        struct backend_file *f = &c->befiles[b];
+        if (pack_append(f->abs_file_name, u->data, u->size, f->md5) == 0) {
+            log_debug("%s successfully packed (%lld bytes)",
+                      f->abs_file_name, (long long int)u->size);
+        } else {
+            log_error("pack %s failed", f->abs_file_name);
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        __sync_add_and_fetch(&upload_stats.files, 1);
+        __sync_add_and_fetch(&upload_stats.bytes, (uint64_t)u->size);
+    }
+    free(u);
+    return ret;
+}
+
+void abort_pack_upload(conn_info_t *c)
+{
+    free(c->pack);
+    c->pack = NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+// 测试用例
+////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_UNITTEST
+
+#include <assert.h>
+
+void test_pack(void)
+{
+    printf("test_pack: ");
+
+    const char *dir = "/tmp/test_pack/1/a";
+    char path[256];
+    uint8_t data[3000];
+    int i;
+    for (i = 0; i < (int)sizeof(data); i++) {
+        data[i] = (uint8_t)i;
+    }
+    pack_segment_size = 4096;
+
+    /* 追加，第二个文件放不下时换一个段 */
+    for (i = 0; i < 4; i++) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        assert(pack_append(path, data, 1000 + i * 500, "0123456789abcdef0123456789abcdef") == 0);
+    }
+    struct pack_extent x;
+    snprintf(path, sizeof(path), "%s/f2", dir);
+    int fd = pack_open(path, &x);
+    assert(fd >= 0 && x.len == 2000 && x.offset == 0);
+    uint8_t buf[3000];
+    assert(pread(fd, buf, x.len, x.offset) == x.len);
+    assert(memcmp(buf, data, x.len) == 0);
+    close(fd);
+
+    /* 重新读入索引，失效的包不再追加 */
+    struct pack *p = get_pack(dir, strlen(dir));
+    pack_invalidate();
+    assert(p->dead);
+    snprintf(path, sizeof(path), "%s/f4", dir);
+    assert(pack_append(path, data, 100, "0123456789abcdef0123456789abcdef") == 0);
+    assert(p->nr_files == 4);
+    put_pack(p);
+    int nr;
+    char *list = pack_list(dir, strlen(dir), &nr);
+    assert(list != NULL && nr == 5);
+    free(list);
+
+    /* 粉碎后段文件中的内容被覆盖 */
+    fd = pack_open(path, &x);
+    assert(fd >= 0 && x.len == 100);
+    assert(pack_crush(path, 1) == 0);
+    assert(pread(fd, buf, x.len, x.offset) == x.len);
+    assert(memcmp(buf, data, x.len) != 0);
+    close(fd);
+    assert(pack_lookup(path, &x) == -1);
+
+    /* 删除超过一半时压缩，压缩后内容不变 */
+    snprintf(path, sizeof(path), "%s/f3", dir);
+    assert(pack_remove(path) == 0);
+    assert(pack_remove(path) == -1);
+    snprintf(path, sizeof(path), "%s/f2", dir);
+    assert(pack_remove(path) == 0);
+    p = get_pack(dir, strlen(dir));
+    assert(compact_pack(p) == 0);
+    put_pack(p);
+    pack_invalidate();
+    snprintf(path, sizeof(path), "%s/f1", dir);
+    fd = pack_open(path, &x);
+    assert(fd >= 0 && x.len == 1500);
+    assert(pread(fd, buf, x.len, x.offset) == x.len);
+    assert(memcmp(buf, data, x.len) == 0);
+    close(fd);
+    snprintf(path, sizeof(path), "%s/f2", dir);
+    assert(pack_lookup(path, &x) == -1);
+
+    /* 全部删除后包被删除 */
+    snprintf(path, sizeof(path), "%s/f0", dir);
+    assert(pack_remove(path) == 0);
+    snprintf(path, sizeof(path), "%s/f1", dir);
+    assert(pack_remove(path) == 0);
+    p = get_pack(dir, strlen(dir));
+    assert(compact_pack(p) == 0);
+    put_pack(p);
+    snprintf(path, sizeof(path), "%s/%s", dir, PACK_INDEX_NAME);
+    assert(access(path, F_OK) != 0);
+    assert(rmdir(dir) == 0);
+
+    printf("success\n");
+}
+
+#endif
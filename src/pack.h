@@ -0,0 +1,110 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+
+
+/*
+ * 小文件打包存放
+ *
+ * 医学影像的一个序列通常是几千个 100～500KB 的 DICOM 文件，每个文件都要创建
+ * 目录项和 inode，列出文件时还要 stat() 每个文件。tunable pack_threshold 不为
+ * 0 时，小于这个大小的上传不再单独创建文件，而是追加到所在目录的段文件中：
+ *
+ *   .pack.<n>   段文件，文件内容依次追加，超过 pack_segment_size 后换下一个段
+ *   .packidx    索引，每行一条记录，同一个文件名后面的记录覆盖前面的：
+ *               + <段号> <偏移> <长度> <md5> <文件名>
+ *               - <文件名>
+ *
+ * 上传的数据先放在连接的内存中，上传完成时校验 md5，追加到每个后端的段文件之
+ * 后再写索引，所以索引中的文件总是完整的，md5 也记录在索引中。下载时打开段文
+ * 件，从文件在段中的偏移开始读取或者 sendfile()；目录遍历遇到索引时列出其中
+ * 的文件，不再 stat() 每个文件。删除只追加一条删除记录，被删除和覆盖的数据超
+ * 过一半时在任务队列中压缩：把有效的文件复制到新的段，写出新的索引替换旧的，
+ * 再删除旧的段。
+ *
+ * 同名的普通文件优先于包中的文件：打包上传时删除同名的普通文件，普通上传时
+ * 删除包中的同名文件。粉碎包中的文件时覆盖写它在段文件中的内容，再从包中删除；
+ * 包中的文件不能重命名。
+ */
+
+#define PACK_INDEX_NAME      ".packidx"
+#define PACK_SEGMENT_PREFIX  ".pack."
+
+struct pack_upload;
+struct conn_info_;
+
+/* 包中的一个文件在段文件中的位置 */
+struct pack_extent {
+    int64_t offset;
+    int64_t len;
+    char md5[32 + 1];      // MD5_LEN + 1
+};
+
+/*
+ * 文件名是不是段文件或者索引，目录遍历时跳过
+ */
+extern int is_pack_file(const char *name);
+
+/*
+ * 大小为 size 的上传是否打包存放
+ */
+extern int pack_upload_wanted(int64_t size);
+
+/*
+ * 开始打包上传，分配存放上传数据的内存。成功返回 0，失败返回 -1
+ */
+extern int begin_pack_upload(struct conn_info_ *c, int64_t size);
+
+/*
+ * 保存上传的数据。成功返回 0，数据超出文件大小返回 -1
+ */
+extern int pack_upload_data(struct conn_info_ *c, uint64_t offset,
+                            const uint8_t *data, int len);
+
+/*
+ * 上传完成，校验 md5 后追加到每个后端的包中。成功返回 0，失败返回 -1
+ */
+extern int finish_pack_upload(struct conn_info_ *c);
+
+/*
+ * 放弃没有完成的打包上传，连接关闭时调用
+ */
+extern void abort_pack_upload(struct conn_info_ *c);
+
+/*
+ * 查找绝对路径 path 对应的包中的文件，找到时打开所在的段文件，返回描述符，
+ * 文件的位置保存在 x 中；不在包中返回 -1
+ */
+extern int pack_open(const char *path, struct pack_extent *x);
+
+/*
+ * 查找包中的文件，找到返回 0，不在包中返回 -1
+ */
+extern int pack_lookup(const char *path, struct pack_extent *x);
+
+/*
+ * 从包中删除文件。成功返回 0，不在包中或者出错返回 -1
+ */
+extern int pack_remove(const char *path);
+
+/*
+ * 粉碎包中的文件：覆盖写它在段文件中的内容 nr_crush 遍，再从包中删除。成功返
+ * 回 0，不在包中、正在压缩或者出错返回 -1
+ */
+extern int pack_crush(const char *path, int nr_crush);
+
+/*
+ * 列出目录 dirpath[0, dirlen) 的包中的文件。返回的缓冲区中依次是 8 字节的文
+ * 件大小和以 '\0' 结尾的文件名，由调用者 free()，文件个数保存在 *nr 中；目录
+ * 没有包时返回 NULL
+ */
+extern char *pack_list(const char *dirpath, int dirlen, int *nr);
+
+/*
+ * 目录被删除或者重命名了，丢弃缓存的包。正在使用的包等修改完成后失效，之后
+ * 的修改重新读入索引
+ */
+extern void pack_invalidate(void);
+
+#endif  /* PACK_H */
@@ -2,6 +2,10 @@
 #define _BSD_SOURCE
 #endif
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <endian.h>
 
 #include <assert.h>
@@ -14,12 +18,18 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include "pathops.h"
 #include "public.h"
 #include "mt_log.h"
+#include "pack.h"
+#include "metaidx.h"
+#include "bkindex.h"
+#include "catchup.h"
 
 extern char *default_md5sum_filename;
 
@@ -241,14 +251,390 @@ void cut_mount_path(char *abspath, const char *mountpoint)
     free(mountpath);
 }
 
+/*
+ * 目录遍历器
+ *
+ * 每一级目录只打开一次，用大缓冲区的 getdents64() 读取目录项，根据 d_type 判
+ * 断文件类型，只对普通文件调用 statx() 获取文件大小，子目录通过 openat() 相
+ * 对于父目录打开。路径名在同一个缓冲区中追加和截断，不再为每个目录项拼接新的
+ * 路径字符串。文件系统不提供 d_type 时（DT_UNKNOWN）以及符号链接才需要额外获
+ * 取文件类型。
+ */
+
+#define DIRWALK_BUFSIZE   (64 * 1024)
+#define DIRWALK_MAX_DEPTH 64
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dirwalk_level {
+    int fd;      /* 这一级目录的文件描述符 */
+    int pos;     /* 缓冲区中下一个目录项的位置 */
+    int len;     /* 缓冲区中有效数据的长度 */
+    int pathlen; /* 这一级目录路径名的长度 */
+    char *buf;   /* getdents64() 的缓冲区，第一次进入这一级时分配 */
+    char *packed;     /* 这一级目录的包中的文件，见 pack_list() */
+    char *packed_pos; /* 下一个包中的文件 */
+    int packed_left;  /* 还没有返回的包中的文件个数 */
+};
+
+struct dirwalk {
+    int depth;
+    struct dirwalk_level levels[DIRWALK_MAX_DEPTH];
+    int rootlen;        /* 遍历的目录路径名的长度 */
+    char *indexed;      /* 目录树在元数据索引中是完整的，见 metaidx_list() */
+    char *indexed_pos;
+    int indexed_left;
+    uint32_t scan;      /* 遍历的文件导入元数据索引，0 表示不导入 */
+    int skipped;        /* 有跳过的文件或者目录，遍历结果不完整 */
+    char path[DIRWALK_PATH_MAX];
+};
+
+/* 服务自己使用的文件：备份索引和补齐时复制中的临时文件 */
+static int is_internal_file(const char *name)
+{
+    int len = strlen(name);
+    int slen = strlen(CATCHUP_TMP_SUFFIX);
+    return !strcmp(name, BKINDEX_NAME) || !strcmp(name, BKINDEX_TMPNAME) ||
+        (len > slen && !strcmp(name + len - slen, CATCHUP_TMP_SUFFIX));
+}
+
+/*
+ * 获取文件类型和大小。需要文件类型时跟随符号链接，和原来的 stat() 行为一致。
+ * AT_STATX_DONT_SYNC 让网络文件系统直接使用本地缓存的属性。
+ */
+static int dirwalk_stat(int dirfd, const char *name, int need_type,
+                        unsigned char *type, int64_t *size, int64_t *mtime)
+{
+    mode_t mode;
+#if defined(STATX_SIZE) && defined(AT_STATX_DONT_SYNC)
+    struct statx sx;
+    unsigned int mask = STATX_SIZE | STATX_MTIME | (need_type ? STATX_TYPE : 0);
+    if (statx(dirfd, name, AT_STATX_DONT_SYNC, mask, &sx) != 0) {
+        return -1;
+    }
+    mode = sx.stx_mode;
+    *size = sx.stx_size;
+    *mtime = sx.stx_mtime.tv_sec;
+#else
+    struct stat s;
+    if (fstatat(dirfd, name, &s, 0) != 0) {
+        return -1;
+    }
+    mode = s.st_mode;
+    *size = s.st_size;
+    *mtime = s.st_mtime;
+#endif
+    if (need_type) {
+        if (S_ISREG(mode)) {
+            *type = DT_REG;
+        } else if (S_ISDIR(mode)) {
+            *type = DT_DIR;
+        } else {
+            *type = DT_UNKNOWN;
+        }
+    } else {
+        /* 调用者已经知道文件类型 */
+    }
+    return 0;
+}
+
+static int dirwalk_push(struct dirwalk *w, int fd, int pathlen)
+{
+    if (w->depth >= DIRWALK_MAX_DEPTH) {
+        log_error("skip %s: directory too deep", w->path);
+        close(fd);
+        return -1;
+    }
+    struct dirwalk_level *lvl = &w->levels[w->depth];
+    if (lvl->buf == NULL) {
+        lvl->buf = malloc(DIRWALK_BUFSIZE);
+        if (lvl->buf == NULL) {
+            log_error("malloc %d bytes failed", DIRWALK_BUFSIZE);
+            close(fd);
+            return -1;
+        }
+    } else {
+        /* 重复使用这一级已经分配的缓冲区 */
+    }
+    lvl->fd = fd;
+    lvl->pos = 0;
+    lvl->len = 0;
+    lvl->pathlen = pathlen;
+    lvl->packed = NULL;
+    lvl->packed_left = 0;
+    w->depth = w->depth + 1;
+    return 0;
+}
+
+static void dirwalk_pop(struct dirwalk *w)
+{
+    struct dirwalk_level *lvl = &w->levels[w->depth - 1];
+    close(lvl->fd);
+    lvl->fd = -1;
+    free(lvl->packed);
+    lvl->packed = NULL;
+    w->depth = w->depth - 1;
+}
+
+struct dirwalk *dirwalk_open(const char *dirpath)
+{
+    int pathlen = strlen(dirpath);
+    while (pathlen > 1 && dirpath[pathlen - 1] == '/') {
+        pathlen = pathlen - 1;
+    }
+    if (pathlen >= DIRWALK_PATH_MAX) {
+        log_error("path %s is too long", dirpath);
+        return NULL;
+    }
+
+    struct dirwalk *w = calloc(1, sizeof(struct dirwalk));
+    if (!w) {
+        log_error("malloc dirwalk failed");
+        return NULL;
+    }
+    memmove(w->path, dirpath, pathlen);
+    w->path[pathlen] = '\0';
+    w->rootlen = pathlen;
+
+    w->indexed = metaidx_list(w->path, &w->indexed_left, &w->scan);
+    if (w->indexed != NULL) {
+        /* 从元数据索引中列出，不访问后端目录 */
+        w->indexed_pos = w->indexed;
+        return w;
+    } else {
+        /* 遍历后端目录，w->scan 不为 0 时同时导入元数据索引 */
+    }
+
+    int fd = open(w->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        int ec = errno;
+        log_error("open directory %s failed: %s", w->path, strerror(ec));
+        free(w);
+        return NULL;
+    }
+    if (dirwalk_push(w, fd, pathlen) < 0) {
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/* 从元数据索引的快照中取得下一个文件 */
+static int dirwalk_next_indexed(struct dirwalk *w, struct dirwalk_entry *e)
+{
+    while (w->indexed_left > 0) {
+        int64_t size;
+        memcpy(&size, w->indexed_pos, 8);
+        const char *rel = w->indexed_pos + 8;
+        int rellen = strlen(rel);
+        w->indexed_pos = w->indexed_pos + 8 + rellen + 1;
+        w->indexed_left = w->indexed_left - 1;
+        int pathlen = w->rootlen + 1 + rellen;
+        if (pathlen >= DIRWALK_PATH_MAX) {
+            log_error("skip %s: path too long", rel);
+            continue;
+        }
+        w->path[w->rootlen] = '/';
+        memmove(&w->path[w->rootlen + 1], rel, rellen + 1);
+        const char *name = strrchr(&w->path[w->rootlen], '/') + 1;
+        e->path = w->path;
+        e->pathlen = pathlen;
+        e->name = name;
+        e->size = size;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * 取得下一个普通文件。返回 1 表示取得一个文件，文件信息在 e 中，e->path 在
+ * 下一次调用之前有效；返回 0 表示遍历完毕；返回 -1 表示读取目录项失败。
+ * 打不开的子目录和获取不到属性的文件记录日志后跳过。
+ */
+int dirwalk_next(struct dirwalk *w, struct dirwalk_entry *e)
+{
+    if (w->indexed != NULL) {
+        return dirwalk_next_indexed(w, e);
+    }
+
+    while (w->depth > 0) {
+        struct dirwalk_level *lvl = &w->levels[w->depth - 1];
+        if (lvl->packed_left > 0) {
+            /* 返回包中的文件，不需要 stat() */
+            int64_t size;
+            memcpy(&size, lvl->packed_pos, 8);
+            const char *name = lvl->packed_pos + 8;
+            int namelen = strlen(name);
+            lvl->packed_pos = lvl->packed_pos + 8 + namelen + 1;
+            lvl->packed_left = lvl->packed_left - 1;
+            int pathlen = lvl->pathlen + 1 + namelen;
+            if (pathlen >= DIRWALK_PATH_MAX) {
+                log_error("skip %s: path too long", name);
+                continue;
+            }
+            w->path[lvl->pathlen] = '/';
+            memmove(&w->path[lvl->pathlen + 1], name, namelen + 1);
+            e->path = w->path;
+            e->pathlen = pathlen;
+            e->name = &w->path[lvl->pathlen + 1];
+            e->size = size;
+            metaidx_import(e->path, e->size, 0, 1, w->scan);
+            return 1;
+        }
+        if (lvl->pos >= lvl->len) {
+            long n = syscall(SYS_getdents64, lvl->fd, lvl->buf, DIRWALK_BUFSIZE);
+            if (n > 0) {
+                lvl->pos = 0;
+                lvl->len = (int)n;
+            } else if (n == 0) {
+                /* 这一级目录读取完毕，回到上一级 */
+                dirwalk_pop(w);
+                continue;
+            } else if (errno == EINTR) {
+                continue;
+            } else {
+                int ec = errno;
+                w->path[lvl->pathlen] = '\0';
+                log_error("getdents64 %s failed: %s", w->path, strerror(ec));
+                return -1;
+            }
+        } else {
+            /* 缓冲区中还有目录项 */
+        }
+
+        struct linux_dirent64 *d = (struct linux_dirent64 *)(lvl->buf + lvl->pos);
+        lvl->pos = lvl->pos + d->d_reclen;
+
+        const char *name = d->d_name;
+        if (name[0] == '.' &&
+            (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            /* 跳过当前目录和上一级目录 */
+            continue;
+        }
+
+        if (is_internal_file(name)) {
+            /* 备份索引和补齐中的临时文件不是上传的文件 */
+            continue;
+        }
+        if (is_pack_file(name)) {
+            if (!strcmp(name, PACK_INDEX_NAME) && lvl->packed == NULL) {
+                /* 遇到索引时列出包中的文件 */
+                lvl->packed = pack_list(w->path, lvl->pathlen, &lvl->packed_left);
+                lvl->packed_pos = lvl->packed;
+            } else {
+                /* 段文件不是上传的文件 */
+            }
+            continue;
+        }
+
+        int namelen = strlen(name);
+        int pathlen = lvl->pathlen + 1 + namelen;
+        if (pathlen >= DIRWALK_PATH_MAX) {
+            log_error("skip %s: path too long", name);
+            continue;
+        }
+        w->path[lvl->pathlen] = '/';
+        memmove(&w->path[lvl->pathlen + 1], name, namelen + 1);
+
+        unsigned char type = d->d_type;
+        int64_t size = -1;
+        int64_t mtime = 0;
+        if (type == DT_UNKNOWN || type == DT_LNK) {
+            if (dirwalk_stat(lvl->fd, name, 1, &type, &size, &mtime) != 0) {
+                int ec = errno;
+                log_error("skip %s: %s", w->path, strerror(ec));
+                w->skipped = 1;
+                continue;
+            }
+        } else {
+            /* 目录项中已经有文件类型 */
+        }
+
+        if (type == DT_DIR) {
+            int fd = openat(lvl->fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd >= 0) {
+                if (dirwalk_push(w, fd, pathlen) < 0) {
+                    w->skipped = 1;
+                }
+            } else {
+                int ec = errno;
+                log_error("skip %s: %s", w->path, strerror(ec));
+                w->skipped = 1;
+            }
+        } else if (type == DT_REG) {
+            if (size < 0 && dirwalk_stat(lvl->fd, name, 0, &type, &size, &mtime) != 0) {
+                int ec = errno;
+                log_error("skip %s: %s", w->path, strerror(ec));
+                w->skipped = 1;
+                continue;
+            }
+            e->path = w->path;
+            e->pathlen = pathlen;
+            e->name = &w->path[lvl->pathlen + 1];
+            e->size = size;
+            metaidx_import(e->path, e->size, mtime, 0, w->scan);
+            return 1;
+        } else {
+            /* 忽略其他文件 */
+            log_error("skip %s: is not a regular file or directory", w->path);
+        }
+    }
+    if (w->scan != 0 && !w->skipped) {
+        /* 遍历完毕，目录树在元数据索引中是完整的 */
+        w->path[w->rootlen] = '\0';
+        metaidx_complete(w->path, w->scan);
+        w->scan = 0;
+    }
+    return 0;
+}
+
+void dirwalk_close(struct dirwalk *w)
+{
+    if (w) {
+        while (w->depth > 0) {
+            dirwalk_pop(w);
+        }
+        int i;
+        for (i = 0; i < DIRWALK_MAX_DEPTH; i++) {
+            free(w->levels[i].buf);
+        }
+        free(w->indexed);
+        free(w);
+    } else {
+        /* 空指针，不做处理 */
+    }
+}
+
+/*
+ * 计算绝对路径 abspath 中挂载点路径 mountpoint 的长度，挂载点不匹配时返回
+ * 0。和 cut_mount_path() 的剪除规则一致，但不修改路径。
+ */
+int mount_prefix_len(const char *abspath, const char *mountpoint)
+{
+    int mountlen = strlen(mountpoint);
+    while (mountlen > 0 && mountpoint[mountlen - 1] == '/') {
+        mountlen = mountlen - 1;
+    }
+    if (!memcmp(abspath, mountpoint, mountlen)) {
+        return mountlen;
+    } else {
+        return 0;
+    }
+}
+
 /*
  * 2 个字节的文件名长度，因为一个字节最多表示 31 个字节的文件名长度。
  * 文件名长度如果是负数，则表示出错了。
  */
-static int fill_file_list(char *out, char *end,
-                           char *filename, int64_t filesize)
+int fill_file_list(char *out, char *end,
+                   const char *filename, int namelen, int64_t filesize)
 {
-    int namelen = strlen(filename);
     if (out + 2/*文件名长度*/ + namelen + 8/*文件内容长度*/ <= end) {
         *((int16_t *)out) = htobe16(namelen);
         out = out + 2;
@@ -285,111 +671,49 @@ int get_dir_list(
     char *list, int listlen,
     struct file_list_result *res)
 {
-    int rc;
+    struct dirwalk *w = dirwalk_open(dirpath);
+    if (!w) {
+        return -1;
+    }
+
     int retcode = 0;
     int32_t nr_files = 0;
-    DIR *dp = opendir(dirpath);
-    if (dp) {
-        struct dirent entry;
-        struct dirent *result;
-        char *out = list;
-        char *end = list + listlen;
-        for (;;) {
-            int rc = readdir_r(dp, &entry, &result);
-            if (rc == 0) {
-                if (!result) {
-                    /* 读取目录项完毕，可以关闭目录 */
-                    assert(nr_files >= 0);
-                    res->nr_files = nr_files;
-                    res->used_buflen = out - list;
-                    retcode = 0;
-                    goto out;
-                } else {
-                    /*
-                     * 现在目录项中的一项内容已经读取到 entry 中，可以
-                     * 在 entry.d_name 读取文件名
-                     */
-                    struct stat s;
-                    char filepath[2048];
-                    snprintf(filepath, sizeof(filepath), "%s/%s", dirpath, entry.d_name);
-                    int rc = stat(filepath, &s);
-                    if (rc == 0) {
-                        if (S_ISREG(s.st_mode)) {
-                            if (!strcmp(entry.d_name, default_md5sum_filename)) {
-                                /* 不返回生成的，用来记录 md5 校验和的文件 */
-                            } else {
-                                nr_files = nr_files + 1;
-                                // log_info("get_dir_list: %d: %s %lld", nr_files, filepath, (long long int)s.st_size);
-                                cut_mount_path(filepath, mountpath);
-                                int filllen = fill_file_list(
-                                    out, end, filepath, s.st_size);
-                                if (filllen > 0) {
-                                    /* 缓冲区内容有填充，更新缓冲区指针 */
-                                    out = out + filllen;
-                                } else {
-                                    /* 出错了，缓冲区太小了？ */
-                                    log_error("fill %s failed", filepath);
-                                    retcode = -4;
-                                    goto out;
-                                }
-                            }
-                        } else if (S_ISDIR(s.st_mode)) {
-                            if (!strcmp(entry.d_name, ".") || !strcmp(entry.d_name, "..")) {
-                                /* 跳过当前目录和上一级目录 */
-                            } else {
-                                struct file_list_result res;
-                                int rc = get_dir_list(
-                                    filepath, mountpath, out, end - out, &res);
-                                if (rc != 0) {
-                                    /* 嗯，递归调用出错了！提前终止 */
-                                    log_error("get_dir_list: get %s file list failed", entry.d_name);
-                                    retcode = rc;
-                                    goto out;
-                                } else {
-                                    /*
-                                     * 递归获取目录成功，文件列表已经放在
-                                     * 缓冲区中，更新文件数量和缓冲区长度
-                                     */
-                                    nr_files = nr_files + res.nr_files;
-                                    out = out + res.used_buflen;
-                                }
-                            }
-                        } else {
-                            /* 忽略其他文件 */
-                            log_error("skip %s: is not a regular file or directory",
-                                      entry.d_name);
-                        }
-                    } else {
-                        /* 获取文件的元信息失败，继续处理下一个文件 */
-                        int ec = errno;
-                        log_error("skip %s: %s", filepath, strerror(ec));
-                    }
-                }
-            } else {
-                int ec = errno;
-                log_error("readdir_r %s failed on %s: %s",
-                          dirpath, entry.d_name, strerror(ec));
-                retcode = -2;
-                goto out;
-            }
+    char *out = list;
+    char *end = list + listlen;
+    int cut = mount_prefix_len(dirpath, mountpath);
+    struct dirwalk_entry e;
+    int rc;
+    while ((rc = dirwalk_next(w, &e)) > 0) {
+        if (!strcmp(e.name, default_md5sum_filename)) {
+            /* 不返回生成的，用来记录 md5 校验和的文件 */
+            continue;
         }
-        return 0;
+        nr_files = nr_files + 1;
+        int filllen = fill_file_list(
+            out, end, e.path + cut, e.pathlen - cut, e.size);
+        if (filllen > 0) {
+            /* 缓冲区内容有填充，更新缓冲区指针 */
+            out = out + filllen;
+        } else {
+            /* 出错了，缓冲区太小了？ */
+            log_error("fill %s failed", e.path);
+            retcode = -4;
+            break;
+        }
+    }
+    if (rc < 0) {
+        retcode = -2;
     } else {
-        int ec = errno;
-        log_error("opendir %s failed: %s", dirpath, strerror(ec));
-        return -1;
+        /* 遍历完毕，或者缓冲区太小提前终止 */
     }
-    /* 程序不会运行到这里 */
-    assert(0);
 
-out:
-    rc = closedir(dp);
-    if (rc == -1) {
-        int ec = errno;
-        log_error("closedir %s failed: %s", dirpath, strerror(ec));
+    if (retcode == 0) {
+        res->nr_files = nr_files;
+        res->used_buflen = out - list;
     } else {
-        /* 关闭目录成功，不需要特别处理 */
+        /* 出错时不更新结果 */
     }
+    dirwalk_close(w);
     return retcode;
 }
 
@@ -398,6 +722,9 @@ out:
  * 头部的消息包长度和文件列表个数
  *
  * (256) (3) (5 hello 12) (3 abc 123) (4 1234 4096)
+ *
+ * 缓冲区不够时直接扩大缓冲区，从中断的地方继续遍历，不再重新扫描目录。文件
+ * 列表很大时应该使用 CMD_GET_FILE_LIST_STREAM_REQ 分段发送。
  */
 char *fill_many_dir_list(
     const char *mountpath, const char *dirs[], int nr_dir,
@@ -416,6 +743,7 @@ char *fill_many_dir_list(
     int maxbufsize = 170 * 1024 * 1024; /* 消息包的最大缓冲区大小：170MB */
     int bufsize = 2 * 1024 * 1024;      /* 首次尝试使用的消息包缓冲区是 2MB */
     int nr_scan = 0;                    /* 成功扫描的目录个数 */
+    int full = 0;                       /* 缓冲区已经达到最大大小 */
 
     buffer = malloc(bufsize);
     if (!buffer) {
@@ -425,69 +753,80 @@ char *fill_many_dir_list(
         /* 缓冲区分配成功，继续执行，获取目录下的文件列表 */
     }
 
-    /*
-     * 如果获取单个目录下的文件列表失败，就加大缓冲区重试，已获取的文
-     * 件列表拷贝到新的缓冲区中。当获取某个目录下的文件列表超过了最大
-     * 重试次数，则放弃这个目录，进行处理下一个目录。
-     */
     int i;
-    for (i = 0; i < nr_dir; i++) {
+    for (i = 0; i < nr_dir && !full; i++) {
         const char *dirpath = dirs[i];
-        struct file_list_result res;
-        char *start;
-        int buflen;
-    again:
-        /* 8字节的消息包长度，4字节的文件列表长度 */
-        start = buffer + 8 + 4 + used_buflen;
-        buflen = bufsize - 8 - 4 - used_buflen;
-        int rc = get_dir_list(dirpath, mountpath, start, buflen, &res);
-        if (rc != 0) {
-            if (rc == -4) {
-                if (bufsize < maxbufsize) {
-                    /* 缓冲区太小，加大缓冲区重试 */
-                    if (bufsize * 2 > maxbufsize) {
-                        bufsize = maxbufsize;
-                    } else {
-                        bufsize = bufsize * 2;
-                    }
-                    buffer = realloc(buffer, bufsize);
-                    if (!buffer) {
-                        log_error("realloc %d bytes failed", bufsize);
-                        free(buffer);
-                        return NULL;
-                    } else {
-                        /* 重新分配缓冲区成功，重试 */
-                        log_info("increase buffer to %d bytes", bufsize);
-                        goto again;
-                    }
-                } else {
-                    log_error("skip %s: max bufsize (%d bytes) reach",
+        struct dirwalk *w = dirwalk_open(dirpath);
+        if (!w) {
+            log_error("skip %s: open directory failed", dirpath);
+            continue;
+        }
+
+        /* 读取目录出错时丢弃这个目录已经填充的文件列表 */
+        int dir_files = nr_files;
+        int dir_buflen = used_buflen;
+        int cut = mount_prefix_len(dirpath, mountpath);
+        struct dirwalk_entry e;
+        int rc;
+        while ((rc = dirwalk_next(w, &e)) > 0) {
+            if (!strcmp(e.name, default_md5sum_filename)) {
+                /* 不返回生成的，用来记录 md5 校验和的文件 */
+                continue;
+            }
+            /* 8字节的消息包长度，4字节的文件列表长度 */
+            int need = 8 + 4 + used_buflen + 2 + (e.pathlen - cut) + 8;
+            if (need > bufsize) {
+                if (bufsize >= maxbufsize) {
+                    log_error("skip rest of %s: max bufsize (%d bytes) reach",
                               dirpath, bufsize);
-                    goto out;
+                    full = 1;
+                    break;
+                }
+                int newsize = bufsize * 2;
+                if (newsize > maxbufsize) {
+                    newsize = maxbufsize;
+                }
+                char *newbuf = realloc(buffer, newsize);
+                if (!newbuf) {
+                    log_error("realloc %d bytes failed", newsize);
+                    full = 1;
+                    break;
+                } else {
+                    log_info("increase buffer to %d bytes", newsize);
+                    buffer = newbuf;
+                    bufsize = newsize;
                 }
             } else {
-                log_error("skip %s: get_dir_list failed", dirpath);
+                /* 缓冲区足够 */
             }
+            int filllen = fill_file_list(
+                buffer + 8 + 4 + used_buflen, buffer + bufsize,
+                e.path + cut, e.pathlen - cut, e.size);
+            used_buflen = used_buflen + filllen;
+            nr_files = nr_files + 1;
+        }
+        dirwalk_close(w);
+
+        if (rc < 0) {
+            log_error("skip %s: read directory failed", dirpath);
+            nr_files = dir_files;
+            used_buflen = dir_buflen;
         } else {
-            /* 当前目录处理完毕，累计文件数量和缓冲区使用量 */
+            /* 当前目录处理完毕 */
             nr_scan = nr_scan + 1;
-            nr_files = nr_files + res.nr_files;
-            used_buflen = used_buflen + res.used_buflen;
         }
     }
 
-out: {
-        /* 获取多个目录下的文件列表完成，最后填充消息包长度和文件列表个数 */
-        int64_t *msglen = (int64_t *)(&buffer[0]);
-        *msglen = htobe64(used_buflen + 12);
-        int32_t *listlen = (int32_t *)(&buffer[8]);
-        *listlen = htobe32(nr_files);
-        out->nr_files = nr_files;
-        out->used_buflen = 8/*消息包总长度*/ + 4/*文件列表长度*/ + used_buflen;
-        log_info("%d directory, %d scan, %d files, %d bytes",
-                 nr_dir, nr_scan, nr_files, used_buflen+12);
-        return buffer;
-    }
+    /* 获取多个目录下的文件列表完成，最后填充消息包长度和文件列表个数 */
+    int64_t *msglen = (int64_t *)(&buffer[0]);
+    *msglen = htobe64(used_buflen + 12);
+    int32_t *listlen = (int32_t *)(&buffer[8]);
+    *listlen = htobe32(nr_files);
+    out->nr_files = nr_files;
+    out->used_buflen = 8/*消息包总长度*/ + 4/*文件列表长度*/ + used_buflen;
+    log_info("%d directory, %d scan, %d files, %d bytes",
+             nr_dir, nr_scan, nr_files, used_buflen+12);
+    return buffer;
 }
 
 void print_file_list(const char *buffer)
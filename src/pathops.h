@@ -1,6 +1,7 @@
 #ifndef PATHOPS_H
 #define PATHOPS_H
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
@@ -19,6 +20,24 @@ extern off_t get_file_size(const char *filepath);
 extern void split_serial(char *s, char **studyid, char **serial);
 extern void cut_mount_path(char *abspath, const char *mountpoint);
 
+/*
+ * 目录遍历器，递归取得目录树下的所有普通文件
+ */
+struct dirwalk;
+
+#define DIRWALK_PATH_MAX  4096  /* 遍历时路径名的最大长度 */
+
+struct dirwalk_entry {
+    const char *path;           /* 文件的完整路径名 */
+    int pathlen;                /* 路径名的长度 */
+    const char *name;           /* 文件名，指向 path 的最后一段 */
+    int64_t size;               /* 文件大小 */
+};
+
+extern struct dirwalk *dirwalk_open(const char *dirpath);
+extern int dirwalk_next(struct dirwalk *w, struct dirwalk_entry *e);
+extern void dirwalk_close(struct dirwalk *w);
+
 struct file_list_result {
     int nr_files;               /* 目录树下的文件个数 */
     int used_buflen;            /* 缓冲区实际使用的长度 */
@@ -29,6 +48,18 @@ extern int get_dir_list(
     char *list, int listlen,
     struct file_list_result *res);
 
+/*
+ * 填充一个文件列表项：2 字节文件名长度，文件名，8 字节文件大小，都是网络字节
+ * 序。返回填充的长度，缓冲区不够时返回 -1
+ */
+extern int fill_file_list(char *out, char *end,
+                          const char *filename, int namelen, int64_t filesize);
+
+/*
+ * 绝对路径中挂载点部分的长度，挂载点不匹配时返回 0
+ */
+extern int mount_prefix_len(const char *abspath, const char *mountpoint);
+
 extern char *fill_many_dir_list(
     const char *mountpath, const char *dirs[], int nr_dir,
     struct file_list_result *out);
@@ -36,6 +36,7 @@
 #define NODE_TYPE_ASM   6
 
 #define NODE_TYPE_PIPE  200
+#define NODE_TYPE_JOBQ  201
 
 #define MAX_IP_LEN 15
 
@@ -110,6 +111,19 @@ extern uint32_t local_id;
 #define CMD_BK_DIR_RENAME_REQ 0x0002001D
 #define CMD_BK_DIR_RENAME_RSP 0x0002001E
 
+// 分段获取文件列表，边遍历目录边发送，格式见 liststream.h
+#define CMD_GET_FILE_LIST_STREAM_REQ 0x0002001F
+#define CMD_GET_FILE_LIST_STREAM_RSP 0x00020020
+
+// 查询后台任务的状态，任务号放在 total 中，见 backup_operation()
+#define CMD_BK_JOB_STATUS_REQ 0x00020021
+#define CMD_BK_JOB_STATUS_RSP 0x00020022
+
+// 批量顺序下载检查、系列或者列出的所有文件，格式见 batchdl.h。响应是没有消
+// 息头的数据流，CMD_BATCH_DOWNLOAD_RSP 只用于配对，不在连接上发送
+#define CMD_BATCH_DOWNLOAD_REQ 0x00020023
+#define CMD_BATCH_DOWNLOAD_RSP 0x00020024
+
 #define CMD_MIGRATION_START_REQ 0x00030001
 #define CMD_MIGRATION_START_RSP 0x00030002
 
@@ -0,0 +1,368 @@
+
+// resume.c
+
+#include <dirent.h>
+
+#include "mt_log.h"
+#include "public.h"
+#include "conn_mgmt.h"
+#include "tunables.h"
+#include "wbuf.h"
+#include "metaidx.h"
+#include "hotcache.h"
+#include "fdcache.h"
+#include "resume.h"
+
+extern int mkdirs(const char *dirpath);
+extern const char *backend_key(const char *path, int *index);
+extern int backend_cnt;
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+#define RESUME_REC_MAX  (MAX_PATH_LEN + MAX_NAME_LEN + 128)
+
+// 续传文件中的记录
+struct record {
+    uint32_t client;
+    char md5[MD5_LEN + 1];
+    int64_t size;
+    int64_t committed;
+    char key[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+};
+
+static void resume_dir(char *path, int len, int b)
+{
+    snprintf(path, len, "%s/%s/%s", backend_dirs[b], METAIDX_DIR, RESUME_DIR);
+}
+
+// 续传文件名是相对路径的散列（64 位 FNV-1a）
+static void record_path(char *path, int len, int b, const char *key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    const char *p;
+    for (p = key; *p != '\0'; p++) {
+        h = (h ^ (uint8_t)*p) * 1099511628211ULL;
+    }
+    snprintf(path, len, "%s/%s/%s/%016llx", backend_dirs[b], METAIDX_DIR,
+             RESUME_DIR, (unsigned long long)h);
+}
+
+// 读取一个续传文件，*mtime 是记录的时间。成功返回 0，失败返回 -1
+static int read_record(const char *path, struct record *r, time_t *mtime)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char line[RESUME_REC_MAX];
+    struct stat st;
+    int rc = -1;
+    if (fstat(fileno(fp), &st) == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        long long int size, committed;
+        int n = 0;
+        if (sscanf(line, "%u %32s %lld %lld %n", &r->client, r->md5,
+                   &size, &committed, &n) == 4 && n > 0) {
+            char *nl = strchr(line + n, '\n');
+            if (nl != NULL) {
+                *nl = '\0';
+            }
+            snprintf(r->key, sizeof(r->key), "%s", line + n);
+            r->size = size;
+            r->committed = committed;
+            *mtime = st.st_mtime;
+            rc = 0;
+        } else {
+            log_warning("bad resume record %s", path);
+        }
+    }
+    fclose(fp);
+    return rc;
+}
+
+// 先写入临时文件再重命名，中途崩溃时不会留下不完整的记录
+static int write_record(int b, const struct record *r)
+{
+    char path[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    resume_dir(path, sizeof(path), b);
+    if (mkdirs(path) != 0) {
+        log_error("mkdir %s failed: %s", path, strerror(errno));
+        return -1;
+    }
+    record_path(path, sizeof(path), b, r->key);
+    char tmp[MAX_PATH_LEN + MAX_NAME_LEN + 16];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        log_error("open %s failed: %s", tmp, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "%u %s %lld %lld %s\n", r->client, r->md5,
+            (long long int)r->size, (long long int)r->committed, r->key);
+    int rc = fflush(fp) == 0 && fdatasync(fileno(fp)) == 0 ? 0 : -1;
+    fclose(fp);
+    if (rc != 0 || rename(tmp, path) != 0) {
+        log_error("write %s failed: %s", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int64_t resume_offset(uint32_t client, const char *key, const char *md5,
+                      int64_t size, uint32_t mask)
+{
+    if (upload_resume_ttl <= 0 || mask == 0) {
+        return 0;
+    }
+
+    int64_t offset = size;
+    int b;
+    for (b = 0; b < backend_cnt; b++) {
+        if (!(mask & (1U << b))) {
+            continue;
+        }
+        char path[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+        record_path(path, sizeof(path), b, key);
+        struct record r;
+        time_t mtime;
+        if (read_record(path, &r, &mtime) != 0) {
+            return 0;
+        }
+        if (r.client != client || strcmp(r.key, key) != 0 ||
+            strcmp(r.md5, md5) != 0 || r.size != size) {
+            // 同名文件的另一次上传
+            return 0;
+        }
+        if (time(NULL) - mtime > upload_resume_ttl) {
+            // 已经过期，等待清理
+            return 0;
+        }
+        struct stat st;
+        snprintf(path, sizeof(path), "%s%s", backend_dirs[b], key);
+        if (stat(path, &st) != 0 || st.st_size < r.committed) {
+            log_warning("%s changed since upload interrupted", path);
+            return 0;
+        }
+        if (r.committed < offset) {
+            offset = r.committed;
+        }
+    }
+    offset = offset - offset % RESUME_ALIGN;
+    if (offset > 0) {
+        log_info("resume upload of %s at %lld", key, (long long int)offset);
+    }
+    return offset;
+}
+
+void resume_save(conn_info_t *c, int64_t committed)
+{
+    if (upload_resume_ttl <= 0 || c->pack != NULL || committed <= 0) {
+        return;
+    }
+    if (close_write_buffer(c) != 0) {
+        // 写入过程中出错了，文件中的数据不可信
+        log_warning("sock_fd:%d write failed, upload cannot resume", c->sock_fd);
+        return;
+    }
+
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct backend_file *f = &c->befiles[i];
+        if (f->lagging || f->fd < 0) {
+            continue;
+        }
+        struct record r;
+        const char *key = backend_key(f->abs_file_name, NULL);
+        if (key == NULL || strlen(f->md5) != MD5_LEN) {
+            continue;
+        }
+        r.client = c->peer_id;
+        snprintf(r.md5, sizeof(r.md5), "%s", f->md5);
+        r.size = f->filesize;
+        r.committed = committed;
+        snprintf(r.key, sizeof(r.key), "%s", key);
+        if (fdatasync(f->fd) != 0) {
+            log_error("fdatasync %s failed: %s", f->abs_file_name, strerror(errno));
+        } else if (write_record(i, &r) == 0) {
+            log_info("%s interrupted at %lld, may resume", f->abs_file_name,
+                     (long long int)committed);
+        } else {
+            // 这个后端没有记录，不能续传
+        }
+    }
+}
+
+void resume_clear(const char *key)
+{
+    int b;
+    for (b = 0; b < backend_cnt; b++) {
+        char path[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+        record_path(path, sizeof(path), b, key);
+        if (unlink(path) != 0 && errno != ENOENT) {
+            log_warning("unlink %s failed: %s", path, strerror(errno));
+        }
+    }
+}
+
+// 删除一个后端中过期的记录
+static int gc_backend(int b, time_t now)
+{
+    char dirpath[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    resume_dir(dirpath, sizeof(dirpath), b);
+    DIR *dir = opendir(dirpath);
+    if (dir == NULL) {
+        // 没有中断过的上传
+        return 0;
+    }
+
+    int n = 0;
+    struct dirent *e;
+    while ((e = readdir(dir)) != NULL) {
+        if (e->d_name[0] == '.') {
+            continue;
+        }
+        char path[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+        if (snprintf(path, sizeof(path), "%s/%s", dirpath, e->d_name) >= (int)sizeof(path)) {
+            // 不是这里写的文件，续传文件名是 16 个字符的散列
+            continue;
+        }
+        struct record r;
+        time_t mtime;
+        if (read_record(path, &r, &mtime) != 0) {
+            struct stat st;
+            if (stat(path, &st) == 0 && now - st.st_mtime > upload_resume_ttl) {
+                // 写了一半的临时文件或者坏的记录
+                unlink(path);
+            }
+            continue;
+        }
+        if (now - mtime <= upload_resume_ttl) {
+            continue;
+        }
+
+        char filepath[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+        struct stat st;
+        if (snprintf(filepath, sizeof(filepath), "%s%s", backend_dirs[b],
+                     r.key) >= (int)sizeof(filepath)) {
+            // 路径太长，不可能是上传的文件，只删除记录
+            log_warning("bad resume record %s", path);
+            unlink(path);
+            continue;
+        }
+        if (stat(filepath, &st) == 0 && now - st.st_mtime <= upload_resume_ttl) {
+            // 文件还在写入，正在续传
+            continue;
+        }
+        if (unlink(filepath) == 0) {
+            metaidx_remove(filepath);
+            hotcache_invalidate(filepath);
+            fdcache_invalidate(filepath);
+            log_info("remove interrupted upload %s", filepath);
+        } else if (errno != ENOENT) {
+            log_warning("unlink %s failed: %s", filepath, strerror(errno));
+        }
+        unlink(path);
+        n = n + 1;
+    }
+    closedir(dir);
+    return n;
+}
+
+int resume_gc(void)
+{
+    if (upload_resume_ttl <= 0) {
+        return 0;
+    }
+    time_t now = time(NULL);
+    int n = 0;
+    int b;
+    for (b = 0; b < backend_cnt; b++) {
+        n = n + gc_backend(b, now);
+    }
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////
+// 测试用例
+////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_UNITTEST
+
+#include <assert.h>
+#include <utime.h>
+
+// 把文件的修改时间设置到 ago 秒以前
+static void test_age(const char *path, time_t ago)
+{
+    struct utimbuf t;
+    t.actime = time(NULL) - ago;
+    t.modtime = t.actime;
+    assert(utime(path, &t) == 0);
+}
+
+void test_resume(void)
+{
+    printf("test_resume: ");
+
+    backend_cnt = 1;
+    snprintf(backend_dirs[0], sizeof(backend_dirs[0]), "/tmp/test_resume");
+    assert(mkdirs("/tmp/test_resume/62/17") == 0);
+    upload_resume_ttl = 60;
+    const char *md5 = "0123456789abcdef0123456789abcdef";
+
+    /* 记录写入后原样读出 */
+    struct record r, r2;
+    memset(&r, 0, sizeof(r));
+    r.client = 0x80000001;
+    snprintf(r.md5, sizeof(r.md5), "%s", md5);
+    r.size = 100000;
+    r.committed = RESUME_ALIGN * 2 + 100;
+    snprintf(r.key, sizeof(r.key), "/62/17/f 1");
+    assert(write_record(0, &r) == 0);
+    char path[MAX_PATH_LEN + MAX_NAME_LEN + 1];
+    record_path(path, sizeof(path), 0, r.key);
+    time_t mtime;
+    assert(read_record(path, &r2, &mtime) == 0);
+    assert(r2.client == r.client && !strcmp(r2.md5, md5) && r2.size == r.size &&
+           r2.committed == r.committed && !strcmp(r2.key, r.key));
+
+    /* 续传位置向下对齐，后端文件比记录短或者请求不匹配时从头开始 */
+    int fd = open("/tmp/test_resume/62/17/f 1", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(resume_offset(r.client, r.key, md5, r.size, 1) == 0);
+    assert(ftruncate(fd, r.committed) == 0);
+    close(fd);
+    assert(resume_offset(r.client, r.key, md5, r.size, 1) == RESUME_ALIGN * 2);
+    assert(resume_offset(r.client + 1, r.key, md5, r.size, 1) == 0);
+    assert(resume_offset(r.client, r.key, "00000000000000000000000000000000",
+                         r.size, 1) == 0);
+    assert(resume_offset(r.client, r.key, md5, r.size + 1, 1) == 0);
+    assert(resume_offset(r.client, "/62/17/f 2", md5, r.size, 1) == 0);
+
+    /* 过期的记录不能续传，文件最近还在写入时清理保留文件和记录 */
+    test_age(path, 120);
+    assert(resume_offset(r.client, r.key, md5, r.size, 1) == 0);
+    assert(resume_gc() == 0);
+    assert(access(path, F_OK) == 0);
+    assert(access("/tmp/test_resume/62/17/f 1", F_OK) == 0);
+
+    /* 文件也过期以后一起删除 */
+    test_age("/tmp/test_resume/62/17/f 1", 120);
+    assert(resume_gc() == 1);
+    assert(access(path, F_OK) != 0);
+    assert(access("/tmp/test_resume/62/17/f 1", F_OK) != 0);
+
+    /* 上传完成时删除记录 */
+    assert(write_record(0, &r) == 0);
+    resume_clear(r.key);
+    assert(access(path, F_OK) != 0);
+
+    resume_dir(path, sizeof(path), 0);
+    rmdir(path);
+    rmdir("/tmp/test_resume/" METAIDX_DIR);
+    rmdir("/tmp/test_resume/62/17");
+    rmdir("/tmp/test_resume/62");
+    rmdir("/tmp/test_resume");
+    printf("success\n");
+}
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include <stdint.h>
+
+#include "conn_mgmt.h"
+
+/*
+ * 断点续传
+ *
+ * 上传中断（连接断开、接收超时、超过截止时间）时，已经连续收到的数据写入后端
+ * 文件并 fdatasync()，每个参与上传的后端在 METAIDX_DIR/RESUME_DIR 中记录一个
+ * 续传文件，文件名是相对路径的散列，内容是一行文本：
+ *
+ *   <客户端 id> <md5> <文件大小> <已经写入的字节数> <相对路径>
+ *
+ * 同一个客户端用同一个文件名、同样的 md5 和大小重新发送 CMD_START_UPLOAD_REQ
+ * 时，每个参与上传的后端都有匹配的记录、后端文件至少有记录的大小，就不截断后
+ * 端文件，上传开始响应的 offset 是续传的位置（所有后端中最小的，向下对齐到
+ * RESUME_ALIGN），客户端从这个位置继续发送上传数据请求，否则 offset 为 0，从
+ * 头开始。上传完成时仍然重新计算整个文件的 md5，续传的部分写错了也能发现。
+ *
+ * 上传完成或者从头开始时删除续传记录。超过 upload_resume_ttl 秒的记录被定时清
+ * 理，后端文件也在这段时间内没有写入时一起删除。upload_resume_ttl 为 0 时关闭
+ * 续传，上传开始响应的 offset 总是 0。打包存放的小文件不续传。
+ */
+
+#define RESUME_DIR          "resume"
+#define RESUME_ALIGN        4096
+#define RESUME_GC_INTERVAL  60      // 清理过期记录的间隔（秒）
+
+/*
+ * 上传开始时查找续传的位置。key 是相对于后端目录的路径，mask 是参与上传的后
+ * 端。返回续传的位置，不能续传时返回 0
+ */
+extern int64_t resume_offset(uint32_t client, const char *key, const char *md5,
+                             int64_t size, uint32_t mask);
+
+/*
+ * 上传中断，committed 之前的数据都已经收到。写出缓冲中的数据，同步后端文件，
+ * 记录续传的位置
+ */
+extern void resume_save(conn_info_t *c, int64_t committed);
+
+/*
+ * 删除 key 在所有后端中的续传记录
+ */
+extern void resume_clear(const char *key);
+
+/*
+ * 删除过期的续传记录和没有完成的文件，返回删除的记录个数
+ */
+extern int resume_gc(void);
+
+#endif  /* RESUME_H */
@@ -21,6 +21,10 @@
  * 2020-03-20
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -37,13 +41,31 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <pthread.h>
+#include <linux/fiemap.h>
 
 #include "mt_log.h"
+#include "scandir.h"
+#include "tunables.h"
+#include "bkindex.h"
+#include "dircache.h"
+#include "pack.h"
 
 #define MAX_PATH_LEN (4096)
 #define BLOCK_SIZE (8192)
 #define BKDIRNAME ".#__hide.youcantseeme__#"
 
+/* linux/fs.h 中的 BLOCK_SIZE 和这里的定义冲突，所以不包含它 */
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#ifndef FS_IOC_FIEMAP
+#define FS_IOC_FIEMAP _IOWR('f', 11, struct fiemap)
+#endif
+
 int write_zero_file(const char *filepath, off_t filesize)
 {
     int fd = open(filepath, O_CREAT | O_TRUNC | O_RDWR,
@@ -123,6 +145,13 @@ int mkdirs(const char *dirpath)
     char path[MAX_PATH_LEN];
     char *p;
 
+    /* 目录通常已经存在，或者只缺最后一级，先直接创建 */
+    if (mkdir(dirpath, 0755) == 0 || errno == EEXIST) {
+        return 0;
+    } else {
+        /* 上级目录不存在，从根目录开始逐级创建 */
+    }
+
     if (dirpath[0] == '/') {
         sprintf(path, "%s/", dirpath);
         p = path + 1;
@@ -262,6 +291,236 @@ int move_file(const char *oldpath, const char *newpath)
     }
 }
 
+/*
+ * 文件复制引擎
+ *
+ * 依次尝试：
+ *
+ * 1. ioctl(FICLONE)：文件系统支持共享数据块（reflink）时，只复制元数据；
+ * 2. copy_file_range()：数据在内核（或者网络文件系统的服务端）中复制，不经过
+ *    用户空间；
+ * 3. 用大缓冲区在用户空间读写。
+ *
+ * 前一种方法不被文件系统支持时，从已经复制的位置开始换下一种方法。每次复制
+ * 都记录使用的方法和吞吐量，同时按方法累计，方便查看每个后端挂载点实际使用
+ * 的是哪一种方法。
+ */
+
+#define COPY_RANGE_CHUNK  (64 * 1024 * 1024) /* copy_file_range() 每次复制的长度 */
+#define COPY_BUFFER_SIZE  (1024 * 1024)      /* 用户空间复制的缓冲区大小 */
+
+struct copy_stat copy_stats[COPY_METHOD_MAX];
+
+const char *copy_method_string(int method)
+{
+    switch (method) {
+    case COPY_METHOD_CLONE: return "reflink";
+    case COPY_METHOD_RANGE: return "copy_file_range";
+    case COPY_METHOD_RW:    return "read/write";
+    default:                return "unknown";
+    }
+}
+
+/* 返回 0 表示复制完成，1 表示文件系统不支持，-1 表示出错 */
+static int copy_by_clone(int src, int dst)
+{
+    if (ioctl(dst, FICLONE, src) == 0) {
+        return 0;
+    } else if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV ||
+               errno == EINVAL || errno == ENOSYS || errno == EPERM) {
+        return 1;
+    } else {
+        log_error("ioctl FICLONE failed: %s", strerror(errno));
+        return -1;
+    }
+}
+
+/* 返回值同 copy_by_clone()，*done 是已经复制的长度 */
+static int copy_by_range(int src, int dst, off_t size, off_t *done)
+{
+#ifdef __NR_copy_file_range
+    while (*done < size) {
+        loff_t in = *done;
+        loff_t out = *done;
+        size_t len = size - *done;
+        if (len > COPY_RANGE_CHUNK) {
+            len = COPY_RANGE_CHUNK;
+        }
+        long n = syscall(__NR_copy_file_range, src, &in, dst, &out, len, 0);
+        if (n > 0) {
+            *done = *done + n;
+        } else if (n == 0) {
+            /* 源文件变短了 */
+            log_error("copy_file_range stopped at %lld of %lld bytes",
+                      (long long int)*done, (long long int)size);
+            return -1;
+        } else if (errno == EINTR) {
+            /* 系统调用被中断，继续复制 */
+        } else if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP ||
+                   errno == EINVAL || errno == EBADF) {
+            return 1;
+        } else {
+            log_error("copy_file_range failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+#else
+    (void) src;
+    (void) dst;
+    (void) size;
+    (void) done;
+    return 1;
+#endif
+}
+
+static int copy_by_rw(int src, int dst, off_t size, off_t *done)
+{
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    if (!buffer) {
+        log_error("malloc %d bytes failed", COPY_BUFFER_SIZE);
+        return -1;
+    }
+    while (*done < size) {
+        size_t want = size - *done;
+        if (want > COPY_BUFFER_SIZE) {
+            want = COPY_BUFFER_SIZE;
+        }
+        ssize_t x = pread(src, buffer, want, *done);
+        if (x > 0) {
+            ssize_t y = 0;
+            while (y < x) {
+                ssize_t n = pwrite(dst, buffer + y, x - y, *done + y);
+                if (n > 0) {
+                    y = y + n;
+                } else if (n < 0 && errno == EINTR) {
+                    /* 系统调用被中断，继续写入 */
+                } else {
+                    log_error("write failed: %d want, %d write: %s",
+                              (int)(x - y), (int)n, strerror(errno));
+                    free(buffer);
+                    return -1;
+                }
+            }
+            *done = *done + x;
+        } else if (x < 0 && errno == EINTR) {
+            /* 系统调用被中断，继续读取 */
+        } else {
+            log_error("read failed: %d want, %d read", (int)want, (int)x);
+            free(buffer);
+            return -1;
+        }
+    }
+    free(buffer);
+    return 0;
+}
+
+/*
+ * 从 method 指定的方法开始复制 size 字节，返回实际使用的方法，出错返回 -1
+ */
+int copy_fd(int src, int dst, off_t size, int method)
+{
+    off_t done = 0;
+    int rc;
+
+    if (method <= COPY_METHOD_CLONE) {
+        rc = copy_by_clone(src, dst);
+        if (rc <= 0) {
+            return rc == 0 ? COPY_METHOD_CLONE : -1;
+        } else {
+            /* 不支持 reflink，换下一种方法 */
+        }
+    }
+    if (method <= COPY_METHOD_RANGE) {
+        rc = copy_by_range(src, dst, size, &done);
+        if (rc <= 0) {
+            return rc == 0 ? COPY_METHOD_RANGE : -1;
+        } else {
+            /* 不支持 copy_file_range()，从已经复制的位置换下一种方法 */
+        }
+    }
+    rc = copy_by_rw(src, dst, size, &done);
+    return rc == 0 ? COPY_METHOD_RW : -1;
+}
+
+/*
+ * 按 mode 为文件预分配 size 字节，返回 0 表示成功，1 表示文件系统不支持，-1
+ * 表示出错（例如空间不足）
+ */
+int preallocate_fd(int fd, off_t size, int mode)
+{
+    int flags = mode == PREALLOC_KEEP_SIZE ? FALLOC_FL_KEEP_SIZE : 0;
+    if (mode == PREALLOC_OFF || size <= 0) {
+        return 0;
+    } else if (fallocate(fd, flags, 0, size) == 0) {
+        return 0;
+    } else if (errno == EOPNOTSUPP || errno == ENOSYS) {
+        return 1;
+    } else {
+        log_error("fallocate fd %d %lld bytes failed: %s",
+                  fd, (long long int)size, strerror(errno));
+        return -1;
+    }
+}
+
+/*
+ * 返回文件占用的区段（extent）个数，文件系统不支持 FIEMAP 时返回 -1。不使用
+ * FIEMAP_FLAG_SYNC，上传完成时每次都调用，同步写回相当于每个文件一次 fsync，
+ * 还没有写回的延迟分配的数据也按文件系统报告的区段统计
+ */
+int count_extents(int fd)
+{
+    struct fiemap fm;
+    memset(&fm, 0, sizeof(fm));
+    fm.fm_start = 0;
+    fm.fm_length = FIEMAP_MAX_OFFSET;
+    fm.fm_flags = 0;
+    fm.fm_extent_count = 0;     // 只统计个数，不返回区段
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm) == 0) {
+        return (int)fm.fm_mapped_extents;
+    } else {
+        return -1;
+    }
+}
+
+int copy_stats_json(char *buf, int len)
+{
+    int n = snprintf(buf, len, "{");
+    int i;
+    for (i = 0; i < COPY_METHOD_MAX && n < len; i++) {
+        struct copy_stat *cs = &copy_stats[i];
+        n = n + snprintf(buf + n, len - n,
+                         "%s\"%s\": {\"files\": %lu, \"bytes\": %lu, \"usecs\": %lu}",
+                         i > 0 ? ", " : "", copy_method_string(i),
+                         cs->files, cs->bytes, cs->usecs);
+    }
+    if (n < len) {
+        n = n + snprintf(buf + n, len - n, "}");
+    }
+    return n < len ? n : len - 1;
+}
+
+static void count_copy(const char *old_path, int method,
+                       off_t size, struct timeval *start)
+{
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    uint64_t usecs = (end.tv_sec - start->tv_sec) * 1000000UL +
+        end.tv_usec - start->tv_usec;
+    if (usecs == 0) {
+        usecs = 1;
+    }
+
+    struct copy_stat *cs = &copy_stats[method];
+    __sync_add_and_fetch(&cs->files, 1);
+    __sync_add_and_fetch(&cs->bytes, (uint64_t)size);
+    __sync_add_and_fetch(&cs->usecs, usecs);
+
+    log_info("copy %s: %lld bytes by %s in %.3f ms, %.1f MB/s",
+             old_path, (long long int)size, copy_method_string(method),
+             usecs / 1000.0, (double)size / usecs);
+}
+
 int copy_file(const char *old_path, const char *new_path)
 {
     char path1[MAX_PATH_LEN];
@@ -283,32 +542,18 @@ int copy_file(const char *old_path, const char *new_path)
             struct stat s;
             int rc = fstat(src, &s);
             if (rc == 0) {
-                char buffer[BLOCK_SIZE];
-                off_t leftsize = s.st_size;
-                while (leftsize > 0) {
-                    int x = read(src, buffer, BLOCK_SIZE);
-                    if (x > 0) {
-                        int y = write(dst, buffer, x);
-                        if (y == x) {
-                            leftsize = leftsize - x;
-                        } else {
-                            log_error("write failed: %d want, %d write", x, y);
-                            close(src);
-                            close(dst);
-                            return -1;
-                        }
-                    } else {
-                        log_error("read failed: %d want, %d read",
-                               BLOCK_SIZE, x);
-                        close(src);
-                        close(dst);
-                        return -1;
-                    }
-                }
-                assert(leftsize == 0);
+                struct timeval start;
+                gettimeofday(&start, NULL);
+                int method = copy_fd(src, dst, s.st_size, COPY_METHOD_CLONE);
                 close(src);
                 close(dst);
-                return 0;
+                if (method >= 0) {
+                    count_copy(old_path, method, s.st_size, &start);
+                    return 0;
+                } else {
+                    log_error("copy %s to %s failed", old_path, new_path);
+                    return -1;
+                }
             } else {
                 log_error("fstat failed: %s", strerror(errno));
                 close(src);
@@ -328,6 +573,29 @@ int copy_file(const char *old_path, const char *new_path)
     }
 }
 
+/* 在备份索引中记录新增的备份 bakpath */
+static void index_new_backup(const char *bakpath)
+{
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s", bakpath);
+    char *p = strrchr(path, '/');
+    if (p == NULL) {
+        return;
+    }
+    const char *name = p + 1;
+    *p = '\0';
+    p = strrchr(path, '/');
+    if (p == NULL || strcmp(p + 1, BKDIRNAME) != 0) {
+        log_error("not a backup path: %s", bakpath);
+        return;
+    }
+    *p = '\0';
+    if (bkindex_add(path[0] ? path : "/", &name, 1) != 0) {
+        /* 索引已经被删除，或者比备份目录旧，下次查找时重建 */
+        log_error("index backup failed: %s", bakpath);
+    }
+}
+
 int file_backup_update(const char *oldpath, char *bakpath)
 {
     int rc;
@@ -340,6 +608,7 @@ int file_backup_update(const char *oldpath, char *bakpath)
         if (rc == 0) {
             rc = move_file(oldpath, realpath);
             if (rc == 0) {
+                index_new_backup(realpath);
                 sprintf(bakpath, "%s", realpath);
                 return 0;
             } else {
@@ -358,104 +627,356 @@ int file_backup_update(const char *oldpath, char *bakpath)
 }
 
 /*
+ * 文件粉碎引擎
+ *
  * 对文件描述符 fd 指向的文件，进行内容覆盖写。由于对文件加密再写入文
  * 件，也只是改写文件的内容，和将随机的内容写入文件是一样的效果。所以，
  * 将加密后的内容再写入文件不是必须的。
+ *
+ * 每一遍都用 xorshift 生成新的随机内容，以 1MB 的对齐块用 pwrite() 写入，
+ * 文件系统支持时使用 O_DIRECT，绕过页缓存，也不会把页缓存中的其他数据挤出
+ * 去。每一遍写完都 fdatasync()。允许时最后用 fallocate(PUNCH_HOLE) 释放数据
+ * 块。一个文件和它的所有备份同时由多个线程粉碎，按设备统计吞吐量。
  */
-int __file_crush(int fd)
+
+#define CRUSH_BLOCK_SIZE (1024 * 1024)  /* 每次写入的长度 */
+#define CRUSH_ALIGN      (4096)         /* O_DIRECT 要求的对齐 */
+
+struct crush_target {
+    char path[MAX_PATH_LEN];
+    dev_t dev;
+    off_t size;
+    int rc;
+    int is_backup;          /* 是否是备份文件 */
+    int err;                /* 出错时的 errno */
+    const char *what;       /* 出错的操作 */
+    uint64_t usecs;
+};
+
+static uint64_t xorshift64(uint64_t *state)
 {
-    struct stat s;
-    int rc1 = fstat(fd, &s);
-    if (rc1 == 0) {
-        char buffer[BLOCK_SIZE];
-        off_t leftsize = s.st_size;
-        while (leftsize > 0) {
-            int blocksize = leftsize >= BLOCK_SIZE ? BLOCK_SIZE : leftsize;
-            int n = write(fd, buffer, blocksize);
-            if (n < 0) {
-                log_error("write failed: fd %d, size %d, %s",
-                       fd, blocksize, strerror(errno));
-                return -1;
-            } else {
-                leftsize = leftsize - blocksize;
-            }
-        }
-        assert(leftsize == 0);
-        int rc2 = fdatasync(fd);
-        if (rc2 == 0) {
-            return 0;
-        } else {
-            log_error("fdatasync failed: fd %d, %s",
-                   fd, strerror(errno));
-            return -1;
-        }
-    } else {
-        log_error("fstat failed: fd %d, %s", fd, strerror(errno));
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void fill_random(char *buffer, size_t len, uint64_t *state)
+{
+    uint64_t *p = (uint64_t *)buffer;
+    size_t i;
+    for (i = 0; i < (len + 7) / 8; i++) {
+        p[i] = xorshift64(state);
+    }
+}
+
+static int set_direct(int fd, int on)
+{
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0) {
         return -1;
+    } else if (on) {
+        return fcntl(fd, F_SETFL, flags | O_DIRECT);
+    } else {
+        return fcntl(fd, F_SETFL, flags & ~O_DIRECT);
     }
 }
 
-int file_crush(int fd, int nr_crush)
+/*
+ * 覆盖写 fd 中从 start 开始的 size 字节 nr_crush 遍，不写日志，可以在任何线
+ * 程中调用。出错时返回 -1，*what 是出错的操作，errno 是出错原因
+ */
+static int overwrite_fd(int fd, off_t start, off_t size, int nr_crush,
+                        const char **what)
 {
+    char *buffer = NULL;
+    int rc = posix_memalign((void **)&buffer, CRUSH_ALIGN, CRUSH_BLOCK_SIZE);
+    if (rc != 0) {
+        *what = "posix_memalign";
+        errno = rc;
+        return -1;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    int direct = flags >= 0 && (flags & O_DIRECT);
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    uint64_t state = ((uint64_t)tv.tv_sec << 20) ^ tv.tv_usec ^
+        ((uint64_t)fd << 48) ^ (uintptr_t)buffer;
+    if (state == 0) {
+        state = 0x9E3779B97F4A7C15ULL;
+    }
+
     int i;
-    int rc1;
     for (i = 0; i < nr_crush; i++) {
-        int rc2 = lseek(fd, 0, SEEK_SET);
-        if (rc2 == 0) {
-            rc1 = __file_crush(fd);
-            if (rc1 == 0) {
-                /* 文件粉碎一次成功 */
+        off_t offset = 0;
+        while (offset < size) {
+            size_t len = size - offset;
+            if (len > CRUSH_BLOCK_SIZE) {
+                len = CRUSH_BLOCK_SIZE;
+            }
+            if (direct && len % CRUSH_ALIGN != 0) {
+                /* 文件末尾不对齐的部分不能用 O_DIRECT 写入 */
+                set_direct(fd, 0);
+                direct = 0;
+            }
+            fill_random(buffer, len, &state);
+            ssize_t n = pwrite(fd, buffer, len, start + offset);
+            if (n > 0) {
+                offset = offset + n;
+            } else if (n < 0 && errno == EINTR) {
+                /* 系统调用被中断，继续写入 */
+            } else if (n < 0 && errno == EINVAL && direct) {
+                /* 文件系统不支持 O_DIRECT，使用页缓存写入 */
+                set_direct(fd, 0);
+                direct = 0;
             } else {
-                log_error("__file_crush failed: fd %d", fd);
+                *what = "write";
+                free(buffer);
                 return -1;
             }
+        }
+        if (fdatasync(fd) != 0) {
+            *what = "fdatasync";
+            free(buffer);
+            return -1;
+        }
+        if (flags >= 0 && (flags & O_DIRECT) && !direct) {
+            /* 下一遍继续使用 O_DIRECT */
+            direct = set_direct(fd, 1) == 0;
+        }
+    }
+    free(buffer);
+
+    if (crush_punch_hole && size > 0) {
+        /* 空文件没有数据块，长度为 0 的 fallocate() 返回 EINVAL */
+        rc = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, size);
+        if (rc != 0 && errno != EOPNOTSUPP) {
+            *what = "fallocate";
+            return -1;
         } else {
-            log_error("lseek failed: fd %d, offset 0, %s",
-                   fd, strerror(errno));
+            /* 释放了数据块，或者文件系统不支持 */
+        }
+    }
+    return 0;
+}
+
+/* 粉碎一个文件并删除，不写日志，结果记录在 t 中 */
+static int crush_target(struct crush_target *t, int nr_crush)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    t->rc = -1;
+    int fd = open(t->path, O_RDWR | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        /* 文件系统不支持 O_DIRECT */
+        fd = open(t->path, O_RDWR);
+    }
+    if (fd < 0) {
+        t->what = "open";
+        t->err = errno;
+        return -1;
+    }
+
+    struct stat s;
+    if (fstat(fd, &s) != 0) {
+        t->what = "fstat";
+        t->err = errno;
+        close(fd);
+        return -1;
+    }
+    t->dev = s.st_dev;
+    t->size = s.st_size;
+
+    if (overwrite_fd(fd, 0, s.st_size, nr_crush, &t->what) != 0) {
+        t->err = errno;
+        close(fd);
+        return -1;
+    }
+    if (close(fd) != 0) {
+        t->what = "close";
+        t->err = errno;
+        return -1;
+    }
+    if (remove(t->path) != 0) {
+        t->what = "remove";
+        t->err = errno;
+        return -1;
+    }
+
+    gettimeofday(&end, NULL);
+    t->usecs = (end.tv_sec - start.tv_sec) * 1000000UL +
+        end.tv_usec - start.tv_usec;
+    t->rc = 0;
+    return 0;
+}
+
+struct crush_batch {
+    struct crush_target *targets;
+    int nr;
+    int cap;
+    int next;               /* 下一个要粉碎的文件，多个线程共享 */
+    int nr_crush;
+};
+
+static int add_crush_target(struct crush_batch *b, const char *path)
+{
+    if (b->nr == b->cap) {
+        int cap = b->cap ? b->cap * 2 : 8;
+        struct crush_target *t = realloc(b->targets,
+                                         cap * sizeof(struct crush_target));
+        if (!t) {
+            log_error("malloc %d crush targets failed", cap);
             return -1;
         }
+        b->targets = t;
+        b->cap = cap;
     }
+    struct crush_target *t = &b->targets[b->nr];
+    memset(t, 0, sizeof(struct crush_target));
+    snprintf(t->path, sizeof(t->path), "%s", path);
+    b->nr = b->nr + 1;
     return 0;
 }
 
-/* 将随机内容写入整个文件，然后删除文件 */
-int filepath_crush(const char *filepath, int nr_crush)
+static void *crush_batch_thread(void *arg)
 {
-    assert(nr_crush >= 1);
-    int fd = open(filepath, O_RDWR);
-    if (fd >= 0) {
-        int retcode;
-        int rc1 = file_crush(fd, nr_crush/*粉碎文件多少次*/);
-        if (rc1 == 0) {
-            int rc2 = remove(filepath);
-            if (rc2 == 0) {
-                retcode = 0;
-                goto out;
-            } else {
-                log_error("remove failed: filepath %s, %s",
-                       filepath, strerror(errno));
-                retcode = -1;
-                goto out;
+    struct crush_batch *b = (struct crush_batch *)arg;
+    for (;;) {
+        int i = __sync_fetch_and_add(&b->next, 1);
+        if (i >= b->nr) {
+            break;
+        }
+        crush_target(&b->targets[i], b->nr_crush);
+    }
+    return NULL;
+}
+
+/* 按设备汇总写入的数据量，记录每个设备的吞吐量 */
+static void log_crush_batch(struct crush_batch *b, uint64_t usecs)
+{
+    int i, j;
+    for (i = 0; i < b->nr; i++) {
+        struct crush_target *t = &b->targets[i];
+        if (t->rc != 0) {
+            continue;
+        }
+        int seen = 0;
+        for (j = 0; j < i; j++) {
+            if (b->targets[j].rc == 0 && b->targets[j].dev == t->dev) {
+                seen = 1;
+                break;
             }
+        }
+        if (seen) {
+            /* 这个设备已经统计过 */
+            continue;
+        }
+        int files = 0;
+        uint64_t bytes = 0;
+        for (j = i; j < b->nr; j++) {
+            if (b->targets[j].rc == 0 && b->targets[j].dev == t->dev) {
+                files = files + 1;
+                bytes = bytes + (uint64_t)b->targets[j].size * b->nr_crush;
+            }
+        }
+        log_info("crush dev %u:%u: %d files, %llu bytes written in %.3f ms, "
+                 "%.1f MB/s", major(t->dev), minor(t->dev), files,
+                 (unsigned long long int)bytes, usecs / 1000.0,
+                 usecs ? (double)bytes / usecs : 0.0);
+    }
+}
+
+/* 用最多 crush_threads 个线程粉碎所有文件，有一个失败就返回 -1 */
+static int run_crush_batch(struct crush_batch *b)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    pthread_t tids[64];
+    int nr_threads = b->nr < crush_threads ? b->nr : crush_threads;
+    if (nr_threads > 64) {
+        nr_threads = 64;
+    }
+    int i, started = 0;
+    for (i = 1; i < nr_threads; i++) {
+        if (pthread_create(&tids[started], NULL, crush_batch_thread, b) == 0) {
+            started = started + 1;
         } else {
-            log_error("file_crush failed: fd %d, filepath %s, %d times",
-                   fd, filepath, nr_crush);
+            /* 创建线程失败，由已有的线程完成 */
+            break;
+        }
+    }
+    crush_batch_thread(b);
+    for (i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    gettimeofday(&end, NULL);
+    uint64_t usecs = (end.tv_sec - start.tv_sec) * 1000000UL +
+        end.tv_usec - start.tv_usec;
+
+    int retcode = 0;
+    for (i = 0; i < b->nr; i++) {
+        struct crush_target *t = &b->targets[i];
+        if (t->rc != 0) {
+            log_error("crush failed: filepath %s, %s: %s",
+                      t->path, t->what, strerror(t->err));
             retcode = -1;
-            goto out;
+        } else {
+            /* 粉碎成功 */
         }
-        int rc3;
-    out:
-        rc3 = close(fd);
-        if (rc3 == 0) {
-            return retcode;
+    }
+    log_crush_batch(b, usecs);
+    return retcode;
+}
+
+int file_crush(int fd, int nr_crush)
+{
+    struct stat s;
+    int rc1 = fstat(fd, &s);
+    if (rc1 == 0) {
+        const char *what = NULL;
+        int rc2 = overwrite_fd(fd, 0, s.st_size, nr_crush, &what);
+        if (rc2 == 0) {
+            return 0;
         } else {
-            log_error("close failed: fd %d, filepath %s, %s",
-                   fd, filepath, strerror(errno));
+            log_error("%s failed: fd %d, %s", what, fd, strerror(errno));
             return -1;
         }
     } else {
-        log_error("open failed: filepath %s, %s",
-               filepath, strerror(errno));
+        log_error("fstat failed: fd %d, %s", fd, strerror(errno));
+        return -1;
+    }
+}
+
+/* 覆盖写文件中的一段，不删除文件，用于打包存放的文件 */
+int range_crush(int fd, off_t offset, off_t size, int nr_crush)
+{
+    const char *what = NULL;
+    if (overwrite_fd(fd, offset, size, nr_crush, &what) == 0) {
+        return 0;
+    } else {
+        log_error("%s failed: fd %d, %s", what, fd, strerror(errno));
+        return -1;
+    }
+}
+
+/* 将随机内容写入整个文件，然后删除文件 */
+int filepath_crush(const char *filepath, int nr_crush)
+{
+    assert(nr_crush >= 1);
+    struct crush_batch b;
+    memset(&b, 0, sizeof(b));
+    b.nr_crush = nr_crush;
+    if (add_crush_target(&b, filepath) == 0) {
+        int rc = run_crush_batch(&b);
+        free(b.targets);
+        return rc;
+    } else {
         return -1;
     }
 }
@@ -519,8 +1040,7 @@ int filepath_crush_cb(const char *path, const struct stat *stat, void *user)
             const char *origname = (const char *)user;
             int namelen = strlen(origname); /* 不计算最后的'\0'结束符 */
             if (strncmp(filename, origname, namelen) == 0) {
-                const int max_nr_crush = 3;
-                return filepath_crush(path, max_nr_crush);
+                return filepath_crush(path, crush_passes);
             } else {
                 /* log_error("filename: %s, origname: %s", filename, origname); */
                 /* log_error("skip filepath %s: not a target", path); */
@@ -622,9 +1142,54 @@ int walk_tree(const char *dirpath,
     }
 }
 
+/* 把 dirpath 中文件 filename 的所有备份加入粉碎列表 */
+static int collect_backups(struct crush_batch *b, const char *dirpath,
+                           const char *filename)
+{
+    struct bkindex_list l;
+    if (bkindex_lookup(dirpath, filename, &l) != 0) {
+        log_error("lookup backups failed: %s/%s", dirpath, filename);
+        return -1;
+    }
+
+    const char *stale[l.nr + 1];
+    int nr_stale = 0;
+    int i;
+    for (i = 0; i < l.nr; i++) {
+        char path[MAX_PATH_LEN];
+        snprintf(path, sizeof(path), "%s/%s/%s", dirpath, BKDIRNAME, l.names[i]);
+        if (access(path, F_OK) != 0 && errno == ENOENT) {
+            /* 备份已经不存在了，从索引中删除 */
+            stale[nr_stale++] = l.names[i];
+        } else if (add_crush_target(b, path) == 0) {
+            b->targets[b->nr - 1].is_backup = 1;
+        } else {
+            bkindex_free(&l);
+            return -1;
+        }
+    }
+    bkindex_remove(dirpath, stale, nr_stale);
+    bkindex_free(&l);
+    return 0;
+}
+
+/* 从备份索引中删除已经粉碎的备份 */
+static void unindex_crushed(struct crush_batch *b, const char *dirpath)
+{
+    const char *names[b->nr + 1];
+    int nr = 0;
+    int i;
+    for (i = 0; i < b->nr; i++) {
+        if (b->targets[i].is_backup && b->targets[i].rc == 0) {
+            names[nr++] = strrchr(b->targets[i].path, '/') + 1;
+        }
+    }
+    bkindex_remove(dirpath, names, nr);
+}
+
 /*
- * 粉碎原文件和所有相关的备份文件。粉碎备份文件时，要扫描目录找到所有
- * 相关的备份文件，对这些备份文件做粉碎操作。
+ * 粉碎原文件和所有相关的备份文件。相关的备份文件从备份索引中查找，见
+ * bkindex.h。
  */
 #define CRUSH_FILE (0x0001)
 #define CRUSH_BACK (0x0010)
@@ -633,7 +1198,6 @@ int file_backup_crush(const char *filepath, int how)
     assert(how != 0);
     assert(filepath);
 
-    const int max_nr_crush = 3;
     char dirpath[MAX_PATH_LEN];
     char filename[MAX_PATH_LEN];
     int rc1 = path_split(filepath, dirpath, filename);
@@ -642,29 +1206,42 @@ int file_backup_crush(const char *filepath, int how)
         char realpath[MAX_PATH_LEN];
         snprintf(realpath, MAX_PATH_LEN, "%s/%s", dirpath, filename);
 
+        /* 先找出所有要粉碎的文件，再同时粉碎 */
+        struct crush_batch b;
+        memset(&b, 0, sizeof(b));
+        b.nr_crush = crush_passes;
+
         if (how & CRUSH_FILE) {
             /* 粉碎文件 */
-            int rc2 = filepath_crush(realpath, max_nr_crush);
-            if (rc2 == 0) {
-                /*
-                 * 粉碎文件成功，继续处理看看是否需要粉碎该文件的所有
-                 * 备份
-                 */
-                retcode = 0;
-            } else {
-                log_error("filepath_crush failed: realpath %s", realpath);
+            int err = access(realpath, F_OK) == 0 ? 0 : errno;
+            if (err == ENOENT && pack_crush(realpath, crush_passes) == 0) {
+                /* 打包存放的文件，段文件中的内容已经覆盖 */
+            } else if (err != 0) {
+                log_error("crush failed: realpath %s, %s",
+                          realpath, strerror(err));
                 return -1;
+            } else if (add_crush_target(&b, realpath) != 0) {
+                return -1;
+            } else {
+                /* 继续处理看看是否需要粉碎该文件的所有备份 */
             }
         } else {
             /* 不用粉碎原文件 */
         }
 
         if (how & CRUSH_BACK) {
-            /* 粉碎备份目录下的所有该文件的备份文件 */
-            return walk_tree(dirpath, filepath_crush_cb, filename);
+            /* 粉碎备份目录下的所有该文件的备份文件，从备份索引中查找 */
+            if (collect_backups(&b, dirpath, filename) != 0) {
+                free(b.targets);
+                return -1;
+            }
         } else {
             /* 不用粉碎该文件的备份 */
         }
+
+        retcode = run_crush_batch(&b);
+        unindex_crushed(&b, dirpath);
+        free(b.targets);
         return retcode;
     } else {
         log_error("path_split failed: filepath %s", filepath);
@@ -687,6 +1264,7 @@ int file_backup_copy(const char *oldpath, char *newpath, int newlen)
         if (rc == 0) {
             rc = copy_file(oldpath, backpath);
             if (rc == 0) {
+                index_new_backup(backpath);
                 snprintf(newpath, newlen, "%s", backpath);
                 return 0;
             } else {
@@ -718,9 +1296,18 @@ int file_backup_delete(const char *oldpath, char *newpath, int newlen)
         char backpath[MAX_PATH_LEN];
         int rc2 = make_backup_name(backpath, oldpath, &tv);
         if (rc2 == 0) {
-            /* 移动文件到备份 */
+            /* 移动文件到备份，只有普通文件记录到备份索引中 */
+            struct stat st;
+            int isreg = lstat(oldpath, &st) == 0 && S_ISREG(st.st_mode);
             int rc3 = move_file(oldpath, backpath);
             if (rc3 == 0) {
+                if (isreg) {
+                    index_new_backup(backpath);
+                } else {
+                    /* 目录被删除时也移动到备份目录，缓存的目录描述符失效 */
+                    dircache_invalidate();
+                    pack_invalidate();
+                }
                 snprintf(newpath, newlen, "%s", backpath);
                 return 0;
             } else {
@@ -783,11 +1370,6 @@ int set_rename_path(
     return 0;
 }
 
-struct bkrename {
-    const char *origname;       /* 源文件名 */
-    const char *new_dirpath;    /* 新目录路径名 */
-    const char *new_filename;   /* 重命名的文件名 */
-};
 
 /* 回调函数，判断路径 path 是否需要重命名 */
 int file_backup_rename_cb(const char *backpath, const struct stat *stat,
@@ -826,8 +1408,62 @@ int file_backup_rename_cb(const char *backpath, const struct stat *stat,
 }
 
 /*
- * 重命名原文件和所有相关的备份文件。重命名备份文件时，要扫描目录找到
- * 所有相关的备份文件，对这些备份文件做重命名操作
+ * 从备份索引中找到 old_dirpath 中文件 old_filename 的所有备份，重命名为
+ * new_dirpath 中文件 new_filename 的备份，同时更新两个目录的备份索引
+ */
+static int rename_backups(const char *old_dirpath, const char *old_filename,
+                          const char *new_dirpath, const char *new_filename)
+{
+    struct bkindex_list l;
+    if (bkindex_lookup(old_dirpath, old_filename, &l) != 0) {
+        log_error("lookup backups failed: %s/%s", old_dirpath, old_filename);
+        return -1;
+    }
+
+    int retcode = 0;
+    int origname_len = strlen(old_filename);
+    const char *removed[l.nr + 1];
+    char *added[l.nr + 1];
+    int nr_removed = 0, nr_added = 0;
+    int i;
+    for (i = 0; i < l.nr; i++) {
+        char oldpath[MAX_PATH_LEN], newpath[MAX_PATH_LEN];
+        snprintf(oldpath, MAX_PATH_LEN, "%s/%s/%s",
+                 old_dirpath, BKDIRNAME, l.names[i]);
+        snprintf(newpath, MAX_PATH_LEN, "%s/%s/%s%s",
+                 new_dirpath, BKDIRNAME, new_filename,
+                 l.names[i] + origname_len);
+        if (rename(oldpath, newpath) == 0) {
+            removed[nr_removed++] = l.names[i];
+            added[nr_added] = strdup(strrchr(newpath, '/') + 1);
+            if (added[nr_added]) {
+                nr_added = nr_added + 1;
+            } else {
+                /* 索引缺少这条记录，重建后会恢复 */
+            }
+        } else if (errno == ENOENT) {
+            /* 备份已经不存在了，从索引中删除 */
+            removed[nr_removed++] = l.names[i];
+        } else {
+            log_error("rename failed: oldpath %s, newpath %s, %s",
+                      oldpath, newpath, strerror(errno));
+            retcode = -1;
+            break;
+        }
+    }
+
+    bkindex_add(new_dirpath, (const char **)added, nr_added);
+    bkindex_remove(old_dirpath, removed, nr_removed);
+    for (i = 0; i < nr_added; i++) {
+        free(added[i]);
+    }
+    bkindex_free(&l);
+    return retcode;
+}
+
+/*
+ * 重命名原文件和所有相关的备份文件。相关的备份文件从备份索引中查找，
+ * 不再扫描目录
  */
 #define BK_RENAME_FILE (0x0001)
 #define BK_RENAME_BACK (0x0010)
@@ -879,13 +1515,8 @@ int file_backup_rename(const char *oldpath, const char *newpath, int how)
         snprintf(new_backdir, MAX_PATH_LEN, "%s/%s", new_dirpath, BKDIRNAME);
         int rc4 = mkdirs(new_backdir);
         if (rc4 == 0) {
-            char old_backdir[MAX_PATH_LEN];
-            snprintf(old_backdir, MAX_PATH_LEN, "%s/%s", old_dirpath, BKDIRNAME);
-            struct bkrename bk;
-            bk.origname = old_filename;
-            bk.new_dirpath = new_dirpath;
-            bk.new_filename = new_filename;
-            return walk_tree(old_backdir, file_backup_rename_cb, &bk);
+            return rename_backups(old_dirpath, old_filename,
+                                  new_dirpath, new_filename);
         } else {
             log_error("mkdirs failed: new_back_dirpath %s", new_backdir);
             return -1;
@@ -920,6 +1551,8 @@ int dir_backup_delete(const char *dirpath, char *bakpath)
                 if (rc == 0) {
                     rc = rename(dirpath, realpath);
                     if (rc == 0) {
+                        dircache_invalidate();
+                        pack_invalidate();
                         sprintf(bakpath, "%s", realpath);
                         return 0;
                     } else {
@@ -952,6 +1585,8 @@ int dir_backup_rename(const char *oldpath, const char *newpath)
 {
     int rc = rename(oldpath, newpath);
     if (rc == 0) {
+        dircache_invalidate();
+        pack_invalidate();
         return 0;
     } else {
         log_error("rename failed: oldpath %s, newpath %s, %s",
@@ -1151,6 +1786,17 @@ void test_file_crush(void)
         assert(rc4 == -1);
     }
 
+    /* 空文件粉碎时不释放数据块 */
+    int64_t punch = crush_punch_hole;
+    crush_punch_hole = 1;
+    sprintf(filepath1, "/tmp/test_file_crush.empty");
+    int fd = open(filepath1, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    assert(file_crush(fd, 1) == 0);
+    assert(close(fd) == 0);
+    assert(unlink(filepath1) == 0);
+    crush_punch_hole = punch;
+
     printf("success\n");
 }
 
@@ -1561,6 +2207,79 @@ void test_copy_file(void)
     printf("success\n");
 }
 
+void test_copy_fd(void)
+{
+    printf("test_copy_fd: ");
+
+    const char *oldpath = "/tmp/test_copy_fd.1";
+    const char *newpath = "/tmp/test_copy_fd.2";
+    off_t filesize = 3 * COPY_BUFFER_SIZE + 12345;
+    int rc;
+
+    int fd = open(oldpath, O_CREAT|O_RDWR|O_TRUNC, 0600); assert(fd >= 0);
+    off_t k;
+    for (k = 0; k < filesize; k++) {
+        char c = (char)(k * 131);
+        rc = write(fd, &c, 1); assert(rc == 1);
+    }
+    rc = close(fd); assert(rc == 0);
+
+    int method;
+    for (method = 0; method < COPY_METHOD_MAX; method++) {
+        int src = open(oldpath, O_RDONLY); assert(src >= 0);
+        int dst = open(newpath, O_CREAT|O_RDWR|O_TRUNC, 0600); assert(dst >= 0);
+        rc = copy_fd(src, dst, filesize, method); assert(rc >= method);
+        printf("%s ", copy_method_string(rc));
+
+        struct stat s;
+        rc = fstat(dst, &s); assert(rc == 0 && s.st_size == filesize);
+        char a[BLOCK_SIZE], b[BLOCK_SIZE];
+        off_t off;
+        for (off = 0; off < filesize; off += BLOCK_SIZE) {
+            int n = pread(src, a, BLOCK_SIZE, off); assert(n > 0);
+            rc = pread(dst, b, BLOCK_SIZE, off); assert(rc == n);
+            assert(memcmp(a, b, n) == 0);
+        }
+        close(src);
+        close(dst);
+    }
+    unlink(oldpath);
+    unlink(newpath);
+
+    printf("success\n");
+}
+
+void test_preallocate_fd(void)
+{
+    printf("test_preallocate_fd: ");
+
+    const char *path = "/tmp/test_preallocate_fd";
+    off_t filesize = 8 * COPY_BUFFER_SIZE + 123;
+    struct stat s;
+    int rc;
+
+    int mode;
+    for (mode = PREALLOC_OFF; mode <= PREALLOC_FULL; mode++) {
+        int fd = open(path, O_CREAT|O_RDWR|O_TRUNC, 0600); assert(fd >= 0);
+        int prc = preallocate_fd(fd, filesize, mode); assert(prc >= 0);
+        rc = fstat(fd, &s); assert(rc == 0);
+        if (prc == 0 && mode == PREALLOC_FULL) {
+            assert(s.st_size == filesize);
+        } else {
+            assert(s.st_size == 0);
+        }
+        rc = pwrite(fd, "x", 1, filesize - 1); assert(rc == 1);
+        rc = fstat(fd, &s); assert(rc == 0 && s.st_size == filesize);
+        printf("%s:%d ", mode == PREALLOC_OFF ? "off" :
+               mode == PREALLOC_KEEP_SIZE ? "keep_size" : "full",
+               count_extents(fd));
+        close(fd);
+    }
+    unlink(path);
+
+    printf("success\n");
+}
+
 void test_filepath_crush_cb(void)
 {
     printf("test_filepath_crush_cb: ");
@@ -34,6 +34,57 @@
 #endif
 
 extern int copy_file(const char *old_path, const char *new_path);
+
+/*
+ * 文件复制的方法，按尝试的先后顺序排列
+ */
+#define COPY_METHOD_CLONE  0    /* ioctl(FICLONE) */
+#define COPY_METHOD_RANGE  1    /* copy_file_range() */
+#define COPY_METHOD_RW     2    /* 用户空间读写 */
+#define COPY_METHOD_MAX    3
+
+struct copy_stat {
+    uint64_t files;             /* 复制的文件个数 */
+    uint64_t bytes;             /* 复制的字节数 */
+    uint64_t usecs;             /* 复制花费的时间，单位是微秒 */
+};
+
+extern struct copy_stat copy_stats[COPY_METHOD_MAX];
+
+extern const char *copy_method_string(int method);
+
+/*
+ * 按方法累计的复制统计写成 JSON，返回写入的长度，放在心跳消息中
+ */
+extern int copy_stats_json(char *buf, int len);
+
+/*
+ * 从 method 指定的方法开始，复制 src 的前 size 字节到 dst，不支持时依次换下
+ * 一种方法。返回实际完成复制的方法，出错返回 -1
+ */
+extern int copy_fd(int src, int dst, off_t size, int method);
+
+/*
+ * 上传文件的空间预分配
+ *
+ * 上传开始时已经知道文件的最终大小，用 fallocate() 一次分配全部空间，文件系统
+ * 可以分配连续的区段，之后的写入也不再扩展文件。上传结束时把文件截断为实际大
+ * 小。
+ */
+#define PREALLOC_OFF        0
+#define PREALLOC_KEEP_SIZE  1   /* FALLOC_FL_KEEP_SIZE，文件大小不变 */
+#define PREALLOC_FULL       2   /* 同时把文件大小设置为最终大小 */
+
+/*
+ * 按 mode 为文件预分配 size 字节。成功返回 0，文件系统不支持返回 1，出错返回
+ * -1
+ */
+extern int preallocate_fd(int fd, off_t size, int mode);
+
+/*
+ * 返回文件的区段（extent）个数，用来查看文件的碎片程度。不支持时返回 -1
+ */
+extern int count_extents(int fd);
 extern int set_rename_path(
     char *path,
     const char *oldpath, const char *newpath, const char *bakpath);
@@ -52,8 +103,8 @@ extern int file_backup_update(const char *oldpath, char *bakpath);
 /*
  * 文件粉碎
  *
- * 粉碎原文件和所有相关的备份文件。粉碎备份文件时，要扫描目录找到所有相
- * 关的备份文件，对这些备份文件做粉碎操作。
+ * 粉碎原文件和所有相关的备份文件。相关的备份文件从备份目录的索引中查找，
+ * 见 bkindex.h。
  *
  * 单个文件的粉碎操作是将随机内容写入整个文件，然后删除文件。由于对文件
  * 加密再写入文件，也只是改写文件的内容，和将随机的内容写入文件是一样的
@@ -80,8 +131,7 @@ struct bkrename {
  * 路径重命名
  *
  * 文件或目录重命名，即是路径重命名。重命名原路径名和所有相关的备份文件。
- * 重命名备份路径名时，要扫描目录找到所有相关的备份路径，对这些备份路径
- * 做重命名操作。
+ * 相关的备份路径从备份目录的索引中查找，重命名后同时更新新旧目录的索引。
  *
  * 当备份路径名所在的目录不存在，将会创建不存在的目录。可以指定重命名单
  * 个路径名，和与路径名相关的所有路径名。
@@ -0,0 +1,553 @@
+
+// stripe.c
+
+#include "mt_log.h"
+#include "public.h"
+#include "conn_mgmt.h"
+#include "tunables.h"
+#include "behealth.h"
+#include "stripe.h"
+
+extern void init_mt_cntt(int thread_id);
+extern int backend_cnt;
+
+#define SLOT_FREE     0    // 没有数据，或者数据已经发送
+#define SLOT_READING  1    // 在 I/O 线程的队列中或者正在读取
+#define SLOT_READY    2
+#define SLOT_FAILED   3    // 所有镜像都读取失败
+
+struct stripe;
+
+struct stripe_slot {
+    struct stripe *s;
+    int state;
+    int replica;            // 读取这个区段的镜像，s->fds 的下标
+    int tries;              // 已经尝试过的镜像个数
+    int len;                // 读到的字节数
+    int64_t extent;         // 区段号，区段 k 从 k * chunk 开始
+    uint8_t *buf;
+    struct stripe_slot *next;   // I/O 线程的队列
+};
+
+struct stripe {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs;               // 连接一个，每个正在读取的区段一个
+    int closed;             // 连接已经关闭，不再读取排队的区段
+    int nr;                 // 参与读取的镜像个数
+    int fds[MAX_BACK_END];
+    int backends[MAX_BACK_END];     // 镜像所在的后端下标
+    int chunk;
+    int depth;
+    int64_t size;
+    int64_t extents;        // 文件的区段个数
+    int64_t low;            // 窗口中第一个区段，之前的区段已经发送
+    int64_t next_extent;    // 下一个要提交读取的区段
+    struct stripe_slot slots[0];    // 区段 k 使用 slots[k % depth]
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static struct stripe_slot *pool_head = NULL;
+static struct stripe_slot *pool_tail = NULL;
+
+static void enqueue_slot(struct stripe_slot *slot)
+{
+    slot->next = NULL;
+    pthread_mutex_lock(&pool_lock);
+    if (pool_tail != NULL) {
+        pool_tail->next = slot;
+    } else {
+        pool_head = slot;
+    }
+    pool_tail = slot;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+static void free_stripe(struct stripe *s)
+{
+    int i;
+    for (i = 0; i < s->nr; i++) {
+        close(s->fds[i]);
+    }
+    for (i = 0; i < s->depth; i++) {
+        free(s->slots[i].buf);
+    }
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s);
+}
+
+// 区段的大小，最后一个区段可能不满
+static int extent_len(struct stripe *s, int64_t extent)
+{
+    int64_t left = s->size - extent * s->chunk;
+    return left < s->chunk ? (int)left : s->chunk;
+}
+
+// 调用者持有 s->lock。窗口中空闲的区段提交读取
+static void schedule(struct stripe *s)
+{
+    while (s->next_extent < s->extents && s->next_extent < s->low + s->depth) {
+        struct stripe_slot *slot = &s->slots[s->next_extent % s->depth];
+        if (slot->state == SLOT_READING) {
+            break;
+        }
+        slot->state = SLOT_READING;
+        slot->extent = s->next_extent;
+        slot->replica = s->next_extent % s->nr;
+        slot->tries = 0;
+        slot->len = 0;
+        s->refs = s->refs + 1;
+        s->next_extent = s->next_extent + 1;
+        enqueue_slot(slot);
+    }
+}
+
+static int pread_all(int fd, uint8_t *buf, int len, int64_t offset)
+{
+    int done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n > 0) {
+            done = done + n;
+        } else if (n == 0) {
+            break;
+        } else if (errno == EINTR) {
+            // 系统调用被中断，继续读取
+        } else {
+            return -1;
+        }
+    }
+    return done;
+}
+
+static void read_slot(struct stripe_slot *slot)
+{
+    struct stripe *s = slot->s;
+
+    pthread_mutex_lock(&s->lock);
+    int closed = s->closed;
+    pthread_mutex_unlock(&s->lock);
+
+    int want = extent_len(s, slot->extent);
+    int n = -1;
+    int errno_cached = 0;
+    int retry = 0;
+    if (!closed) {
+        uint64_t start = behealth_now_usecs();
+        n = pread_all(s->fds[slot->replica], slot->buf, want,
+                      slot->extent * s->chunk);
+        errno_cached = errno;
+        int backend = s->backends[slot->replica];
+        if (n == want) {
+            behealth_record(backend, behealth_now_usecs() - start, 1);
+        } else {
+            log_warning("striped read of extent %lld from backend %d failed: %s",
+                        (long long int)slot->extent, backend,
+                        n < 0 ? strerror(errno_cached) : "short read");
+            if (n < 0 && behealth_is_fault(errno_cached)) {
+                behealth_record(backend, 0, 0);
+            }
+            slot->tries = slot->tries + 1;
+            retry = slot->tries < s->nr;
+        }
+    }
+
+    if (retry) {
+        // 换下一个镜像重新读取
+        slot->replica = (slot->replica + 1) % s->nr;
+        enqueue_slot(slot);
+        return;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (n == want) {
+        slot->state = SLOT_READY;
+        slot->len = n;
+    } else {
+        slot->state = SLOT_FAILED;
+    }
+    s->refs = s->refs - 1;
+    int last = s->refs == 0;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    if (last) {
+        free_stripe(s);
+    }
+}
+
+static void *stripe_thread(void *arg)
+{
+    int thread_id = (int)(intptr_t)arg;
+    init_mt_cntt(thread_id);
+    log_info("stripe thread:%d start", thread_id);
+
+    while (1) {
+        pthread_mutex_lock(&pool_lock);
+        while (pool_head == NULL) {
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        }
+        struct stripe_slot *slot = pool_head;
+        pool_head = slot->next;
+        if (pool_head == NULL) {
+            pool_tail = NULL;
+        } else {
+            // 队列中还有区段
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        read_slot(slot);
+    }
+    return NULL;
+}
+
+int init_stripe_pool(int nr, int first_thread_id)
+{
+    int i;
+    for (i = 0; i < nr; i++) {
+        pthread_t tid;
+        int ret = pthread_create(&tid, NULL, stripe_thread,
+                                 (void *)(intptr_t)(first_thread_id + i));
+        if (ret != 0) {
+            log_crit("create stripe thread:%d failed", first_thread_id + i);
+            return -1;
+        } else {
+            pthread_detach(tid);
+        }
+    }
+    return 0;
+}
+
+// 描述符移到 MAX_CONNS_CNT 以上，不占用连接表使用的描述符
+static int open_high(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fd >= MAX_CONNS_CNT) {
+        return fd;
+    }
+    int hfd = fcntl(fd, F_DUPFD_CLOEXEC, MAX_CONNS_CNT);
+    if (hfd >= 0) {
+        close(fd);
+        return hfd;
+    } else {
+        return fd;
+    }
+}
+
+static struct stripe *alloc_stripe(int chunk, int depth, int64_t size)
+{
+    struct stripe *s = calloc(1, sizeof(struct stripe) +
+                              depth * sizeof(struct stripe_slot));
+    if (s == NULL) {
+        log_error("malloc stripe failed");
+        return NULL;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->refs = 1;
+    s->chunk = chunk;
+    s->depth = depth;
+    s->size = size;
+    s->extents = (size + s->chunk - 1) / s->chunk;
+
+    int i;
+    for (i = 0; i < s->depth; i++) {
+        s->slots[i].s = s;
+        s->slots[i].extent = -1;
+        s->slots[i].buf = malloc(s->chunk);
+        if (s->slots[i].buf == NULL) {
+            log_error("malloc %d bytes for striped read failed", s->chunk);
+            free_stripe(s);
+            return NULL;
+        }
+    }
+    return s;
+}
+
+// 从 offset 所在的区段开始预取，连接使用 s 读取
+static void start_stripe(conn_info_t *c, struct stripe *s, int64_t offset)
+{
+    pthread_mutex_lock(&s->lock);
+    s->low = offset / s->chunk;
+    s->next_extent = s->low;
+    schedule(s);
+    pthread_mutex_unlock(&s->lock);
+    c->stripe = s;
+}
+
+int open_striped_read(conn_info_t *c, const char *paths[], int64_t size,
+                      int64_t offset)
+{
+    if (stripe_threshold == 0 || size < stripe_threshold || c->stripe != NULL) {
+        return -1;
+    }
+
+    uint32_t mask = 0;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        if (paths[i] != NULL && behealth_is_healthy(i)) {
+            mask |= 1U << i;
+        }
+    }
+    int order[MAX_BACK_END];
+    int n = behealth_order(order, mask);
+    if (n < 2) {
+        return -1;
+    }
+
+    struct stripe *s = alloc_stripe(stripe_chunk, stripe_depth, size);
+    if (s == NULL) {
+        return -1;
+    }
+
+    int k;
+    for (k = 0; k < n; k++) {
+        int fd = open_high(paths[order[k]]);
+        if (fd >= 0) {
+            s->fds[s->nr] = fd;
+            s->backends[s->nr] = order[k];
+            s->nr = s->nr + 1;
+        } else {
+            log_warning("open %s for striped read failed: %s",
+                        paths[order[k]], strerror(errno));
+        }
+    }
+    if (s->nr < 2) {
+        free_stripe(s);
+        return -1;
+    }
+
+    start_stripe(c, s, offset);
+    log_debug("striped read of %lld bytes from %d replicas at %lld",
+              (long long int)size, s->nr, (long long int)offset);
+    return 0;
+}
+
+void detect_sequential_read(conn_info_t *c, int64_t offset, int len)
+{
+    if (offset == c->ra_next) {
+        c->ra_seq = c->ra_seq + 1;
+    } else {
+        // 客户端跳着读，重新计数
+        c->ra_seq = 0;
+    }
+    c->ra_next = offset + len;
+    if (readahead_depth == 0 || c->stripe != NULL || c->ra_seq < READAHEAD_TRIGGER) {
+        return;
+    }
+
+    // 只从一个后端预读，打包存放的文件和绕过页缓存的后端不预读
+    int order[MAX_BACK_END];
+    int n = behealth_order(order, (1U << backend_cnt) - 1);
+    int k;
+    for (k = 0; k < n; k++) {
+        struct backend_file *f = &c->befiles[order[k]];
+        if (f->fd < 0) {
+            continue;
+        } else if (f->packed || f->direct) {
+            return;
+        }
+        int fd = open_high(f->abs_file_name);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            log_warning("open %s for read-ahead failed: %s",
+                        f->abs_file_name, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        if (offset >= st.st_size) {
+            close(fd);
+            return;
+        }
+        struct stripe *s = alloc_stripe(readahead_chunk, readahead_depth + 1, st.st_size);
+        if (s == NULL) {
+            close(fd);
+            return;
+        }
+        s->fds[0] = fd;
+        s->backends[0] = order[k];
+        s->nr = 1;
+        start_stripe(c, s, offset);
+        log_debug("read-ahead of %s from %lld", f->abs_file_name, (long long int)offset);
+        return;
+    }
+}
+
+int striped_peek(conn_info_t *c, int64_t offset, const uint8_t **data)
+{
+    struct stripe *s = c->stripe;
+    if (offset >= s->size) {
+        return 0;
+    }
+    int64_t extent = offset / s->chunk;
+
+    pthread_mutex_lock(&s->lock);
+    if (extent < s->low || extent >= s->low + s->depth) {
+        // 不在窗口中，等待正在读取的区段完成后从新的位置开始预取
+        int i = 0;
+        while (i < s->depth) {
+            if (s->slots[i].state == SLOT_READING) {
+                pthread_cond_wait(&s->cond, &s->lock);
+                i = 0;
+            } else {
+                i = i + 1;
+            }
+        }
+        for (i = 0; i < s->depth; i++) {
+            s->slots[i].state = SLOT_FREE;
+            s->slots[i].extent = -1;
+        }
+        s->next_extent = extent;
+    } else {
+        // 窗口前进，之前的区段可以预取后面的数据了
+    }
+    s->low = extent;
+    schedule(s);
+
+    struct stripe_slot *slot = &s->slots[extent % s->depth];
+    while (slot->state == SLOT_READING) {
+        pthread_cond_wait(&s->cond, &s->lock);
+    }
+    int n = -1;
+    if (slot->state == SLOT_READY && slot->extent == extent) {
+        int skip = offset - extent * s->chunk;
+        *data = slot->buf + skip;
+        n = slot->len - skip;
+    } else {
+        log_error("striped read at %lld failed", (long long int)offset);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+int striped_read(conn_info_t *c, int64_t offset, uint8_t *buf, int len)
+{
+    int done = 0;
+    while (done < len) {
+        const uint8_t *data;
+        int n = striped_peek(c, offset + done, &data);
+        if (n < 0) {
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+        if (n > len - done) {
+            n = len - done;
+        }
+        memcpy(buf + done, data, n);
+        done = done + n;
+    }
+    return done;
+}
+
+void close_striped_read(conn_info_t *c)
+{
+    struct stripe *s = c->stripe;
+    if (s == NULL) {
+        return;
+    }
+    c->stripe = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    s->closed = 1;
+    s->refs = s->refs - 1;
+    int last = s->refs == 0;
+    pthread_mutex_unlock(&s->lock);
+    if (last) {
+        free_stripe(s);
+    } else {
+        // 最后一个正在读取的区段完成时释放
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+// 测试用例
+////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_UNITTEST
+
+#include <assert.h>
+
+extern char backend_dirs[MAX_BACK_END][MAX_NAME_LEN+1];
+
+static uint8_t test_byte(int64_t offset)
+{
+    return (uint8_t)(offset % 251);
+}
+
+// 读取 [offset, end) 并检查内容，每次读取 step 字节
+static void test_read_range(conn_info_t *c, int64_t offset, int64_t end, int step)
+{
+    uint8_t buf[1000];
+    assert(step <= (int)sizeof(buf));
+    while (offset < end) {
+        int want = end - offset < step ? (int)(end - offset) : step;
+        assert(striped_read(c, offset, buf, want) == want);
+        int i;
+        for (i = 0; i < want; i++) {
+            assert(buf[i] == test_byte(offset + i));
+        }
+        offset = offset + want;
+    }
+}
+
+void test_stripe(void)
+{
+    printf("test_stripe: ");
+
+    backend_cnt = 2;
+    stripe_threshold = 1;
+    stripe_chunk = 4096;
+    stripe_depth = 4;
+    init_behealth();
+    assert(init_stripe_pool(2, 1) == 0);
+
+    /* 两个镜像，最后一个区段不满 */
+    int64_t size = 4096 * 10 + 123;
+    uint8_t *data = malloc(size);
+    assert(data != NULL);
+    int64_t k;
+    for (k = 0; k < size; k++) {
+        data[k] = test_byte(k);
+    }
+    char paths[2][MAX_PATH_LEN];
+    const char *mirrors[MAX_BACK_END] = {NULL};
+    int i;
+    for (i = 0; i < 2; i++) {
+        snprintf(backend_dirs[i], sizeof(backend_dirs[i]), "/tmp/test_stripe%d", i);
+        snprintf(paths[i], sizeof(paths[i]), "%s/f", backend_dirs[i]);
+        assert(mkdir(backend_dirs[i], 0755) == 0 || errno == EEXIST);
+        int fd = open(paths[i], O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(fd >= 0 && write(fd, data, size) == size);
+        close(fd);
+        mirrors[i] = paths[i];
+    }
+    free(data);
+
+    /* 从区段中间开始，按区段读到文件末尾，正好是请求的范围 */
+    conn_info_t c;
+    memset(&c, 0, sizeof(c));
+    assert(open_striped_read(&c, mirrors, size, 5000) == 0);
+    assert(c.stripe->low == 1 && c.stripe->extents == 11);
+    test_read_range(&c, 5000, size, 1000);
+    const uint8_t *p;
+    assert(striped_peek(&c, size, &p) == 0);
+    assert(striped_peek(&c, size - 1, &p) == 1 && *p == test_byte(size - 1));
+
+    /* 跳回窗口之前重新预取 */
+    test_read_range(&c, 0, 5000, 999);
+    close_striped_read(&c);
+    assert(c.stripe == NULL);
+
+    for (i = 0; i < 2; i++) {
+        unlink(paths[i]);
+        rmdir(backend_dirs[i]);
+    }
+    printf("success\n");
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stdint.h>
+
+#include "conn_mgmt.h"
+
+/*
+ * 大文件的条带读取
+ *
+ * 每个文件在所有后端目录中都有完整的镜像，一个大文件的下载可以同时从几个镜像
+ * 读取不同的区段，合起来使用几个磁盘的带宽。文件不小于 stripe_threshold 并且
+ * 有两个以上健康的镜像时（见 behealth.h），顺序下载和分块下载都打开条带读取：
+ *
+ * - 文件按 stripe_chunk 分成区段，第 k 个区段交给第 k % n 个镜像读取，n 是参
+ *   与读取的镜像个数。读取在 stripe_threads 个 I/O 线程中进行；
+ * - 每个连接有一个 stripe_depth 个区段的重排缓冲，发送位置之后的区段提前提交读
+ *   取，发送时按顺序等待区段读完。发送位置前进后，空出来的区段继续预取后面的数
+ *   据，所以同时在读取的数据不超过 stripe_depth * stripe_chunk；
+ * - 请求的位置不在缓冲的窗口中时（客户端跳着读），等待正在读取的区段完成，从
+ *   新的位置重新开始预取；
+ * - 一个镜像读取失败时，这个区段换下一个镜像重新读取，所有镜像都失败才返回错
+ *   误。每次读取的耗时和结果都记录到后端的健康状况中。
+ *
+ * 发送线程只在需要的区段还没有读完时等待，和直接读文件时阻塞在磁盘上一样，但
+ * 同时其他镜像在读后面的区段。条带读取使用自己打开的文件描述符，连接关闭时正
+ * 在读取的区段完成后才释放缓冲。打包存放的文件都很小，不使用条带读取。
+ *
+ * 没有条带读取的分块下载每个请求都同步读文件，客户端处理响应时磁盘空闲。
+ * readahead_depth 不为 0 时，连续 READAHEAD_TRIGGER 个请求都紧接着上一个请求
+ * 的位置，就用同样的缓冲和 I/O 线程从一个镜像预读：只有一个镜像参与读取，区段
+ * 大小是 readahead_chunk，请求所在的区段之后再预读 readahead_depth 个区段（为
+ * 1 时是双缓冲）。后面的请求直接从内存回复，读盘的时间和网络传输重叠。
+ */
+
+#define READAHEAD_TRIGGER   2
+
+/*
+ * 启动 nr 个 I/O 线程，线程号从 first_thread_id 开始。成功返回 0，失败返回 -1
+ */
+extern int init_stripe_pool(int nr, int first_thread_id);
+
+/*
+ * 为连接打开条带读取。paths[i] 是文件在 backend_dirs[i] 中的路径，没有时为
+ * NULL，size 是文件大小，从 offset 所在的区段开始预取。打开了条带读取返回 0，
+ * 条带读取关闭、文件太小或者健康的镜像不够时返回 -1，这时按原来的方式读取
+ */
+extern int open_striped_read(conn_info_t *c, const char *paths[], int64_t size,
+                             int64_t offset);
+
+/*
+ * 分块下载的数据请求从 offset 开始读取 len 字节时调用，请求是顺序的时打开预读
+ */
+extern void detect_sequential_read(conn_info_t *c, int64_t offset, int len);
+
+/*
+ * 等待 offset 所在的区段读完，*data 指向 offset 处的数据，在下一次调用之前有
+ * 效。返回可以使用的字节数，到达文件末尾返回 0，读取失败返回 -1
+ */
+extern int striped_peek(conn_info_t *c, int64_t offset, const uint8_t **data);
+
+/*
+ * 从 offset 读取最多 len 字节到 buf，返回读取的字节数，失败返回 -1
+ */
+extern int striped_read(conn_info_t *c, int64_t offset, uint8_t *buf, int len);
+
+/*
+ * 关闭连接的条带读取，下载完成和连接关闭时调用
+ */
+extern void close_striped_read(conn_info_t *c);
+
+#endif  /* STRIPE_H */
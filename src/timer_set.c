@@ -16,12 +16,24 @@ typedef struct _timer_node
 {
     user_timer_t user_timer;
     uint32_t flags;
+    uint32_t index;     // 节点在定时器集合中的下标，也就是 timer_id
+    uint32_t prev;      // 双向链表，删除定时器时不用再遍历查找前驱节点
     uint32_t next;
     uint64_t hold_jiffies;
     uint64_t exp_jiffies;
     list_head_t * p_list;
 } timer_node_t;
 
+// 定时器节点按块分配，每块 1024 个节点。创建定时器集合时只分配第一块，节点用完
+// 了再分配下一块，最多分配到 MAX_TIMER_NODE_CNT 个节点。
+#define TIMER_CHUNK_SHIFT   10
+#define TIMER_CHUNK_SIZE    (1U << TIMER_CHUNK_SHIFT)
+#define TIMER_CHUNK_MASK    (TIMER_CHUNK_SIZE - 1)
+#define MAX_TIMER_CHUNK_CNT ((MAX_TIMER_NODE_CNT + TIMER_CHUNK_SIZE - 1) / TIMER_CHUNK_SIZE)
+
+// 空闲链表和工作链表的结束标志
+#define TIMER_NIL           MAX_TIMER_NODE_CNT
+
 struct timer_set
 {
     uint32_t flags;
@@ -32,7 +44,9 @@ struct timer_set
     
     uint32_t free_start;
     uint32_t free_cnt;
-    timer_node_t timer_nodes[MAX_TIMER_NODE_CNT];
+    uint32_t nr_nodes;  // 已经分配的节点数量
+    uint32_t nr_chunks; // 已经分配的节点块数量
+    timer_node_t * chunks[MAX_TIMER_CHUNK_CNT];
 };
 
 uint64_t get_curr_jiffies(timer_set_t * p_timer_set)
@@ -48,25 +62,31 @@ uint64_t get_curr_jiffies(timer_set_t * p_timer_set)
 static inline uint32_t get_timer_index(
     timer_set_t *p_timer_set, timer_node_t *p_timer_node)
 {
-    return (uint32_t)(p_timer_node - p_timer_set->timer_nodes);
+    (void) p_timer_set;
+    return p_timer_node->index;
 }
 
 static inline timer_node_t *get_timer_node(
     timer_set_t *p_timer_set, uint32_t index)
 {
-    if (index >= MAX_TIMER_NODE_CNT) {
+    if (index >= p_timer_set->nr_nodes) {
         return NULL;
     } else {
-        return &(p_timer_set->timer_nodes[index]);
+        return &(p_timer_set->chunks[index >> TIMER_CHUNK_SHIFT][index & TIMER_CHUNK_MASK]);
     }
 }
 
 user_timer_t *get_user_timer(timer_set_t *p_timer_set, int timer_id)
 {
-    if (timer_id <= 0 || timer_id >= MAX_TIMER_NODE_CNT) {
+    if (timer_id <= 0) {
         return NULL;
     } else {
-        return &(p_timer_set->timer_nodes[timer_id].user_timer);
+        timer_node_t *node = get_timer_node(p_timer_set, (uint32_t)timer_id);
+        if (node != NULL) {
+            return &(node->user_timer);
+        } else {
+            return NULL;
+        }
     }
 }
 
@@ -89,7 +109,8 @@ static inline void clear_timer_node(timer_node_t *p_timer_node)
 {
     clear_user_timer(&(p_timer_node->user_timer));
     p_timer_node->flags = 0;
-    p_timer_node->next = MAX_TIMER_NODE_CNT;
+    p_timer_node->prev = TIMER_NIL;
+    p_timer_node->next = TIMER_NIL;
     p_timer_node->hold_jiffies = 0;
     p_timer_node->exp_jiffies = 0;
     p_timer_node->p_list = NULL;
@@ -97,11 +118,57 @@ static inline void clear_timer_node(timer_node_t *p_timer_node)
 
 static inline void init_list_head(list_head_t *p_list)
 {
-    p_list->head = MAX_TIMER_NODE_CNT;
-    p_list->tail = MAX_TIMER_NODE_CNT;
+    p_list->head = TIMER_NIL;
+    p_list->tail = TIMER_NIL;
     p_list->cnt = 0;
 }
 
+// 分配一块新的定时器节点，挂到空闲链表的头部
+static int grow_timer_nodes(timer_set_t *ts)
+{
+    if (ts->nr_chunks >= MAX_TIMER_CHUNK_CNT) {
+        printf("%s:%d:%s: timer nodes reach limits %d\n",
+               __FILE__, __LINE__, __FUNCTION__, MAX_TIMER_NODE_CNT);
+        return -1;
+    }
+
+    timer_node_t *chunk = (timer_node_t *)malloc(
+        TIMER_CHUNK_SIZE * sizeof(timer_node_t));
+    if (chunk == NULL) {
+        printf("%s:%d:%s: malloc timer chunk %u failed\n",
+               __FILE__, __LINE__, __FUNCTION__, ts->nr_chunks);
+        return -1;
+    }
+
+    uint32_t base = ts->nr_chunks * TIMER_CHUNK_SIZE;
+    uint32_t first = base;
+    if (base == 0) {
+        // 0 号定时器不使用，timer_id > 0 才是合法的定时器
+        clear_timer_node(&chunk[0]);
+        chunk[0].index = 0;
+        first = 1;
+    }
+
+    uint32_t k;
+    uint32_t last = base + TIMER_CHUNK_SIZE;
+    if (last > MAX_TIMER_NODE_CNT) {
+        last = MAX_TIMER_NODE_CNT;
+    }
+    for (k = first; k < last; k++) {
+        timer_node_t *node = &chunk[k - base];
+        clear_timer_node(node);
+        node->index = k;
+        node->next = (k + 1 < last) ? k + 1 : ts->free_start;
+    }
+
+    ts->chunks[ts->nr_chunks] = chunk;
+    ts->nr_chunks += 1;
+    ts->nr_nodes = last;
+    ts->free_start = first;
+    ts->free_cnt += last - first;
+    return 0;
+}
+
 static timer_set_t *init_timer_set(timer_set_t *ts, uint16_t base_ticks)
 {
     ts->flags = 1;
@@ -116,13 +183,12 @@ static timer_set_t *init_timer_set(timer_set_t *ts, uint16_t base_ticks)
         ts->curr_lists[i] = 0;
     }
     
-    ts->free_start = 1;
-    ts->free_cnt = MAX_TIMER_NODE_CNT - 1;
-    clear_timer_node(&ts->timer_nodes[0]);
-    int k;
-    for (k = 0; k < MAX_TIMER_NODE_CNT; k++) {
-        clear_timer_node(&ts->timer_nodes[k]);
-        ts->timer_nodes[k].next = k + 1;
+    ts->free_start = TIMER_NIL;
+    ts->free_cnt = 0;
+    ts->nr_nodes = 0;
+    ts->nr_chunks = 0;
+    if (grow_timer_nodes(ts) < 0) {
+        return NULL;
     }
     
     return ts;
@@ -145,35 +211,48 @@ timer_set_t *create_timer_set(uint16_t base_ticks)
         return NULL;
     }
     
-    return init_timer_set(p_timer_set, base_ticks);
+    if (init_timer_set(p_timer_set, base_ticks) == NULL) {
+        printf("%s --> %s --> L%d : init timer set fail \r\n",
+               __FILE__, __FUNCTION__, __LINE__);
+        free(p_timer_set);
+        return NULL;
+    }
+
+    return p_timer_set;
 }
 
 void destroy_timer_set(timer_set_t *p_timer_set)
 {
     if (p_timer_set != NULL) {
+        uint32_t i;
+        for (i = 0; i < p_timer_set->nr_chunks; i++) {
+            free(p_timer_set->chunks[i]);
+        }
         free(p_timer_set);
     }
 }
 
 static inline timer_node_t *alloc_timer_node(timer_set_t *ts)
 {
-    if (ts->free_cnt > 0) {
-        int id = ts->free_start;
-        if (id < MAX_TIMER_NODE_CNT) {
-            timer_node_t *node = &ts->timer_nodes[id];
-            ts->free_start = node->next;
-            ts->free_cnt = ts->free_cnt - 1;
-            clear_timer_node(node);
-            node->flags = 1;
-            return node;
-        } else {
-            printf("%s:%d:%s: next free timer node index %d is invalid!\n",
-                   __FILE__, __LINE__, __FUNCTION__, id);
+    if (ts->free_cnt == 0) {
+        if (grow_timer_nodes(ts) < 0) {
+            printf("%s:%d:%s: run out of timer node!\n",
+                   __FILE__, __LINE__, __FUNCTION__);
             return NULL;
         }
+    }
+
+    uint32_t id = ts->free_start;
+    timer_node_t *node = get_timer_node(ts, id);
+    if (node != NULL) {
+        ts->free_start = node->next;
+        ts->free_cnt = ts->free_cnt - 1;
+        clear_timer_node(node);
+        node->flags = 1;
+        return node;
     } else {
-        printf("%s:%d:%s: run out of timer node!\n",
-               __FILE__, __LINE__, __FUNCTION__);
+        printf("%s:%d:%s: next free timer node index %u is invalid!\n",
+               __FILE__, __LINE__, __FUNCTION__, id);
         return NULL;
     }
 }
@@ -183,7 +262,7 @@ static inline int free_timer_node(
 {
     uint32_t index = get_timer_index(p_timer_set, p_timer_node);
 
-    if (index >= MAX_TIMER_NODE_CNT) {
+    if (index == 0 || index >= p_timer_set->nr_nodes) {
         return -1;
     }
 
@@ -249,7 +328,7 @@ static inline list_head_t *get_timer_list_head(
 {
     // 每一级的当前链都是下一次执行 run_timer_set() 时才有可能处理
 
-    int exp_jiffies = node->exp_jiffies;
+    uint64_t exp_jiffies = node->exp_jiffies;
     int level = get_timer_level(ts, exp_jiffies);
     if (0 <= level && level < 8) {
         int index = get_timer_list_index(ts, level, exp_jiffies);
@@ -265,20 +344,23 @@ static inline int add_timer_node_to_list(
     timer_set_t *ts, list_head_t *target, timer_node_t *node)
 {
     uint32_t index = get_timer_index(ts, node);
-    if (index < MAX_TIMER_NODE_CNT && target->cnt < MAX_TIMER_NODE_CNT) {
+    if (index < ts->nr_nodes && target->cnt < MAX_TIMER_NODE_CNT) {
         node->p_list = target;
+        node->next = TIMER_NIL;
         target->cnt += 1;
-        if (target->tail < MAX_TIMER_NODE_CNT) {
-            ts->timer_nodes[target->tail].next = index;
+        if (target->tail != TIMER_NIL) {
+            get_timer_node(ts, target->tail)->next = index;
+            node->prev = target->tail;
             target->tail = index;
-        } else /* target->tail >= MAX_TIMER_NODE_CNT */ {
+        } else /* target->tail == TIMER_NIL */ {
             // 第一次往定时器列表中插入定时器
+            node->prev = TIMER_NIL;
             target->head = index;
             target->tail = index;
         }
-        return (int)(int32_t)index; // 0~100000 的无符号转换不会溢出
+        return (int)(int32_t)index; // 不超过 MAX_TIMER_NODE_CNT 的无符号转换不会溢出
     } else {
-        if (index >= MAX_TIMER_NODE_CNT) {
+        if (index >= ts->nr_nodes) {
             printf("%s:%d:%s: invalid timer %d\n",
                    __FILE__, __LINE__, __FUNCTION__, index);
         } else /* curr->cnt >= MAX_TIMER_NODE_CNT */ {
@@ -340,43 +422,36 @@ int create_one_timer(timer_set_t *set, user_timer_t *timer)
 }
 
 
+// 双向链表，直接通过前驱和后继节点摘除定时器，不用遍历链表
 static timer_node_t *delete_one_timer_from_list(
     timer_set_t *p_timer_set, timer_node_t *p_timer_node)
 {
     uint32_t timer_index = get_timer_index(p_timer_set, p_timer_node);
     list_head_t * p_list = NULL;
-    uint32_t prev_index = 0;
     
-    if (timer_index >= MAX_TIMER_NODE_CNT || p_timer_node->p_list == NULL) {
-        printf("timer_id:%u no in work list ", timer_index);
+    if (timer_index >= p_timer_set->nr_nodes || p_timer_node->p_list == NULL) {
+        printf("timer_id:%u no in work list\n", timer_index);
         return NULL;
     }
     
     p_list = p_timer_node->p_list;
     
-    if (p_list->head == timer_index && p_list->tail == timer_index) {
-        p_list->head = MAX_TIMER_NODE_CNT;
-        p_list->tail = MAX_TIMER_NODE_CNT;
-    } else if (p_list->head == timer_index) {
+    if (p_timer_node->prev != TIMER_NIL) {
+        get_timer_node(p_timer_set, p_timer_node->prev)->next = p_timer_node->next;
+    } else {
         p_list->head = p_timer_node->next;
-    } else if (p_list->tail == timer_index) {
-        prev_index = p_list->head;
-        while (p_timer_set->timer_nodes[prev_index].next != timer_index) {
-            prev_index = p_timer_set->timer_nodes[prev_index].next;
-        }
-        p_list->tail = prev_index;
-        p_timer_set->timer_nodes[prev_index].next = MAX_TIMER_NODE_CNT;
+    }
+
+    if (p_timer_node->next != TIMER_NIL) {
+        get_timer_node(p_timer_set, p_timer_node->next)->prev = p_timer_node->prev;
     } else {
-        prev_index = p_list->head;
-        while (p_timer_set->timer_nodes[prev_index].next != timer_index) {
-            prev_index = p_timer_set->timer_nodes[prev_index].next;
-        }
-        p_timer_set->timer_nodes[prev_index].next = p_timer_node->next;
+        p_list->tail = p_timer_node->prev;
     }
     
     p_list->cnt--;
     
-    p_timer_node->next = MAX_TIMER_NODE_CNT;
+    p_timer_node->prev = TIMER_NIL;
+    p_timer_node->next = TIMER_NIL;
     p_timer_node->p_list = NULL;
     
     return p_timer_node;
@@ -385,20 +460,10 @@ static timer_node_t *delete_one_timer_from_list(
 static inline timer_node_t *delete_first_timer_from_list(
     timer_set_t *ts, list_head_t *curr)
 {
-    if (curr->cnt > 0 && curr->head < MAX_TIMER_NODE_CNT) {
-        timer_node_t *node = &ts->timer_nodes[curr->head];
-        uint32_t index = get_timer_index(ts, node);
-        if (index == curr->tail) {
-            curr->head = MAX_TIMER_NODE_CNT;
-            curr->tail = MAX_TIMER_NODE_CNT;
-        } else {
-            curr->head = node->next;
-        }
-        node->next = MAX_TIMER_NODE_CNT;
-        node->p_list = NULL;
-        curr->cnt -= 1;
-        return node;
-    } else /* curr->cnt == 0 || curr->head >= MAX_TIMER_NODE_CNT */ {
+    if (curr->cnt > 0 && curr->head != TIMER_NIL) {
+        timer_node_t *node = get_timer_node(ts, curr->head);
+        return delete_one_timer_from_list(ts, node);
+    } else /* curr->cnt == 0 || curr->head == TIMER_NIL */ {
         printf("%s:%d:%s: no timer node in timer set %p current list %p\n",
                __FILE__, __LINE__, __FUNCTION__, ts, curr);
         return NULL;
@@ -411,17 +476,23 @@ int destroy_one_timer(timer_set_t *p_timer_set, int timer_id)
     
     // printf("timer_id:%d ", timer_id);
     
-    if (p_timer_set == NULL || timer_id < 0 || timer_id >= MAX_TIMER_NODE_CNT) {
+    if (p_timer_set == NULL || timer_id <= 0) {
         return -1;
     }
     
     p_timer_node = get_timer_node(p_timer_set, timer_id);
+    if (p_timer_node == NULL) {
+        return -1;
+    }
     if (p_timer_node->flags == 0) {
-        printf("double free timer_id:%d ", timer_id);
+        printf("double free timer_id:%d\n", timer_id);
         return 0;
     }
     
-    delete_one_timer_from_list(p_timer_set, p_timer_node);
+    // 定时器的回调函数中销毁自己时，定时器已经不在工作链表中
+    if (p_timer_node->p_list != NULL) {
+        delete_one_timer_from_list(p_timer_set, p_timer_node);
+    }
     return free_timer_node(p_timer_set, p_timer_node);
 }
 
@@ -431,17 +502,20 @@ int reset_one_timer(timer_set_t *p_timer_set, int timer_id)
     
     // printf("reset timer_id:%d ", timer_id);
     
-    if (p_timer_set == NULL || timer_id < 0 || timer_id >= MAX_TIMER_NODE_CNT) {
+    if (p_timer_set == NULL || timer_id <= 0) {
         return -1;
     }
     
     p_timer_node = get_timer_node(p_timer_set, timer_id);
-    if (p_timer_node->flags == 0) {
-        printf("timer_id:%d not in work list ", timer_id);
+    if (p_timer_node == NULL || p_timer_node->flags == 0) {
+        printf("timer_id:%d not in work list\n", timer_id);
         return -1;
     }
     
-    delete_one_timer_from_list(p_timer_set, p_timer_node);
+    // 定时器的回调函数中重置自己时，定时器已经不在工作链表中
+    if (p_timer_node->p_list != NULL) {
+        delete_one_timer_from_list(p_timer_set, p_timer_node);
+    }
     
     p_timer_node->exp_jiffies = p_timer_node->hold_jiffies + p_timer_set->jiffies;
     
@@ -514,7 +588,6 @@ static inline void move_timer_from_higher_level(
             // 虽然目前移动定时器有错误，但不影响整体继续运行
         } else {
             // 移动到更低级别成功，继续处理更高级别的定时器列表
-            printf("move timer to lower level\n");
         }
 
         if (higher_next_index == 0) {
@@ -522,11 +595,9 @@ static inline void move_timer_from_higher_level(
             move_timer_from_higher_level(ts, higher_level);
         } else {
             // 更高一级的定时器列表还没有处理完毕，不用再往更高级别处理
-            printf("handling timer, no more high level\n");
         }
     } else {
         // 当前级别已是最高级别，没有更高级别，不做处理
-        printf("already top level, do nothing\n");
     }
 }
 
@@ -579,7 +650,6 @@ static void __run_timer_set(timer_set_t *ts)
     for (i = 0; i < nr_nodes; i++) {
         timer_node_t *node = delete_first_timer_from_list(ts, curr);
         if (node != NULL) {
-            printf("handle timer node %p\n", node);
             handle_one_timer_node(ts, curr, node);
         } else {
             printf("%s:%d:%s: no timer node in timer set %p current list %p\n",
@@ -592,11 +662,30 @@ static void __run_timer_set(timer_set_t *ts)
     if (next_list_index == 0) {
         // 当前级别的定时器列表处理完毕，将更高一级的定时器移动到当前级别，等待
         // 下一次处理
-        printf("move higher level\n");
         move_timer_from_higher_level(ts, 0);
     } else {
         // 当前级别的定时器还没有处理完毕，等待下次处理
-        printf("next_list_index: %d, do nothing\n", next_list_index);
+    }
+}
+
+static inline uint32_t get_active_timer_cnt(timer_set_t *ts)
+{
+    // 0 号定时器不使用，不计入
+    return ts->nr_nodes - 1 - ts->free_cnt;
+}
+
+// 定时器集合中没有定时器时，各级的当前链只是一个 256 进制的计数器，直接按
+// 进位推进，不用逐个节拍地处理
+static void skip_empty_timer_set(timer_set_t *ts, uint64_t ticks)
+{
+    ts->jiffies += ticks;
+
+    int level;
+    uint64_t carry = ticks;
+    for (level = 0; level < 8 && carry > 0; level++) {
+        uint64_t sum = ts->curr_lists[level] + carry;
+        ts->curr_lists[level] = (uint32_t)(sum & 0x00FF);
+        carry = sum >> 8;
     }
 }
 
@@ -609,3 +698,44 @@ void run_timer_set(timer_set_t *p_timer_set)
                __FILE__, __LINE__, __FUNCTION__);
     }
 }
+
+void run_timer_set_ticks(timer_set_t *p_timer_set, uint64_t ticks)
+{
+    if (p_timer_set == NULL) {
+        printf("%s:%d:%s: invalid timer_set",
+               __FILE__, __LINE__, __FUNCTION__);
+        return;
+    }
+
+    while (ticks > 0) {
+        if (get_active_timer_cnt(p_timer_set) == 0) {
+            // 没有定时器，一次性追上剩余的节拍
+            skip_empty_timer_set(p_timer_set, ticks);
+            break;
+        } else {
+            __run_timer_set(p_timer_set);
+            ticks -= 1;
+        }
+    }
+}
+
+uint32_t get_timer_set_idle_ticks(timer_set_t *p_timer_set)
+{
+    if (p_timer_set == NULL || get_active_timer_cnt(p_timer_set) == 0) {
+        return TIMER_SET_NO_EXPIRY;
+    }
+
+    // 第 0 级的第 k 条链在第 k+1 个节拍时处理。第 0 级转完一圈时会把更高一级
+    // 的定时器移动下来，这个节拍也必须执行，所以最多只往后看到这一圈结束
+    uint32_t curr = p_timer_set->curr_lists[0];
+    uint32_t limit = 256 - curr;
+    uint32_t k;
+    for (k = 0; k < limit; k++) {
+        if (p_timer_set->timer_lists[0][curr + k].cnt > 0) {
+            return k + 1;
+        } else {
+            // 空链，继续往后查找
+        }
+    }
+    return limit;
+}
@@ -33,7 +33,8 @@ typedef struct user_timer
 } user_timer_t;
 
 
-#define MAX_TIMER_NODE_CNT   100000
+// 定时器节点按块按需分配，这里只是上限，不再预先占用内存
+#define MAX_TIMER_NODE_CNT   (1024 * 1024)
 
 struct timer_set;
 
@@ -43,6 +44,14 @@ timer_set_t * create_timer_set(uint16_t base_ticks);
 
 void run_timer_set(timer_set_t * p_timer_set);
 
+// 连续推进 ticks 个节拍，没有定时器时一次性追上
+void run_timer_set_ticks(timer_set_t * p_timer_set, uint64_t ticks);
+
+// 距离下一次需要执行 run_timer_set() 还有多少个节拍，至少为 1
+// 没有任何定时器时返回 TIMER_SET_NO_EXPIRY
+#define TIMER_SET_NO_EXPIRY  0xFFFFFFFFU
+uint32_t get_timer_set_idle_ticks(timer_set_t * p_timer_set);
+
 void destroy_timer_set(timer_set_t * p_timer_set);
 
 int create_one_timer(timer_set_t * p_timer_set, user_timer_t * p_user_timer);
@@ -0,0 +1,278 @@
+
+// tunables.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "mt_log.h"
+#include "public.h"
+#include "tunables.h"
+
+int64_t conn_idle_timeout = 300;
+int64_t conn_stall_timeout = 60;
+int64_t conn_deadline = 0;
+int64_t jobq_threads = 2;
+int64_t jobq_depth = 1024;
+int64_t crush_passes = 3;
+int64_t crush_threads = 4;
+int64_t crush_punch_hole = 0;
+int64_t bkindex_rebuild_all = 0;
+int64_t dircache_size = 64;
+int64_t upload_prealloc = 0;
+int64_t upload_wbuf_size = 2 * 1024 * 1024;
+int64_t upload_wbuf_flush_ms = 1000;
+int64_t direct_io_backends = 0;
+int64_t seq_fadvise = 0;
+int64_t upload_durability = 0;
+int64_t group_commit_ms = 2;
+int64_t pack_threshold = 0;
+int64_t pack_segment_size = 64 * 1024 * 1024;
+int64_t metaidx_enabled = 0;
+int64_t metaidx_slots = 65536;
+int64_t backend_quarantine_errors = 3;
+int64_t backend_quarantine_ms = 5000;
+int64_t stripe_threshold = 0;
+int64_t stripe_chunk = 1024 * 1024;
+int64_t stripe_depth = 8;
+int64_t stripe_threads = 4;
+int64_t readahead_depth = 0;
+int64_t readahead_chunk = 256 * 1024;
+int64_t batch_prefetch = 2;
+int64_t write_quorum = 0;
+int64_t write_lag_ms = 0;
+int64_t catchup_max_pending = 10000;
+int64_t hotcache_bytes = 0;
+int64_t hotcache_files = 4096;
+int64_t hotcache_file_max = 1024 * 1024;
+int64_t hotcache_check_ms = 1000;
+int64_t fdcache_size = 0;
+int64_t upload_resume_ttl = 0;
+
+static const char * const off_on[] = {"off", "on", NULL};
+static const char * const prealloc_modes[] = {"off", "keep_size", "full", NULL};
+static const char * const fadvise_modes[] = {"default", "sequential", "willneed", "dontneed", NULL};
+static const char * const durability_modes[] = {"none", "fsync", "group", NULL};
+
+struct tunable {
+    const char *name;
+    int64_t *value;
+    int64_t minval;
+    int64_t maxval;
+    const char * const *names; // 取值为名字时的名字列表，下标就是取值
+    const char *help;
+};
+
+static const struct tunable tunables[] = {
+    {"conn_idle_timeout", &conn_idle_timeout, 0, 86400, NULL,
+     "seconds a connection may stay idle, 0 disables"},
+    {"conn_stall_timeout", &conn_stall_timeout, 0, 86400, NULL,
+     "seconds a transfer may make no progress, 0 disables"},
+    {"conn_deadline", &conn_deadline, 0, 7*86400, NULL,
+     "seconds a single transfer may last, 0 disables"},
+    {"jobq_threads", &jobq_threads, 1, 64, NULL,
+     "threads running background jobs such as crush and rename"},
+    {"jobq_depth", &jobq_depth, 1, 65536, NULL,
+     "background jobs that may be queued or running at once"},
+    {"crush_passes", &crush_passes, 1, 35, NULL,
+     "overwrite passes when crushing a file"},
+    {"crush_threads", &crush_threads, 1, 64, NULL,
+     "threads crushing a file and its backups at the same time"},
+    {"crush_punch_hole", &crush_punch_hole, 0, 1, off_on,
+     "free the crushed blocks with fallocate(PUNCH_HOLE)"},
+    {"bkindex_rebuild", &bkindex_rebuild_all, 0, 1, off_on,
+     "rebuild all backup indexes in the background at startup"},
+    {"dircache_size", &dircache_size, 0, 4096, NULL,
+     "directory descriptors cached by each worker, 0 disables"},
+    {"upload_prealloc", &upload_prealloc, 0, 2, prealloc_modes,
+     "fallocate() uploads to their announced size at start"},
+    {"upload_wbuf_size", &upload_wbuf_size, 0, 64 * 1024 * 1024, NULL,
+     "bytes of contiguous upload data merged into one write, 0 disables"},
+    {"upload_wbuf_flush_ms", &upload_wbuf_flush_ms, 0, 60000, NULL,
+     "milliseconds buffered upload data may wait, 0 waits for finish"},
+    {"direct_io", &direct_io_backends, 0, 31, NULL,
+     "bitmask of backends (in -b order) using O_DIRECT for uploads and downloads"},
+    {"seq_fadvise", &seq_fadvise, 0, 3, fadvise_modes,
+     "posix_fadvise() hint for sequential downloads, default is the build-time one"},
+    {"upload_durability", &upload_durability, 0, 2, durability_modes,
+     "sync uploads before acknowledging finish: per file, or batched with syncfs()"},
+    {"group_commit_ms", &group_commit_ms, 0, 1000, NULL,
+     "milliseconds a group commit waits to collect finish requests"},
+    {"pack_threshold", &pack_threshold, 0, 16 * 1024 * 1024, NULL,
+     "uploads smaller than this many bytes are packed into segment files, 0 disables"},
+    {"pack_segment_size", &pack_segment_size, 1024 * 1024, 1024 * 1024 * 1024, NULL,
+     "bytes appended to one pack segment before starting the next"},
+    {"metaidx", &metaidx_enabled, 0, 1, off_on,
+     "answer metadata requests from the embedded index of uploaded files"},
+    {"metaidx_slots", &metaidx_slots, 1024, 16 * 1024 * 1024, NULL,
+     "initial number of slots in a new metadata index, it grows when 3/4 full"},
+    {"backend_quarantine_errors", &backend_quarantine_errors, 0, 1000, NULL,
+     "consecutive read errors before a backend is quarantined, 0 never quarantines"},
+    {"backend_quarantine_ms", &backend_quarantine_ms, 100, 3600 * 1000, NULL,
+     "first quarantine of a failing backend, doubled after each failed probe"},
+    {"stripe_threshold", &stripe_threshold, 0, 1LL << 40, NULL,
+     "downloads at least this many bytes read extents from all healthy mirrors, 0 is off"},
+    {"stripe_chunk", &stripe_chunk, 64 * 1024, 16 * 1024 * 1024, NULL,
+     "bytes in one extent of a striped read"},
+    {"stripe_depth", &stripe_depth, 2, 64, NULL,
+     "extents prefetched ahead of the send position of a striped read"},
+    {"stripe_threads", &stripe_threads, 1, 64, NULL,
+     "threads reading extents for striped reads and read-ahead"},
+    {"readahead_depth", &readahead_depth, 0, 64, NULL,
+     "chunks read ahead of a sequential chunked download, 0 is off"},
+    {"readahead_chunk", &readahead_chunk, 64 * 1024, 16 * 1024 * 1024, NULL,
+     "bytes in one read-ahead chunk"},
+    {"batch_prefetch", &batch_prefetch, 0, 7, NULL,
+     "files opened and read ahead of the one being sent in a batch download"},
+    {"write_quorum", &write_quorum, 0, MAX_BACK_END, NULL,
+     "mirrors that must take an upload, the others catch up later, 0 requires all"},
+    {"write_lag_ms", &write_lag_ms, 0, 60 * 1000, NULL,
+     "a mirror slower than this in one write leaves the upload if the quorum holds, 0 is off"},
+    {"catchup_max_pending", &catchup_max_pending, 1, 1000000, NULL,
+     "files waiting for catch-up before uploads require all mirrors again"},
+    {"hotcache_bytes", &hotcache_bytes, 0, 16LL << 30, NULL,
+     "memory for mapped hot files served to chunked downloads, 0 is off"},
+    {"hotcache_files", &hotcache_files, 64, 1024 * 1024, NULL,
+     "maximum number of files in the hot file cache"},
+    {"hotcache_file_max", &hotcache_file_max, 4096, 64 * 1024 * 1024, NULL,
+     "largest file kept in the hot file cache"},
+    {"hotcache_check_ms", &hotcache_check_ms, 0, 60 * 1000, NULL,
+     "a cached file is checked against the backend at most this often"},
+    {"fdcache_size", &fdcache_size, 0, 4096, NULL,
+     "read-only backend file descriptors shared by downloads on each worker, 0 disables"},
+    {"upload_resume_ttl", &upload_resume_ttl, 0, 30 * 86400, NULL,
+     "seconds an interrupted upload may be resumed before it is removed, 0 disables"},
+};
+
+#define NR_TUNABLES (sizeof(tunables) / sizeof(tunables[0]))
+
+static const struct tunable *find_tunable(const char *name, size_t len)
+{
+    size_t i;
+    for (i = 0; i < NR_TUNABLES; i++) {
+        if (strlen(tunables[i].name) == len &&
+            strncmp(tunables[i].name, name, len) == 0) {
+            return &tunables[i];
+        } else {
+            // 继续查找下一个参数
+        }
+    }
+    return NULL;
+}
+
+static int parse_value(const struct tunable *t, const char *s, int64_t *out)
+{
+    if (t->names != NULL) {
+        int64_t i;
+        for (i = 0; t->names[i] != NULL; i++) {
+            if (strcmp(t->names[i], s) == 0) {
+                *out = i;
+                return 0;
+            } else {
+                // 继续比较下一个名字
+            }
+        }
+        // 名字都不匹配时，也允许直接使用下标
+    } else {
+        // 取值只能是整数
+    }
+
+    char *end = NULL;
+    errno = 0;
+    long long v = strtoll(s, &end, 0);
+    if (errno != 0 || end == s || *end != '\0') {
+        return -1;
+    } else if (v < t->minval || v > t->maxval) {
+        return -1;
+    } else {
+        *out = v;
+        return 0;
+    }
+}
+
+static int set_one_tunable(char *kv)
+{
+    char *eq = strchr(kv, '=');
+    if (eq == NULL) {
+        printf("invalid tunable '%s': expect key=value\n", kv);
+        return -1;
+    }
+
+    const struct tunable *t = find_tunable(kv, eq - kv);
+    if (t == NULL) {
+        printf("unknown tunable '%.*s'\n", (int)(eq - kv), kv);
+        return -1;
+    }
+
+    int64_t v;
+    if (parse_value(t, eq + 1, &v) == 0) {
+        *t->value = v;
+        return 0;
+    } else {
+        printf("invalid value '%s' for tunable %s\n", eq + 1, t->name);
+        return -1;
+    }
+}
+
+int set_tunables(const char *options)
+{
+    char buffer[1024];
+    if (options == NULL || strlen(options) >= sizeof(buffer)) {
+        printf("invalid tunables\n");
+        return -1;
+    }
+    snprintf(buffer, sizeof(buffer), "%s", options);
+
+    char *saveptr = NULL;
+    char *kv = strtok_r(buffer, ",", &saveptr);
+    while (kv != NULL) {
+        if (set_one_tunable(kv) < 0) {
+            return -1;
+        } else {
+            kv = strtok_r(NULL, ",", &saveptr);
+        }
+    }
+    return 0;
+}
+
+static const char *value_string(const struct tunable *t, char *buf, size_t len)
+{
+    int64_t v = *t->value;
+    if (t->names != NULL) {
+        int64_t n = 0;
+        while (t->names[n] != NULL) {
+            n++;
+        }
+        if (0 <= v && v < n) {
+            return t->names[v];
+        } else {
+            // 下标越界，按整数输出
+        }
+    } else {
+        // 整数参数
+    }
+    snprintf(buf, len, "%lld", (long long int)v);
+    return buf;
+}
+
+void log_tunables(void)
+{
+    size_t i;
+    char buf[32];
+    for (i = 0; i < NR_TUNABLES; i++) {
+        log_info("tunable %s = %s", tunables[i].name,
+                 value_string(&tunables[i], buf, sizeof(buf)));
+    }
+}
+
+void print_tunables(void)
+{
+    size_t i;
+    char buf[32];
+    for (i = 0; i < NR_TUNABLES; i++) {
+        printf("           %-24s %s (default %s)\r\n",
+               tunables[i].name, tunables[i].help,
+               value_string(&tunables[i], buf, sizeof(buf)));
+    }
+}
@@ -0,0 +1,146 @@
+#ifndef TUNABLES_H
+#define TUNABLES_H
+
+#include <stdint.h>
+
+/*
+ * 运行时可调整的参数，通过命令行选项 -o 设置，多个参数用逗号分隔。例如：
+ *
+ * -o conn_idle_timeout=300,conn_stall_timeout=60
+ *
+ * 取值为整数，或者为参数表中列出的名字。
+ */
+
+/* 连接空闲超时（秒），0 表示不检查 */
+extern int64_t conn_idle_timeout;
+
+/* 传输过程中没有任何进展的超时（秒），0 表示不检查 */
+extern int64_t conn_stall_timeout;
+
+/* 一次传输从开始到结束的最长时间（秒），0 表示不限制 */
+extern int64_t conn_deadline;
+
+/* 执行后台任务（文件粉碎、重命名、删除）的线程数 */
+extern int64_t jobq_threads;
+
+/* 同时排队和执行的后台任务的上限，超过时拒绝新的任务 */
+extern int64_t jobq_depth;
+
+/* 粉碎文件时覆盖写的遍数 */
+extern int64_t crush_passes;
+
+/* 同时粉碎一个文件和它的备份的线程数 */
+extern int64_t crush_threads;
+
+/* 粉碎后是否用 fallocate(PUNCH_HOLE) 释放数据块，0 表示不释放 */
+extern int64_t crush_punch_hole;
+
+/* 启动时是否在后台重建所有后端目录的备份索引 */
+extern int64_t bkindex_rebuild_all;
+
+/* 每个工作者线程缓存的目录描述符个数，0 表示不缓存 */
+extern int64_t dircache_size;
+
+/* 上传开始时是否按文件大小预分配空间：off，keep_size 或者 full */
+extern int64_t upload_prealloc;
+
+/* 每个上传连接合并连续数据的写缓冲大小（字节），0 表示不合并 */
+extern int64_t upload_wbuf_size;
+
+/* 写缓冲中的数据最长停留时间（毫秒），0 表示直到上传完成才写出 */
+extern int64_t upload_wbuf_flush_ms;
+
+/* 使用 O_DIRECT 的后端目录的位图，按 -b 参数中的顺序，见 dio.h */
+extern int64_t direct_io_backends;
+
+/* 顺序下载时的 posix_fadvise() 提示，0 表示使用编译时的选择 */
+extern int64_t seq_fadvise;
+
+/* 上传完成响应之前的持久化方式：none，fsync 或者 group，见 gcommit.h */
+extern int64_t upload_durability;
+
+/* 组提交收集上传完成请求的时间（毫秒） */
+extern int64_t group_commit_ms;
+
+/* 小于这个大小（字节）的上传打包存放，0 表示不打包，见 pack.h */
+extern int64_t pack_threshold;
+
+/* 一个段文件的大小上限（字节） */
+extern int64_t pack_segment_size;
+
+/* 是否使用文件元数据索引，见 metaidx.h */
+extern int64_t metaidx_enabled;
+
+/* 新建的元数据索引的槽数，装满 3/4 时自动扩大 */
+extern int64_t metaidx_slots;
+
+/* 后端连续读取出错多少次后被隔离，0 表示不隔离，见 behealth.h */
+extern int64_t backend_quarantine_errors;
+
+/* 后端第一次隔离的时间（毫秒），每次探测失败后加倍 */
+extern int64_t backend_quarantine_ms;
+
+/* 不小于这个大小（字节）的下载从所有健康的镜像条带读取，0 表示关闭，见 stripe.h */
+extern int64_t stripe_threshold;
+
+/* 条带读取的区段大小（字节） */
+extern int64_t stripe_chunk;
+
+/* 条带读取在发送位置之后预取的区段个数 */
+extern int64_t stripe_depth;
+
+/* 条带读取的 I/O 线程个数 */
+extern int64_t stripe_threads;
+
+/* 顺序的分块下载在请求位置之后预读的区段个数，0 表示关闭，见 stripe.h */
+extern int64_t readahead_depth;
+
+/* 预读的区段大小（字节） */
+extern int64_t readahead_chunk;
+
+/* 批量下载在正在发送的文件之后提前打开和预读的文件个数，见 batchdl.h */
+extern int64_t batch_prefetch;
+
+/* 上传需要写入成功的镜像个数，其他镜像稍后补齐，0 表示全部，见 catchup.h */
+extern int64_t write_quorum;
+
+/* 一次写入超过这个时间（毫秒）的镜像退出上传，0 表示不限制 */
+extern int64_t write_lag_ms;
+
+/* 等待补齐的文件达到这个个数时，上传重新要求所有镜像 */
+extern int64_t catchup_max_pending;
+
+/* 热点文件缓存可以映射的字节数，0 表示关闭，见 hotcache.h */
+extern int64_t hotcache_bytes;
+
+/* 热点文件缓存最多缓存的文件个数 */
+extern int64_t hotcache_files;
+
+/* 大于这个大小（字节）的文件不缓存 */
+extern int64_t hotcache_file_max;
+
+/* 缓存的文件命中时，距离上次检查超过这个时间（毫秒）就重新检查 */
+extern int64_t hotcache_check_ms;
+
+/* 每个工作者线程缓存的后端文件只读描述符个数，0 表示不缓存，见 fdcache.h */
+extern int64_t fdcache_size;
+
+/* 中断的上传可以续传的时间（秒），过期后删除，0 表示关闭续传，见 resume.h */
+extern int64_t upload_resume_ttl;
+
+/*
+ * 解析并设置 key=value[,key=value...]，成功返回 0，失败返回 -1
+ */
+extern int set_tunables(const char *options);
+
+/*
+ * 把所有参数的当前值写入日志
+ */
+extern void log_tunables(void);
+
+/*
+ * 打印所有参数的说明，用于命令行帮助
+ */
+extern void print_tunables(void);
+
+#endif  /* TUNABLES_H */
@@ -0,0 +1,293 @@
+
+// wbuf.c
+
+#include "config.h"
+#include "mt_log.h"
+#include "public.h"
+#include "conn_mgmt.h"
+#include "tunables.h"
+#include "dio.h"
+#include "pack.h"
+#include "catchup.h"
+#include "wbuf.h"
+
+extern int backend_cnt;
+extern int get_thread_id(void);
+extern timer_set_t * timer_sets[MAX_WORKERS+1];
+
+struct write_buffer {
+    uint64_t offset;        // 缓冲中第一个字节在文件中的偏移
+    int len;                // 缓冲中的数据长度
+    int size;               // 缓冲的大小
+    int error;              // 写入失败过，之后的写入都返回失败
+    int timer_id;           // 定时写出的定时器，0 表示没有
+    uint64_t since;         // 缓冲中最早的数据的接收时间，单位是毫秒
+    uint8_t *data;
+};
+
+static int pwrite_all(int fd, const uint8_t *data, int len, uint64_t offset)
+{
+    int done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, data + done, len - done, offset + done);
+        if (n > 0) {
+            done = done + n;
+        } else if (n < 0 && errno == EINTR) {
+            // 系统调用被中断，继续写入
+        } else {
+            log_error("pwrite %d bytes to fd %d at %llu failed: %s",
+                      len - done, fd, (unsigned long long)(offset + done),
+                      n < 0 ? strerror(errno) : "no space written");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * 写入每个后端文件。要求所有镜像时有一个失败就立刻返回，不再写入其他的后端文
+ * 件；只要求 write_quorum 个镜像时，失败或者太慢的镜像退出这次上传，剩下的镜
+ * 像不够时才返回失败
+ */
+static int write_backends(conn_info_t *c, const uint8_t *data, int len,
+                          uint64_t offset)
+{
+    int quorum = c->write_quorum > 0 && c->write_quorum < backend_cnt;
+    int i;
+    for (i = 0; i < backend_cnt; i++) {
+        struct backend_file *f = &c->befiles[i];
+        if (f->lagging) {
+            continue;
+        }
+        uint64_t start = get_curr_time();
+        int rc = f->direct ? dio_pwrite(f->fd, data, len, offset)
+            : pwrite_all(f->fd, data, len, offset);
+        if (rc != 0) {
+            log_error("write %s:%llu failed: %d bytes",
+                      c->befiles[i].abs_file_name,
+                      (unsigned long long)offset, len);
+            if (!quorum || catchup_drop_mirror(c, i) != 0) {
+                return -1;
+            }
+        } else if (quorum && write_lag_ms > 0 &&
+                   get_curr_time() - start > (uint64_t)write_lag_ms) {
+            log_warning("write %s:%llu took %lu ms",
+                        c->befiles[i].abs_file_name, (unsigned long long)offset,
+                        get_curr_time() - start);
+            // 其他镜像已经够了就不再等待这个镜像
+            (void) catchup_drop_mirror(c, i);
+        } else {
+            // 写入成功，继续写入下一个后端文件
+        }
+    }
+    return 0;
+}
+
+static int on_wbuf_timer(void *pv_user_timer)
+{
+    user_timer_t *t = (user_timer_t *)pv_user_timer;
+    int sock_fd = (int)(intptr_t)t->pv_param1;
+    uint32_t generation = (uint32_t)(uintptr_t)t->pv_param2;
+    int tid = get_thread_id();
+
+    conn_info_t *c = &conns_info[sock_fd];
+    if (c->sock_fd != sock_fd || c->generation != generation ||
+        c->thread_id != tid || c->wbuf == NULL) {
+        // 连接已经关闭或者被复用，销毁自己
+        destroy_one_timer(timer_sets[tid], t->timer_id);
+        return 0;
+    }
+
+    struct write_buffer *w = c->wbuf;
+    if (w->len > 0 && get_curr_time() - w->since >= (uint64_t)upload_wbuf_flush_ms) {
+        // 写入失败在下一次响应中返回
+        flush_write_buffer(c);
+    } else {
+        // 缓冲为空，或者数据刚刚到达
+    }
+    return 0;
+}
+
+static struct write_buffer *open_write_buffer(conn_info_t *c)
+{
+    struct write_buffer *w = calloc(1, sizeof(struct write_buffer));
+    if (w == NULL) {
+        log_error("malloc write buffer failed");
+        return NULL;
+    }
+    // 缓冲池中的缓冲区按 DIO_ALIGN 对齐，不小于 upload_wbuf_size
+    w->data = get_dio_buffer();
+    if (w->data == NULL) {
+        free(w);
+        return NULL;
+    }
+    w->size = upload_wbuf_size;
+
+    if (upload_wbuf_flush_ms > 0 && c->thread_id > 0 &&
+        timer_sets[c->thread_id] != NULL) {
+        user_timer_t t;
+        memset(&t, 0, sizeof(user_timer_t));
+        t.loop_cnt = 0xFFFFFFFF;
+        t.hold_time = upload_wbuf_flush_ms < MS_PER_TICK ?
+            MS_PER_TICK : upload_wbuf_flush_ms;
+        t.call_back = on_wbuf_timer;
+        t.pv_param1 = (void *)(intptr_t)c->sock_fd;
+        t.pv_param2 = (void *)(uintptr_t)c->generation;
+        int timer_id = create_one_timer(timer_sets[c->thread_id], &t);
+        w->timer_id = timer_id > 0 ? timer_id : 0;
+    } else {
+        // 不定时写出，或者不在工作者线程中
+    }
+
+    c->wbuf = w;
+    return w;
+}
+
+int flush_write_buffer(conn_info_t *c)
+{
+    struct write_buffer *w = c->wbuf;
+    if (w == NULL) {
+        return 0;
+    }
+    if (w->len > 0 && !w->error) {
+        if (write_backends(c, w->data, w->len, w->offset) != 0) {
+            w->error = 1;
+        } else {
+            // 写入成功
+        }
+    } else {
+        // 没有数据，或者已经失败过
+    }
+    w->len = 0;
+    return w->error ? -1 : 0;
+}
+
+int buffer_upload_data(conn_info_t *c, uint64_t offset,
+                       const uint8_t *data, int len)
+{
+    if (c->pack != NULL) {
+        // 打包上传的数据放在内存中，上传完成时一起追加
+        return pack_upload_data(c, offset, data, len);
+    }
+    struct write_buffer *w = c->wbuf;
+    if (w == NULL && upload_wbuf_size > 0) {
+        w = open_write_buffer(c);
+    }
+    if (w == NULL) {
+        // 写缓冲被禁用，或者分配失败，直接写入
+        return write_backends(c, data, len, offset);
+    }
+    if (w->error) {
+        return -1;
+    }
+
+    if (w->len > 0 &&
+        (offset != w->offset + w->len || w->len + len > w->size)) {
+        // 数据不连续，或者放不下了
+        if (flush_write_buffer(c) != 0) {
+            return -1;
+        }
+    }
+    if (len >= w->size) {
+        // 比缓冲还大的数据直接写入
+        return write_backends(c, data, len, offset);
+    }
+
+    if (w->len == 0) {
+        w->offset = offset;
+        w->since = get_curr_time();
+    }
+    memcpy(w->data + w->len, data, len);
+    w->len = w->len + len;
+    if (w->len == w->size) {
+        return flush_write_buffer(c);
+    } else {
+        return 0;
+    }
+}
+
+int close_write_buffer(conn_info_t *c)
+{
+    struct write_buffer *w = c->wbuf;
+    if (w == NULL) {
+        return 0;
+    }
+    int rc = flush_write_buffer(c);
+    if (w->timer_id > 0 && c->thread_id > 0 && timer_sets[c->thread_id] != NULL) {
+        destroy_one_timer(timer_sets[c->thread_id], w->timer_id);
+    }
+    put_dio_buffer(w->data);
+    free(w);
+    c->wbuf = NULL;
+    return rc;
+}
+
+////////////////////////////////////////////////////////////////////////
+// 测试用例
+////////////////////////////////////////////////////////////////////////
+
+#ifdef CONFIG_UNITTEST
+
+#include <assert.h>
+
+static off_t test_file_size(int fd)
+{
+    struct stat st;
+    assert(fstat(fd, &st) == 0);
+    return st.st_size;
+}
+
+void test_wbuf(void)
+{
+    printf("test_wbuf: ");
+
+    const char *path = "/tmp/test_wbuf";
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(fd >= 0);
+    backend_cnt = 1;
+    upload_wbuf_size = 8192;
+    upload_wbuf_flush_ms = 0;
+    conn_info_t c;
+    memset(&c, 0, sizeof(c));
+    c.befiles[0].fd = fd;
+    uint8_t data[8192];
+    memset(data, 'x', sizeof(data));
+
+    /* 连续的数据留在缓冲中 */
+    assert(buffer_upload_data(&c, 0, data, 100) == 0);
+    assert(buffer_upload_data(&c, 100, data, 100) == 0);
+    assert(c.wbuf != NULL && c.wbuf->len == 200 && test_file_size(fd) == 0);
+
+    /* 不连续时先写出缓冲中的数据 */
+    assert(buffer_upload_data(&c, 1000, data, 100) == 0);
+    assert(test_file_size(fd) == 200);
+    assert(c.wbuf->offset == 1000 && c.wbuf->len == 100);
+
+    /* 放不下时先写出，正好填满时立刻写出 */
+    assert(buffer_upload_data(&c, 1100, data, 8100) == 0);
+    assert(test_file_size(fd) == 1100 && c.wbuf->len == 8100);
+    assert(buffer_upload_data(&c, 9200, data, 92) == 0);
+    assert(test_file_size(fd) == 9292 && c.wbuf->len == 0);
+
+    /* 比缓冲大的数据直接写入 */
+    assert(buffer_upload_data(&c, 9292, data, 8192) == 0);
+    assert(test_file_size(fd) == 9292 + 8192 && c.wbuf->len == 0);
+    assert(close_write_buffer(&c) == 0 && c.wbuf == NULL);
+
+    /* 写入失败以后，之后的写入和上传完成都返回失败 */
+    int rdonly = open(path, O_RDONLY);
+    assert(rdonly >= 0);
+    c.befiles[0].fd = rdonly;
+    assert(buffer_upload_data(&c, 0, data, 100) == 0);
+    assert(flush_write_buffer(&c) == -1);
+    assert(buffer_upload_data(&c, 100, data, 100) == -1);
+    assert(flush_write_buffer(&c) == -1);
+    assert(close_write_buffer(&c) == -1 && c.wbuf == NULL);
+
+    close(rdonly);
+    close(fd);
+    unlink(path);
+    printf("success\n");
+}
+
+#endif
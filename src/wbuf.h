@@ -0,0 +1,42 @@
+#ifndef WBUF_H
+#define WBUF_H
+
+#include <stdint.h>
+
+#include "conn_mgmt.h"
+
+/*
+ * 上传数据的写缓冲
+ *
+ * 每个上传数据请求只有 128KB，偏移几乎总是连续的。连接上的写缓冲把连续的数
+ * 据合并起来，用一次 pwrite() 写入每个后端文件。遇到下面的情况时写出缓冲中
+ * 的数据：
+ *
+ * 1. 新的数据和缓冲中的数据不连续；
+ * 2. 缓冲已满（upload_wbuf_size）；
+ * 3. 数据在缓冲中停留超过 upload_wbuf_flush_ms；
+ * 4. 上传完成，在检查 md5 之前；
+ * 5. 连接关闭。
+ *
+ * 打开写缓冲时，上传数据的响应只表示数据已经收到，写入的错误在后面的数据响
+ * 应或者上传完成响应中返回；上传完成响应仍然表示所有数据都已经写入后端文件。
+ */
+
+/*
+ * 写入上传的数据，写缓冲被禁用时直接写入每个后端文件。成功返回 0，写入失败
+ * 返回 -1
+ */
+extern int buffer_upload_data(conn_info_t *c, uint64_t offset,
+                              const uint8_t *data, int len);
+
+/*
+ * 把缓冲中的数据写入后端文件，之前的写入失败过也返回 -1
+ */
+extern int flush_write_buffer(conn_info_t *c);
+
+/*
+ * 写出缓冲中的数据，释放写缓冲。上传完成和连接关闭时调用
+ */
+extern int close_write_buffer(conn_info_t *c);
+
+#endif  /* WBUF_H */
@@ -0,0 +1,120 @@
+
+// dio_bench.c
+
+/*
+ * 比较页缓存和直接 I/O 的吞吐量和尾延迟，用来决定后端是否打开
+ * backend_direct_io：每种方式写入 chunks 个写缓冲大小的块，再随机读取同样多个
+ * 128KB 的块。
+ *
+ * 编译（在仓库根目录）：
+ *
+ *   gcc -std=gnu99 -O2 -Isrc tools/dio_bench.c src/dio.c src/mt_log.c
+ *       src/tunables.c -o dio_bench -lpthread
+ *
+ * 运行：./dio_bench [目录] [块数]，目录需要在被测试的后端文件系统上，默认是
+ * 当前目录。
+ */
+
+#include <assert.h>
+#include <sys/time.h>
+
+#include "mt_log.h"
+#include "public.h"
+#include "tunables.h"
+#include "dio.h"
+
+int get_thread_id(void)
+{
+    return 0;
+}
+
+static uint64_t now_usecs(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char *what, int direct, uint64_t bytes, uint64_t usecs,
+                   uint64_t *lat, int n)
+{
+    qsort(lat, n, sizeof(uint64_t), cmp_u64);
+    printf("%s %s: %.1f MB/s, p50 %lu us, p99 %lu us\n",
+           direct ? "direct  " : "buffered", what, (double)bytes / usecs,
+           lat[n / 2], lat[n * 99 / 100]);
+}
+
+static void bench_one(const char *path, int direct, int chunk, int chunks)
+{
+    uint64_t *lat = calloc(chunks, sizeof(uint64_t));
+    uint8_t *buf = get_dio_buffer();
+    uint8_t *data = malloc(MAX_MSG_DATA_LEN);
+    assert(lat && buf && data);
+    memset(buf, 0x5a, chunk);
+
+    int fd = open(path, O_CREAT|O_RDWR|O_TRUNC, 0600);
+    assert(fd >= 0);
+    if (direct && set_direct_io(fd, 1) != 0) {
+        printf("%s: O_DIRECT not supported\n", path);
+        close(fd);
+        unlink(path);
+        free(data);
+        put_dio_buffer(buf);
+        free(lat);
+        return;
+    }
+    uint64_t start = now_usecs();
+    int i;
+    for (i = 0; i < chunks; i++) {
+        uint64_t t = now_usecs();
+        int rc = direct ? dio_pwrite(fd, buf, chunk, (uint64_t)i * chunk)
+            : (pwrite(fd, buf, chunk, (uint64_t)i * chunk) == chunk ? 0 : -1);
+        assert(rc == 0);
+        lat[i] = now_usecs() - t;
+    }
+    fdatasync(fd);
+    report("write", direct, (uint64_t)chunk * chunks, now_usecs() - start, lat, chunks);
+
+    uint64_t filesize = (uint64_t)chunk * chunks;
+    start = now_usecs();
+    for (i = 0; i < chunks; i++) {
+        uint64_t off = (uint64_t)rand() % (filesize - MAX_MSG_DATA_LEN);
+        uint64_t t = now_usecs();
+        int n = direct ? dio_pread(fd, data, MAX_MSG_DATA_LEN, off)
+            : pread(fd, data, MAX_MSG_DATA_LEN, off);
+        assert(n == MAX_MSG_DATA_LEN);
+        lat[i] = now_usecs() - t;
+    }
+    report("read ", direct, (uint64_t)MAX_MSG_DATA_LEN * chunks,
+           now_usecs() - start, lat, chunks);
+
+    close(fd);
+    unlink(path);
+    free(data);
+    put_dio_buffer(buf);
+    free(lat);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = argc > 1 ? argv[1] : ".";
+    int chunks = argc > 2 ? atoi(argv[2]) : 128;
+    if (chunks < 2) {
+        fprintf(stderr, "usage: %s [dir] [chunks >= 2]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "%s/dio_bench.%d", dir, (int)getpid());
+    int chunk = dio_buffer_size() / DIO_ALIGN * DIO_ALIGN;
+    bench_one(path, 0, chunk, chunks);
+    bench_one(path, 1, chunk, chunks);
+    return 0;
+}